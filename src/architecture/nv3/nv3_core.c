@@ -9,17 +9,21 @@
 #include "architecture/nv3/nv3_ref.h"
 #include "architecture/nv3/nv3_state.h"
 #include "core/nvcore.h"
+#include "core/pci/pci.h"
 #include "architecture/nv3/nv3.h"
 
 // Test overclock time in seconds
 #define NV3_TEST_OVERCLOCK_TIME_BETWEEN_RECLOCKS 5
 
+// How long to wait for PGRAPH to go idle before reprogramming a PLL
+#define NV3_TEST_OVERCLOCK_IDLE_TIMEOUT_NS 100000000
+
 // Default clock settings
 #define NV3_TEST_OVERCLOCK_BASE_13500 0x01A30B
 #define NV3_TEST_OVERCLOCK_BASE_14318 0x01C40E
 
-// Global state for the NV3 GPU
-static nv3_state_t nv3_state;
+// State for the NV3 GPU, one per thread like current_device
+static __thread nv3_state_t nv3_state;
 
 /* TEMPORARY test function to test certain hardcoded overclocks */
 bool nv3_init_test_overclock(void)
@@ -31,7 +35,7 @@ bool nv3_init_test_overclock(void)
     printf("Note: Some NVIDIA RIVA 128 ZX cards manufactured by TSMC run at 90Mhz and will have less overclocking potential!\n");
 
     /* read the straps to find our base clock value */
-    uint32_t straps = nv_mmio_read32(NV3_PSTRAPS);
+    uint32_t straps = nv_reg_read32(NV3_PSTRAPS);
 
     /* 
         there are two possible clock bases here: 13.5 and 14.318 Mhz 
@@ -70,21 +74,25 @@ bool nv3_init_test_overclock(void)
 
         printf("Trying MCLK = %.2f Mhz (NV_PRAMDAC_MPLL_COEFF = 0x%08X)...\n", megahertz, final_clock);
 
-        nv_mmio_write32(NV3_PRAMDAC_CLOCK_MEMORY, final_clock);
+        // Don't pull the memory clock out from under the graphics engine while it's still busy
+        if (!nv_mmio_wait(NV3_PGRAPH_STATUS, 0xFFFFFFFF, 0x00, NV3_TEST_OVERCLOCK_IDLE_TIMEOUT_NS, NULL))
+            printf("Warning: PGRAPH still busy (NV3_PGRAPH_STATUS = 0x%08X), reclocking anyway\n", nv_reg_read32(NV3_PGRAPH_STATUS));
+
+        nv_shadow_write32(NV3_PRAMDAC_CLOCK_MEMORY, final_clock);
         nv3_state.mpll = final_clock;
 
-        // Sleep for the specified interval
-        sleep(NV3_TEST_OVERCLOCK_TIME_BETWEEN_RECLOCKS);
+        // Sleep for the specified interval (skipped straight over under the fast-forward time source)
+        nv_sleep_ns(NV3_TEST_OVERCLOCK_TIME_BETWEEN_RECLOCKS * NV_TIME_NS_PER_SECOND);
     }
 
     printf("We survived. Returning to 100Mhz...\n");
     
     /* restore original clock */
     if (is_14318mhz_clock) {
-        nv_mmio_write32(NV3_PRAMDAC_CLOCK_MEMORY, NV3_TEST_OVERCLOCK_BASE_14318);
+        nv_shadow_write32(NV3_PRAMDAC_CLOCK_MEMORY, NV3_TEST_OVERCLOCK_BASE_14318);
         nv3_state.mpll = NV3_TEST_OVERCLOCK_BASE_14318;
     } else {
-        nv_mmio_write32(NV3_PRAMDAC_CLOCK_MEMORY, NV3_TEST_OVERCLOCK_BASE_13500);
+        nv_shadow_write32(NV3_PRAMDAC_CLOCK_MEMORY, NV3_TEST_OVERCLOCK_BASE_13500);
         nv3_state.mpll = NV3_TEST_OVERCLOCK_BASE_13500;
     }
 
@@ -110,8 +118,21 @@ bool nv3_init(void)
         return false;
     }
 
-    current_device.nv_pmc_boot_0 = nv_mmio_read32(NV3_PMC_BOOT);
-    current_device.nv_pfb_boot_0 = nv_mmio_read32(NV3_PFB_BOOT);
+    /* 
+        Registers that only change when we write them go through the shadow cache,
+        so read-modify-write sequences on them never have to read across the bus
+    */
+    nv_shadow_tag(NV3_PMC_ENABLE, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PMC_INTERRUPT_ENABLE, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PRAMDAC_CLOCK_MEMORY, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PRAMDAC_CLOCK_PIXEL, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PGRAPH_DEBUG_0, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PGRAPH_DEBUG_1, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PGRAPH_DEBUG_2, NV_SHADOW_CACHEABLE);
+    nv_shadow_tag(NV3_PGRAPH_DEBUG_3, NV_SHADOW_CACHEABLE);
+
+    current_device.nv_pmc_boot_0 = nv_reg_read32(NV3_PMC_BOOT);
+    current_device.nv_pfb_boot_0 = nv_reg_read32(NV3_PFB_BOOT);
     
     // Initialize NV3 state structure
     nv3_state.revision = current_device.nv_pmc_boot_0;
@@ -147,11 +168,11 @@ bool nv3_init(void)
     printf("Video RAM Bus Width     = %u bit\n", nv3_state.vram_width);
 
     /* Read in the straps */
-    current_device.straps = nv_mmio_read32(NV3_PSTRAPS);
+    current_device.straps = nv_reg_read32(NV3_PSTRAPS);
     printf("Straps                  = 0x%08X\n", current_device.straps);
 
-    uint32_t vpll = nv_mmio_read32(NV3_PRAMDAC_CLOCK_PIXEL);
-    uint32_t mpll = nv_mmio_read32(NV3_PRAMDAC_CLOCK_MEMORY);
+    uint32_t vpll = nv_shadow_read32(NV3_PRAMDAC_CLOCK_PIXEL);
+    uint32_t mpll = nv_shadow_read32(NV3_PRAMDAC_CLOCK_MEMORY);
     
     // Store clock information in state
     nv3_state.vpll = vpll;
@@ -160,17 +181,17 @@ bool nv3_init(void)
     printf("Pixel Clock Coefficient = 0x%08X\n", vpll);
     printf("Memory Clock Coefficient= 0x%08X\n", mpll);
 
-    /* Power up all GPU subsystems */
-    printf("Enabling all GPU subsystems (0x11111111 -> NV3_PMC_ENABLE)...");
-    nv_mmio_write32(NV3_PMC_ENABLE, 0x11111111);
+    /* Power up all GPU subsystems, then enable interrupts. The order matters, so the batch isn't sorted */
+    nv_mmio_write_t bringup_sequence[] = {
+        { NV3_PMC_ENABLE, 0x11111111 },
+        { NV3_PMC_INTERRUPT_ENABLE, (NV3_PMC_INTERRUPT_ENABLE_HARDWARE | NV3_PMC_INTERRUPT_ENABLE_SOFTWARE) },
+    };
+
+    printf("Enabling all GPU subsystems (0x11111111 -> NV3_PMC_ENABLE) and interrupts...");
+    nv_mmio_write_batch(bringup_sequence, sizeof(bringup_sequence) / sizeof(bringup_sequence[0]), 0);
     nv3_state.enabled_subsystems = 0x11111111;
     printf("Done!\n");
 
-    /* Enable interrupts */
-    printf("Enabling interrupts...");
-    nv_mmio_write32(NV3_PMC_INTERRUPT_ENABLE, (NV3_PMC_INTERRUPT_ENABLE_HARDWARE | NV3_PMC_INTERRUPT_ENABLE_SOFTWARE));
-    printf("Done!\n");
- 
     // Set default mode (640x480x16 @ 60Hz)
     nv3_state.current_mode = mode_table[NV3_MODE_640x480x16];
     printf("Default mode set to %dx%dx%d\n", 
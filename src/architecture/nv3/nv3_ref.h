@@ -224,6 +224,9 @@
 
 #define NV3_PFIFO_RUNOUT_RAMIN_ERR                      28          // bit to or with
 
+// RAMRO entries are two dwords, the USER offset that was written (with the reason in 31:28) and then the data
+#define NV3_RAMRO_ENTRY_SIZE                            8
+
 #define NV3_PFIFO_CACHE0_SIZE                           1           // This is for software-injected notified only!
 #define NV3_PFIFO_CACHE1_SIZE_REV_AB                    32
 #define NV3_PFIFO_CACHE1_SIZE_REV_C                     64
@@ -541,9 +544,21 @@
 #define NV3_PGRAPH_PATTERN_BITMAP_HIGH                  0x400610    // pattern bitmap [31:0]
 #define NV3_PGRAPH_PATTERN_BITMAP_LOW                   0x400614    // pattern bitmap [63:32]
 #define NV3_PGRAPH_PATTERN_SHAPE                        0x400618
+#define NV3_PGRAPH_PATTERN_SHAPE_8X8                    0x0
+#define NV3_PGRAPH_PATTERN_SHAPE_64X1                   0x1
+#define NV3_PGRAPH_PATTERN_SHAPE_1X64                   0x2
 #define NV3_PGRAPH_ROP3                                 0x400624    // ROP3      
-#define NV3_PGRAPH_PLANE_MASK                           0x400628
+#define NV3_PGRAPH_ROP3_BLACKNESS                       0x00
+#define NV3_PGRAPH_ROP3_PATCOPY                         0xF0
+#define NV3_PGRAPH_ROP3_SRCCOPY                         0xCC
+#define NV3_PGRAPH_ROP3_DSTCOPY                         0xAA        // Leaves the destination alone
+#define NV3_PGRAPH_ROP3_WHITENESS                       0xFF
+#define NV3_PGRAPH_PLANE_MASK                           0x400628    // Pixel bits that drawing may change
 #define NV3_PGRAPH_CHROMA_KEY                           0x40062C
+#define NV3_PGRAPH_CHROMA_KEY_ENABLE                    31          // Source pixels matching the key's colour aren't drawn
+#define NV3_PGRAPH_BOFFSET(i)                           (0x400630+(i*4))    // Byte offset of buffer i in VRAM
+#define NV3_PGRAPH_BPITCH(i)                            (0x400650+(i*4))    // Bytes per row of buffer i
+#define NV3_PGRAPH_BPITCH_MAX                           0x1FFF
 #define NV3_PGRAPH_BETA                                 0x400640    // Beta factor (30:23 fractional, 22:0 before fraction)
 #define NV3_PGRAPH_DMA                                  0x400680
 #define NV3_PGRAPH_INSTANCE                             0x400688    // Current instance (?)
@@ -565,6 +580,7 @@
 #define NV3_PGRAPH_FIFO_ACCESS_ENABLED                  0x1
 #define NV3_PGRAPH_CLIP_MISC                            0x4006A0    // Miscellaneous clipping information
 #define NV3_PGRAPH_STATUS                               0x4006B0    // Current PGRAPH status
+#define NV3_PGRAPH_STATUS_BUSY                          0           // Still executing methods
 #define NV3_PGRAPH_TRAPPED_ADDRESS                      0x4006B4
 #define NV3_PGRAPH_TRAPPED_DATA                         0x4006B8
 #define NV3_PGRAPH_TRAPPED_INSTANCE                     0x4006BC
@@ -633,6 +649,152 @@
 
 #define NV3_PGRAPH_REGISTER_END                         0x401FFF    // end of pgraph registers
 #define NV3_PGRAPH_REAL_END                             0x5C1FFF
+#define NV3_PGRAPH_CLASS_SHIFT                          16          // Class ranges are 64KB apart, starting at class 0
+
+#define NV3_PGRAPH_BPIXEL                               0x400728    // Pixel format of each buffer, 4 bits per buffer
+#define NV3_PGRAPH_BPIXEL_FORMAT_Y8                     0x1
+#define NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5                 0x2
+#define NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5               0x3
+#define NV3_PGRAPH_BPIXEL_FORMAT_X8R8G8B8               0x4
+
+//
+// Class methods. Offsets are within the 8KB of a subchannel (or of the class range above). Points and sizes are
+// packed as y/height in 31:16 and x/width in 15:0, with signed coordinates.
+//
+#define NV3_METHOD_NO_OPERATION                         0x0100
+#define NV3_METHOD_NOTIFY                               0x0104
+
+#define NV3_CLASS02_ROP_SET_ROP                         0x0300      // 7:0, ternary raster operation
+#define NV3_CLASS03_CHROMA_SET_COLOR                    0x0304
+#define NV3_CLASS04_PLANE_MASK_SET_MASK                 0x0304
+#define NV3_CLASS05_CLIP_SET_POINT                      0x0300
+#define NV3_CLASS05_CLIP_SET_SIZE                       0x0304
+#define NV3_CLASS06_PATTERN_SET_SHAPE                   0x0308      // NV3_PGRAPH_PATTERN_SHAPE_*
+#define NV3_CLASS06_PATTERN_SET_COLOR0                  0x0310
+#define NV3_CLASS06_PATTERN_SET_COLOR1                  0x0314
+#define NV3_CLASS06_PATTERN_SET_BITMAP0                 0x0318      // Pattern bits 31:0
+#define NV3_CLASS06_PATTERN_SET_BITMAP1                 0x031C      // Pattern bits 63:32
+
+#define NV3_CLASS07_RECTANGLE_SET_COLOR                 0x0304
+#define NV3_CLASS07_RECTANGLE_START                     0x0400      // 16 pairs of point, size
+#define NV3_CLASS07_RECTANGLE_END                       0x047C
+
+#define NV3_CLASS08_POINT_SET_COLOR                     0x0304
+#define NV3_CLASS08_POINT_START                         0x0400      // 32 points
+#define NV3_CLASS08_POINT_END                           0x047C
+
+#define NV3_CLASS09_LINE_SET_COLOR                      0x0304      // Also used by class 0x0A
+#define NV3_CLASS09_LINE_START                          0x0400      // 16 pairs of start, end
+#define NV3_CLASS09_LINE_END                            0x047C
+#define NV3_CLASS09_POLYLINE_START                      0x0500      // 32 points, each continuing from the last
+#define NV3_CLASS09_POLYLINE_END                        0x057C
+
+// Type A draws solid rectangles, type C transparent 1bpp glyphs clipped to a rectangle. Glyph bits are packed
+// continuously across rows, first pixel in bit 31 of the first dword; the glyph is drawn once all of its bits
+// have been written.
+#define NV3_CLASS0C_TEXT_COLOR_A                        0x03FC
+#define NV3_CLASS0C_TEXT_RECT_A_START                   0x0400      // 64 pairs of point, size
+#define NV3_CLASS0C_TEXT_RECT_A_END                     0x05FC
+#define NV3_CLASS0C_TEXT_CLIP_C_POINT0                  0x0BEC      // Top left
+#define NV3_CLASS0C_TEXT_CLIP_C_POINT1                  0x0BF0      // Bottom right, exclusive
+#define NV3_CLASS0C_TEXT_COLOR1_C                       0x0BF4
+#define NV3_CLASS0C_TEXT_SIZE_C                         0x0BF8
+#define NV3_CLASS0C_TEXT_POINT_C                        0x0BFC
+#define NV3_CLASS0C_TEXT_MONO_C_START                   0x0C00      // 128 dwords of glyph bits
+#define NV3_CLASS0C_TEXT_MONO_C_END                     0x0DFC
+
+// Lines of line_length pixels are copied from offset_in to offset_out, converting between the two formats on the way.
+// Offsets are in VRAM; a format of 0 copies bytes unchanged, with line_length counted in bytes.
+#define NV3_CLASS0D_M2MF_OFFSET_IN                      0x030C
+#define NV3_CLASS0D_M2MF_OFFSET_OUT                     0x0310
+#define NV3_CLASS0D_M2MF_PITCH_IN                       0x0314
+#define NV3_CLASS0D_M2MF_PITCH_OUT                      0x0318
+#define NV3_CLASS0D_M2MF_LINE_LENGTH_IN                 0x031C
+#define NV3_CLASS0D_M2MF_LINE_COUNT                     0x0320
+#define NV3_CLASS0D_M2MF_FORMAT                         0x0324
+#define NV3_CLASS0D_M2MF_FORMAT_IN                      0           // 3:0, NV3_PGRAPH_BPIXEL_FORMAT_*
+#define NV3_CLASS0D_M2MF_FORMAT_OUT                     8           // 11:8, NV3_PGRAPH_BPIXEL_FORMAT_*
+#define NV3_CLASS0D_M2MF_BUFFER_NOTIFY                  0x0328      // Starts the transfer
+
+// Scales a VRAM image (in its own format) onto the output rectangle with bilinear filtering. Steps are 12.20 source
+// pixels per output pixel, and the point in is where the output's top left corner falls in the source, in 12.4.
+#define NV3_CLASS0E_SCALED_COLOR_FORMAT                 0x0300      // NV3_PGRAPH_BPIXEL_FORMAT_* of the source
+#define NV3_CLASS0E_SCALED_CLIP_POINT                   0x0304
+#define NV3_CLASS0E_SCALED_CLIP_SIZE                    0x0308
+#define NV3_CLASS0E_SCALED_IMAGE_OUT_POINT              0x030C
+#define NV3_CLASS0E_SCALED_IMAGE_OUT_SIZE               0x0310
+#define NV3_CLASS0E_SCALED_DELTA_DU_DX                  0x0314
+#define NV3_CLASS0E_SCALED_DELTA_DV_DY                  0x0318
+#define NV3_CLASS0E_SCALED_IMAGE_IN_SIZE                0x031C
+#define NV3_CLASS0E_SCALED_IMAGE_IN_PITCH               0x0320
+#define NV3_CLASS0E_SCALED_IMAGE_IN_OFFSET              0x0324
+#define NV3_CLASS0E_SCALED_IMAGE_IN_POINT               0x0328      // Starts the transfer
+
+#define NV3_CLASS10_BLIT_POINT_IN                       0x0300
+#define NV3_CLASS10_BLIT_POINT_OUT                      0x0304
+#define NV3_CLASS10_BLIT_SIZE                           0x0308      // Starts the blit
+
+// Stretches an image sent through the method stream, in the destination's format, by replicating pixels. Steps are
+// 12.20 output pixels per source pixel; each row of the image starts on a new dword.
+#define NV3_CLASS15_STRETCHED_SIZE_IN                   0x0300
+#define NV3_CLASS15_STRETCHED_DELTA_DX_DU               0x0304
+#define NV3_CLASS15_STRETCHED_DELTA_DY_DV               0x0308
+#define NV3_CLASS15_STRETCHED_CLIP_POINT                0x030C
+#define NV3_CLASS15_STRETCHED_CLIP_SIZE                 0x0310
+#define NV3_CLASS15_STRETCHED_POINT_12D4                0x0314      // Where the output starts, in 12.4
+#define NV3_CLASS15_STRETCHED_COLOR_START               0x0400      // 128 dwords of pixels
+#define NV3_CLASS15_STRETCHED_COLOR_END                 0x05FC
+
+// Direct3D 5 triangles (0x17) and points (0x18) with a zeta buffer. Colour goes to buffer 0, like the 2D classes;
+// the zeta buffer is buffer 1, 16 bits of depth per pixel. Vertices are a D3DTLVERTEX each: screen x, y and z (0-1),
+// 1/w and texture coordinates are floats, the colours X8R8G8B8. Textures are power of two sized, wrap, and are
+// sampled nearest and modulated with the diffuse colour. Specular, fog and alpha aren't modelled.
+#define NV3_PGRAPH_ZETA_BUFFER                          1
+
+#define NV3_D3D_CONTROL_ZFUNC                           0           // 3:0, NV3_D3D_ZFUNC_*, 0 = no zeta buffer
+#define NV3_D3D_CONTROL_ZWRITE_ENABLE                   4
+#define NV3_D3D_CONTROL_TEXTURE_ENABLE                  8
+#define NV3_D3D_CONTROL_CULL                            12          // 13:12, NV3_D3D_CULL_*
+#define NV3_D3D_ZFUNC_NEVER                             1           // As D3DCMPFUNC
+#define NV3_D3D_ZFUNC_LESS                              2
+#define NV3_D3D_ZFUNC_EQUAL                             3
+#define NV3_D3D_ZFUNC_LESSEQUAL                         4
+#define NV3_D3D_ZFUNC_GREATER                           5
+#define NV3_D3D_ZFUNC_NOTEQUAL                          6
+#define NV3_D3D_ZFUNC_GREATEREQUAL                      7
+#define NV3_D3D_ZFUNC_ALWAYS                            8
+#define NV3_D3D_CULL_NONE                               1           // As D3DCULL; clockwise is on screen, y down
+#define NV3_D3D_CULL_CW                                 2
+#define NV3_D3D_CULL_CCW                                3
+
+#define NV3_CLASS17_D3D5_TEXTURE_OFFSET                 0x0304      // In VRAM
+#define NV3_CLASS17_D3D5_TEXTURE_FORMAT                 0x0308
+#define NV3_CLASS17_D3D5_TEXTURE_FORMAT_COLOR           0           // 3:0, NV3_PGRAPH_BPIXEL_FORMAT_*
+#define NV3_CLASS17_D3D5_TEXTURE_FORMAT_WIDTH_LOG2      16          // 19:16
+#define NV3_CLASS17_D3D5_TEXTURE_FORMAT_HEIGHT_LOG2     20          // 23:20
+#define NV3_CLASS17_D3D5_CONTROL                        0x0314      // NV3_D3D_CONTROL_*
+#define NV3_CLASS17_D3D5_TLVERTEX_START                 0x0400      // 16 vertices of 8 dwords, laid out as below
+#define NV3_CLASS17_D3D5_TLVERTEX_END                   0x05FC
+#define NV3_CLASS17_D3D5_TLVERTEX_SIZE                  0x20
+#define NV3_CLASS17_D3D5_TLVERTEX_SPECULAR              0x00
+#define NV3_CLASS17_D3D5_TLVERTEX_COLOR                 0x04
+#define NV3_CLASS17_D3D5_TLVERTEX_SX                    0x08
+#define NV3_CLASS17_D3D5_TLVERTEX_SY                    0x0C
+#define NV3_CLASS17_D3D5_TLVERTEX_SZ                    0x10
+#define NV3_CLASS17_D3D5_TLVERTEX_RHW                   0x14
+#define NV3_CLASS17_D3D5_TLVERTEX_TU                    0x18
+#define NV3_CLASS17_D3D5_TLVERTEX_TV                    0x1C
+#define NV3_CLASS17_D3D5_DRAW_START                     0x0600      // 16 triangles, vertex indices in 3:0, 7:4, 11:8
+#define NV3_CLASS17_D3D5_DRAW_END                       0x063C
+
+#define NV3_CLASS18_POINT_ZETA_CONTROL                  0x0304      // Only the NV3_D3D_CONTROL_Z* bits
+#define NV3_CLASS18_POINT_ZETA_COLOR                    0x0308
+#define NV3_CLASS18_POINT_ZETA_START                    0x0400      // 128 pairs of point, depth in 15:0
+#define NV3_CLASS18_POINT_ZETA_END                      0x07FC
+
+#define NV3_CLASS1C_IMAGE_SET_FORMAT                    0x0300      // NV3_PGRAPH_BPIXEL_FORMAT_*
+#define NV3_CLASS1C_IMAGE_SET_PITCH                     0x0308
+#define NV3_CLASS1C_IMAGE_SET_OFFSET                    0x030C
 
 // PRMCIO is redirected to SVGA subsystem
 #define NV3_PRMCIO_START                                0x601000
@@ -709,6 +871,12 @@
 #define NV3_OBJECT_SUBMIT_SUBCHANNEL                    13
 #define NV3_OBJECT_SUBMIT_CHANNEL                       16
 #define NV3_OBJECT_SUBMIT_END                           NV3_USER_END
+#define NV3_OBJECT_SUBMIT_CHANNEL_SIZE                  0x10000     // 64KB per channel, 8KB per subchannel
+#define NV3_OBJECT_SUBMIT_METHOD                        0x1FFC      // 12:2
+
+// Methods every object understands
+#define NV3_OBJECT_METHOD_SET_OBJECT                    0x0000      // Bind the object with this handle to the subchannel
+#define NV3_OBJECT_METHOD_FREE_COUNT                    0x0010      // Read: bytes free in CACHE1
 
 // also PDFB (Debug Framebuffer?)
 #define NV3_PNVM_START                                  0x1000000   // VRAM access (max 8MB)
@@ -729,6 +897,13 @@
 #define NV3_RAMIN_RAMHT_SIZE_2                         0x3FFF
 #define NV3_RAMIN_RAMHT_SIZE_3                         0x7FFF
 
+// RAMHT entries are two dwords, the object handle and then its context
+#define NV3_RAMHT_ENTRY_SIZE                           8
+#define NV3_RAMHT_CONTEXT_INSTANCE                     0           // 15:0, instance address >> 4
+#define NV3_RAMHT_CONTEXT_CLASS                        16          // 22:16, PFIFO class id
+#define NV3_RAMHT_CONTEXT_CHANNEL                      24          // 30:24
+#define NV3_RAMHT_CONTEXT_VALID                        31
+
 /* OBSOLETE AREA for AUDIO probably. DO NOT USE! */
 #define NV3_RAMIN_RAMAU_START                          0x1C01000   
 #define NV3_RAMIN_RAMAU_END                            0x1C01BFF
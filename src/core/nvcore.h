@@ -8,6 +8,114 @@
 // This resolves the "undeclared function" error
 bool nv3_init(void);  // NV3/NV3T initialization function
 
+// Flat GPU address space used by nv_mmio_read32/nv_mmio_write32
+// BAR0 registers sit at the bottom, the BAR1 framebuffer and instance memory are folded in above them
+#define NV_MMIO_REGS_START      0x0000000
+#define NV_MMIO_REGS_END        0x0FFFFFF
+#define NV_MMIO_VRAM_START      0x1000000
+#define NV_MMIO_VRAM_END        0x17FFFFF
+#define NV_MMIO_RAMIN_START     0x1C00000
+#define NV_MMIO_RAMIN_END       0x1FFFFFF
+
+// The flat space is resolved through a table of 4MB windows so the hot path is a single lookup
+#define NV_MMIO_WINDOW_SHIFT    22
+#define NV_MMIO_WINDOW_SIZE     (1 << NV_MMIO_WINDOW_SHIFT)
+#define NV_MMIO_WINDOW_MASK     (NV_MMIO_WINDOW_SIZE - 1)
+#define NV_MMIO_WINDOW_COUNT    8
+
+// Shadow register cache (nvcore_shadow.c)
+// Reading a register across PCI costs on the order of a microsecond, so registers that only change when we
+// write them can be tagged and served from a per-device shadow copy instead.
+typedef enum nv_shadow_policy_e {
+    NV_SHADOW_VOLATILE = 0,                         // The GPU can change it behind our back; always read the real register
+    NV_SHADOW_CACHEABLE = 1,                        // Only changes when we write it; reads can come from the shadow
+    NV_SHADOW_READ_SENSITIVE = 2,                   // Reading it has side effects; only the value last written is known
+} nv_shadow_policy_t;
+
+#define NV_SHADOW_CACHE_SIZE    64                  // Must be a power of two
+
+typedef struct nv_shadow_entry_s {
+    uint32_t addr;
+    uint32_t value;
+    uint8_t policy;
+    bool tagged;                                    // Slot is in use
+    bool valid;                                     // value matches the hardware
+} nv_shadow_entry_t;
+
+typedef struct nv_shadow_stats_s {
+    uint64_t hits;                                  // Reads served from the shadow
+    uint64_t misses;                                // Reads of tagged registers that had to go to the hardware
+    uint64_t writes;                                // Writes through the shadow
+    uint64_t uncached;                              // Accesses to volatile or untagged registers
+} nv_shadow_stats_t;
+
+typedef struct nv_shadow_cache_s {
+    nv_shadow_entry_t entries[NV_SHADOW_CACHE_SIZE];
+    uint32_t tagged_count;
+    nv_shadow_stats_t stats;
+} nv_shadow_cache_t;
+
+// Time source (nvcore_time.c)
+// A source is given the clock's skipped time (the device's fast-forward offset) and may ignore it.
+typedef struct nv_time_source_s {
+    const char *name;
+    uint64_t (*now)(const uint64_t *skipped_ns);    // Monotonic nanoseconds
+    void (*sleep_ns)(uint64_t *skipped_ns, uint64_t ns);
+} nv_time_source_t;
+
+#define NV_TIME_NS_PER_SECOND       1000000000ull
+
+// Register polling (nvcore_wait.c)
+// Wait durations are kept in a log2 histogram: bucket n counts waits of [2^(n-1), 2^n) ns, bucket 0 is no wait
+#define NV_WAIT_HISTOGRAM_BUCKETS   40              // The last bucket also holds anything longer than ~4.5 minutes
+
+typedef struct nv_wait_stats_s {
+    uint64_t waits;
+    uint64_t timeouts;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[NV_WAIT_HISTOGRAM_BUCKETS];
+} nv_wait_stats_t;
+
+// Pixel format conversion (nvcore_pixel.c)
+typedef enum nv_pixel_format_e {
+    NV_PIXEL_FORMAT_Y8 = 0,
+    NV_PIXEL_FORMAT_X1R5G5B5 = 1,
+    NV_PIXEL_FORMAT_R5G6B5 = 2,
+    NV_PIXEL_FORMAT_X8R8G8B8 = 3,
+    NV_PIXEL_FORMAT_COUNT,
+} nv_pixel_format_t;
+
+// Converts count pixels. dst and src may only overlap if they're the same format.
+typedef void (*nv_pixel_convert_t)(void *dst, const void *src, uint32_t count);
+
+// Image scaling (nvcore_scale.c)
+typedef enum nv_scale_filter_e {
+    NV_SCALE_NEAREST = 0,
+    NV_SCALE_BILINEAR = 1,
+} nv_scale_filter_t;
+
+// What an output column or row samples: index0 blended towards index1 by weight/256
+typedef struct nv_scale_tap_s {
+    uint32_t index0;
+    uint32_t index1;
+    uint32_t weight;
+} nv_scale_tap_t;
+
+typedef struct nv_scaler_s {
+    nv_scale_filter_t filter;
+    nv_pixel_format_t dst_format;
+    nv_pixel_format_t src_format;
+    uint32_t dst_width;
+    uint32_t dst_height;
+    uint32_t src_width;
+    uint32_t src_height;
+    int32_t u0, du;                                 // 16.16 source position of the first output column, and step
+    int32_t v0, dv;                                 // The same for rows
+    nv_scale_tap_t *columns;                        // One per output column
+    nv_scale_tap_t *rows;                           // One per output row
+} nv_scaler_t;
+
 // Function prototypes for device initialization
 typedef bool (*init_function_t)(void);
 typedef bool (*shutdown_function_t)(void);
@@ -33,19 +141,109 @@ typedef struct nv_device_s {
     uint32_t nv_pfb_boot_0;
     uint32_t vram_amount;
     uint32_t straps;
+    char pci_slot_name[16];                         // Domain:bus:device.function, as used by sysfs
+    uint32_t bar0_size;                             // Real BAR lengths, 0 if unknown
+    uint32_t bar1_size;
     void *mmio_mapping;
     void *vram_mapping;
     void *ramin_mapping;
+    uint32_t mmio_mapping_size;                     // Sizes of the host mappings behind the pointers above
+    uint32_t vram_mapping_size;
+    uint32_t ramin_mapping_size;
+    bool vram_write_combined;                       // VRAM is mapped write-combined; see nv_vram_flush
+    nv_shadow_cache_t shadow;                       // Shadow register cache
+    uint8_t *mmio_windows[NV_MMIO_WINDOW_COUNT];   // Host address of each 4MB window, NULL if unmapped or emulated
+    uint64_t time_skipped_ns;                       // Sleeps skipped by the fast-forward clock on this device
     nv_device_info_t device_info;
 } nv_device_t;
 
 // External globals
 extern nv_device_info_t supported_devices[];
-extern nv_device_t current_device;
+
+// The device nvcore talks to, per thread, so that separate threads can each drive a device of their own (say, one
+// virtual device each). current_device stays the name everything uses for it.
+extern nv_device_t nv_default_device;
+extern __thread nv_device_t *nv_current_device;
+#define current_device (*nv_current_device)
 
 // Function prototypes
 bool nv_detect(void);
-uint32_t nv_mmio_read32(uint32_t addr);
-void nv_mmio_write32(uint32_t addr, uint32_t value);
+nv_device_t *nv_device_select(nv_device_t *device);
 bool init_mmio_mappings(uint32_t bar0_base, uint32_t bar1_base);
-void cleanup_mmio_mappings(void);
\ No newline at end of file
+void cleanup_mmio_mappings(void);
+
+// Bulk VRAM transfers through the BAR1 window (nvcore_vram.c)
+// Copies take any byte offset and size, fills need a dword aligned offset and size.
+void nv_vram_select_engine(void);
+const char *nv_vram_engine_name(void);
+bool nv_vram_copy_to(uint32_t offset, const void *src, uint32_t size);
+bool nv_vram_copy_from(void *dst, uint32_t offset, uint32_t size);
+bool nv_vram_fill(uint32_t offset, uint32_t value, uint32_t size);
+bool nv_vram_upload_image(uint32_t offset, uint32_t pitch, nv_pixel_format_t format, const void *pixels,
+    uint32_t src_pitch, nv_pixel_format_t src_format, uint32_t width, uint32_t height);
+bool nv_vram_upload_scaled(uint32_t offset, uint32_t pitch, const nv_scaler_t *scaler, const void *pixels,
+    uint32_t src_pitch);
+
+// Pixel format conversion (nvcore_pixel.c)
+// The converter is picked once for a pair of formats; the conversion itself never branches per pixel.
+uint32_t nv_pixel_format_bytes(nv_pixel_format_t format);
+const char *nv_pixel_format_name(nv_pixel_format_t format);
+nv_pixel_convert_t nv_pixel_get_converter(nv_pixel_format_t dst_format, nv_pixel_format_t src_format);
+bool nv_pixel_convert(void *dst, nv_pixel_format_t dst_format, const void *src, nv_pixel_format_t src_format,
+    uint32_t count);
+
+// Image scaling (nvcore_scale.c)
+// A scaler is set up once for a pair of image sizes and reused; the tables are read only afterwards, so one scaler
+// can serve several threads. nv_scaler_init* clean up whatever the scaler held before, so it starts zeroed.
+bool nv_scaler_init(nv_scaler_t *scaler, nv_scale_filter_t filter, nv_pixel_format_t dst_format, uint32_t dst_width,
+    uint32_t dst_height, nv_pixel_format_t src_format, uint32_t src_width, uint32_t src_height);
+bool nv_scaler_init_steps(nv_scaler_t *scaler, nv_scale_filter_t filter, nv_pixel_format_t dst_format,
+    uint32_t dst_width, uint32_t dst_height, nv_pixel_format_t src_format, uint32_t src_width, uint32_t src_height,
+    int32_t u0, int32_t du, int32_t v0, int32_t dv);
+void nv_scaler_cleanup(nv_scaler_t *scaler);
+void nv_scaler_span(const nv_scaler_t *scaler, void *dst, const void *row0, const void *row1, uint32_t weight,
+    uint32_t x0, uint32_t x1);
+void nv_scaler_row(const nv_scaler_t *scaler, void *dst, const void *src, uint32_t src_pitch, uint32_t y,
+    uint32_t x0, uint32_t x1);
+
+// Shadow register cache (nvcore_shadow.c)
+// Writes through nv_mmio_write32, nv_reg_write32 and the batch paths keep the shadow coherent; the VRAM and RAMIN
+// accessors don't, so registers are the only thing worth tagging. A read-sensitive register is never read for
+// real: its value is only known once it has been written, and until then reading it through the shadow fails
+// (returns 0xFFFFFFFF) and the read-modify-write helpers refuse to touch it and return false.
+void nv_shadow_reset(void);
+bool nv_shadow_tag(uint32_t addr, nv_shadow_policy_t policy);
+void nv_shadow_invalidate(uint32_t addr);
+void nv_shadow_note_write(uint32_t addr, uint32_t value);
+uint32_t nv_shadow_read32(uint32_t addr);
+void nv_shadow_write32(uint32_t addr, uint32_t value);
+bool nv_mmio_set_bits(uint32_t addr, uint32_t bits);
+bool nv_mmio_clear_bits(uint32_t addr, uint32_t bits);
+bool nv_mmio_update_field(uint32_t addr, uint32_t shift, uint32_t mask, uint32_t value);
+void nv_shadow_get_stats(nv_shadow_stats_t *stats);
+
+// Time source (nvcore_time.c)
+// nv_time_host really sleeps; nv_time_fast_forward skips sleeps by moving the clock forward (the default in virtual
+// builds, so long procedures finish instantly). Each device keeps its own skipped time, so a sleep only moves the
+// clock of the device the sleeping thread drives: the current virtual device in virtual builds, otherwise
+// current_device. nv_time_now_skipping reads the clock of a given offset, for code that serves a device from
+// another thread (the virtual device's worker).
+extern const nv_time_source_t nv_time_host;
+extern const nv_time_source_t nv_time_fast_forward;
+
+void nv_time_set_source(const nv_time_source_t *source);
+const nv_time_source_t *nv_time_get_source(void);
+uint64_t nv_time_now(void);
+void nv_sleep_ns(uint64_t ns);
+uint64_t nv_time_skipped(void);
+uint64_t nv_time_now_skipping(const uint64_t *skipped_ns);
+
+// Register polling (nvcore_wait.c)
+bool nv_mmio_wait(uint32_t addr, uint32_t mask, uint32_t value, uint64_t timeout_ns, uint64_t *waited_ns);
+void nv_wait_get_stats(nv_wait_stats_t *stats);
+
+// Statistics for all core subsystems (nvcore_stats.c)
+void nv_stats_print(void);
+
+// Inline register/VRAM/RAMIN accessors
+#include "core/nvcore_io.h"
\ No newline at end of file
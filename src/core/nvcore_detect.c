@@ -22,8 +22,19 @@ nv_device_info_t supported_devices[] =
     { 0, 0, "", NULL, NULL, NULL, NULL, }, // sentinel
 };
 
-// The selected device after detection is done. 
-nv_device_t current_device = {0}; 
+// The selected device after detection is done. Threads that drive a device of their own point nv_current_device
+// at it (nv_device_select), everything else uses this one.
+nv_device_t nv_default_device = {0};
+__thread nv_device_t *nv_current_device = &nv_default_device;
+
+// Make device the calling thread's current device (NULL goes back to the default one). Returns the previous one.
+nv_device_t *nv_device_select(nv_device_t *device)
+{
+    nv_device_t *previous = nv_current_device;
+
+    nv_current_device = (device) ? device : &nv_default_device;
+    return previous;
+}
 
 bool nv_detect()
 {
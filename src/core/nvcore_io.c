@@ -7,6 +7,177 @@
 #include <sys/types.h>
 #include "nvplayground.h"
 #include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+
+// Point every 4MB window of the flat address space at the host mapping that backs it.
+// A window only partially covered by the mapping (a BAR that isn't a multiple of 4MB) gets no entry, so the fast
+// path never runs off the end; the slow path finds the mapped part of it with nv_mmio_region_ptr.
+static void nv_mmio_map_region(uint32_t start, void *mapping, uint32_t size)
+{
+    if (!mapping)
+        return;
+
+    for (uint32_t offset = 0; offset + NV_MMIO_WINDOW_SIZE <= size; offset += NV_MMIO_WINDOW_SIZE)
+        current_device.mmio_windows[(start + offset) >> NV_MMIO_WINDOW_SHIFT] = (uint8_t *)mapping + offset;
+}
+
+static void nv_mmio_build_windows(void)
+{
+    memset(current_device.mmio_windows, 0, sizeof(current_device.mmio_windows));
+    nv_mmio_map_region(NV_MMIO_REGS_START, current_device.mmio_mapping, current_device.mmio_mapping_size);
+    nv_mmio_map_region(NV_MMIO_VRAM_START, current_device.vram_mapping, current_device.vram_mapping_size);
+    nv_mmio_map_region(NV_MMIO_RAMIN_START, current_device.ramin_mapping, current_device.ramin_mapping_size);
+}
+
+// Issue a run of consecutive dwords without fencing, splitting it wherever it crosses a window
+static void nv_mmio_issue_span(uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    // Keep any shadowed registers in the run coherent
+    if (current_device.shadow.tagged_count) {
+        for (uint32_t i = 0; i < count; i++)
+            nv_shadow_note_write(addr + i * 4, values[i]);
+    }
+
+    if (__builtin_expect(nv_trace_enabled, 0)) {
+        for (uint32_t i = 0; i < count; i++)
+            nv_trace_record(addr + i * 4, values[i], NV_TRACE_WRITE);
+    }
+
+    while (count) {
+        uint32_t room = (NV_MMIO_WINDOW_SIZE - (addr & NV_MMIO_WINDOW_MASK)) / 4;
+        uint32_t run = (count < room) ? count : room;
+        volatile uint32_t *ptr = nv_mmio_window_ptr(addr);
+
+        if (ptr) {
+            for (uint32_t i = 0; i < run; i++)
+                ptr[i] = values[i];
+        } else {
+            nv_mmio_write_span_slow(addr, values, run);
+        }
+
+        addr += run * 4;
+        values += run;
+        count -= run;
+    }
+}
+
+void nv_mmio_write_span(uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    nv_mmio_issue_span(addr, values, count);
+    nv_mmio_barrier();
+}
+
+static void nv_mmio_insertion_sort_batch(nv_mmio_write_t *writes, uint32_t count)
+{
+    for (uint32_t i = 1; i < count; i++) {
+        nv_mmio_write_t entry = writes[i];
+        uint32_t j = i;
+
+        while (j > 0 && writes[j - 1].addr > entry.addr) {
+            writes[j] = writes[j - 1];
+            j--;
+        }
+
+        writes[j] = entry;
+    }
+}
+
+// Stable sort by address, so that repeated writes to one register keep their relative order
+static void nv_mmio_sort_batch(nv_mmio_write_t *writes, uint32_t count)
+{
+    nv_mmio_write_t *scratch = NULL;
+
+    // Batches are usually short (and often already sorted), so insertion sort wins there
+    if (count > 32)
+        scratch = malloc(count * sizeof(nv_mmio_write_t));
+
+    if (!scratch) {
+        nv_mmio_insertion_sort_batch(writes, count);
+        return;
+    }
+
+    // Bottom-up merge sort
+    nv_mmio_write_t *src = writes, *dst = scratch;
+
+    for (uint32_t width = 1; width < count; width *= 2) {
+        for (uint32_t lo = 0; lo < count; lo += width * 2) {
+            uint32_t mid = (lo + width < count) ? lo + width : count;
+            uint32_t hi = (lo + width * 2 < count) ? lo + width * 2 : count;
+            uint32_t a = lo, b = mid, out = lo;
+
+            while (a < mid && b < hi)
+                dst[out++] = (src[b].addr < src[a].addr) ? src[b++] : src[a++];
+            while (a < mid)
+                dst[out++] = src[a++];
+            while (b < hi)
+                dst[out++] = src[b++];
+        }
+
+        nv_mmio_write_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != writes)
+        memcpy(writes, src, count * sizeof(nv_mmio_write_t));
+
+    free(scratch);
+}
+
+// Issue a batch in the order given, coalescing neighbours at consecutive addresses into spans. With dedup, a write
+// followed by another to the same address is dropped; only sorted batches ask for that.
+static void nv_mmio_issue_batch(const nv_mmio_write_t *writes, uint32_t count, bool dedup)
+{
+    uint32_t run_values[64];
+    uint32_t run_addr = 0, run_length = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (dedup && i + 1 < count && writes[i + 1].addr == writes[i].addr)
+            continue;
+
+        bool extends_run = (run_length > 0
+            && run_length < sizeof(run_values) / sizeof(run_values[0])
+            && writes[i].addr == run_addr + run_length * 4);
+
+        if (!extends_run) {
+            if (run_length)
+                nv_mmio_issue_span(run_addr, run_values, run_length);
+
+            run_addr = writes[i].addr;
+            run_length = 0;
+        }
+
+        run_values[run_length++] = writes[i].value;
+    }
+
+    if (run_length)
+        nv_mmio_issue_span(run_addr, run_values, run_length);
+}
+
+void nv_mmio_write_batch(const nv_mmio_write_t *writes, uint32_t count, uint32_t flags)
+{
+    nv_mmio_write_t local[64];
+    nv_mmio_write_t *sorted = NULL;
+
+    // The caller's array is left alone, so sorting happens on a copy. If there's no memory for one, issuing the
+    // batch as given still ends with every register holding its last value.
+    if ((flags & NV_MMIO_BATCH_SORT_DEDUP) && count > 1)
+        sorted = (count <= sizeof(local) / sizeof(local[0])) ? local : malloc(count * sizeof(nv_mmio_write_t));
+
+    if (sorted) {
+        memcpy(sorted, writes, count * sizeof(nv_mmio_write_t));
+        nv_mmio_sort_batch(sorted, count);
+        nv_mmio_issue_batch(sorted, count, true);
+
+        if (sorted != local)
+            free(sorted);
+    } else {
+        nv_mmio_issue_batch(writes, count, false);
+    }
+
+    nv_mmio_barrier();
+}
 
 #ifndef USE_VIRTUAL_PCI
 
@@ -15,75 +186,167 @@ static void *mmio_mapped_base = NULL;
 static void *vram_mapped_base = NULL;
 static void *ramin_mapped_base = NULL;
 
-bool init_mmio_mappings(uint32_t bar0_base, uint32_t bar1_base)
+// Map part of a BAR through its sysfs resource file (resourceN or resourceN_wc)
+static void *nv_mmio_map_sysfs(const char *resource, uint32_t offset, uint32_t size)
+{
+    char path[128];
+
+    if (!current_device.pci_slot_name[0])
+        return MAP_FAILED;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s", current_device.pci_slot_name, resource);
+
+    int fd = open(path, O_RDWR | O_SYNC);
+
+    if (fd == -1)
+        return MAP_FAILED;
+
+    void *mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+    return mapping;
+}
+
+// Map part of a BAR uncached through /dev/mem, the fallback when sysfs is not available
+static void *nv_mmio_map_devmem(uint32_t physical_address, uint32_t size)
 {
-    printf("Initializing memory mappings with real hardware access\n");
-    
-    // Open /dev/mem for physical memory mapping
-    mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
     if (mem_fd == -1) {
-        perror("Failed to open /dev/mem");
-        return false;
+        mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+
+        if (mem_fd == -1) {
+            perror("Failed to open /dev/mem");
+            return MAP_FAILED;
+        }
     }
-    
-    // Map BAR0 (MMIO registers)
-    mmio_mapped_base = mmap(0, 0x1000000, PROT_READ | PROT_WRITE, MAP_SHARED,
-                          mem_fd, bar0_base);
+
+    return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, physical_address);
+}
+
+bool init_mmio_mappings(uint32_t bar0_base, uint32_t bar1_base)
+{
+    printf("Initializing memory mappings with real hardware access\n");
+
+    /* 
+        Size everything from the real BAR lengths. BAR1 holds the framebuffer in its lower half and
+        instance memory in its top quarter; the flat address space limits how much of each we can use.
+    */
+    uint32_t bar0_size = current_device.bar0_size ? current_device.bar0_size : 0x1000000;
+    uint32_t bar1_size = current_device.bar1_size ? current_device.bar1_size : 0x1000000;
+
+    uint32_t mmio_size = bar0_size;
+    uint32_t vram_size = bar1_size / 2;
+    uint32_t ramin_size = bar1_size / 4;
+    uint32_t ramin_offset = bar1_size - ramin_size;
+
+    if (mmio_size > NV_MMIO_REGS_END - NV_MMIO_REGS_START + 1)
+        mmio_size = NV_MMIO_REGS_END - NV_MMIO_REGS_START + 1;
+    if (vram_size > NV_MMIO_VRAM_END - NV_MMIO_VRAM_START + 1)
+        vram_size = NV_MMIO_VRAM_END - NV_MMIO_VRAM_START + 1;
+    if (ramin_size > NV_MMIO_RAMIN_END - NV_MMIO_RAMIN_START + 1)
+        ramin_size = NV_MMIO_RAMIN_END - NV_MMIO_RAMIN_START + 1;
+
+    printf("BAR0 size 0x%08X, BAR1 size 0x%08X\n", bar0_size, bar1_size);
+
+    // Map BAR0 (MMIO registers), always uncached
+    mmio_mapped_base = nv_mmio_map_sysfs("resource0", 0, mmio_size);
+
+    if (mmio_mapped_base == MAP_FAILED)
+        mmio_mapped_base = nv_mmio_map_devmem(bar0_base, mmio_size);
+
     if (mmio_mapped_base == MAP_FAILED) {
         perror("Failed to map BAR0 MMIO registers");
-        close(mem_fd);
+        mmio_mapped_base = NULL;
+        cleanup_mmio_mappings();
         return false;
     }
-    
-    // Map BAR1 VRAM area
-    vram_mapped_base = mmap(0, 0x800000, PROT_READ | PROT_WRITE, MAP_SHARED,
-                          mem_fd, bar1_base);
+
+    current_device.mmio_mapping = mmio_mapped_base;
+    current_device.mmio_mapping_size = mmio_size;
+
+    // Map BAR1 VRAM area, write-combined if we can
+    vram_mapped_base = MAP_FAILED;
+    current_device.vram_write_combined = false;
+
+#ifdef USE_WC_FRAMEBUFFER
+    vram_mapped_base = nv_mmio_map_sysfs("resource1_wc", 0, vram_size);
+
+    if (vram_mapped_base != MAP_FAILED)
+        current_device.vram_write_combined = true;
+    else
+        printf("Write-combined VRAM mapping not available, falling back to uncached\n");
+#endif
+
+    if (vram_mapped_base == MAP_FAILED)
+        vram_mapped_base = nv_mmio_map_sysfs("resource1", 0, vram_size);
+
+    if (vram_mapped_base == MAP_FAILED)
+        vram_mapped_base = nv_mmio_map_devmem(bar1_base, vram_size);
+
     if (vram_mapped_base == MAP_FAILED) {
         perror("Failed to map BAR1 VRAM");
-        munmap(mmio_mapped_base, 0x1000000);
-        close(mem_fd);
+        vram_mapped_base = NULL;
+        cleanup_mmio_mappings();
         return false;
     }
-    
-    // Map BAR1 RAMIN area (starts at 0xC00000 offset from BAR1 base)
-    ramin_mapped_base = mmap(0, 0x400000, PROT_READ | PROT_WRITE, MAP_SHARED,
-                           mem_fd, bar1_base + 0xC00000);
+
+    current_device.vram_mapping = vram_mapped_base;
+    current_device.vram_mapping_size = vram_size;
+
+    // Map BAR1 RAMIN area uncached, the GPU reads hash tables and contexts back out of it
+    ramin_mapped_base = nv_mmio_map_sysfs("resource1", ramin_offset, ramin_size);
+
+    if (ramin_mapped_base == MAP_FAILED)
+        ramin_mapped_base = nv_mmio_map_devmem(bar1_base + ramin_offset, ramin_size);
+
     if (ramin_mapped_base == MAP_FAILED) {
         perror("Failed to map BAR1 RAMIN");
-        munmap(vram_mapped_base, 0x800000);
-        munmap(mmio_mapped_base, 0x1000000);
-        close(mem_fd);
+        ramin_mapped_base = NULL;
+        cleanup_mmio_mappings();
         return false;
     }
-    
-    // Store mappings in the current_device structure
-    current_device.mmio_mapping = mmio_mapped_base;
-    current_device.vram_mapping = vram_mapped_base;
+
     current_device.ramin_mapping = ramin_mapped_base;
+    current_device.ramin_mapping_size = ramin_size;
+
+    nv_mmio_build_windows();
+    nv_shadow_reset();
+    nv_vram_select_engine();
     
-    printf("Memory mappings initialized successfully\n");
+    printf("Memory mappings initialized successfully (VRAM %s)\n",
+        current_device.vram_write_combined ? "write-combined" : "uncached");
     return true;
 }
 
 void cleanup_mmio_mappings(void)
 {
+    memset(current_device.mmio_windows, 0, sizeof(current_device.mmio_windows));
+
+    // Drain anything still sitting in the write-combining buffers before the mapping goes away
+    nv_vram_flush();
+
     if (ramin_mapped_base) {
-        munmap(ramin_mapped_base, 0x400000);
+        munmap(ramin_mapped_base, current_device.ramin_mapping_size);
         ramin_mapped_base = NULL;
-        current_device.ramin_mapping = NULL;
     }
     
     if (vram_mapped_base) {
-        munmap(vram_mapped_base, 0x800000);
+        munmap(vram_mapped_base, current_device.vram_mapping_size);
         vram_mapped_base = NULL;
-        current_device.vram_mapping = NULL;
     }
     
     if (mmio_mapped_base) {
-        munmap(mmio_mapped_base, 0x1000000);
+        munmap(mmio_mapped_base, current_device.mmio_mapping_size);
         mmio_mapped_base = NULL;
-        current_device.mmio_mapping = NULL;
     }
+
+    current_device.mmio_mapping = NULL;
+    current_device.mmio_mapping_size = 0;
+    current_device.vram_mapping = NULL;
+    current_device.vram_mapping_size = 0;
+    current_device.vram_write_combined = false;
+    current_device.ramin_mapping = NULL;
+    current_device.ramin_mapping_size = 0;
     
     if (mem_fd != -1) {
         close(mem_fd);
@@ -93,103 +356,123 @@ void cleanup_mmio_mappings(void)
     printf("Memory mappings cleaned up\n");
 }
 
-uint32_t nv_mmio_read32(uint32_t addr)
+// Where an address lands in whichever mapping covers it, for the tails of partially covered windows
+static volatile uint32_t *nv_mmio_region_ptr(uint32_t addr)
 {
-    volatile uint32_t *ptr;
-    
-    if (addr < 0x1000000) {
-        // MMIO access
-        if (!mmio_mapped_base) {
-            printf("Error: Attempted MMIO read before initialization\n");
-            return 0xFFFFFFFF;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)mmio_mapped_base + addr);
-    } 
-    else if (addr >= 0x1000000 && addr < 0x1800000) {
-        // VRAM access
-        if (!vram_mapped_base) {
-            printf("Error: Attempted VRAM read before initialization\n");
-            return 0xFFFFFFFF;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)vram_mapped_base + (addr - 0x1000000));
-    }
-    else if (addr >= 0x1C00000 && addr < 0x2000000) {
-        // RAMIN access
-        if (!ramin_mapped_base) {
-            printf("Error: Attempted RAMIN read before initialization\n");
-            return 0xFFFFFFFF;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)ramin_mapped_base + (addr - 0x1C00000));
-    }
-    else {
-        printf("Error: Invalid MMIO read address: 0x%08X\n", addr);
-        return 0xFFFFFFFF;
-    }
-    
-    return *ptr;
+    if (addr <= NV_MMIO_REGS_END && mmio_mapped_base && addr - NV_MMIO_REGS_START < current_device.mmio_mapping_size)
+        return (volatile uint32_t *)((uint8_t *)mmio_mapped_base + addr - NV_MMIO_REGS_START);
+
+    if (addr >= NV_MMIO_VRAM_START && addr <= NV_MMIO_VRAM_END && vram_mapped_base
+        && addr - NV_MMIO_VRAM_START < current_device.vram_mapping_size)
+        return (volatile uint32_t *)((uint8_t *)vram_mapped_base + addr - NV_MMIO_VRAM_START);
+
+    if (addr >= NV_MMIO_RAMIN_START && addr <= NV_MMIO_RAMIN_END && ramin_mapped_base
+        && addr - NV_MMIO_RAMIN_START < current_device.ramin_mapping_size)
+        return (volatile uint32_t *)((uint8_t *)ramin_mapped_base + addr - NV_MMIO_RAMIN_START);
+
+    return NULL;
 }
 
-void nv_mmio_write32(uint32_t addr, uint32_t value)
+uint32_t nv_mmio_read32_slow(uint32_t addr)
 {
-    volatile uint32_t *ptr;
-    
-    if (addr < 0x1000000) {
-        // MMIO access
-        if (!mmio_mapped_base) {
-            printf("Error: Attempted MMIO write before initialization\n");
-            return;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)mmio_mapped_base + addr);
-    } 
-    else if (addr >= 0x1000000 && addr < 0x1800000) {
-        // VRAM access
-        if (!vram_mapped_base) {
-            printf("Error: Attempted VRAM write before initialization\n");
-            return;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)vram_mapped_base + (addr - 0x1000000));
-    }
-    else if (addr >= 0x1C00000 && addr < 0x2000000) {
-        // RAMIN access
-        if (!ramin_mapped_base) {
-            printf("Error: Attempted RAMIN write before initialization\n");
-            return;
-        }
-        ptr = (volatile uint32_t *)((uint8_t *)ramin_mapped_base + (addr - 0x1C00000));
+    volatile uint32_t *ptr = nv_mmio_region_ptr(addr);
+
+    if (ptr)
+        return *ptr;
+
+    if (addr <= NV_MMIO_REGS_END && !mmio_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted MMIO read before initialization\n");
+    else if (addr >= NV_MMIO_VRAM_START && addr <= NV_MMIO_VRAM_END && !vram_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted VRAM read before initialization\n");
+    else if (addr >= NV_MMIO_RAMIN_START && addr <= NV_MMIO_RAMIN_END && !ramin_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted RAMIN read before initialization\n");
+    else
+        nv_log_error(NV_LOG_CORE, "Error: Invalid MMIO read address: 0x%08X\n", addr);
+
+    return 0xFFFFFFFF;
+}
+
+void nv_mmio_write_span_slow(uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    // Write what's mapped, then only report the first bad address rather than every dword of the run
+    for (; count; addr += 4, values++, count--) {
+        volatile uint32_t *ptr = nv_mmio_region_ptr(addr);
+
+        if (!ptr)
+            break;
+
+        *ptr = values[0];
     }
-    else {
-        printf("Error: Invalid MMIO write address: 0x%08X\n", addr);
+
+    if (count)
+        nv_mmio_write32_slow(addr, values[0]);
+}
+
+void nv_mmio_write32_slow(uint32_t addr, uint32_t value)
+{
+    volatile uint32_t *ptr = nv_mmio_region_ptr(addr);
+
+    if (ptr) {
+        *ptr = value;
         return;
     }
-    
-    *ptr = value;
+
+    if (addr <= NV_MMIO_REGS_END && !mmio_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted MMIO write before initialization\n");
+    else if (addr >= NV_MMIO_VRAM_START && addr <= NV_MMIO_VRAM_END && !vram_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted VRAM write before initialization\n");
+    else if (addr >= NV_MMIO_RAMIN_START && addr <= NV_MMIO_RAMIN_END && !ramin_mapped_base)
+        nv_log_error(NV_LOG_CORE, "Error: Attempted RAMIN write before initialization\n");
+    else
+        nv_log_error(NV_LOG_CORE, "Error: Invalid MMIO write address: 0x%08X\n", addr);
 }
 
 #else
 
 // In virtual mode, we use the functions from virtual_pci.c
-extern uint32_t virtual_mmio_read32(uint32_t addr);
-extern void virtual_mmio_write32(uint32_t addr, uint32_t value);
 
 bool init_mmio_mappings(uint32_t bar0_base, uint32_t bar1_base)
 {
     printf("Using virtual MMIO mappings (no real hardware access)\n");
-    return true;  // Nothing to do, virtual mappings already set up
+
+    // VRAM and RAMIN are plain memory, so they can be accessed directly.
+    // Registers are left without a window so they always go through the virtual device model.
+    current_device.mmio_mapping = NULL;
+    current_device.vram_mapping = virtual_pci_get_vram();
+    current_device.ramin_mapping = virtual_pci_get_ramin();
+    current_device.vram_mapping_size = VIRTUAL_VRAM_SIZE;
+    current_device.ramin_mapping_size = VIRTUAL_RAMIN_SIZE;
+    nv_mmio_build_windows();
+    nv_shadow_reset();
+
+    // Use the same transfer engine as real hardware so that benchmarks are comparable
+    nv_vram_select_engine();
+    return true;
 }
 
 void cleanup_mmio_mappings(void)
 {
-    // Nothing to do, virtual mappings cleaned up in virtual_pci_cleanup
+    // The buffers themselves are cleaned up in virtual_pci_cleanup
+    memset(current_device.mmio_windows, 0, sizeof(current_device.mmio_windows));
+    current_device.vram_mapping = NULL;
+    current_device.vram_mapping_size = 0;
+    current_device.ramin_mapping = NULL;
+    current_device.ramin_mapping_size = 0;
 }
 
-uint32_t nv_mmio_read32(uint32_t addr)
+uint32_t nv_mmio_read32_slow(uint32_t addr)
 {
     return virtual_mmio_read32(addr);
 }
 
-void nv_mmio_write32(uint32_t addr, uint32_t value)
+void nv_mmio_write32_slow(uint32_t addr, uint32_t value)
 {
     virtual_mmio_write32(addr, value);
 }
 
+void nv_mmio_write_span_slow(uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    virtual_mmio_write_span(addr, values, count);
+}
+
 #endif // USE_VIRTUAL_PCI
\ No newline at end of file
@@ -0,0 +1,178 @@
+#pragma once
+
+//
+// Filename: nvcore_io.h
+// Purpose: Inline MMIO access layer
+//
+// The region an address belongs to is resolved once, in init_mmio_mappings, into current_device.mmio_windows.
+// After that every access is a table lookup plus a single volatile load or store; the out-of-line slow path
+// only runs for unmapped addresses, the tail of a BAR that ends partway through a window (or emulated registers
+// in the virtual build).
+//
+// If you already know which region you are touching, use the nv_reg_/nv_vram_/nv_ramin_ accessors, which skip
+// the lookup entirely. VRAM and RAMIN offsets are relative to the start of their region.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "core/nvcore.h"
+#include "core/nvcore_trace.h"
+
+#ifdef USE_VIRTUAL_PCI
+#include "core/pci/pci.h"
+#endif
+
+// One entry of a batched write
+typedef struct nv_mmio_write_s {
+    uint32_t addr;
+    uint32_t value;
+} nv_mmio_write_t;
+
+// nv_mmio_write_batch flags
+#define NV_MMIO_BATCH_SORT_DEDUP    0x1     // Sort by address and keep only the last write to each one
+
+// Out-of-line fallbacks for addresses that do not have a host window (nvcore_io.c)
+uint32_t nv_mmio_read32_slow(uint32_t addr);
+void nv_mmio_write32_slow(uint32_t addr, uint32_t value);
+void nv_mmio_write_span_slow(uint32_t addr, const uint32_t *values, uint32_t count);
+
+// Batched writes (nvcore_io.c). Both issue their stores back to back and fence once at the end.
+// By default a batch is issued in the order given, every write included, and only neighbours that are already
+// at consecutive addresses are merged into spans. NV_MMIO_BATCH_SORT_DEDUP sorts a copy of the batch by address
+// and drops all but the last write to each register, which turns scattered setup into fewer, longer spans. Only
+// use it for plain registers whose write order doesn't matter; never for data ports (like the DAC palette) or
+// FIFOs, where every write counts.
+void nv_mmio_write_batch(const nv_mmio_write_t *writes, uint32_t count, uint32_t flags);
+void nv_mmio_write_span(uint32_t addr, const uint32_t *values, uint32_t count);
+
+// Make sure every MMIO store issued so far has left the CPU before continuing
+static inline void nv_mmio_barrier(void)
+{
+    __sync_synchronize();
+}
+
+// Flush point for write-combined VRAM. Stores into a write-combined framebuffer can sit in the CPU's
+// combining buffers, so call this after drawing and before anything that depends on the data being in
+// VRAM (kicking the GPU, reading it back, scanout-sensitive register writes). The bulk transfer engine
+// does this itself at the end of every transfer.
+static inline void nv_vram_flush(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_sfence();
+#else
+    __sync_synchronize();
+#endif
+}
+
+// Spin-wait hint for polling loops: lets the sibling hyperthread run and saves power while spinning
+static inline void nv_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline volatile uint32_t *nv_mmio_window_ptr(uint32_t addr)
+{
+    uint32_t index = addr >> NV_MMIO_WINDOW_SHIFT;
+
+    if (__builtin_expect(index >= NV_MMIO_WINDOW_COUNT, 0))
+        return NULL;
+
+    uint8_t *window = current_device.mmio_windows[index];
+
+    if (__builtin_expect(!window, 0))
+        return NULL;
+
+    return (volatile uint32_t *)(window + (addr & NV_MMIO_WINDOW_MASK));
+}
+
+// Generic accessors over the flat address space (registers, VRAM and RAMIN)
+static inline uint32_t nv_mmio_read32(uint32_t addr)
+{
+    volatile uint32_t *ptr = nv_mmio_window_ptr(addr);
+    uint32_t value = (__builtin_expect(!ptr, 0)) ? nv_mmio_read32_slow(addr) : *ptr;
+
+    nv_trace_mmio(addr, value, NV_TRACE_READ);
+    return value;
+}
+
+static inline void nv_mmio_write32(uint32_t addr, uint32_t value)
+{
+    volatile uint32_t *ptr = nv_mmio_window_ptr(addr);
+
+    nv_trace_mmio(addr, value, NV_TRACE_WRITE);
+
+    // Keep a shadowed register coherent with a direct write
+    if (__builtin_expect(current_device.shadow.tagged_count != 0, 0))
+        nv_shadow_note_write(addr, value);
+
+    if (__builtin_expect(!ptr, 0)) {
+        nv_mmio_write32_slow(addr, value);
+        return;
+    }
+
+    *ptr = value;
+}
+
+// BAR0 register accessors
+static inline uint32_t nv_reg_read32(uint32_t reg)
+{
+#ifdef USE_VIRTUAL_PCI
+    // Registers have side effects in the virtual device, so they always go through its model
+    uint32_t value = virtual_mmio_read32(reg);
+#else
+    uint32_t value = *(volatile uint32_t *)((uint8_t *)current_device.mmio_mapping + reg);
+#endif
+
+    nv_trace_mmio(NV_MMIO_REGS_START + reg, value, NV_TRACE_READ);
+    return value;
+}
+
+static inline void nv_reg_write32(uint32_t reg, uint32_t value)
+{
+    nv_trace_mmio(NV_MMIO_REGS_START + reg, value, NV_TRACE_WRITE);
+
+    if (__builtin_expect(current_device.shadow.tagged_count != 0, 0))
+        nv_shadow_note_write(NV_MMIO_REGS_START + reg, value);
+
+#ifdef USE_VIRTUAL_PCI
+    virtual_mmio_write32(reg, value);
+#else
+    *(volatile uint32_t *)((uint8_t *)current_device.mmio_mapping + reg) = value;
+#endif
+}
+
+// BAR1 framebuffer accessors
+static inline uint32_t nv_vram_read32(uint32_t offset)
+{
+    uint32_t value = *(volatile uint32_t *)((uint8_t *)current_device.vram_mapping + offset);
+
+    nv_trace_mmio(NV_MMIO_VRAM_START + offset, value, NV_TRACE_READ);
+    return value;
+}
+
+static inline void nv_vram_write32(uint32_t offset, uint32_t value)
+{
+    nv_trace_mmio(NV_MMIO_VRAM_START + offset, value, NV_TRACE_WRITE);
+    *(volatile uint32_t *)((uint8_t *)current_device.vram_mapping + offset) = value;
+}
+
+// BAR1 instance memory accessors
+static inline uint32_t nv_ramin_read32(uint32_t offset)
+{
+    uint32_t value = *(volatile uint32_t *)((uint8_t *)current_device.ramin_mapping + offset);
+
+    nv_trace_mmio(NV_MMIO_RAMIN_START + offset, value, NV_TRACE_READ);
+    return value;
+}
+
+static inline void nv_ramin_write32(uint32_t offset, uint32_t value)
+{
+    nv_trace_mmio(NV_MMIO_RAMIN_START + offset, value, NV_TRACE_WRITE);
+    *(volatile uint32_t *)((uint8_t *)current_device.ramin_mapping + offset) = value;
+}
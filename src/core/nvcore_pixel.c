@@ -0,0 +1,227 @@
+//
+// Filename: nvcore_pixel.c
+// Purpose: Pixel format conversion between the 8, 16 and 32bpp formats the GPUs draw in
+//
+// Every conversion goes through X8R8G8B8: the source is unpacked 8 pixels at a time into a vector of 32-bit lanes,
+// widening each channel by repeating its top bits, and packed straight back into the destination format. There's a
+// converter for every pair of formats, made from one unpack and one pack, so the choice happens once per call
+// through nv_pixel_get_converter and the inner loop has no per-pixel branching. Converting a format to itself is a
+// plain copy.
+//
+// Y8 is treated as grey: it's replicated into all three channels, and RGB becomes Y8 by its luma.
+//
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+
+#define NV_PIXEL_BATCH  8                           // Pixels per step
+
+typedef uint32_t nv_pixel_u32x8_t __attribute__((vector_size(32)));
+typedef uint16_t nv_pixel_u16x8_t __attribute__((vector_size(16)));
+typedef uint8_t nv_pixel_u8x8_t __attribute__((vector_size(8)));
+
+static const uint32_t nv_pixel_bytes[NV_PIXEL_FORMAT_COUNT] = {
+    [NV_PIXEL_FORMAT_Y8] = 1,
+    [NV_PIXEL_FORMAT_X1R5G5B5] = 2,
+    [NV_PIXEL_FORMAT_R5G6B5] = 2,
+    [NV_PIXEL_FORMAT_X8R8G8B8] = 4,
+};
+
+static const char *const nv_pixel_names[NV_PIXEL_FORMAT_COUNT] = {
+    [NV_PIXEL_FORMAT_Y8] = "Y8",
+    [NV_PIXEL_FORMAT_X1R5G5B5] = "X1R5G5B5",
+    [NV_PIXEL_FORMAT_R5G6B5] = "R5G6B5",
+    [NV_PIXEL_FORMAT_X8R8G8B8] = "X8R8G8B8",
+};
+
+//
+// Unpacking into X8R8G8B8
+//
+
+static inline void nv_pixel_unpack_y8(nv_pixel_u32x8_t *p, const uint8_t *src)
+{
+    nv_pixel_u8x8_t y;
+
+    memcpy(&y, src, sizeof(y));
+    *p = __builtin_convertvector(y, nv_pixel_u32x8_t) * 0x010101;
+}
+
+// A 5 or 6 bit channel widened to 8 bits, so that full scale stays full scale
+#define nv_pixel_widen5(c)  (((c) << 3) | ((c) >> 2))
+#define nv_pixel_widen6(c)  (((c) << 2) | ((c) >> 4))
+
+static inline void nv_pixel_unpack_x1r5g5b5(nv_pixel_u32x8_t *p, const uint8_t *src)
+{
+    nv_pixel_u16x8_t packed;
+
+    memcpy(&packed, src, sizeof(packed));
+
+    nv_pixel_u32x8_t c = __builtin_convertvector(packed, nv_pixel_u32x8_t);
+
+    *p = nv_pixel_widen5((c >> 10) & 0x1F) << 16 | nv_pixel_widen5((c >> 5) & 0x1F) << 8 | nv_pixel_widen5(c & 0x1F);
+}
+
+static inline void nv_pixel_unpack_r5g6b5(nv_pixel_u32x8_t *p, const uint8_t *src)
+{
+    nv_pixel_u16x8_t packed;
+
+    memcpy(&packed, src, sizeof(packed));
+
+    nv_pixel_u32x8_t c = __builtin_convertvector(packed, nv_pixel_u32x8_t);
+
+    *p = nv_pixel_widen5((c >> 11) & 0x1F) << 16 | nv_pixel_widen6((c >> 5) & 0x3F) << 8 | nv_pixel_widen5(c & 0x1F);
+}
+
+static inline void nv_pixel_unpack_x8r8g8b8(nv_pixel_u32x8_t *p, const uint8_t *src)
+{
+    memcpy(p, src, sizeof(*p));
+    *p &= 0xFFFFFF;
+}
+
+//
+// Packing from X8R8G8B8
+//
+
+// ITU-R BT.601 luma in 8 bit fixed point
+static inline void nv_pixel_pack_y8(uint8_t *dst, const nv_pixel_u32x8_t *pixels)
+{
+    nv_pixel_u32x8_t p = *pixels;
+    nv_pixel_u32x8_t y = (((p >> 16) & 0xFF) * 77 + ((p >> 8) & 0xFF) * 150 + (p & 0xFF) * 29) >> 8;
+    nv_pixel_u8x8_t packed = __builtin_convertvector(y, nv_pixel_u8x8_t);
+
+    memcpy(dst, &packed, sizeof(packed));
+}
+
+static inline void nv_pixel_pack_x1r5g5b5(uint8_t *dst, const nv_pixel_u32x8_t *pixels)
+{
+    nv_pixel_u32x8_t p = *pixels;
+    nv_pixel_u32x8_t c = ((p >> 9) & 0x7C00) | ((p >> 6) & 0x03E0) | ((p >> 3) & 0x001F);
+    nv_pixel_u16x8_t packed = __builtin_convertvector(c, nv_pixel_u16x8_t);
+
+    memcpy(dst, &packed, sizeof(packed));
+}
+
+static inline void nv_pixel_pack_r5g6b5(uint8_t *dst, const nv_pixel_u32x8_t *pixels)
+{
+    nv_pixel_u32x8_t p = *pixels;
+    nv_pixel_u32x8_t c = ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+    nv_pixel_u16x8_t packed = __builtin_convertvector(c, nv_pixel_u16x8_t);
+
+    memcpy(dst, &packed, sizeof(packed));
+}
+
+static inline void nv_pixel_pack_x8r8g8b8(uint8_t *dst, const nv_pixel_u32x8_t *pixels)
+{
+    memcpy(dst, pixels, sizeof(*pixels));
+}
+
+//
+// Converters
+//
+
+// The last partial batch goes through a padded copy, so the vector code never reads or writes past either end
+#define NV_PIXEL_CONVERTER(dst_name, src_name, dst_bytes, src_bytes)                                            \
+    static void nv_pixel_convert_##dst_name##_##src_name(void *dst, const void *src, uint32_t count)            \
+    {                                                                                                           \
+        uint8_t *out = dst;                                                                                     \
+        const uint8_t *in = src;                                                                                \
+        uint32_t i = 0;                                                                                         \
+                                                                                                                \
+        nv_pixel_u32x8_t p;                                                                                     \
+                                                                                                                \
+        for (; i + NV_PIXEL_BATCH <= count; i += NV_PIXEL_BATCH) {                                              \
+            nv_pixel_unpack_##src_name(&p, in + i * (src_bytes));                                               \
+            nv_pixel_pack_##dst_name(out + i * (dst_bytes), &p);                                                \
+        }                                                                                                       \
+                                                                                                                \
+        if (i < count) {                                                                                        \
+            uint8_t in_tail[NV_PIXEL_BATCH * 4] = { 0 }, out_tail[NV_PIXEL_BATCH * 4];                          \
+                                                                                                                \
+            memcpy(in_tail, in + i * (src_bytes), (count - i) * (src_bytes));                                   \
+            nv_pixel_unpack_##src_name(&p, in_tail);                                                            \
+            nv_pixel_pack_##dst_name(out_tail, &p);                                                             \
+            memcpy(out + i * (dst_bytes), out_tail, (count - i) * (dst_bytes));                                 \
+        }                                                                                                       \
+    }
+
+// Converting a format to itself is a copy instead (see below)
+NV_PIXEL_CONVERTER(y8, x1r5g5b5, 1, 2)
+NV_PIXEL_CONVERTER(y8, r5g6b5, 1, 2)
+NV_PIXEL_CONVERTER(y8, x8r8g8b8, 1, 4)
+NV_PIXEL_CONVERTER(x1r5g5b5, y8, 2, 1)
+NV_PIXEL_CONVERTER(x1r5g5b5, r5g6b5, 2, 2)
+NV_PIXEL_CONVERTER(x1r5g5b5, x8r8g8b8, 2, 4)
+NV_PIXEL_CONVERTER(r5g6b5, y8, 2, 1)
+NV_PIXEL_CONVERTER(r5g6b5, x1r5g5b5, 2, 2)
+NV_PIXEL_CONVERTER(r5g6b5, x8r8g8b8, 2, 4)
+NV_PIXEL_CONVERTER(x8r8g8b8, y8, 4, 1)
+NV_PIXEL_CONVERTER(x8r8g8b8, x1r5g5b5, 4, 2)
+NV_PIXEL_CONVERTER(x8r8g8b8, r5g6b5, 4, 2)
+
+static void nv_pixel_copy_8(void *dst, const void *src, uint32_t count)
+{
+    memmove(dst, src, count);
+}
+
+static void nv_pixel_copy_16(void *dst, const void *src, uint32_t count)
+{
+    memmove(dst, src, count * 2);
+}
+
+static void nv_pixel_copy_32(void *dst, const void *src, uint32_t count)
+{
+    memmove(dst, src, count * 4);
+}
+
+// Indexed by destination, then source
+static const nv_pixel_convert_t nv_pixel_converters[NV_PIXEL_FORMAT_COUNT][NV_PIXEL_FORMAT_COUNT] = {
+    [NV_PIXEL_FORMAT_Y8] = {
+        nv_pixel_copy_8, nv_pixel_convert_y8_x1r5g5b5, nv_pixel_convert_y8_r5g6b5, nv_pixel_convert_y8_x8r8g8b8,
+    },
+    [NV_PIXEL_FORMAT_X1R5G5B5] = {
+        nv_pixel_convert_x1r5g5b5_y8, nv_pixel_copy_16, nv_pixel_convert_x1r5g5b5_r5g6b5,
+        nv_pixel_convert_x1r5g5b5_x8r8g8b8,
+    },
+    [NV_PIXEL_FORMAT_R5G6B5] = {
+        nv_pixel_convert_r5g6b5_y8, nv_pixel_convert_r5g6b5_x1r5g5b5, nv_pixel_copy_16,
+        nv_pixel_convert_r5g6b5_x8r8g8b8,
+    },
+    [NV_PIXEL_FORMAT_X8R8G8B8] = {
+        nv_pixel_convert_x8r8g8b8_y8, nv_pixel_convert_x8r8g8b8_x1r5g5b5, nv_pixel_convert_x8r8g8b8_r5g6b5,
+        nv_pixel_copy_32,
+    },
+};
+
+uint32_t nv_pixel_format_bytes(nv_pixel_format_t format)
+{
+    return (format < NV_PIXEL_FORMAT_COUNT) ? nv_pixel_bytes[format] : 0;
+}
+
+const char *nv_pixel_format_name(nv_pixel_format_t format)
+{
+    return (format < NV_PIXEL_FORMAT_COUNT) ? nv_pixel_names[format] : "invalid";
+}
+
+// The converter from src_format to dst_format, NULL if either isn't a format
+nv_pixel_convert_t nv_pixel_get_converter(nv_pixel_format_t dst_format, nv_pixel_format_t src_format)
+{
+    if (dst_format >= NV_PIXEL_FORMAT_COUNT || src_format >= NV_PIXEL_FORMAT_COUNT)
+        return NULL;
+
+    return nv_pixel_converters[dst_format][src_format];
+}
+
+bool nv_pixel_convert(void *dst, nv_pixel_format_t dst_format, const void *src, nv_pixel_format_t src_format,
+    uint32_t count)
+{
+    nv_pixel_convert_t convert = nv_pixel_get_converter(dst_format, src_format);
+
+    if (!convert) {
+        nv_log_error(NV_LOG_CORE, "Error: Can't convert pixels from format %u to format %u\n", src_format, dst_format);
+        return false;
+    }
+
+    convert(dst, src, count);
+    return true;
+}
@@ -0,0 +1,248 @@
+//
+// Filename: nvcore_scale.c
+// Purpose: Separable fixed point image scaler, nearest or bilinear
+//
+// Setting a scaler up works out, once, which source pixels and what weight every output column and every output row
+// samples (a tap). Positions are 16.16 fixed point and advance by a constant step, so there's no division anywhere
+// and scaling an image costs a table lookup per output pixel, however big or small the source is.
+//
+// A bilinear output row is made from two source rows: each is gathered through the column taps, unpacked to
+// X8R8G8B8 with the pixel conversion library, blended horizontally, and the two results are blended vertically and
+// packed into the destination format. Nearest just gathers and converts. Rows are done in chunks of columns on the
+// stack, so a scaler can be shared by any number of threads once it's set up.
+//
+#include <stdlib.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+
+#define NV_SCALE_CHUNK      256                     // Output pixels per chunk
+
+typedef uint32_t nv_scale_u32x8_t __attribute__((vector_size(32)));
+typedef uint16_t nv_scale_u16x16_t __attribute__((vector_size(32)));
+
+// Taps for an axis of size output pixels, sampling source pixels [0, source), with output pixel i's centre at
+// position + i * step in source pixels
+static void nv_scaler_build_taps(nv_scale_tap_t *taps, uint32_t size, uint32_t source, nv_scale_filter_t filter,
+    int32_t position, int32_t step)
+{
+    int64_t pos = position;
+
+    for (uint32_t i = 0; i < size; i++, pos += step) {
+        nv_scale_tap_t *tap = &taps[i];
+        int64_t index;
+
+        if (filter == NV_SCALE_NEAREST) {
+            index = (pos + 0x8000) >> 16;
+            index = (index < 0) ? 0 : (index >= source) ? source - 1 : index;
+            tap->index0 = tap->index1 = (uint32_t)index;
+            tap->weight = 0;
+            continue;
+        }
+
+        index = pos >> 16;
+
+        if (index < 0) {
+            tap->index0 = tap->index1 = 0;
+            tap->weight = 0;
+        } else if (index >= (int64_t)source - 1) {
+            tap->index0 = tap->index1 = source - 1;
+            tap->weight = 0;
+        } else {
+            tap->index0 = (uint32_t)index;
+            tap->index1 = (uint32_t)index + 1;
+            tap->weight = (pos >> 8) & 0xFF;
+        }
+    }
+}
+
+void nv_scaler_cleanup(nv_scaler_t *scaler)
+{
+    free(scaler->columns);
+    free(scaler->rows);
+    memset(scaler, 0, sizeof(*scaler));
+}
+
+// Scale with an explicit mapping: output pixel (0, 0) samples source position (u0, v0), and each output pixel
+// steps by du across and dv down. All in 16.16 source pixels.
+bool nv_scaler_init_steps(nv_scaler_t *scaler, nv_scale_filter_t filter, nv_pixel_format_t dst_format,
+    uint32_t dst_width, uint32_t dst_height, nv_pixel_format_t src_format, uint32_t src_width, uint32_t src_height,
+    int32_t u0, int32_t du, int32_t v0, int32_t dv)
+{
+    nv_scaler_cleanup(scaler);
+
+    if (!nv_pixel_get_converter(dst_format, src_format) || !dst_width || !dst_height || !src_width || !src_height) {
+        nv_log_error(NV_LOG_CORE, "Error: Can't scale %ux%u %s to %ux%u %s\n", src_width, src_height,
+            nv_pixel_format_name(src_format), dst_width, dst_height, nv_pixel_format_name(dst_format));
+        return false;
+    }
+
+    scaler->columns = malloc(dst_width * sizeof(nv_scale_tap_t));
+    scaler->rows = malloc(dst_height * sizeof(nv_scale_tap_t));
+
+    if (!scaler->columns || !scaler->rows) {
+        nv_log_error(NV_LOG_CORE, "Error: Can't allocate scaler taps for %ux%u\n", dst_width, dst_height);
+        nv_scaler_cleanup(scaler);
+        return false;
+    }
+
+    scaler->filter = filter;
+    scaler->dst_format = dst_format;
+    scaler->src_format = src_format;
+    scaler->dst_width = dst_width;
+    scaler->dst_height = dst_height;
+    scaler->src_width = src_width;
+    scaler->src_height = src_height;
+    scaler->u0 = u0;
+    scaler->du = du;
+    scaler->v0 = v0;
+    scaler->dv = dv;
+
+    nv_scaler_build_taps(scaler->columns, dst_width, src_width, filter, u0, du);
+    nv_scaler_build_taps(scaler->rows, dst_height, src_height, filter, v0, dv);
+    return true;
+}
+
+// Scale the whole source image onto the whole destination, pixel centres lined up
+bool nv_scaler_init(nv_scaler_t *scaler, nv_scale_filter_t filter, nv_pixel_format_t dst_format, uint32_t dst_width,
+    uint32_t dst_height, nv_pixel_format_t src_format, uint32_t src_width, uint32_t src_height)
+{
+    int32_t du = (dst_width) ? (int32_t)(((uint64_t)src_width << 16) / dst_width) : 0;
+    int32_t dv = (dst_height) ? (int32_t)(((uint64_t)src_height << 16) / dst_height) : 0;
+
+    return nv_scaler_init_steps(scaler, filter, dst_format, dst_width, dst_height, src_format, src_width, src_height,
+        du / 2 - 0x8000, du, dv / 2 - 0x8000, dv);
+}
+
+// Gather the source pixels of count taps: the first of each pair into out0, and the second into out1 if it's given
+static void nv_scaler_gather(uint8_t *out0, uint8_t *out1, const uint8_t *row, uint32_t bytes,
+    const nv_scale_tap_t *taps, uint32_t count)
+{
+    switch (bytes) {
+        case 1:
+            for (uint32_t i = 0; i < count; i++)
+                out0[i] = row[taps[i].index0];
+
+            for (uint32_t i = 0; out1 && i < count; i++)
+                out1[i] = row[taps[i].index1];
+            break;
+        case 2:
+            for (uint32_t i = 0; i < count; i++)
+                memcpy(out0 + i * 2, row + (size_t)taps[i].index0 * 2, 2);
+
+            for (uint32_t i = 0; out1 && i < count; i++)
+                memcpy(out1 + i * 2, row + (size_t)taps[i].index1 * 2, 2);
+            break;
+        default:
+            for (uint32_t i = 0; i < count; i++)
+                memcpy(out0 + i * 4, row + (size_t)taps[i].index0 * 4, 4);
+
+            for (uint32_t i = 0; out1 && i < count; i++)
+                memcpy(out1 + i * 4, row + (size_t)taps[i].index1 * 4, 4);
+            break;
+    }
+}
+
+// a + (b - a) * weight / 256 for every channel of X8R8G8B8 pixels, 8 at a time. Channels are spread out into 16 bit
+// lanes (blue and red, then green), where the products fit and the multiplies are a single instruction on any SIMD
+// unit; 32 bit lanes would need a multiply that SSE2 doesn't have.
+static inline void nv_scaler_lerp8(uint32_t *out, const uint32_t *a, const uint32_t *b,
+    const nv_scale_u32x8_t *weight)
+{
+    nv_scale_u32x8_t va, vb, w = *weight;
+
+    memcpy(&va, a, sizeof(va));
+    memcpy(&vb, b, sizeof(vb));
+
+    nv_scale_u16x16_t w16 = (nv_scale_u16x16_t)(w | (w << 16)), inverse = 256 - w16;
+    nv_scale_u16x16_t rb = ((nv_scale_u16x16_t)(va & 0xFF00FF) * inverse
+        + (nv_scale_u16x16_t)(vb & 0xFF00FF) * w16) >> 8;
+    nv_scale_u16x16_t g = ((nv_scale_u16x16_t)((va >> 8) & 0xFF00FF) * inverse
+        + (nv_scale_u16x16_t)((vb >> 8) & 0xFF00FF) * w16) >> 8;
+    nv_scale_u32x8_t result = (nv_scale_u32x8_t)rb | (((nv_scale_u32x8_t)g << 8) & 0xFF00);
+
+    memcpy(out, &result, sizeof(result));
+}
+
+// Blend a chunk of one source row horizontally into X8R8G8B8
+static void nv_scaler_horizontal(const nv_scaler_t *scaler, uint32_t *out, const uint8_t *row,
+    const nv_scale_tap_t *taps, const uint32_t *weights, uint32_t count)
+{
+    uint32_t right[NV_SCALE_CHUNK];
+
+    // X8R8G8B8 is gathered as it is, anything else is gathered and then unpacked
+    if (scaler->src_format == NV_PIXEL_FORMAT_X8R8G8B8) {
+        nv_scaler_gather((uint8_t *)out, (uint8_t *)right, row, 4, taps, count);
+    } else {
+        nv_pixel_convert_t unpack = nv_pixel_get_converter(NV_PIXEL_FORMAT_X8R8G8B8, scaler->src_format);
+        uint8_t left_gathered[NV_SCALE_CHUNK * 2], right_gathered[NV_SCALE_CHUNK * 2];
+
+        nv_scaler_gather(left_gathered, right_gathered, row, nv_pixel_format_bytes(scaler->src_format), taps, count);
+        unpack(out, left_gathered, count);
+        unpack(right, right_gathered, count);
+    }
+
+    // The chunk's arrays are whole batches long, so the last batch can run past count
+    for (uint32_t i = 0; i < count; i += 8) {
+        nv_scale_u32x8_t w;
+
+        memcpy(&w, weights + i, sizeof(w));
+        nv_scaler_lerp8(out + i, out + i, right + i, &w);
+    }
+}
+
+// Scale output columns [x0, x1) of one output row from its two source rows, blended by weight (0-255, towards
+// row1). For nearest, or a weight of 0, row1 isn't read.
+void nv_scaler_span(const nv_scaler_t *scaler, void *dst, const void *row0, const void *row1, uint32_t weight,
+    uint32_t x0, uint32_t x1)
+{
+    nv_pixel_convert_t pack = nv_pixel_get_converter(scaler->dst_format, NV_PIXEL_FORMAT_X8R8G8B8);
+    nv_pixel_convert_t convert = nv_pixel_get_converter(scaler->dst_format, scaler->src_format);
+    uint32_t src_bytes = nv_pixel_format_bytes(scaler->src_format);
+    uint32_t dst_bytes = nv_pixel_format_bytes(scaler->dst_format);
+    uint8_t *out = dst;
+
+    for (uint32_t x = x0; x < x1; x += NV_SCALE_CHUNK) {
+        uint32_t count = (x1 - x < NV_SCALE_CHUNK) ? x1 - x : NV_SCALE_CHUNK;
+        const nv_scale_tap_t *taps = &scaler->columns[x];
+
+        if (scaler->filter == NV_SCALE_NEAREST) {
+            uint8_t gathered[NV_SCALE_CHUNK * 4];
+
+            nv_scaler_gather(gathered, NULL, row0, src_bytes, taps, count);
+            convert(out, gathered, count);
+        } else {
+            uint32_t weights[NV_SCALE_CHUNK], upper[NV_SCALE_CHUNK], lower[NV_SCALE_CHUNK];
+
+            for (uint32_t i = 0; i < count; i++)
+                weights[i] = taps[i].weight;
+
+            nv_scaler_horizontal(scaler, upper, row0, taps, weights, count);
+
+            if (weight) {
+                nv_scale_u32x8_t vertical = (nv_scale_u32x8_t){ 0 } + weight;
+
+                nv_scaler_horizontal(scaler, lower, row1, taps, weights, count);
+
+                for (uint32_t i = 0; i < count; i += 8)
+                    nv_scaler_lerp8(upper + i, upper + i, lower + i, &vertical);
+            }
+
+            pack(out, upper, count);
+        }
+
+        out += count * dst_bytes;
+    }
+}
+
+// Scale output columns [x0, x1) of output row y from a source image
+void nv_scaler_row(const nv_scaler_t *scaler, void *dst, const void *src, uint32_t src_pitch, uint32_t y,
+    uint32_t x0, uint32_t x1)
+{
+    const nv_scale_tap_t *tap = &scaler->rows[y];
+    const uint8_t *image = src;
+
+    nv_scaler_span(scaler, dst, image + (size_t)tap->index0 * src_pitch, image + (size_t)tap->index1 * src_pitch,
+        tap->weight, x0, x1);
+}
@@ -0,0 +1,185 @@
+//
+// Filename: nvcore_shadow.c
+// Purpose: Shadow register cache with read-avoiding read-modify-write helpers
+//
+// Register sequences very often read a register only to flip one bit in it. For registers that only ever change
+// when we write them, the shadow remembers the last value so the read never has to cross the bus.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+
+// Fibonacci hash of the dword index, so neighbouring registers land in different slots
+static inline uint32_t nv_shadow_hash(uint32_t addr)
+{
+    return ((addr >> 2) * 2654435761u) >> 16;
+}
+
+static nv_shadow_entry_t *nv_shadow_find(uint32_t addr)
+{
+    nv_shadow_cache_t *cache = &current_device.shadow;
+
+    if (!cache->tagged_count)
+        return NULL;
+
+    uint32_t slot = nv_shadow_hash(addr) & (NV_SHADOW_CACHE_SIZE - 1);
+
+    for (uint32_t probe = 0; probe < NV_SHADOW_CACHE_SIZE; probe++) {
+        nv_shadow_entry_t *entry = &cache->entries[(slot + probe) & (NV_SHADOW_CACHE_SIZE - 1)];
+
+        if (!entry->tagged)
+            return NULL;
+
+        if (entry->addr == addr)
+            return entry;
+    }
+
+    return NULL;
+}
+
+void nv_shadow_reset(void)
+{
+    memset(&current_device.shadow, 0, sizeof(current_device.shadow));
+}
+
+bool nv_shadow_tag(uint32_t addr, nv_shadow_policy_t policy)
+{
+    nv_shadow_cache_t *cache = &current_device.shadow;
+    nv_shadow_entry_t *entry = nv_shadow_find(addr);
+
+    if (entry) {
+        entry->policy = policy;
+        entry->valid = false;
+        return true;
+    }
+
+    // Keep the table at most 3/4 full so probe sequences stay short
+    if (cache->tagged_count >= NV_SHADOW_CACHE_SIZE * 3 / 4) {
+        printf("Error: Shadow register cache is full, can't tag register 0x%08X\n", addr);
+        return false;
+    }
+
+    uint32_t slot = nv_shadow_hash(addr) & (NV_SHADOW_CACHE_SIZE - 1);
+
+    while (cache->entries[slot].tagged)
+        slot = (slot + 1) & (NV_SHADOW_CACHE_SIZE - 1);
+
+    entry = &cache->entries[slot];
+    entry->addr = addr;
+    entry->value = 0;
+    entry->policy = policy;
+    entry->tagged = true;
+    entry->valid = false;
+    cache->tagged_count++;
+    return true;
+}
+
+void nv_shadow_invalidate(uint32_t addr)
+{
+    nv_shadow_entry_t *entry = nv_shadow_find(addr);
+
+    if (entry)
+        entry->valid = false;
+}
+
+// Keep the shadow coherent with a write that has been or is about to be issued (the write accessors and batches)
+void nv_shadow_note_write(uint32_t addr, uint32_t value)
+{
+    nv_shadow_entry_t *entry = nv_shadow_find(addr);
+
+    if (entry && entry->policy != NV_SHADOW_VOLATILE) {
+        entry->value = value;
+        entry->valid = true;
+    }
+}
+
+// The register's current value, from the shadow where possible. Fails for a read-sensitive register that hasn't
+// been written yet, since the only way to find out would be the read with side effects.
+static bool nv_shadow_fetch(uint32_t addr, uint32_t *value)
+{
+    nv_shadow_cache_t *cache = &current_device.shadow;
+    nv_shadow_entry_t *entry = nv_shadow_find(addr);
+
+    if (!entry || entry->policy == NV_SHADOW_VOLATILE) {
+        cache->stats.uncached++;
+        *value = nv_mmio_read32(addr);
+        return true;
+    }
+
+    if (entry->valid) {
+        cache->stats.hits++;
+        *value = entry->value;
+        return true;
+    }
+
+    cache->stats.misses++;
+
+    if (entry->policy == NV_SHADOW_READ_SENSITIVE) {
+        nv_log_error(NV_LOG_CORE, "Error: Read-sensitive register 0x%08X has to be written before it can be read "
+            "through the shadow\n", addr);
+        return false;
+    }
+
+    entry->value = *value = nv_mmio_read32(addr);
+    entry->valid = true;
+    return true;
+}
+
+uint32_t nv_shadow_read32(uint32_t addr)
+{
+    uint32_t value;
+
+    return nv_shadow_fetch(addr, &value) ? value : 0xFFFFFFFF;
+}
+
+void nv_shadow_write32(uint32_t addr, uint32_t value)
+{
+    // nv_mmio_write32 updates the shadow itself
+    nv_mmio_write32(addr, value);
+    current_device.shadow.stats.writes++;
+}
+
+bool nv_mmio_set_bits(uint32_t addr, uint32_t bits)
+{
+    uint32_t current;
+
+    if (!nv_shadow_fetch(addr, &current))
+        return false;
+
+    nv_shadow_write32(addr, current | bits);
+    return true;
+}
+
+bool nv_mmio_clear_bits(uint32_t addr, uint32_t bits)
+{
+    uint32_t current;
+
+    if (!nv_shadow_fetch(addr, &current))
+        return false;
+
+    nv_shadow_write32(addr, current & ~bits);
+    return true;
+}
+
+// Replace the field at [shift + width of mask - 1 : shift] with value, e.g.
+// nv_mmio_update_field(NV3_PMC_ENABLE, NV3_PMC_ENABLE_PGRAPH, 0x01, NV3_PMC_ENABLE_PGRAPH_ENABLED)
+bool nv_mmio_update_field(uint32_t addr, uint32_t shift, uint32_t mask, uint32_t value)
+{
+    uint32_t current;
+
+    if (!nv_shadow_fetch(addr, &current))
+        return false;
+
+    current &= ~(mask << shift);
+    current |= (value & mask) << shift;
+    nv_shadow_write32(addr, current);
+    return true;
+}
+
+void nv_shadow_get_stats(nv_shadow_stats_t *stats)
+{
+    *stats = current_device.shadow.stats;
+}
@@ -0,0 +1,164 @@
+//
+// Filename: nvcore_stats.c
+// Purpose: Statistics for the core subsystems
+//
+#include <stdio.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "core/pci/pci.h"
+#include "util/util.h"
+
+static void nv_stats_print_shadow(void)
+{
+    nv_shadow_stats_t stats;
+    nv_shadow_get_stats(&stats);
+
+    uint64_t lookups = stats.hits + stats.misses;
+    double hit_rate = (lookups) ? (100.0 * stats.hits / lookups) : 0.0;
+
+    printf("Shadow register cache:\n");
+    printf("    Tagged registers    = %u\n", current_device.shadow.tagged_count);
+    printf("    Hits                = %llu\n", (unsigned long long)stats.hits);
+    printf("    Misses              = %llu\n", (unsigned long long)stats.misses);
+    printf("    Hit rate            = %.1f%%\n", hit_rate);
+    printf("    Writes              = %llu\n", (unsigned long long)stats.writes);
+    printf("    Uncached accesses   = %llu\n", (unsigned long long)stats.uncached);
+}
+
+static void nv_stats_print_trace(void)
+{
+    nv_trace_stats_t stats;
+    nv_trace_get_stats(&stats);
+
+    if (!stats.threads)
+        return;
+
+    printf("MMIO trace:\n");
+    printf("    Threads             = %u\n", stats.threads);
+    printf("    Recorded            = %llu\n", (unsigned long long)stats.recorded);
+    printf("    Dropped             = %llu\n", (unsigned long long)stats.dropped);
+    printf("    Written             = %llu\n", (unsigned long long)stats.written);
+}
+
+// Print a duration with a sensible unit
+static void nv_stats_format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%lluus", (unsigned long long)(ns / 1000));
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%llums", (unsigned long long)(ns / 1000000));
+    else
+        snprintf(buf, size, "%llus", (unsigned long long)(ns / 1000000000));
+}
+
+static void nv_stats_print_wait(void)
+{
+    nv_wait_stats_t stats;
+    nv_wait_get_stats(&stats);
+
+    if (!stats.waits)
+        return;
+
+    char low[16], high[16];
+
+    printf("Register waits:\n");
+    printf("    Waits               = %llu\n", (unsigned long long)stats.waits);
+    printf("    Timeouts            = %llu\n", (unsigned long long)stats.timeouts);
+    printf("    Average             = %llu ns\n", (unsigned long long)(stats.total_ns / stats.waits));
+    printf("    Longest             = %llu ns\n", (unsigned long long)stats.max_ns);
+
+    for (uint32_t bucket = 0; bucket < NV_WAIT_HISTOGRAM_BUCKETS; bucket++) {
+        if (!stats.histogram[bucket])
+            continue;
+
+        nv_stats_format_ns(low, sizeof(low), (bucket) ? 1ull << (bucket - 1) : 0);
+        nv_stats_format_ns(high, sizeof(high), 1ull << bucket);
+        printf("    [%6s, %6s)    = %llu\n", low, high, (unsigned long long)stats.histogram[bucket]);
+    }
+}
+
+static void nv_stats_print_time(void)
+{
+    char skipped[16];
+    nv_stats_format_ns(skipped, sizeof(skipped), nv_time_skipped());
+
+    printf("Time source:\n");
+    printf("    Source              = %s\n", nv_time_get_source()->name);
+    printf("    Sleep time skipped  = %s\n", skipped);
+}
+
+static void nv_stats_print_logging(void)
+{
+    nv_log_stats_t stats;
+    nv_log_get_stats(&stats);
+
+    printf("Logging:\n");
+    printf("    Messages written    = %llu\n", (unsigned long long)stats.written);
+    printf("    Dropped (ring full) = %llu\n", (unsigned long long)stats.dropped);
+    printf("    Rate limited        = %llu\n", (unsigned long long)stats.suppressed);
+}
+
+#ifdef USE_VIRTUAL_PCI
+static void nv_stats_print_virtual(void)
+{
+    virtual_pfifo_stats_t pfifo;
+
+    if (virtual_pfifo_get_stats(&pfifo) && (pfifo.pushed || pfifo.runouts)) {
+        printf("Virtual PFIFO:\n");
+        printf("    Methods pushed      = %llu\n", (unsigned long long)pfifo.pushed);
+        printf("    Methods pulled      = %llu\n", (unsigned long long)pfifo.pulled);
+        printf("    Runouts (RAMRO)     = %llu\n", (unsigned long long)pfifo.runouts);
+        printf("    Hash failures       = %llu\n", (unsigned long long)pfifo.hash_failures);
+        printf("    CACHE1 high water   = %u/%u\n", pfifo.cache1_high_water, pfifo.cache1_size - 1);
+    }
+
+    virtual_pgraph_stats_t pgraph;
+
+    if (virtual_pgraph_get_stats(&pgraph) && pgraph.methods) {
+        printf("Virtual PGRAPH:\n");
+        printf("    Methods             = %llu\n", (unsigned long long)pgraph.methods);
+        printf("    Software methods    = %llu\n", (unsigned long long)pgraph.software_methods);
+        printf("    Pixels drawn        = %llu\n", (unsigned long long)pgraph.pixels);
+
+        if (pgraph.glyphs)
+            printf("    Glyphs drawn        = %llu (%.1f%% cached)\n", (unsigned long long)pgraph.glyphs,
+                100.0 * pgraph.glyph_cache_hits / pgraph.glyphs);
+
+        if (pgraph.triangles)
+            printf("    Triangles           = %llu (%llu batches)\n", (unsigned long long)pgraph.triangles,
+                (unsigned long long)pgraph.triangle_batches);
+
+        if (pgraph.notifies)
+            printf("    Notifies            = %llu\n", (unsigned long long)pgraph.notifies);
+
+        if (pgraph.pipelined)
+            printf("    Queue stalls        = %llu\n", (unsigned long long)pgraph.queue_stalls);
+    }
+
+    virtual_handler_stats_t stats[64];
+    uint32_t count = virtual_mmio_get_handler_stats(stats, sizeof(stats) / sizeof(stats[0]));
+
+    printf("Virtual device handlers:\n");
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (stats[i].reads || stats[i].writes)
+            printf("    %-20s= %llu reads, %llu writes\n", stats[i].name,
+                (unsigned long long)stats[i].reads, (unsigned long long)stats[i].writes);
+    }
+}
+#endif
+
+void nv_stats_print(void)
+{
+    printf("\n=== Statistics ===\n");
+    nv_stats_print_shadow();
+    nv_stats_print_wait();
+    nv_stats_print_time();
+    nv_stats_print_trace();
+    nv_stats_print_logging();
+#ifdef USE_VIRTUAL_PCI
+    nv_stats_print_virtual();
+#endif
+}
@@ -0,0 +1,108 @@
+//
+// Filename: nvcore_time.c
+// Purpose: Pluggable time source for core and architecture code
+//
+// Everything that measures or waits for time goes through nv_time_now and nv_sleep_ns, so the clock can be swapped
+// out. The host source is CLOCK_MONOTONIC and really sleeps. The fast-forward source runs on the same clock but
+// skips every sleep by moving an offset forward instead, so time keeps flowing at the normal rate while code runs
+// and jumps ahead whenever it would have waited. Anything derived from the clock (the virtual PTIMER and vblank)
+// sees the jump as time passing, so it stays consistent.
+//
+// The offset belongs to a device, not the process: a thread sleeping moves the clock of the device it drives and
+// nobody else's. In virtual builds that's the thread's virtual device, which reads its clock with the same offset
+// from any thread; otherwise it's current_device.
+//
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+
+#ifdef USE_VIRTUAL_PCI
+#include "core/pci/virtual.h"
+#endif
+
+static inline uint64_t nv_time_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static uint64_t nv_time_host_now(const uint64_t *skipped_ns)
+{
+    return nv_time_clock();
+}
+
+static void nv_time_host_sleep(uint64_t *skipped_ns, uint64_t ns)
+{
+    uint64_t until = nv_time_clock() + ns;
+    struct timespec deadline = { until / 1000000000ull, until % 1000000000ull };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+}
+
+static uint64_t nv_time_fast_forward_now(const uint64_t *skipped_ns)
+{
+    return nv_time_clock() + __atomic_load_n(skipped_ns, __ATOMIC_ACQUIRE);
+}
+
+static void nv_time_fast_forward_sleep(uint64_t *skipped_ns, uint64_t ns)
+{
+    __atomic_fetch_add(skipped_ns, ns, __ATOMIC_ACQ_REL);
+}
+
+const nv_time_source_t nv_time_host = { "host", nv_time_host_now, nv_time_host_sleep };
+const nv_time_source_t nv_time_fast_forward = { "fast-forward", nv_time_fast_forward_now, nv_time_fast_forward_sleep };
+
+// Against the virtual device there's nothing worth waiting for in real time
+#ifdef USE_VIRTUAL_PCI
+static const nv_time_source_t *nv_time_source = &nv_time_fast_forward;
+#else
+static const nv_time_source_t *nv_time_source = &nv_time_host;
+#endif
+
+void nv_time_set_source(const nv_time_source_t *source)
+{
+    __atomic_store_n(&nv_time_source, source, __ATOMIC_RELEASE);
+}
+
+const nv_time_source_t *nv_time_get_source(void)
+{
+    return __atomic_load_n(&nv_time_source, __ATOMIC_ACQUIRE);
+}
+
+// The skipped time of the device the calling thread drives
+static uint64_t *nv_time_skipped_ns(void)
+{
+#ifdef USE_VIRTUAL_PCI
+    virtual_device_t *dev = virtual_device_current();
+
+    if (dev)
+        return &dev->time_skipped_ns;
+#endif
+
+    return &current_device.time_skipped_ns;
+}
+
+uint64_t nv_time_now(void)
+{
+    return nv_time_get_source()->now(nv_time_skipped_ns());
+}
+
+uint64_t nv_time_now_skipping(const uint64_t *skipped_ns)
+{
+    return nv_time_get_source()->now(skipped_ns);
+}
+
+void nv_sleep_ns(uint64_t ns)
+{
+    nv_time_get_source()->sleep_ns(nv_time_skipped_ns(), ns);
+}
+
+// Time skipped by the fast-forward source so far, on the calling thread's device
+uint64_t nv_time_skipped(void)
+{
+    return __atomic_load_n(nv_time_skipped_ns(), __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,369 @@
+//
+// Filename: nvcore_trace.c
+// Purpose: Lock-free per-thread MMIO trace rings and the binary trace writer
+//
+// Each recording thread owns a single-producer/single-consumer ring. The only shared state a producer touches
+// is its own head index; rings are published on a lock-free list the first time a thread records anything.
+// The drain side (the background writer, or an explicit nv_trace_drain) merges the rings by timestamp.
+// If a ring fills up faster than it is drained, new records are dropped and counted rather than blocking.
+// When a thread exits its ring is marked as orphaned, and the drain side frees it once it has been emptied.
+//
+// Timestamps come from nv_time_now, so with the fast-forward clock they line up with what the virtual device saw.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "core/nvcore_trace.h"
+#include "util/util.h"
+
+// How often the background writer drains the rings
+#define NV_TRACE_DRAIN_INTERVAL_NS  10000000
+
+typedef struct nv_trace_ring_s {
+    nv_trace_record_t records[NV_TRACE_RING_SIZE];
+    uint64_t head;                              // Written by the owning thread only
+    uint64_t tail;                              // Written by the drain side only
+    uint64_t dropped;
+    uint16_t thread;
+    bool orphaned;                              // Owning thread has exited
+    struct nv_trace_ring_s *next;
+} nv_trace_ring_t;
+
+bool nv_trace_enabled = false;
+
+static __thread nv_trace_ring_t *nv_trace_local_ring = NULL;
+static nv_trace_ring_t *nv_trace_rings = NULL;
+static uint32_t nv_trace_thread_count = 0;
+static pthread_key_t nv_trace_ring_key;
+static pthread_once_t nv_trace_ring_key_once = PTHREAD_ONCE_INIT;
+
+// Drain side state
+static pthread_mutex_t nv_trace_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *nv_trace_file = NULL;
+static uint64_t nv_trace_written = 0;
+static nv_trace_ring_t **nv_trace_drain_rings = NULL;  // Snapshot of the list for one drain, grown as needed
+static uint64_t *nv_trace_drain_heads = NULL;
+static uint32_t nv_trace_drain_capacity = 0;
+static uint64_t nv_trace_freed_recorded = 0;          // Counts carried over from rings that have been freed
+static uint64_t nv_trace_freed_dropped = 0;
+
+static pthread_t nv_trace_writer;
+static bool nv_trace_writer_running = false;
+static bool nv_trace_writer_stop = false;
+
+// Runs as a recording thread exits; the ring stays on the list until the drain side has emptied it
+static void nv_trace_orphan_ring(void *arg)
+{
+    nv_trace_ring_t *ring = arg;
+
+    nv_trace_local_ring = NULL;
+    __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void nv_trace_create_ring_key(void)
+{
+    pthread_key_create(&nv_trace_ring_key, nv_trace_orphan_ring);
+}
+
+static nv_trace_ring_t *nv_trace_create_ring(void)
+{
+    nv_trace_ring_t *ring = calloc(1, sizeof(nv_trace_ring_t));
+
+    if (!ring)
+        return NULL;
+
+    pthread_once(&nv_trace_ring_key_once, nv_trace_create_ring_key);
+    pthread_setspecific(nv_trace_ring_key, ring);
+
+    ring->thread = (uint16_t)__atomic_fetch_add(&nv_trace_thread_count, 1, __ATOMIC_RELAXED);
+
+    // Publish the ring on the list. Only the drain side removes rings, under its lock, so a plain CAS push is enough.
+    nv_trace_ring_t *head = __atomic_load_n(&nv_trace_rings, __ATOMIC_RELAXED);
+
+    do {
+        ring->next = head;
+    } while (!__atomic_compare_exchange_n(&nv_trace_rings, &head, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return ring;
+}
+
+static inline uint8_t nv_trace_region_of(uint32_t addr)
+{
+    if (addr <= NV_MMIO_REGS_END)
+        return NV_TRACE_REGION_REGS;
+    else if (addr >= NV_MMIO_VRAM_START && addr <= NV_MMIO_VRAM_END)
+        return NV_TRACE_REGION_VRAM;
+    else if (addr >= NV_MMIO_RAMIN_START && addr <= NV_MMIO_RAMIN_END)
+        return NV_TRACE_REGION_RAMIN;
+
+    return NV_TRACE_REGION_INVALID;
+}
+
+void nv_trace_record(uint32_t addr, uint32_t value, nv_trace_direction_t direction)
+{
+    nv_trace_ring_t *ring = nv_trace_local_ring;
+
+    if (__builtin_expect(!ring, 0)) {
+        ring = nv_trace_local_ring = nv_trace_create_ring();
+
+        if (!ring)
+            return;
+    }
+
+    uint64_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= NV_TRACE_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    nv_trace_record_t *record = &ring->records[head & (NV_TRACE_RING_SIZE - 1)];
+    record->timestamp = nv_time_now();
+    record->addr = addr;
+    record->value = value;
+    record->direction = direction;
+    record->region = nv_trace_region_of(addr);
+    record->thread = ring->thread;
+    record->reserved = 0;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Take a ring off the list and free it. Caller holds nv_trace_drain_lock, so nothing else removes rings; a new
+// ring can still be pushed in front of it at any time.
+static void nv_trace_free_ring(nv_trace_ring_t *ring)
+{
+    nv_trace_ring_t *head = ring;
+
+    if (!__atomic_compare_exchange_n(&nv_trace_rings, &head, ring->next, false, __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE)) {
+        nv_trace_ring_t *previous = head;
+
+        while (previous->next != ring)
+            previous = previous->next;
+
+        previous->next = ring->next;
+    }
+
+    nv_trace_freed_recorded += ring->head;
+    nv_trace_freed_dropped += ring->dropped;
+    free(ring);
+}
+
+// Make room to drain this many rings at once. Caller holds nv_trace_drain_lock.
+static bool nv_trace_reserve_drain(uint32_t count)
+{
+    if (count <= nv_trace_drain_capacity)
+        return true;
+
+    uint32_t capacity = (nv_trace_drain_capacity) ? nv_trace_drain_capacity : 64;
+
+    while (capacity < count)
+        capacity *= 2;
+
+    nv_trace_ring_t **rings = realloc(nv_trace_drain_rings, capacity * sizeof(*rings));
+
+    if (!rings)
+        return false;
+
+    nv_trace_drain_rings = rings;
+
+    uint64_t *heads = realloc(nv_trace_drain_heads, capacity * sizeof(*heads));
+
+    if (!heads)
+        return false;
+
+    nv_trace_drain_heads = heads;
+    nv_trace_drain_capacity = capacity;
+    return true;
+}
+
+// Merge everything currently in the rings into the file, oldest first. Caller holds nv_trace_drain_lock.
+static void nv_trace_drain_locked(void)
+{
+    uint32_t ring_count = 0;
+
+    for (nv_trace_ring_t *ring = __atomic_load_n(&nv_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        ring_count++;
+
+    // Without the memory, drain the rings that fit this time and the rest on a later pass; records wait in
+    // their rings (or get dropped and counted once a ring fills) rather than vanishing
+    if (!nv_trace_reserve_drain(ring_count)) {
+        nv_log_warning(NV_LOG_CORE, "MMIO trace: Out of memory, only draining %u of %u rings\n",
+            nv_trace_drain_capacity, ring_count);
+        ring_count = nv_trace_drain_capacity;
+    }
+
+    nv_trace_ring_t **rings = nv_trace_drain_rings;
+    uint64_t *heads = nv_trace_drain_heads;
+    nv_trace_ring_t *ring = __atomic_load_n(&nv_trace_rings, __ATOMIC_ACQUIRE);
+
+    // Rings pushed since counting sit in front of the ones counted and wait for the next drain
+    for (uint32_t i = 0; i < ring_count && ring; i++, ring = ring->next) {
+        rings[i] = ring;
+        heads[i] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    while (true) {
+        nv_trace_ring_t *oldest = NULL;
+        uint32_t oldest_index = 0;
+
+        for (uint32_t i = 0; i < ring_count; i++) {
+            nv_trace_ring_t *ring = rings[i];
+
+            if (ring->tail == heads[i])
+                continue;
+
+            if (!oldest
+                || ring->records[ring->tail & (NV_TRACE_RING_SIZE - 1)].timestamp
+                    < oldest->records[oldest->tail & (NV_TRACE_RING_SIZE - 1)].timestamp) {
+                oldest = ring;
+                oldest_index = i;
+            }
+        }
+
+        if (!oldest)
+            break;
+
+        // Write out the whole run from this ring that is older than every other ring's next record
+        uint64_t end = oldest->tail;
+
+        while (end != heads[oldest_index]) {
+            uint64_t timestamp = oldest->records[end & (NV_TRACE_RING_SIZE - 1)].timestamp;
+            bool still_oldest = true;
+
+            for (uint32_t i = 0; i < ring_count && still_oldest; i++) {
+                if (i != oldest_index && rings[i]->tail != heads[i]
+                    && rings[i]->records[rings[i]->tail & (NV_TRACE_RING_SIZE - 1)].timestamp < timestamp)
+                    still_oldest = false;
+            }
+
+            if (!still_oldest)
+                break;
+
+            end++;
+
+            // Don't wrap around the end of the ring inside one fwrite
+            if ((end & (NV_TRACE_RING_SIZE - 1)) == 0)
+                break;
+        }
+
+        uint64_t count = end - oldest->tail;
+
+        if (nv_trace_file)
+            fwrite(&oldest->records[oldest->tail & (NV_TRACE_RING_SIZE - 1)], sizeof(nv_trace_record_t), count, nv_trace_file);
+
+        nv_trace_written += count;
+        __atomic_store_n(&oldest->tail, end, __ATOMIC_RELEASE);
+    }
+
+    // An orphaned ring can't get any more records, so once it's empty it can go
+    for (uint32_t i = 0; i < ring_count; i++) {
+        if (__atomic_load_n(&rings[i]->orphaned, __ATOMIC_ACQUIRE)
+            && rings[i]->tail == __atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE))
+            nv_trace_free_ring(rings[i]);
+    }
+}
+
+void nv_trace_drain(void)
+{
+    pthread_mutex_lock(&nv_trace_drain_lock);
+    nv_trace_drain_locked();
+    pthread_mutex_unlock(&nv_trace_drain_lock);
+}
+
+static void *nv_trace_writer_thread(void *arg)
+{
+    struct timespec interval = { 0, NV_TRACE_DRAIN_INTERVAL_NS };
+
+    while (!__atomic_load_n(&nv_trace_writer_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        nv_trace_drain();
+    }
+
+    return NULL;
+}
+
+bool nv_trace_start(const char *path)
+{
+    pthread_mutex_lock(&nv_trace_drain_lock);
+
+    if (nv_trace_file) {
+        pthread_mutex_unlock(&nv_trace_drain_lock);
+        printf("Error: MMIO trace already running\n");
+        return false;
+    }
+
+    // Throw away anything left over from a previous trace
+    nv_trace_file = NULL;
+    nv_trace_drain_locked();
+
+    nv_trace_file = fopen(path, "wb");
+
+    if (!nv_trace_file) {
+        pthread_mutex_unlock(&nv_trace_drain_lock);
+        perror("Failed to open MMIO trace file");
+        return false;
+    }
+
+    nv_trace_header_t header = { NV_TRACE_MAGIC, NV_TRACE_VERSION, sizeof(nv_trace_record_t), 0 };
+    fwrite(&header, sizeof(header), 1, nv_trace_file);
+    nv_trace_written = 0;
+
+    pthread_mutex_unlock(&nv_trace_drain_lock);
+
+    nv_trace_writer_stop = false;
+    nv_trace_writer_running = (pthread_create(&nv_trace_writer, NULL, nv_trace_writer_thread, NULL) == 0);
+
+    if (!nv_trace_writer_running)
+        printf("Warning: No background trace writer, records will be dropped once the rings fill up\n");
+
+    __atomic_store_n(&nv_trace_enabled, true, __ATOMIC_RELEASE);
+    printf("MMIO trace started: %s\n", path);
+    return true;
+}
+
+void nv_trace_stop(void)
+{
+    if (!__atomic_load_n(&nv_trace_enabled, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&nv_trace_enabled, false, __ATOMIC_RELEASE);
+
+    if (nv_trace_writer_running) {
+        __atomic_store_n(&nv_trace_writer_stop, true, __ATOMIC_RELEASE);
+        pthread_join(nv_trace_writer, NULL);
+        nv_trace_writer_running = false;
+    }
+
+    pthread_mutex_lock(&nv_trace_drain_lock);
+    nv_trace_drain_locked();
+    fclose(nv_trace_file);
+    nv_trace_file = NULL;
+    pthread_mutex_unlock(&nv_trace_drain_lock);
+
+    printf("MMIO trace stopped (%llu records written)\n", (unsigned long long)nv_trace_written);
+}
+
+void nv_trace_get_stats(nv_trace_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    // The lock keeps rings from being freed under the walk
+    pthread_mutex_lock(&nv_trace_drain_lock);
+
+    for (nv_trace_ring_t *ring = __atomic_load_n(&nv_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        stats->recorded += __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    stats->recorded += nv_trace_freed_recorded;
+    stats->dropped += nv_trace_freed_dropped;
+    stats->written = nv_trace_written;
+    stats->threads = __atomic_load_n(&nv_trace_thread_count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&nv_trace_drain_lock);
+}
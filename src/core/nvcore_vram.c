@@ -0,0 +1,414 @@
+//
+// Filename: nvcore_vram.c
+// Purpose: Bulk VRAM copy/fill engine over the BAR1 window
+//
+// Single dword MMIO accesses only use a small fraction of the available bus bandwidth, so large transfers go
+// through here instead. Writes into VRAM use wide non-temporal stores (they are never read back by the CPU and
+// combine into full bursts), reads use wide loads. The widest engine the CPU supports is picked at runtime.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NV_VRAM_HAVE_X86_ENGINES
+#endif
+
+typedef struct nv_vram_engine_s {
+    const char *name;
+    void (*copy_to)(volatile uint8_t *dst, const uint8_t *src, uint32_t size);
+    void (*copy_from)(uint8_t *dst, const volatile uint8_t *src, uint32_t size);
+    void (*fill)(volatile uint8_t *dst, uint32_t value, uint32_t size);
+} nv_vram_engine_t;
+
+//
+// Scalar engine: also used for the unaligned head and tail of the SIMD engines
+//
+
+static void nv_vram_copy_to_scalar(volatile uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+    while (size && ((uintptr_t)dst & 3)) {
+        *dst++ = *src++;
+        size--;
+    }
+
+    for (; size >= 4; size -= 4, dst += 4, src += 4) {
+        uint32_t value;
+        memcpy(&value, src, sizeof(value));
+        *(volatile uint32_t *)dst = value;
+    }
+
+    while (size--)
+        *dst++ = *src++;
+}
+
+static void nv_vram_copy_from_scalar(uint8_t *dst, const volatile uint8_t *src, uint32_t size)
+{
+    while (size && ((uintptr_t)src & 3)) {
+        *dst++ = *src++;
+        size--;
+    }
+
+    for (; size >= 4; size -= 4, dst += 4, src += 4) {
+        uint32_t value = *(const volatile uint32_t *)src;
+        memcpy(dst, &value, sizeof(value));
+    }
+
+    while (size--)
+        *dst++ = *src++;
+}
+
+static void nv_vram_fill_scalar(volatile uint8_t *dst, uint32_t value, uint32_t size)
+{
+    for (; size >= 4; size -= 4, dst += 4)
+        *(volatile uint32_t *)dst = value;
+}
+
+#ifdef NV_VRAM_HAVE_X86_ENGINES
+
+//
+// SSE2 engine: 16 byte accesses, 64 bytes per iteration
+//
+
+__attribute__((target("sse2")))
+static void nv_vram_copy_to_sse2(volatile uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+    uint32_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_copy_to_scalar(dst, src, head);
+    dst += head, src += head, size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)(dst + 0), a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+
+    for (; size >= 16; size -= 16, dst += 16, src += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+
+    _mm_sfence();
+    nv_vram_copy_to_scalar(dst, src, size);
+}
+
+__attribute__((target("sse2")))
+static void nv_vram_copy_from_sse2(uint8_t *dst, const volatile uint8_t *src, uint32_t size)
+{
+    uint32_t head = (16 - ((uintptr_t)src & 15)) & 15;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_copy_from_scalar(dst, src, head);
+    dst += head, src += head, size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_load_si128((const __m128i *)(src + 0));
+        __m128i b = _mm_load_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_load_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_load_si128((const __m128i *)(src + 48));
+        _mm_storeu_si128((__m128i *)(dst + 0), a);
+        _mm_storeu_si128((__m128i *)(dst + 16), b);
+        _mm_storeu_si128((__m128i *)(dst + 32), c);
+        _mm_storeu_si128((__m128i *)(dst + 48), d);
+    }
+
+    for (; size >= 16; size -= 16, dst += 16, src += 16)
+        _mm_storeu_si128((__m128i *)dst, _mm_load_si128((const __m128i *)src));
+
+    nv_vram_copy_from_scalar(dst, src, size);
+}
+
+__attribute__((target("sse2")))
+static void nv_vram_fill_sse2(volatile uint8_t *dst, uint32_t value, uint32_t size)
+{
+    __m128i pattern = _mm_set1_epi32((int32_t)value);
+
+    // dst is dword aligned, so the head is a whole number of dwords
+    uint32_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_fill_scalar(dst, value, head);
+    dst += head, size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64) {
+        _mm_stream_si128((__m128i *)(dst + 0), pattern);
+        _mm_stream_si128((__m128i *)(dst + 16), pattern);
+        _mm_stream_si128((__m128i *)(dst + 32), pattern);
+        _mm_stream_si128((__m128i *)(dst + 48), pattern);
+    }
+
+    for (; size >= 16; size -= 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, pattern);
+
+    _mm_sfence();
+    nv_vram_fill_scalar(dst, value, size);
+}
+
+//
+// AVX2 engine: 32 byte accesses, 128 bytes per iteration
+//
+
+__attribute__((target("avx2")))
+static void nv_vram_copy_to_avx2(volatile uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+    uint32_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_copy_to_scalar(dst, src, head);
+    dst += head, src += head, size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + 0));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)(dst + 0), a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+
+    for (; size >= 32; size -= 32, dst += 32, src += 32)
+        _mm256_stream_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+
+    _mm_sfence();
+    nv_vram_copy_to_scalar(dst, src, size);
+}
+
+__attribute__((target("avx2")))
+static void nv_vram_copy_from_avx2(uint8_t *dst, const volatile uint8_t *src, uint32_t size)
+{
+    uint32_t head = (32 - ((uintptr_t)src & 31)) & 31;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_copy_from_scalar(dst, src, head);
+    dst += head, src += head, size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_load_si256((const __m256i *)(src + 0));
+        __m256i b = _mm256_load_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_load_si256((const __m256i *)(src + 64));
+        __m256i d = _mm256_load_si256((const __m256i *)(src + 96));
+        _mm256_storeu_si256((__m256i *)(dst + 0), a);
+        _mm256_storeu_si256((__m256i *)(dst + 32), b);
+        _mm256_storeu_si256((__m256i *)(dst + 64), c);
+        _mm256_storeu_si256((__m256i *)(dst + 96), d);
+    }
+
+    for (; size >= 32; size -= 32, dst += 32, src += 32)
+        _mm256_storeu_si256((__m256i *)dst, _mm256_load_si256((const __m256i *)src));
+
+    nv_vram_copy_from_scalar(dst, src, size);
+}
+
+__attribute__((target("avx2")))
+static void nv_vram_fill_avx2(volatile uint8_t *dst, uint32_t value, uint32_t size)
+{
+    __m256i pattern = _mm256_set1_epi32((int32_t)value);
+    uint32_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+
+    if (head > size)
+        head = size;
+
+    nv_vram_fill_scalar(dst, value, head);
+    dst += head, size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128) {
+        _mm256_stream_si256((__m256i *)(dst + 0), pattern);
+        _mm256_stream_si256((__m256i *)(dst + 32), pattern);
+        _mm256_stream_si256((__m256i *)(dst + 64), pattern);
+        _mm256_stream_si256((__m256i *)(dst + 96), pattern);
+    }
+
+    for (; size >= 32; size -= 32, dst += 32)
+        _mm256_stream_si256((__m256i *)dst, pattern);
+
+    _mm_sfence();
+    nv_vram_fill_scalar(dst, value, size);
+}
+
+#endif // NV_VRAM_HAVE_X86_ENGINES
+
+static const nv_vram_engine_t nv_vram_engine_scalar = {
+    "scalar", nv_vram_copy_to_scalar, nv_vram_copy_from_scalar, nv_vram_fill_scalar,
+};
+
+#ifdef NV_VRAM_HAVE_X86_ENGINES
+static const nv_vram_engine_t nv_vram_engine_sse2 = {
+    "SSE2", nv_vram_copy_to_sse2, nv_vram_copy_from_sse2, nv_vram_fill_sse2,
+};
+
+static const nv_vram_engine_t nv_vram_engine_avx2 = {
+    "AVX2", nv_vram_copy_to_avx2, nv_vram_copy_from_avx2, nv_vram_fill_avx2,
+};
+#endif
+
+static const nv_vram_engine_t *nv_vram_engine = NULL;
+static pthread_once_t nv_vram_engine_once = PTHREAD_ONCE_INIT;
+
+static void nv_vram_pick_engine(void)
+{
+    const nv_vram_engine_t *engine = &nv_vram_engine_scalar;
+
+#ifdef NV_VRAM_HAVE_X86_ENGINES
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        engine = &nv_vram_engine_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        engine = &nv_vram_engine_sse2;
+#endif
+
+    printf("VRAM transfer engine: %s\n", engine->name);
+    nv_vram_engine = engine;
+}
+
+// The engine only depends on the CPU, so it's picked once for the process whichever thread's device asks first
+void nv_vram_select_engine(void)
+{
+    pthread_once(&nv_vram_engine_once, nv_vram_pick_engine);
+}
+
+const char *nv_vram_engine_name(void)
+{
+    return (nv_vram_engine) ? nv_vram_engine->name : "none";
+}
+
+static bool nv_vram_check_range(const char *operation, uint32_t offset, uint32_t size)
+{
+    if (!current_device.vram_mapping) {
+        printf("Error: Attempted VRAM %s before initialization\n", operation);
+        return false;
+    }
+
+    if (offset > current_device.vram_mapping_size || size > current_device.vram_mapping_size - offset) {
+        printf("Error: VRAM %s out of range (offset 0x%08X, size 0x%08X)\n", operation, offset, size);
+        return false;
+    }
+
+    nv_vram_select_engine();
+    return true;
+}
+
+bool nv_vram_copy_to(uint32_t offset, const void *src, uint32_t size)
+{
+    if (!nv_vram_check_range("copy", offset, size))
+        return false;
+
+    nv_vram_engine->copy_to((volatile uint8_t *)current_device.vram_mapping + offset, src, size);
+    return true;
+}
+
+bool nv_vram_copy_from(void *dst, uint32_t offset, uint32_t size)
+{
+    if (!nv_vram_check_range("copy", offset, size))
+        return false;
+
+    nv_vram_engine->copy_from(dst, (const volatile uint8_t *)current_device.vram_mapping + offset, size);
+    return true;
+}
+
+bool nv_vram_fill(uint32_t offset, uint32_t value, uint32_t size)
+{
+    if ((offset | size) & 3) {
+        printf("Error: VRAM fill must be dword aligned (offset 0x%08X, size 0x%08X)\n", offset, size);
+        return false;
+    }
+
+    if (!nv_vram_check_range("fill", offset, size))
+        return false;
+
+    nv_vram_engine->fill((volatile uint8_t *)current_device.vram_mapping + offset, value, size);
+    return true;
+}
+
+// Upload an image into VRAM, converting it into the format of the surface it's going to. Each row is converted a
+// chunk at a time into a small buffer and then streamed out, so the conversion stays in cache and the VRAM side
+// still gets wide writes.
+#define NV_VRAM_UPLOAD_CHUNK    1024                // Pixels converted per copy
+
+bool nv_vram_upload_image(uint32_t offset, uint32_t pitch, nv_pixel_format_t format, const void *pixels,
+    uint32_t src_pitch, nv_pixel_format_t src_format, uint32_t width, uint32_t height)
+{
+    nv_pixel_convert_t convert = nv_pixel_get_converter(format, src_format);
+    uint32_t bytes = nv_pixel_format_bytes(format), src_bytes = nv_pixel_format_bytes(src_format);
+    uint8_t chunk[NV_VRAM_UPLOAD_CHUNK * 4];
+
+    if (!convert) {
+        printf("Error: Can't upload an image from format %u to format %u\n", src_format, format);
+        return false;
+    }
+
+    if (!width || !height)
+        return true;
+
+    uint64_t extent = (uint64_t)pitch * (height - 1) + (uint64_t)width * bytes;
+
+    if (extent > UINT32_MAX || !nv_vram_check_range("upload", offset, (uint32_t)extent))
+        return false;
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *src = (const uint8_t *)pixels + (size_t)y * src_pitch;
+        volatile uint8_t *dst = (volatile uint8_t *)current_device.vram_mapping + offset + (size_t)y * pitch;
+
+        for (uint32_t x = 0; x < width; x += NV_VRAM_UPLOAD_CHUNK) {
+            uint32_t count = (width - x < NV_VRAM_UPLOAD_CHUNK) ? width - x : NV_VRAM_UPLOAD_CHUNK;
+
+            convert(chunk, src + (size_t)x * src_bytes, count);
+            nv_vram_engine->copy_to(dst + (size_t)x * bytes, chunk, count * bytes);
+        }
+    }
+
+    return true;
+}
+
+// Scale an image with a scaler that's already set up and upload it, in the scaler's destination format
+bool nv_vram_upload_scaled(uint32_t offset, uint32_t pitch, const nv_scaler_t *scaler, const void *pixels,
+    uint32_t src_pitch)
+{
+    uint32_t bytes = nv_pixel_format_bytes(scaler->dst_format);
+    uint8_t chunk[NV_VRAM_UPLOAD_CHUNK * 4];
+
+    if (!scaler->columns) {
+        printf("Error: Attempted a scaled upload with a scaler that isn't set up\n");
+        return false;
+    }
+
+    uint64_t extent = (uint64_t)pitch * (scaler->dst_height - 1) + (uint64_t)scaler->dst_width * bytes;
+
+    if (extent > UINT32_MAX || !nv_vram_check_range("upload", offset, (uint32_t)extent))
+        return false;
+
+    for (uint32_t y = 0; y < scaler->dst_height; y++) {
+        volatile uint8_t *dst = (volatile uint8_t *)current_device.vram_mapping + offset + (size_t)y * pitch;
+
+        for (uint32_t x = 0; x < scaler->dst_width; x += NV_VRAM_UPLOAD_CHUNK) {
+            uint32_t end = (scaler->dst_width - x < NV_VRAM_UPLOAD_CHUNK) ? scaler->dst_width
+                : x + NV_VRAM_UPLOAD_CHUNK;
+
+            nv_scaler_row(scaler, chunk, pixels, src_pitch, y, x, end);
+            nv_vram_engine->copy_to(dst + (size_t)x * bytes, chunk, (end - x) * bytes);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,109 @@
+//
+// Filename: nvcore_wait.c
+// Purpose: Timed register polling with adaptive backoff
+//
+// Most waits on the GPU (FIFO space, engine idle, vblank) finish within a few register reads, so nv_mmio_wait
+// starts by spinning. If the condition takes longer it backs off exponentially with pause instructions and
+// sched_yield, and only falls back to sleeping once the wait has clearly become a long one.
+//
+// Time comes from nv_time_now rather than PTIMER: the host clock is a vDSO call, reading PTIMER costs a bus round
+// trip. Under the fast-forward time source the sleeps are skipped, so a long wait or a timeout ends almost at once.
+//
+#include <stdio.h>
+#include <sched.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+
+// Backoff tuning
+#define NV_WAIT_SPIN_NS             2000            // Poll back to back for this long first
+#define NV_WAIT_PAUSE_MAX           64              // Largest run of pause instructions between polls
+#define NV_WAIT_YIELD_NS            100000          // After this long, yield between polls
+#define NV_WAIT_SLEEP_NS            1000000         // After this long, sleep between polls
+#define NV_WAIT_SLEEP_MIN_NS        10000
+#define NV_WAIT_SLEEP_MAX_NS        1000000
+
+// Shared by every thread that waits, so it's only ever updated atomically
+static nv_wait_stats_t nv_wait_stats = {0};
+
+static inline uint32_t nv_wait_bucket(uint64_t ns)
+{
+    uint32_t bucket = (ns) ? 64 - __builtin_clzll(ns) : 0;
+    return (bucket < NV_WAIT_HISTOGRAM_BUCKETS) ? bucket : NV_WAIT_HISTOGRAM_BUCKETS - 1;
+}
+
+static void nv_wait_account(uint64_t waited, bool timed_out)
+{
+    uint64_t max = __atomic_load_n(&nv_wait_stats.max_ns, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&nv_wait_stats.waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nv_wait_stats.total_ns, waited, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nv_wait_stats.histogram[nv_wait_bucket(waited)], 1, __ATOMIC_RELAXED);
+
+    while (waited > max
+        && !__atomic_compare_exchange_n(&nv_wait_stats.max_ns, &max, waited, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (timed_out)
+        __atomic_add_fetch(&nv_wait_stats.timeouts, 1, __ATOMIC_RELAXED);
+}
+
+// Wait until (read32(addr) & mask) == value, for at most timeout_ns. Returns false on timeout.
+// waited_ns, if not NULL, receives how long the wait took.
+bool nv_mmio_wait(uint32_t addr, uint32_t mask, uint32_t value, uint64_t timeout_ns, uint64_t *waited_ns)
+{
+    uint64_t start = nv_time_now();
+    uint64_t elapsed = 0;
+    uint64_t sleep_ns = NV_WAIT_SLEEP_MIN_NS;
+    uint32_t pauses = 1;
+    bool done;
+
+    while (!(done = ((nv_mmio_read32(addr) & mask) == value))) {
+        elapsed = nv_time_now() - start;
+
+        if (elapsed >= timeout_ns)
+            break;
+
+        if (elapsed < NV_WAIT_SPIN_NS)
+            continue;
+
+        if (elapsed < NV_WAIT_YIELD_NS) {
+            for (uint32_t i = 0; i < pauses; i++)
+                nv_cpu_relax();
+
+            if (pauses < NV_WAIT_PAUSE_MAX)
+                pauses <<= 1;
+        } else if (elapsed < NV_WAIT_SLEEP_NS) {
+            sched_yield();
+        } else {
+            uint64_t remaining = timeout_ns - elapsed;
+            uint64_t nap = (sleep_ns < remaining) ? sleep_ns : remaining;
+
+            nv_sleep_ns(nap);
+
+            if (sleep_ns < NV_WAIT_SLEEP_MAX_NS)
+                sleep_ns <<= 1;
+        }
+    }
+
+    if (done)
+        elapsed = nv_time_now() - start;
+
+    nv_wait_account(elapsed, !done);
+
+    if (waited_ns)
+        *waited_ns = elapsed;
+
+    return done;
+}
+
+// Each counter is read atomically, though the set as a whole may be mid-update
+void nv_wait_get_stats(nv_wait_stats_t *stats)
+{
+    stats->waits = __atomic_load_n(&nv_wait_stats.waits, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&nv_wait_stats.timeouts, __ATOMIC_RELAXED);
+    stats->total_ns = __atomic_load_n(&nv_wait_stats.total_ns, __ATOMIC_RELAXED);
+    stats->max_ns = __atomic_load_n(&nv_wait_stats.max_ns, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; i < NV_WAIT_HISTOGRAM_BUCKETS; i++)
+        stats->histogram[i] = __atomic_load_n(&nv_wait_stats.histogram[i], __ATOMIC_RELAXED);
+}
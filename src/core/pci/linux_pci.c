@@ -33,6 +33,14 @@ bool pci_does_device_exist(uint32_t device_id, uint32_t vendor_id)
         if (dev->vendor_id == vendor_id && dev->device_id == device_id) {
             current_device.bus_number = dev->bus;
             current_device.function_number = dev->dev | (dev->func << 3);
+
+            // The sysfs name and real BAR sizes are needed to map the BARs through sysfs
+            pci_fill_info(dev, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_SIZES);
+            snprintf(current_device.pci_slot_name, sizeof(current_device.pci_slot_name), "%04x:%02x:%02x.%d",
+                dev->domain, dev->bus, dev->dev, dev->func);
+            current_device.bar0_size = (uint32_t)dev->size[0];
+            current_device.bar1_size = (uint32_t)dev->size[1];
+
             printf("Found PCI device %04x:%04x at bus %02x device %02x function %d\n",
                    vendor_id, device_id, dev->bus, dev->dev, dev->func);
             return true;
@@ -124,6 +132,10 @@ bool pci_init(void)
 
 bool pci_does_device_exist(uint32_t device_id, uint32_t vendor_id)
 {
+    // The virtual device only emulates a Riva 128, so don't claim to be anything else
+    if (device_id != PCI_DEVICE_NV3 || vendor_id != PCI_VENDOR_SGS_NV)
+        return false;
+
     // Register the device with the virtual PCI system
     virtual_pci_register_device(device_id, vendor_id);
     return true;
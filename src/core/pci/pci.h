@@ -11,10 +11,90 @@ uint32_t pci_read_config_16(uint32_t bus_number, uint32_t function_number, uint3
 uint32_t pci_read_config_32(uint32_t bus_number, uint32_t function_number, uint32_t offset);
 void pci_cleanup(void);
 
-// Virtual PCI functions
+// Size of the virtual device's backing stores
+#define VIRTUAL_MMIO_SIZE   0x1000000               // 16MB BAR0 register space
+#define VIRTUAL_VRAM_SIZE   0x800000                // 8MB VRAM
+#define VIRTUAL_RAMIN_SIZE  0x400000                // 4MB RAMIN
+
+// Virtual devices. Each has its own memory, registers and clock and they share no state, so separate threads can
+// drive separate devices without any locking. A thread picks the device that virtual_mmio_* and virtual_pci_* (and
+// through them nvcore) talk to with virtual_device_select; threads that don't select one get the device
+// virtual_pci_init created. Destroying a device deselects it on the calling thread, and fails (returns false) while
+// any other thread still has it selected. PGRAPH methods run on the submitting thread unless the device is switched
+// to its own worker thread with virtual_device_set_pipelined; the device virtual_pci_init creates is.
+typedef struct virtual_device_s virtual_device_t;
+
+virtual_device_t *virtual_device_create(uint32_t device_id, uint32_t vendor_id);
+bool virtual_device_destroy(virtual_device_t *dev);
+void virtual_device_reset(virtual_device_t *dev);
+virtual_device_t *virtual_device_select(virtual_device_t *dev);
+uint32_t virtual_device_read32(virtual_device_t *dev, uint32_t addr);
+void virtual_device_write32(virtual_device_t *dev, uint32_t addr, uint32_t value);
+void virtual_device_write_span(virtual_device_t *dev, uint32_t addr, const uint32_t *values, uint32_t count);
+uint32_t virtual_device_read_config(virtual_device_t *dev, uint32_t offset, uint32_t size);
+void *virtual_device_get_vram(virtual_device_t *dev);
+void *virtual_device_get_ramin(virtual_device_t *dev);
+bool virtual_device_set_pipelined(virtual_device_t *dev, bool pipelined);
+
+// Snapshots of a virtual device: memory, registers, config space and subsystem state. Restoring one only costs the
+// pages the device has touched since, and any number of devices can be restored from the same snapshot. nvcore's
+// own view of the device (current_device, with its shadow cache) isn't part of it; keep a copy of that alongside.
+typedef struct virtual_snapshot_s virtual_snapshot_t;
+
+virtual_snapshot_t *virtual_snapshot_create(virtual_device_t *dev);
+bool virtual_snapshot_restore(virtual_device_t *dev, const virtual_snapshot_t *snapshot);
+void virtual_snapshot_destroy(virtual_snapshot_t *snapshot);
+
+// Virtual PCI functions, on the calling thread's current device
 bool virtual_pci_init(void);
 void virtual_pci_cleanup(void);
+void virtual_pci_reset(void);
 uint32_t virtual_pci_read_config_8(uint32_t bus_number, uint32_t function_number, uint32_t offset);
 uint32_t virtual_pci_read_config_16(uint32_t bus_number, uint32_t function_number, uint32_t offset);
 uint32_t virtual_pci_read_config_32(uint32_t bus_number, uint32_t function_number, uint32_t offset);
-void virtual_pci_register_device(uint32_t device_id, uint32_t vendor_id);
\ No newline at end of file
+void virtual_pci_register_device(uint32_t device_id, uint32_t vendor_id);
+void *virtual_pci_get_vram(void);
+void *virtual_pci_get_ramin(void);
+
+// Virtual MMIO functions, on the calling thread's current device
+typedef struct virtual_handler_stats_s {
+    const char *name;
+    uint32_t start;                                 // Registers it decodes, inclusive
+    uint32_t end;
+    uint64_t reads;
+    uint64_t writes;
+} virtual_handler_stats_t;
+
+uint32_t virtual_mmio_read32(uint32_t addr);
+void virtual_mmio_write32(uint32_t addr, uint32_t value);
+void virtual_mmio_write_span(uint32_t addr, const uint32_t *values, uint32_t count);
+uint32_t virtual_mmio_get_handler_stats(virtual_handler_stats_t *stats, uint32_t max);
+
+// Virtual PFIFO command submission statistics
+typedef struct virtual_pfifo_stats_s {
+    uint64_t pushed;                                // Methods queued into CACHE1
+    uint64_t pulled;                                // Methods the puller handed on
+    uint64_t runouts;                               // Submissions diverted to RAMRO
+    uint64_t hash_failures;                         // Puller stalls on a missing RAMHT entry
+    uint32_t cache1_size;
+    uint32_t cache1_high_water;
+} virtual_pfifo_stats_t;
+
+bool virtual_pfifo_get_stats(virtual_pfifo_stats_t *stats);
+
+// Virtual PGRAPH statistics
+typedef struct virtual_pgraph_stats_s {
+    uint64_t methods;                               // Methods executed
+    uint64_t software_methods;                      // Methods trapped for software
+    uint64_t pixels;                                // Pixels drawn
+    uint64_t glyphs;                                // Text glyphs drawn
+    uint64_t glyph_cache_hits;                      // Glyphs that were already expanded
+    uint64_t triangles;                             // Direct3D triangles set up
+    uint64_t triangle_batches;                      // Batches they were drawn in
+    uint64_t notifies;                              // Notifications written
+    uint64_t queue_stalls;                          // Submissions that waited for room on the worker's queue
+    bool pipelined;                                 // Methods run on the worker thread
+} virtual_pgraph_stats_t;
+
+bool virtual_pgraph_get_stats(virtual_pgraph_stats_t *stats);
+bool virtual_pgraph_set_pipelined(bool pipelined);
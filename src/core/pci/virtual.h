@@ -0,0 +1,327 @@
+#pragma once
+
+//
+// Filename: virtual.h
+// Purpose: Internal interface of the virtual NV3 device model
+//
+// The virtual device decodes the same flat address space as the core (registers, then VRAM, then RAMIN, see
+// NV_MMIO_*_START). Every access is resolved through a 4MB window table to its backing store, then through a page
+// table that says whether any handlers are registered in that 4KB page. Pages without handlers are plain memory,
+// so the common case stays two table lookups and a load or store.
+//
+// Handlers are registered per dword: a range registration fills in every dword of the range, and a later
+// registration overrides an earlier one, so a subsystem can register a catch-all for its block and then specific
+// handlers for individual registers.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "core/nvcore.h"
+#include "core/pci/pci.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_PAGE_SHIFT          12
+#define VIRTUAL_PAGE_SIZE           (1 << VIRTUAL_PAGE_SHIFT)
+#define VIRTUAL_PAGE_COUNT          ((NV_MMIO_RAMIN_END + 1) >> VIRTUAL_PAGE_SHIFT)
+
+#define VIRTUAL_MAX_HANDLERS        64
+
+// A read handler returns the value of the register, a write handler decides what (if anything) gets stored
+typedef uint32_t (*virtual_read_handler_t)(virtual_device_t *dev, uint32_t addr);
+typedef void (*virtual_write_handler_t)(virtual_device_t *dev, uint32_t addr, uint32_t value);
+
+typedef struct virtual_handler_s {
+    const char *name;
+    uint32_t start;
+    uint32_t end;                                   // Inclusive
+    virtual_read_handler_t read;                    // NULL: read the backing store
+    virtual_write_handler_t write;                  // NULL: write the backing store
+    uint64_t reads;                                 // Hit counters
+    uint64_t writes;
+} virtual_handler_t;
+
+typedef struct virtual_page_s {
+    virtual_handler_t *regs[VIRTUAL_PAGE_SIZE / 4];
+} virtual_page_t;
+
+// PTIMER is derived from the device's clock (virtual_time_now) on demand rather than ticked: the GPU time at time t is
+// gpu_base_ns + (t - host_base_ns) * NUMERATOR / DENOMINATOR
+typedef struct virtual_ptimer_state_s {
+    uint64_t host_base_ns;
+    uint64_t gpu_base_ns;
+    uint64_t alarm_checked_ns;                      // GPU time the alarm was last checked up to
+} virtual_ptimer_state_t;
+
+// PFIFO CACHE1. The ring lives here rather than in the CACHE1_METHOD registers because rev C parts have twice as many
+// entries as that window holds; PUT and GET are still kept in their registers (as entry index << 2).
+typedef struct virtual_pfifo_entry_s {
+    uint32_t method;                                // Subchannel in 15:13, method in 12:2
+    uint32_t data;
+} virtual_pfifo_entry_t;
+
+typedef struct virtual_pfifo_state_s {
+    uint32_t cache1_size;                           // Entries, depends on the revision
+    virtual_pfifo_entry_t cache1[NV3_PFIFO_CACHE1_SIZE_MAX];
+    uint64_t pushed;
+    uint64_t pulled;
+    uint64_t runouts;
+    uint64_t hash_failures;
+    uint32_t cache1_high_water;                     // Most entries ever queued at once
+} virtual_pfifo_state_t;
+
+// Glyphs expanded from 1bpp into a byte mask per pixel at the surface depth, kept by their bitmap
+#define VIRTUAL_GLYPH_MAX_DWORDS        ((NV3_CLASS0C_TEXT_MONO_C_END - NV3_CLASS0C_TEXT_MONO_C_START) / 4 + 1)
+#define VIRTUAL_GLYPH_CACHE_SIZE        512         // Entries, a power of two: a few fonts' worth
+#define VIRTUAL_GLYPH_CACHE_WAYS        4           // Entries a glyph can go in
+#define VIRTUAL_GLYPH_CACHE_PIXELS      512         // Largest glyph kept, 16x32 or so
+
+typedef struct virtual_glyph_s {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;                                 // Bytes per pixel of the mask
+    uint32_t bits_pitch;                            // Bytes per row of bits
+    uint32_t set_bits;                              // Pixels the whole glyph draws
+    uint8_t *bits;                                  // Rows of glyph bits, first pixel in bit 7
+    uint8_t *mask;                                  // Rows of width * bytes, 0xFF under set bits
+} virtual_glyph_t;
+
+typedef struct virtual_glyph_entry_s {
+    uint32_t generation;                            // Only valid if it matches the cache's
+    uint64_t last_used;                             // Glyph count when last drawn, for replacement
+    uint32_t key[VIRTUAL_GLYPH_CACHE_PIXELS / 32];  // The glyph's dwords as written
+    virtual_glyph_t glyph;
+    uint8_t bits[VIRTUAL_GLYPH_CACHE_PIXELS + 16];
+    uint8_t mask[VIRTUAL_GLYPH_CACHE_PIXELS * 4 + 16];
+} virtual_glyph_entry_t;
+
+typedef struct virtual_glyph_cache_s {
+    uint32_t generation;                            // Bumped on reset, which drops every entry at once
+    virtual_glyph_entry_t entries[VIRTUAL_GLYPH_CACHE_SIZE];
+} virtual_glyph_cache_t;
+
+// Direct3D triangles, set up when they're submitted and rasterised a batch at a time
+#define VIRTUAL_D3D_VERTICES            16
+#define VIRTUAL_D3D_BATCH_SIZE          256         // Triangles
+#define VIRTUAL_D3D_ATTRIBUTES          7           // Z, R, G, B, U/W, V/W, 1/W
+
+typedef struct virtual_d3d_triangle_s {
+    int32_t x0, y0, x1, y1;                         // Bounding box in pixels, exclusive, before clipping
+    int32_t edge_a[3];                              // Edge functions a*x + b*y + c of pixel centres in 1/16 pixels,
+    int32_t edge_b[3];                              // >= 0 inside, with the fill rule folded into c
+    int64_t edge_c[3];
+    float origin_x;                                 // Attribute planes are relative to the first vertex
+    float origin_y;
+    float planes[VIRTUAL_D3D_ATTRIBUTES][3];        // Value at the origin, d/dx, d/dy
+    uint32_t control;                               // NV3_D3D_CONTROL_* when it was submitted
+    uint32_t texture_offset;
+    uint32_t texture_format;
+} virtual_d3d_triangle_t;
+
+typedef struct virtual_d3d_batch_s {
+    uint32_t count;
+    virtual_d3d_triangle_t triangles[VIRTUAL_D3D_BATCH_SIZE];
+    uint32_t *bins;                                 // Triangle indices, grouped by tile, in submission order
+    uint32_t *bin_starts;                           // Where each tile's group starts, one extra for the end
+    uint32_t bins_size;                             // Allocated entries
+    uint32_t bin_starts_size;
+} virtual_d3d_batch_t;
+
+// PGRAPH state that the classes accumulate across methods. What the hardware keeps in registers (ROP, pattern, clip,
+// buffers) stays in the PGRAPH registers.
+typedef struct virtual_pgraph_state_s {
+    uint32_t rect_color;
+    uint32_t rect_point;                            // Point half of the rectangle being specified
+    uint32_t point_color;
+    uint32_t line_color;
+    uint32_t line_start;                            // First end of the line being specified
+    uint32_t polyline_last;                         // Where the polyline continues from
+    bool polyline_started;
+    uint32_t clip_point;
+    uint32_t blit_in;
+    uint32_t blit_out;
+    uint32_t m2mf_offset_in;
+    uint32_t m2mf_offset_out;
+    uint32_t m2mf_pitch_in;
+    uint32_t m2mf_pitch_out;
+    uint32_t m2mf_line_length;
+    uint32_t m2mf_line_count;
+    uint32_t m2mf_format;
+    uint32_t scaled_format;
+    uint32_t scaled_clip_point;
+    uint32_t scaled_clip_size;
+    uint32_t scaled_out_point;
+    uint32_t scaled_out_size;
+    uint32_t scaled_du_dx;
+    uint32_t scaled_dv_dy;
+    uint32_t scaled_in_size;
+    uint32_t scaled_in_pitch;
+    uint32_t scaled_in_offset;
+    uint32_t stretch_size_in;
+    uint32_t stretch_dx_du;
+    uint32_t stretch_dy_dv;
+    uint32_t stretch_clip_point;
+    uint32_t stretch_clip_size;
+    uint32_t stretch_point;                         // Integer pixel, taken from the 12.4 point
+    bool stretch_active;                            // An image is being sent
+    uint32_t stretch_row_dwords;                    // Dwords per source row
+    uint32_t stretch_fill;                          // Dwords of the current row received so far
+    uint32_t stretch_line;                          // Source row being received
+    uint32_t stretch_next_y;                        // First output row not drawn yet
+    uint32_t stretch_row[(NV3_PGRAPH_BPITCH_MAX + 1) / 4];
+    uint32_t d3d_texture_offset;
+    uint32_t d3d_texture_format;
+    uint32_t d3d_control;
+    uint32_t d3d_vertices[VIRTUAL_D3D_VERTICES][NV3_CLASS17_D3D5_TLVERTEX_SIZE / 4];
+    uint32_t point_zeta_control;
+    uint32_t point_zeta_color;
+    uint32_t point_zeta_point;
+    uint32_t text_color_a;
+    uint32_t text_point_a;
+    uint32_t text_clip_c[2];                        // Top left, bottom right
+    uint32_t text_color_c;
+    uint32_t text_size_c;
+    uint32_t text_point_c;
+    uint32_t text_mono_c[VIRTUAL_GLYPH_MAX_DWORDS + 1];     // Plus one, so bits can be read in pairs of dwords
+    uint64_t methods;
+    uint64_t software_methods;
+    uint64_t pixels;                                // Pixels written, after clipping
+    uint64_t glyphs;
+    uint64_t glyph_cache_hits;
+    uint64_t triangles;
+    uint64_t triangle_batches;
+    uint64_t notifies;
+} virtual_pgraph_state_t;
+
+// Methods on their way to the PGRAPH worker thread, a ring with one producer (whoever writes the USER area or a
+// class range) and one consumer (the worker). Each side only writes its own counters, which live on their own cache
+// lines; the counters only ever grow, an entry is queue[counter % VIRTUAL_PGRAPH_QUEUE_SIZE].
+#define VIRTUAL_PGRAPH_QUEUE_SIZE       4096        // Entries, a power of two
+
+typedef struct virtual_pgraph_command_s {
+    uint32_t class_id;                              // PGRAPH numbering
+    uint32_t method;
+    uint32_t data;
+} virtual_pgraph_command_t;
+
+typedef struct virtual_pgraph_worker_s {
+    virtual_pgraph_command_t queue[VIRTUAL_PGRAPH_QUEUE_SIZE];
+
+    // Producer side
+    uint64_t head __attribute__((aligned(64)));     // Commands submitted
+    uint64_t stalls;                                // Submissions that found the queue full
+    uint32_t waiters;                               // Threads blocked on progress
+
+    // Worker side
+    uint64_t tail __attribute__((aligned(64)));     // Commands executed
+    uint64_t retired;                               // Commands whose drawing can all be seen
+    uint32_t sleeping;                              // The worker is waiting on wake, or about to
+
+    pthread_t thread __attribute__((aligned(64)));
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                            // Work was submitted, or the worker should stop
+    pthread_cond_t progress;                        // tail or retired moved on
+    bool running;
+    bool stop;
+} virtual_pgraph_worker_t;
+
+// Vblank is derived from the same clock: frame n starts at base_ns + n * VIRTUAL_FRAME_NS
+#define VIRTUAL_FRAME_NS            16666667        // 60Hz
+
+typedef struct virtual_vblank_state_s {
+    uint64_t base_ns;
+    uint64_t frame;                                 // Last frame the vblank interrupt was raised for
+} virtual_vblank_state_t;
+
+struct virtual_device_s {
+    uint32_t device_id;
+    uint32_t vendor_id;
+    uint32_t bar0_addr;
+    uint32_t bar1_addr;
+    bool initialized;
+    uint8_t pci_config[256];
+
+    // Backing stores
+    uint32_t *mmio;
+    uint32_t *vram;
+    uint32_t *ramin;
+    uint32_t *windows[NV_MMIO_WINDOW_COUNT];        // Backing store behind each 4MB window, NULL if nothing's there
+    uint64_t snapshot_id;                           // Snapshot the backing stores are mapped over, 0 if anonymous
+    uint64_t time_skipped_ns;                       // The device's own fast-forward offset (see nvcore_time.c)
+    uint32_t selections;                            // Threads that have it selected
+
+    // Dispatch
+    virtual_handler_t handlers[VIRTUAL_MAX_HANDLERS];
+    uint32_t handler_count;
+    virtual_page_t *pages[VIRTUAL_PAGE_COUNT];      // NULL if no handlers in the page
+
+    // Subsystem state that doesn't live in registers
+    virtual_pfifo_state_t pfifo;
+    virtual_pgraph_state_t pgraph;
+    virtual_ptimer_state_t ptimer;
+    virtual_vblank_state_t vblank;
+    virtual_glyph_cache_t glyphs;
+    nv_scaler_t scaled_scaler;                      // Kept between images, rebuilt when the mapping changes
+    nv_scaler_t stretch_scaler;
+    virtual_d3d_batch_t d3d;                        // Triangles not drawn yet
+    virtual_pgraph_worker_t pgraph_worker;
+};
+
+// The device virtual_mmio_* and virtual_pci_* go to: whichever the calling thread selected (virtual_device_select),
+// otherwise the one virtual_pci_init created
+extern __thread virtual_device_t *virtual_current;
+extern virtual_device_t *virtual_default;
+
+static inline virtual_device_t *virtual_device_current(void)
+{
+    return (virtual_current) ? virtual_current : virtual_default;
+}
+
+// The device's clock, the same whichever thread reads it
+static inline uint64_t virtual_time_now(virtual_device_t *dev)
+{
+    return nv_time_now_skipping(&dev->time_skipped_ns);
+}
+
+// Backing store of a register, for handlers that keep their state there
+static inline uint32_t *virtual_reg(virtual_device_t *dev, uint32_t addr)
+{
+    return &dev->mmio[addr >> 2];
+}
+
+// Dispatch (virtual_mmio.c)
+bool virtual_mmio_register(virtual_device_t *dev, const char *name, uint32_t start, uint32_t end,
+    virtual_read_handler_t read, virtual_write_handler_t write);
+void virtual_mmio_build_windows(virtual_device_t *dev);
+void virtual_mmio_cleanup(virtual_device_t *dev);
+
+// Common handlers
+uint32_t virtual_read_zero(virtual_device_t *dev, uint32_t addr);
+void virtual_write_ignore(virtual_device_t *dev, uint32_t addr, uint32_t value);
+void virtual_write_1_to_clear(virtual_device_t *dev, uint32_t addr, uint32_t value);
+
+// Subsystems. attach registers the handlers once, reset puts the registers into their power-on state.
+void virtual_pmc_attach(virtual_device_t *dev);
+void virtual_pmc_reset(virtual_device_t *dev);
+void virtual_pfb_attach(virtual_device_t *dev);
+void virtual_pfb_reset(virtual_device_t *dev);
+void virtual_pfifo_attach(virtual_device_t *dev);
+void virtual_pfifo_reset(virtual_device_t *dev);
+void virtual_pgraph_attach(virtual_device_t *dev);
+void virtual_pgraph_reset(virtual_device_t *dev);
+void virtual_pgraph_cleanup(virtual_device_t *dev);
+void virtual_pgraph_update(virtual_device_t *dev);
+void virtual_pgraph_method(virtual_device_t *dev, uint32_t context, uint32_t method, uint32_t data);
+void virtual_pgraph_sync(virtual_device_t *dev);
+bool virtual_pgraph_worker_start(virtual_device_t *dev);
+void virtual_pgraph_worker_stop(virtual_device_t *dev);
+bool virtual_pgraph_worker_busy(virtual_device_t *dev);
+void virtual_ptimer_attach(virtual_device_t *dev);
+void virtual_ptimer_reset(virtual_device_t *dev);
+uint64_t virtual_ptimer_now(virtual_device_t *dev);
+void virtual_ptimer_update(virtual_device_t *dev);
+void virtual_pramdac_attach(virtual_device_t *dev);
+void virtual_pramdac_reset(virtual_device_t *dev);
+
+// Snapshots (virtual_snapshot.c)
+void virtual_snapshot_detach(virtual_device_t *dev);
@@ -0,0 +1,229 @@
+//
+// Filename: virtual_mmio.c
+// Purpose: Address decode and handler dispatch for the virtual device
+//
+// virtual_device_* access a given device. virtual_mmio_* are the same for the calling thread's current device,
+// which is what nvcore's slow path calls.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+
+__thread virtual_device_t *virtual_current = NULL;
+virtual_device_t *virtual_default = NULL;
+
+// Point each 4MB window at its backing store. VRAM and RAMIN may be smaller than their part of the address
+// space, anything past the end of a backing store is left unmapped.
+void virtual_mmio_build_windows(virtual_device_t *dev)
+{
+    memset(dev->windows, 0, sizeof(dev->windows));
+
+    for (uint32_t offset = 0; offset < VIRTUAL_MMIO_SIZE; offset += NV_MMIO_WINDOW_SIZE)
+        dev->windows[(NV_MMIO_REGS_START + offset) >> NV_MMIO_WINDOW_SHIFT] = dev->mmio + (offset >> 2);
+
+    for (uint32_t offset = 0; offset < VIRTUAL_VRAM_SIZE; offset += NV_MMIO_WINDOW_SIZE)
+        dev->windows[(NV_MMIO_VRAM_START + offset) >> NV_MMIO_WINDOW_SHIFT] = dev->vram + (offset >> 2);
+
+    for (uint32_t offset = 0; offset < VIRTUAL_RAMIN_SIZE; offset += NV_MMIO_WINDOW_SIZE)
+        dev->windows[(NV_MMIO_RAMIN_START + offset) >> NV_MMIO_WINDOW_SHIFT] = dev->ramin + (offset >> 2);
+}
+
+bool virtual_mmio_register(virtual_device_t *dev, const char *name, uint32_t start, uint32_t end,
+    virtual_read_handler_t read, virtual_write_handler_t write)
+{
+    if (start > end || end > NV_MMIO_RAMIN_END || (start & 3)) {
+        printf("Virtual MMIO: Invalid handler range 0x%08X-0x%08X (%s)\n", start, end, name);
+        return false;
+    }
+
+    if (dev->handler_count >= VIRTUAL_MAX_HANDLERS) {
+        printf("Virtual MMIO: Too many handlers, can't register %s\n", name);
+        return false;
+    }
+
+    virtual_handler_t *handler = &dev->handlers[dev->handler_count++];
+    handler->name = name;
+    handler->start = start;
+    handler->end = end;
+    handler->read = read;
+    handler->write = write;
+    handler->reads = handler->writes = 0;
+
+    for (uint32_t addr = start; addr <= end; addr += 4) {
+        virtual_page_t **page = &dev->pages[addr >> VIRTUAL_PAGE_SHIFT];
+
+        if (!*page && !(*page = calloc(1, sizeof(virtual_page_t)))) {
+            printf("Virtual MMIO: Out of memory registering %s\n", name);
+            return false;
+        }
+
+        (*page)->regs[(addr & (VIRTUAL_PAGE_SIZE - 1)) >> 2] = handler;
+    }
+
+    return true;
+}
+
+void virtual_mmio_cleanup(virtual_device_t *dev)
+{
+    for (uint32_t page = 0; page < VIRTUAL_PAGE_COUNT; page++) {
+        free(dev->pages[page]);
+        dev->pages[page] = NULL;
+    }
+
+    dev->handler_count = 0;
+}
+
+static inline uint32_t *virtual_mmio_decode(virtual_device_t *dev, uint32_t addr)
+{
+    if (__builtin_expect(!dev || addr > NV_MMIO_RAMIN_END, 0))
+        return NULL;
+
+    uint32_t *window = dev->windows[addr >> NV_MMIO_WINDOW_SHIFT];
+    return (window) ? window + ((addr & NV_MMIO_WINDOW_MASK) >> 2) : NULL;
+}
+
+static inline virtual_handler_t *virtual_mmio_handler(virtual_device_t *dev, uint32_t addr)
+{
+    virtual_page_t *page = dev->pages[addr >> VIRTUAL_PAGE_SHIFT];
+    return (page) ? page->regs[(addr & (VIRTUAL_PAGE_SIZE - 1)) >> 2] : NULL;
+}
+
+uint32_t virtual_device_read32(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t *backing = virtual_mmio_decode(dev, addr);
+
+    if (!backing) {
+        nv_log_warning(NV_LOG_VIRTUAL, "Virtual MMIO: Invalid read from address 0x%08X\n", addr);
+        return 0xFFFFFFFF;
+    }
+
+    virtual_handler_t *handler = virtual_mmio_handler(dev, addr);
+
+    if (__builtin_expect(!handler, 1))
+        return *backing;
+
+    handler->reads++;
+    return (handler->read) ? handler->read(dev, addr & ~3) : *backing;
+}
+
+static inline void virtual_mmio_store(virtual_device_t *dev, uint32_t *backing, uint32_t addr, uint32_t value)
+{
+    virtual_handler_t *handler = virtual_mmio_handler(dev, addr);
+
+    if (__builtin_expect(!handler, 1)) {
+        *backing = value;
+        return;
+    }
+
+    handler->writes++;
+
+    if (handler->write)
+        handler->write(dev, addr & ~3, value);
+    else
+        *backing = value;
+}
+
+void virtual_device_write32(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    uint32_t *backing = virtual_mmio_decode(dev, addr);
+
+    if (!backing) {
+        nv_log_warning(NV_LOG_VIRTUAL, "Virtual MMIO: Invalid write to address 0x%08X (value 0x%08X)\n",
+            addr, value);
+        return;
+    }
+
+    virtual_mmio_store(dev, backing, addr, value);
+}
+
+// Write a run of consecutive dwords. The run is validated once, and pages without handlers are copied in one go.
+void virtual_device_write_span(virtual_device_t *dev, uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    uint32_t *backing = virtual_mmio_decode(dev, addr);
+
+    if (!count)
+        return;
+
+    // Spans never cross a window, the caller splits them (see nv_mmio_issue_span)
+    if (!backing || count > (NV_MMIO_WINDOW_SIZE - (addr & NV_MMIO_WINDOW_MASK)) / 4) {
+        nv_log_warning(NV_LOG_VIRTUAL, "Virtual MMIO: Invalid span write to address 0x%08X (%u dwords)\n",
+            addr, count);
+        return;
+    }
+
+    while (count) {
+        uint32_t in_page = (VIRTUAL_PAGE_SIZE - (addr & (VIRTUAL_PAGE_SIZE - 1))) / 4;
+        uint32_t chunk = (count < in_page) ? count : in_page;
+
+        if (!dev->pages[addr >> VIRTUAL_PAGE_SHIFT]) {
+            memcpy(backing, values, chunk * 4);
+        } else {
+            for (uint32_t i = 0; i < chunk; i++)
+                virtual_mmio_store(dev, backing + i, addr + i * 4, values[i]);
+        }
+
+        addr += chunk * 4;
+        backing += chunk;
+        values += chunk;
+        count -= chunk;
+    }
+}
+
+uint32_t virtual_mmio_read32(uint32_t addr)
+{
+    return virtual_device_read32(virtual_device_current(), addr);
+}
+
+void virtual_mmio_write32(uint32_t addr, uint32_t value)
+{
+    virtual_device_write32(virtual_device_current(), addr, value);
+}
+
+void virtual_mmio_write_span(uint32_t addr, const uint32_t *values, uint32_t count)
+{
+    virtual_device_write_span(virtual_device_current(), addr, values, count);
+}
+
+uint32_t virtual_mmio_get_handler_stats(virtual_handler_stats_t *stats, uint32_t max)
+{
+    virtual_device_t *dev = virtual_device_current();
+    uint32_t count = 0;
+
+    if (!dev)
+        return 0;
+
+    for (uint32_t i = 0; i < dev->handler_count && count < max; i++, count++) {
+        stats[count].name = dev->handlers[i].name;
+        stats[count].start = dev->handlers[i].start;
+        stats[count].end = dev->handlers[i].end;
+        stats[count].reads = dev->handlers[i].reads;
+        stats[count].writes = dev->handlers[i].writes;
+    }
+
+    return count;
+}
+
+//
+// Common handlers
+//
+
+uint32_t virtual_read_zero(virtual_device_t *dev, uint32_t addr)
+{
+    return 0;
+}
+
+// Read-only registers
+void virtual_write_ignore(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+}
+
+// Interrupt status registers: writing a 1 acknowledges that interrupt
+void virtual_write_1_to_clear(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    *virtual_reg(dev, addr) &= ~value;
+}
@@ -1,250 +1,331 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "nvplayground.h"
 #include "core/nvcore.h"
+#include "util/util.h"
 #include "core/pci/pci.h"
+#include "core/pci/virtual.h"
 
-// Memory for emulating virtual hardware
-static uint32_t *virtual_mmio = NULL;
-static uint32_t *virtual_vram = NULL;
-static uint32_t *virtual_ramin = NULL;
-
-// Virtual PCI configuration space
-static uint8_t virtual_pci_config[256] = {0};
-
-// Virtual device information
-static struct {
-    uint32_t device_id;
-    uint32_t vendor_id;
-    uint32_t bar0_addr;
-    uint32_t bar1_addr;
-    bool initialized;
-} virtual_device = {0};
-
-// Virtual MMIO access functions
-uint32_t virtual_mmio_read32(uint32_t addr)
-{
-    if (!virtual_mmio || addr >= 0x1000000) {
-        printf("Virtual MMIO: Invalid read from address 0x%08X\n", addr);
-        return 0xFFFFFFFF;
+// Each virtual device is its own anonymous mapping, as are its backing stores, so nothing is committed until a page
+// is first touched and RSS only grows with the registers and memory actually used. Untouched pages read back as zero.
+// Devices share nothing, so any number of them can be driven from separate threads at once.
+static void *virtual_pci_alloc(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (memory == MAP_FAILED) ? NULL : memory;
+}
+
+static void virtual_pci_free(uint32_t **memory, uint32_t size)
+{
+    if (*memory) {
+        munmap(*memory, size);
+        *memory = NULL;
     }
-    
-    uint32_t value = virtual_mmio[addr/4];
-    
-    // Log reads from important registers
-    switch (addr) {
-        case 0x000000: // PMC_BOOT
-            printf("Virtual MMIO: Read PMC_BOOT = 0x%08X\n", value);
-            break;
-        case 0x100000: // PFB_BOOT
-            printf("Virtual MMIO: Read PFB_BOOT = 0x%08X\n", value);
-            break;
-        case 0x101000: // PSTRAPS
-            printf("Virtual MMIO: Read PSTRAPS = 0x%08X\n", value);
-            break;
+}
+
+// Put the virtual hardware back into its power-on state
+void virtual_device_reset(virtual_device_t *dev)
+{
+    // Nothing can still be drawing into memory that's about to go
+    virtual_pgraph_sync(dev);
+
+    // Dropping the pages is cheaper than zeroing them, they come back zero-filled on the next touch. Stores mapped
+    // over a snapshot would come back as the snapshot, so they go back to anonymous memory first.
+    virtual_snapshot_detach(dev);
+    madvise(dev->mmio, VIRTUAL_MMIO_SIZE, MADV_DONTNEED);
+    madvise(dev->vram, VIRTUAL_VRAM_SIZE, MADV_DONTNEED);
+    madvise(dev->ramin, VIRTUAL_RAMIN_SIZE, MADV_DONTNEED);
+
+    virtual_pmc_reset(dev);
+    virtual_pfb_reset(dev);
+    virtual_pfifo_reset(dev);
+    virtual_pgraph_reset(dev);
+    virtual_ptimer_reset(dev);
+    virtual_pramdac_reset(dev);
+}
+
+// Fill in the config space for a device and vendor id
+static void virtual_device_configure(virtual_device_t *dev, uint32_t device_id, uint32_t vendor_id)
+{
+    dev->device_id = device_id;
+    dev->vendor_id = vendor_id;
+
+    // Device ID and Vendor ID
+    dev->pci_config[0] = vendor_id & 0xFF;
+    dev->pci_config[1] = (vendor_id >> 8) & 0xFF;
+    dev->pci_config[2] = device_id & 0xFF;
+    dev->pci_config[3] = (device_id >> 8) & 0xFF;
+
+    // Command register: I/O and Memory space enabled
+    dev->pci_config[4] = 0x03;
+    dev->pci_config[5] = 0x00;
+
+    // Status register: 66MHz capable, fast back-to-back capable
+    dev->pci_config[6] = 0x00;
+    dev->pci_config[7] = 0x20;
+
+    // Revision ID: NV3 Rev B (0x10)
+    dev->pci_config[8] = 0x10;
+
+    // Class code: Display controller (0x030000)
+    dev->pci_config[9] = 0x00;   // Programming interface
+    dev->pci_config[10] = 0x00;  // Subclass
+    dev->pci_config[11] = 0x03;  // Base class
+
+    // BAR0: Memory mapped, non-prefetchable, 32-bit
+    dev->pci_config[0x10] = (dev->bar0_addr & 0xFF);
+    dev->pci_config[0x11] = (dev->bar0_addr >> 8) & 0xFF;
+    dev->pci_config[0x12] = (dev->bar0_addr >> 16) & 0xFF;
+    dev->pci_config[0x13] = (dev->bar0_addr >> 24) & 0xFF;
+
+    // BAR1: Memory mapped, prefetchable, 32-bit
+    dev->pci_config[0x14] = (dev->bar1_addr & 0xFF);
+    dev->pci_config[0x15] = (dev->bar1_addr >> 8) & 0xFF;
+    dev->pci_config[0x16] = (dev->bar1_addr >> 16) & 0xFF;
+    dev->pci_config[0x17] = (dev->bar1_addr >> 24) & 0xFF;
+}
+
+// A new device in its power-on state, NULL if it couldn't be allocated
+virtual_device_t *virtual_device_create(uint32_t device_id, uint32_t vendor_id)
+{
+    virtual_device_t *dev = virtual_pci_alloc(sizeof(virtual_device_t));
+
+    if (!dev) {
+        printf("Failed to allocate a virtual device\n");
+        return NULL;
     }
-    
-    return value;
+
+    dev->mmio = virtual_pci_alloc(VIRTUAL_MMIO_SIZE);
+    dev->vram = virtual_pci_alloc(VIRTUAL_VRAM_SIZE);
+    dev->ramin = virtual_pci_alloc(VIRTUAL_RAMIN_SIZE);
+
+    if (!dev->mmio || !dev->vram || !dev->ramin) {
+        printf("Failed to allocate memory for virtual hardware\n");
+        virtual_device_destroy(dev);
+        return NULL;
+    }
+
+    // Set default BAR addresses
+    dev->bar0_addr = 0xF0000000;  // Virtual BAR0 address
+    dev->bar1_addr = 0xF8000000;  // Virtual BAR1 address
+    dev->initialized = true;
+    virtual_device_configure(dev, device_id, vendor_id);
+
+    // Wire up the address decode and every subsystem's register handlers
+    virtual_mmio_build_windows(dev);
+    virtual_pmc_attach(dev);
+    virtual_pfb_attach(dev);
+    virtual_pfifo_attach(dev);
+    virtual_pgraph_attach(dev);
+    virtual_ptimer_attach(dev);
+    virtual_pramdac_attach(dev);
+
+    virtual_device_reset(dev);
+    return dev;
 }
 
-void virtual_mmio_write32(uint32_t addr, uint32_t value)
+// Fails, leaving the device alone, while another thread still has it selected
+bool virtual_device_destroy(virtual_device_t *dev)
 {
-    if (!virtual_mmio || addr >= 0x1000000) {
-        printf("Virtual MMIO: Invalid write to address 0x%08X (value 0x%08X)\n", addr, value);
-        return;
+    if (!dev)
+        return true;
+
+    if (virtual_current == dev)
+        virtual_device_select(NULL);
+
+    uint32_t selections = __atomic_load_n(&dev->selections, __ATOMIC_ACQUIRE);
+
+    if (selections) {
+        nv_log_error(NV_LOG_PCI, "Virtual PCI: Can't destroy a device %u other thread(s) still have selected\n",
+            selections);
+        return false;
     }
-    
-    // Log writes to important registers
-    switch (addr) {
-        case 0x000200: // PMC_ENABLE
-            printf("Virtual MMIO: Write PMC_ENABLE = 0x%08X (", value);
-            if (value == 0x11111111) 
-                printf("all subsystems enabled)\n");
-            else
-                printf("partial subsystem enable)\n");
-            break;
-            
-        case 0x000140: // PMC_INTR_EN
-            printf("Virtual MMIO: Write PMC_INTR_EN = 0x%08X (interrupts %s)\n", 
-                  value, (value & 0x3) ? "enabled" : "disabled");
-            break;
-            
-        case 0x680504: // PRAMDAC_CLOCK_MEMORY
-            printf("Virtual MMIO: Write PRAMDAC_CLOCK_MEMORY = 0x%08X\n", value);
-            
-            // Extract clock parameters
-            uint32_t vdiv = value & 0xFF;
-            uint32_t ndiv = (value >> 8) & 0xFF;
-            uint32_t pdiv = (value >> 16) & 0x7;
-            
-            // Calculate approximate clock frequency in MHz
-            float base_freq = 14.31818f; // 14.31818 MHz crystal
-            float mclk = (base_freq * ndiv) / (vdiv * (1 << pdiv));
-            
-            printf("Virtual MMIO: MCLK set to approximately %.2f MHz\n", mclk);
-            break;
+
+    if (virtual_default == dev)
+        virtual_default = NULL;
+
+    virtual_pgraph_cleanup(dev);
+    virtual_mmio_cleanup(dev);
+    virtual_pci_free(&dev->mmio, VIRTUAL_MMIO_SIZE);
+    virtual_pci_free(&dev->vram, VIRTUAL_VRAM_SIZE);
+    virtual_pci_free(&dev->ramin, VIRTUAL_RAMIN_SIZE);
+    munmap(dev, sizeof(virtual_device_t));
+    return true;
+}
+
+// A thread's selection is counted on the device until it selects another one or exits
+static pthread_key_t virtual_select_key;
+static pthread_once_t virtual_select_key_once = PTHREAD_ONCE_INIT;
+
+static void virtual_device_deselect_at_exit(void *arg)
+{
+    virtual_device_t *dev = arg;
+
+    virtual_current = NULL;
+    __atomic_sub_fetch(&dev->selections, 1, __ATOMIC_RELEASE);
+}
+
+static void virtual_device_create_select_key(void)
+{
+    pthread_key_create(&virtual_select_key, virtual_device_deselect_at_exit);
+}
+
+// Make dev the calling thread's current device (NULL goes back to the default one). Returns the previous one.
+virtual_device_t *virtual_device_select(virtual_device_t *dev)
+{
+    virtual_device_t *previous = virtual_current;
+
+    if (dev == previous)
+        return previous;
+
+    pthread_once(&virtual_select_key_once, virtual_device_create_select_key);
+
+    if (dev)
+        __atomic_add_fetch(&dev->selections, 1, __ATOMIC_ACQ_REL);
+
+    if (previous)
+        __atomic_sub_fetch(&previous->selections, 1, __ATOMIC_RELEASE);
+
+    virtual_current = dev;
+    pthread_setspecific(virtual_select_key, dev);
+    return previous;
+}
+
+void *virtual_device_get_vram(virtual_device_t *dev)
+{
+    return dev->vram;
+}
+
+void *virtual_device_get_ramin(virtual_device_t *dev)
+{
+    return dev->ramin;
+}
+
+// Read 1, 2 or 4 bytes of config space, all ones if the access is misaligned or out of range
+uint32_t virtual_device_read_config(virtual_device_t *dev, uint32_t offset, uint32_t size)
+{
+    uint32_t value = 0;
+
+    if ((size != 1 && size != 2 && size != 4) || (offset & (size - 1)) || offset > sizeof(dev->pci_config) - size) {
+        nv_log_warning(NV_LOG_PCI, "Virtual PCI: Invalid %u-bit config read at offset 0x%X\n", size * 8, offset);
+        return (size >= 4) ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
     }
-    
-    virtual_mmio[addr/4] = value;
+
+    for (uint32_t i = 0; i < size; i++)
+        value |= (uint32_t)dev->pci_config[offset + i] << (i * 8);
+
+    return value;
+}
+
+//
+// The process's default device, and the thread's current one
+//
+
+void virtual_pci_reset(void)
+{
+    virtual_device_reset(virtual_device_current());
 }
 
 bool virtual_pci_init(void)
 {
     printf("Initializing virtual PCI device...\n");
-    
-    // Allocate memory for virtual hardware components
-    virtual_mmio = (uint32_t *)calloc(0x1000000 / 4, sizeof(uint32_t));
-    virtual_vram = (uint32_t *)calloc(0x800000 / 4, sizeof(uint32_t));  // 8MB VRAM
-    virtual_ramin = (uint32_t *)calloc(0x400000 / 4, sizeof(uint32_t)); // 4MB RAMIN
-    
-    if (!virtual_mmio || !virtual_vram || !virtual_ramin) {
-        printf("Failed to allocate memory for virtual hardware\n");
-        virtual_pci_cleanup();
+
+    virtual_device_t *dev = virtual_device_create(0, 0);
+
+    if (!dev)
         return false;
-    }
-    
-    // Set default BAR addresses
-    virtual_device.bar0_addr = 0xF0000000;  // Virtual BAR0 address
-    virtual_device.bar1_addr = 0xF8000000;  // Virtual BAR1 address
-    virtual_device.initialized = true;
-    
-    // Initialize core MMIO registers for NV3
-    
-    // PMC_BOOT (NV3 Rev B0)
-    virtual_mmio[0x000000/4] = 0x00030110;  // NV3_BOOT_REG_REV_B00
-    
-    // PFB_BOOT (4MB VRAM, 64-bit wide, 2 banks)
-    virtual_mmio[0x100000/4] = (0x2 << 0) | (0x0 << 2) | (0x0 << 3);
-    
-    // PSTRAPS register
-    virtual_mmio[0x101000/4] = (0x1 << 6) | (0x1 << 1) | (0x1 << 0); // 14.31818 MHz, 66MHz, BIOS present
-    
-    // PRAMDAC_CLOCK_MEMORY (100 MHz default)
-    virtual_mmio[0x680504/4] = 0x0EC40E;
-    
+
+    virtual_default = dev;
+
+    // The process's own device executes PGRAPH methods on a worker thread
+    virtual_device_set_pipelined(dev, true);
+
     printf("Virtual NV3 device initialized successfully\n");
     return true;
 }
 
 void virtual_pci_register_device(uint32_t device_id, uint32_t vendor_id)
 {
-    if (!virtual_device.initialized) {
+    virtual_device_t *dev = virtual_device_current();
+
+    if (!dev || !dev->initialized) {
         printf("Virtual PCI: Cannot register device, not initialized\n");
         return;
     }
-    
-    virtual_device.device_id = device_id;
-    virtual_device.vendor_id = vendor_id;
-    
-    // Initialize PCI config space for the registered device
-    
-    // Device ID and Vendor ID
-    virtual_pci_config[0] = vendor_id & 0xFF;
-    virtual_pci_config[1] = (vendor_id >> 8) & 0xFF;
-    virtual_pci_config[2] = device_id & 0xFF;
-    virtual_pci_config[3] = (device_id >> 8) & 0xFF;
-    
-    // Command register: I/O and Memory space enabled
-    virtual_pci_config[4] = 0x03;
-    virtual_pci_config[5] = 0x00;
-    
-    // Status register: 66MHz capable, fast back-to-back capable
-    virtual_pci_config[6] = 0x00;
-    virtual_pci_config[7] = 0x20;
-    
-    // Revision ID: NV3 Rev B (0x10)
-    virtual_pci_config[8] = 0x10;
-    
-    // Class code: Display controller (0x030000)
-    virtual_pci_config[9] = 0x00;   // Programming interface
-    virtual_pci_config[10] = 0x00;  // Subclass
-    virtual_pci_config[11] = 0x03;  // Base class
-    
-    // BAR0: Memory mapped, non-prefetchable, 32-bit
-    virtual_pci_config[0x10] = (virtual_device.bar0_addr & 0xFF);
-    virtual_pci_config[0x11] = (virtual_device.bar0_addr >> 8) & 0xFF;
-    virtual_pci_config[0x12] = (virtual_device.bar0_addr >> 16) & 0xFF;
-    virtual_pci_config[0x13] = (virtual_device.bar0_addr >> 24) & 0xFF;
-    
-    // BAR1: Memory mapped, prefetchable, 32-bit
-    virtual_pci_config[0x14] = (virtual_device.bar1_addr & 0xFF);
-    virtual_pci_config[0x15] = (virtual_device.bar1_addr >> 8) & 0xFF;
-    virtual_pci_config[0x16] = (virtual_device.bar1_addr >> 16) & 0xFF;
-    virtual_pci_config[0x17] = (virtual_device.bar1_addr >> 24) & 0xFF;
-    
+
+    virtual_device_configure(dev, device_id, vendor_id);
     printf("Virtual PCI: Registered device %04X:%04X\n", device_id, vendor_id);
     
     // Set up device bus and function information for the framework
     current_device.bus_number = 0;
     current_device.function_number = 0;
+    snprintf(current_device.pci_slot_name, sizeof(current_device.pci_slot_name), "0000:00:00.0");
+    current_device.bar0_size = VIRTUAL_MMIO_SIZE;
+    current_device.bar1_size = 0x1000000;
+}
+
+void *virtual_pci_get_vram(void)
+{
+    virtual_device_t *dev = virtual_device_current();
+    return (dev) ? dev->vram : NULL;
+}
+
+void *virtual_pci_get_ramin(void)
+{
+    virtual_device_t *dev = virtual_device_current();
+    return (dev) ? dev->ramin : NULL;
 }
 
 void virtual_pci_cleanup(void)
 {
-    if (virtual_mmio) {
-        free(virtual_mmio);
-        virtual_mmio = NULL;
-    }
-    
-    if (virtual_vram) {
-        free(virtual_vram);
-        virtual_vram = NULL;
-    }
-    
-    if (virtual_ramin) {
-        free(virtual_ramin);
-        virtual_ramin = NULL;
-    }
-    
-    virtual_device.initialized = false;
+    virtual_device_destroy(virtual_default);
     printf("Virtual PCI device cleaned up\n");
 }
 
-uint32_t virtual_pci_read_config_8(uint32_t bus_number, uint32_t function_number, uint32_t offset)
+// Config reads go to the current device; the bus and function are ignored, there's only ever the one slot
+static uint32_t virtual_pci_read_config(uint32_t offset, uint32_t size)
 {
-    if (offset >= sizeof(virtual_pci_config)) {
-        printf("Virtual PCI: Invalid 8-bit config read at offset 0x%X\n", offset);
-        return 0xFF;
+    virtual_device_t *dev = virtual_device_current();
+
+    if (!dev) {
+        nv_log_warning(NV_LOG_PCI, "Virtual PCI: Config read at offset 0x%X with no device\n", offset);
+        return (size >= 4) ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
     }
-    
-    uint8_t value = virtual_pci_config[offset];
-    printf("Virtual PCI: Read config byte at 0x%X = 0x%02X\n", offset, value);
+
+    return virtual_device_read_config(dev, offset, size);
+}
+
+uint32_t virtual_pci_read_config_8(uint32_t bus_number, uint32_t function_number, uint32_t offset)
+{
+    uint32_t value = virtual_pci_read_config(offset, 1);
+
+    nv_log_debug(NV_LOG_PCI, "Virtual PCI: Read config byte at 0x%X = 0x%02X\n", offset, value);
     return value;
 }
 
 uint32_t virtual_pci_read_config_16(uint32_t bus_number, uint32_t function_number, uint32_t offset)
 {
-    if (offset % 2 != 0 || offset >= sizeof(virtual_pci_config) - 1) {
-        printf("Virtual PCI: Invalid 16-bit config read at offset 0x%X\n", offset);
-        return 0xFFFF;
-    }
-    
-    uint16_t value = virtual_pci_config[offset] | (virtual_pci_config[offset+1] << 8);
-    printf("Virtual PCI: Read config word at 0x%X = 0x%04X\n", offset, value);
+    uint32_t value = virtual_pci_read_config(offset, 2);
+
+    nv_log_debug(NV_LOG_PCI, "Virtual PCI: Read config word at 0x%X = 0x%04X\n", offset, value);
     return value;
 }
 
 uint32_t virtual_pci_read_config_32(uint32_t bus_number, uint32_t function_number, uint32_t offset)
 {
-    if (offset % 4 != 0 || offset >= sizeof(virtual_pci_config) - 3) {
-        printf("Virtual PCI: Invalid 32-bit config read at offset 0x%X\n", offset);
-        return 0xFFFFFFFF;
-    }
-    
-    uint32_t value = virtual_pci_config[offset] | 
-                   (virtual_pci_config[offset+1] << 8) |
-                   (virtual_pci_config[offset+2] << 16) |
-                   (virtual_pci_config[offset+3] << 24);
-    
-    printf("Virtual PCI: Read config dword at 0x%X = 0x%08X\n", offset, value);
+    uint32_t value = virtual_pci_read_config(offset, 4);
+
+    nv_log_debug(NV_LOG_PCI, "Virtual PCI: Read config dword at 0x%X = 0x%08X\n", offset, value);
     
     // Special handling for BAR registers
     if (offset == PCI_CFG_OFFSET_BAR0) {
-        printf("Virtual PCI: Read BAR0 (0x%08X)\n", value);
+        nv_log_debug(NV_LOG_PCI, "Virtual PCI: Read BAR0 (0x%08X)\n", value);
     } else if (offset == PCI_CFG_OFFSET_BAR1) {
-        printf("Virtual PCI: Read BAR1 (0x%08X)\n", value);
+        nv_log_debug(NV_LOG_PCI, "Virtual PCI: Read BAR1 (0x%08X)\n", value);
     }
     
     return value;
-}
\ No newline at end of file
+}
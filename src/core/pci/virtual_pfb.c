@@ -0,0 +1,43 @@
+//
+// Filename: virtual_pfb.c
+// Purpose: Virtual NV3 PFB (framebuffer interface) and PEXTDEV straps
+//
+#include <stdio.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "architecture/nv3/nv3_ref.h"
+
+static uint32_t virtual_pfb_boot_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t value = *virtual_reg(dev, addr);
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Read PFB_BOOT = 0x%08X\n", value);
+    return value;
+}
+
+static uint32_t virtual_pstraps_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t value = *virtual_reg(dev, addr);
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Read PSTRAPS = 0x%08X\n", value);
+    return value;
+}
+
+void virtual_pfb_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PFB_BOOT", NV3_PFB_BOOT, NV3_PFB_BOOT, virtual_pfb_boot_read, virtual_write_ignore);
+    virtual_mmio_register(dev, "PSTRAPS", NV3_PSTRAPS, NV3_PSTRAPS, virtual_pstraps_read, virtual_write_ignore);
+}
+
+void virtual_pfb_reset(virtual_device_t *dev)
+{
+    // 4MB VRAM, 64-bit wide, 2 banks
+    *virtual_reg(dev, NV3_PFB_BOOT) = (NV3_PFB_BOOT_RAM_AMOUNT_4MB << NV3_PFB_BOOT_RAM_AMOUNT)
+        | (NV3_PFB_BOOT_RAM_WIDTH_64 << NV3_PFB_BOOT_RAM_WIDTH)
+        | (NV3_PFB_BOOT_RAM_BANKS_2 << NV3_PFB_BOOT_RAM_BANKS);
+
+    // 14.31818 MHz crystal, BIOS present, 66MHz bus
+    *virtual_reg(dev, NV3_PSTRAPS) = (NV3_PSTRAPS_CRYSTAL_14318180 << NV3_PSTRAPS_CRYSTAL)
+        | (NV3_PSTRAPS_BIOS_PRESENT << NV3_PSTRAPS_BIOS)
+        | (NV3_PSTRAPS_BUS_SPEED_66MHZ << NV3_PSTRAPS_BUS_SPEED);
+}
@@ -0,0 +1,346 @@
+//
+// Filename: virtual_pfifo.c
+// Purpose: Virtual NV3 PFIFO (command FIFO): USER submission, CACHE1 and the puller
+//
+// A write to the USER area is a method submission: the address encodes the channel, subchannel and method, the
+// value is the method's data. The pusher queues it into CACHE1, or diverts it to RAMRO if it can't be accepted
+// (pushing disabled, cache full, or another channel still owns the cache). The puller then drains CACHE1 in order.
+// SET_OBJECT binds the object a handle names in RAMHT to the subchannel, every other method is handed to PGRAPH
+// along with the context of the object bound to its subchannel.
+//
+// The puller runs synchronously after every push, so CACHE1 only fills while pulling is disabled or stalled. A
+// missing RAMHT entry stalls it with a cache error until the interrupt is acknowledged, which is what makes
+// backpressure visible through the FREE_COUNT method and CACHE1_STATUS.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "architecture/nv3/nv3_ref.h"
+
+// Why a submission went to RAMRO, stored in 31:28 of the RAMRO entry
+#define VIRTUAL_PFIFO_RUNOUT_ILLEGAL        (1u << NV3_PFIFO_RUNOUT_RAMIN_ERR)
+#define VIRTUAL_PFIFO_RUNOUT_CACHE_FULL     (1u << 29)
+#define VIRTUAL_PFIFO_RUNOUT_PUSH_DISABLED  (1u << 30)
+
+#define VIRTUAL_PFIFO_CTX_STRIDE            0x10        // CACHE1_CTX holds one context per subchannel
+#define VIRTUAL_PFIFO_RAMFC_STRIDE          (NV3_DMA_SUBCHANNELS_PER_CHANNEL * 4)
+
+static inline uint32_t virtual_pfifo_raise(virtual_device_t *dev, uint32_t intr)
+{
+    return *virtual_reg(dev, NV3_PFIFO_INTR) |= (1 << intr);
+}
+
+static inline uint32_t *virtual_pfifo_ramin(virtual_device_t *dev, uint32_t offset)
+{
+    return &dev->ramin[(offset & (VIRTUAL_RAMIN_SIZE - 1)) >> 2];
+}
+
+static inline uint32_t *virtual_pfifo_ctx(virtual_device_t *dev, uint32_t subchannel)
+{
+    return virtual_reg(dev, NV3_PFIFO_CACHE1_CTX_START + subchannel * VIRTUAL_PFIFO_CTX_STRIDE);
+}
+
+// CACHE1 occupancy. One entry is always left free so a full ring can be told apart from an empty one.
+static inline uint32_t virtual_pfifo_cache1_used(virtual_device_t *dev)
+{
+    uint32_t put = *virtual_reg(dev, NV3_PFIFO_CACHE1_PUT) >> NV3_PFIFO_CACHE1_PUT_ADDRESS;
+    uint32_t get = *virtual_reg(dev, NV3_PFIFO_CACHE1_GET) >> NV3_PFIFO_CACHE1_GET_ADDRESS;
+    return (put - get) & (dev->pfifo.cache1_size - 1);
+}
+
+static inline uint32_t virtual_pfifo_cache1_free(virtual_device_t *dev)
+{
+    return dev->pfifo.cache1_size - 1 - virtual_pfifo_cache1_used(dev);
+}
+
+//
+// RAMRO
+//
+
+static inline uint32_t virtual_pfifo_ramro_size(virtual_device_t *dev)
+{
+    uint32_t config = *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMRO);
+    return ((config >> NV3_PFIFO_CONFIG_RAMRO_SIZE) & 1) ? NV3_RAMIN_RAMRO_SIZE_1 + 1 : NV3_RAMIN_RAMRO_SIZE_0 + 1;
+}
+
+static void virtual_pfifo_runout(virtual_device_t *dev, uint32_t offset, uint32_t value, uint32_t reason)
+{
+    uint32_t config = *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMRO);
+    uint32_t base = config & 0xFE00;                // 15:9
+    uint32_t size = virtual_pfifo_ramro_size(dev);
+    uint32_t put = *virtual_reg(dev, NV3_PFIFO_RUNOUT_PUT) & (size - 1) & ~7;
+    uint32_t get = *virtual_reg(dev, NV3_PFIFO_RUNOUT_GET) & (size - 1) & ~7;
+    uint32_t next = (put + NV3_RAMRO_ENTRY_SIZE) & (size - 1);
+
+    dev->pfifo.runouts++;
+    nv_log_debug(NV_LOG_VIRTUAL, "Virtual PFIFO: Runout at USER+0x%06X (data 0x%08X, reason 0x%08X)\n",
+        offset, value, reason);
+
+    if (next == get) {
+        virtual_pfifo_raise(dev, NV3_PFIFO_INTR_RUNOUT_OVERFLOW);
+        return;
+    }
+
+    *virtual_pfifo_ramin(dev, base + put) = (offset & 0x0FFFFFFF) | reason;
+    *virtual_pfifo_ramin(dev, base + put + 4) = value;
+    *virtual_reg(dev, NV3_PFIFO_RUNOUT_PUT) = next;
+    virtual_pfifo_raise(dev, NV3_PFIFO_INTR_RUNOUT);
+}
+
+//
+// RAMHT
+//
+
+// Fold the handle into the table's index width, then mix in the channel
+static inline uint32_t virtual_pfifo_ramht_hash(uint32_t handle, uint32_t channel, uint32_t bits)
+{
+    uint32_t hash = 0;
+
+    for (; handle; handle >>= bits)
+        hash ^= handle & ((1 << bits) - 1);
+
+    return (hash ^ (channel << (bits - 4))) & ((1 << bits) - 1);
+}
+
+static bool virtual_pfifo_ramht_lookup(virtual_device_t *dev, uint32_t handle, uint32_t channel, uint32_t *context)
+{
+    uint32_t config = *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMHT);
+    uint32_t base = config & 0xF000;                // 15:12
+    uint32_t size_bits = (config >> NV3_PFIFO_CONFIG_RAMHT_SIZE) & 0x3;
+    uint32_t entries = (NV3_RAMIN_RAMHT_SIZE_0 + 1) / NV3_RAMHT_ENTRY_SIZE << size_bits;
+    uint32_t index = virtual_pfifo_ramht_hash(handle, channel, 9 + size_bits);
+
+    // Collisions are resolved by probing the following entries
+    for (uint32_t probe = 0; probe < entries; probe++, index = (index + 1) & (entries - 1)) {
+        uint32_t *entry = virtual_pfifo_ramin(dev, base + index * NV3_RAMHT_ENTRY_SIZE);
+
+        if (!entry[0] && !entry[1])
+            break;
+
+        if (entry[0] == handle && (entry[1] >> NV3_RAMHT_CONTEXT_VALID) & 1
+            && ((entry[1] >> NV3_RAMHT_CONTEXT_CHANNEL) & 0x7F) == channel) {
+            *context = entry[1];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Puller
+//
+
+// Stop the puller on an entry it can't resolve. The entry stays at GET and is retried once the error is acknowledged.
+static void virtual_pfifo_stall(virtual_device_t *dev, virtual_pfifo_entry_t *entry, uint32_t channel)
+{
+    nv_log_debug(NV_LOG_VIRTUAL, "Virtual PFIFO: No object for method 0x%04X (data 0x%08X) on channel %u\n",
+        entry->method, entry->data, channel);
+
+    dev->pfifo.hash_failures++;
+    *virtual_reg(dev, NV3_PFIFO_CACHE1_PULL0) |= (1 << NV3_PFIFO_CACHE1_PULL0_HASH_FAILURE);
+    virtual_pfifo_raise(dev, NV3_PFIFO_INTR_CACHE_ERROR);
+}
+
+static void virtual_pfifo_pull(virtual_device_t *dev)
+{
+    // A cache error stalls the puller until it's acknowledged
+    if (!(*virtual_reg(dev, NV3_PFIFO_CACHE1_PULL0) & (1 << NV3_PFIFO_CACHE1_PULL0_ENABLED))
+        || (*virtual_reg(dev, NV3_PFIFO_INTR) & (1 << NV3_PFIFO_INTR_CACHE_ERROR)))
+        return;
+
+    uint32_t channel = *virtual_reg(dev, NV3_PFIFO_CACHE1_PUSH_CHANNEL_ID) & 0x7F;
+    uint32_t *get = virtual_reg(dev, NV3_PFIFO_CACHE1_GET);
+
+    while (virtual_pfifo_cache1_used(dev)) {
+        uint32_t index = (*get >> NV3_PFIFO_CACHE1_GET_ADDRESS) & (dev->pfifo.cache1_size - 1);
+        virtual_pfifo_entry_t *entry = &dev->pfifo.cache1[index];
+        uint32_t subchannel = (entry->method >> NV3_PFIFO_CACHE1_METHOD_SUBCHANNEL) & 0x7;
+        uint32_t method = entry->method & NV3_OBJECT_SUBMIT_METHOD;
+        uint32_t *context = virtual_pfifo_ctx(dev, subchannel);
+
+        if (method == NV3_OBJECT_METHOD_SET_OBJECT) {
+            if (!virtual_pfifo_ramht_lookup(dev, entry->data, channel, context)) {
+                virtual_pfifo_stall(dev, entry, channel);
+                return;
+            }
+        } else if (!*context) {
+            // Nothing bound to the subchannel
+            virtual_pfifo_stall(dev, entry, channel);
+            return;
+        } else {
+            virtual_pgraph_method(dev, *context, method, entry->data);
+        }
+
+        *get = ((index + 1) & (dev->pfifo.cache1_size - 1)) << NV3_PFIFO_CACHE1_GET_ADDRESS;
+        dev->pfifo.pulled++;
+    }
+}
+
+//
+// Pusher
+//
+
+// Only one channel owns CACHE1 at a time. Once it has drained, the subchannel bindings of the outgoing channel are
+// saved to RAMFC and those of the incoming one restored.
+static bool virtual_pfifo_switch_channel(virtual_device_t *dev, uint32_t channel)
+{
+    uint32_t *current = virtual_reg(dev, NV3_PFIFO_CACHE1_PUSH_CHANNEL_ID);
+    uint32_t ramfc = *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMFC) & 0xFE00;     // 15:9
+
+    if (virtual_pfifo_cache1_used(dev))
+        return false;
+
+    for (uint32_t subchannel = 0; subchannel < NV3_DMA_SUBCHANNELS_PER_CHANNEL; subchannel++) {
+        *virtual_pfifo_ramin(dev, ramfc + *current * VIRTUAL_PFIFO_RAMFC_STRIDE + subchannel * 4)
+            = *virtual_pfifo_ctx(dev, subchannel);
+        *virtual_pfifo_ctx(dev, subchannel)
+            = *virtual_pfifo_ramin(dev, ramfc + channel * VIRTUAL_PFIFO_RAMFC_STRIDE + subchannel * 4);
+    }
+
+    *current = channel;
+    return true;
+}
+
+static void virtual_pfifo_user_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    uint32_t offset = addr - NV3_USER_START;
+    uint32_t channel = (offset >> NV3_OBJECT_SUBMIT_CHANNEL) & 0x7F;
+    uint32_t subchannel = (offset >> NV3_OBJECT_SUBMIT_SUBCHANNEL) & 0x7;
+    uint32_t method = offset & NV3_OBJECT_SUBMIT_METHOD;
+
+    if (!(*virtual_reg(dev, NV3_PFIFO_CACHE1_PUSH0) & 1)) {
+        virtual_pfifo_runout(dev, offset, value, VIRTUAL_PFIFO_RUNOUT_PUSH_DISABLED);
+        return;
+    }
+
+    if (channel != (*virtual_reg(dev, NV3_PFIFO_CACHE1_PUSH_CHANNEL_ID) & 0x7F)
+        && !virtual_pfifo_switch_channel(dev, channel)) {
+        virtual_pfifo_runout(dev, offset, value, VIRTUAL_PFIFO_RUNOUT_ILLEGAL);
+        return;
+    }
+
+    if (!virtual_pfifo_cache1_free(dev)) {
+        virtual_pfifo_runout(dev, offset, value, VIRTUAL_PFIFO_RUNOUT_CACHE_FULL);
+        return;
+    }
+
+    uint32_t *put = virtual_reg(dev, NV3_PFIFO_CACHE1_PUT);
+    uint32_t index = (*put >> NV3_PFIFO_CACHE1_PUT_ADDRESS) & (dev->pfifo.cache1_size - 1);
+
+    dev->pfifo.cache1[index].method = (subchannel << NV3_PFIFO_CACHE1_METHOD_SUBCHANNEL) | method;
+    dev->pfifo.cache1[index].data = value;
+    *put = ((index + 1) & (dev->pfifo.cache1_size - 1)) << NV3_PFIFO_CACHE1_PUT_ADDRESS;
+    dev->pfifo.pushed++;
+
+    uint32_t used = virtual_pfifo_cache1_used(dev);
+
+    if (used > dev->pfifo.cache1_high_water)
+        dev->pfifo.cache1_high_water = used;
+
+    virtual_pfifo_pull(dev);
+}
+
+// The only thing readable in USER is how much room CACHE1 has left
+static uint32_t virtual_pfifo_user_read(virtual_device_t *dev, uint32_t addr)
+{
+    if (((addr - NV3_USER_START) & NV3_OBJECT_SUBMIT_METHOD) == NV3_OBJECT_METHOD_FREE_COUNT)
+        return virtual_pfifo_cache1_free(dev) * 4;
+
+    return 0;
+}
+
+//
+// Registers
+//
+
+static uint32_t virtual_pfifo_cache_status_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t put, get, size;
+
+    switch (addr) {
+        case NV3_PFIFO_CACHE0_STATUS:
+            put = *virtual_reg(dev, NV3_PFIFO_CACHE0_PUT);
+            get = *virtual_reg(dev, NV3_PFIFO_CACHE0_GET);
+            return (put == get) ? (1 << NV3_PFIFO_CACHE0_STATUS_EMPTY) : 0;
+        case NV3_PFIFO_CACHE1_STATUS:
+            if (!virtual_pfifo_cache1_used(dev))
+                return (1 << NV3_PFIFO_CACHE1_STATUS_EMPTY);
+
+            return (!virtual_pfifo_cache1_free(dev)) ? (1 << NV3_PFIFO_CACHE1_STATUS_FULL) : 0;
+        default:
+            size = virtual_pfifo_ramro_size(dev);
+            put = *virtual_reg(dev, NV3_PFIFO_RUNOUT_PUT) & (size - 1) & ~7;
+            get = *virtual_reg(dev, NV3_PFIFO_RUNOUT_GET) & (size - 1) & ~7;
+
+            if (put == get)
+                return (1 << NV3_PFIFO_RUNOUT_STATUS_EMPTY);
+
+            return (1 << NV3_PFIFO_RUNOUT_STATUS_RANOUT)
+                | ((((put + NV3_RAMRO_ENTRY_SIZE) & (size - 1)) == get) ? (1 << NV3_PFIFO_RUNOUT_STATUS_FULL) : 0);
+    }
+}
+
+// Acknowledging a cache error, enabling the puller or moving GET past a bad entry restarts the puller
+static void virtual_pfifo_intr_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    virtual_write_1_to_clear(dev, addr, value);
+    virtual_pfifo_pull(dev);
+}
+
+static void virtual_pfifo_pull_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    *virtual_reg(dev, addr) = value;
+    virtual_pfifo_pull(dev);
+}
+
+void virtual_pfifo_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PFIFO_INTR", NV3_PFIFO_INTR, NV3_PFIFO_INTR, NULL, virtual_pfifo_intr_write);
+    virtual_mmio_register(dev, "PFIFO_RUNOUT_STATUS", NV3_PFIFO_RUNOUT_STATUS, NV3_PFIFO_RUNOUT_STATUS,
+        virtual_pfifo_cache_status_read, virtual_write_ignore);
+    virtual_mmio_register(dev, "PFIFO_CACHE0_STATUS", NV3_PFIFO_CACHE0_STATUS, NV3_PFIFO_CACHE0_STATUS,
+        virtual_pfifo_cache_status_read, virtual_write_ignore);
+    virtual_mmio_register(dev, "PFIFO_CACHE1_STATUS", NV3_PFIFO_CACHE1_STATUS, NV3_PFIFO_CACHE1_STATUS,
+        virtual_pfifo_cache_status_read, virtual_write_ignore);
+    virtual_mmio_register(dev, "PFIFO_CACHE1_PULL0", NV3_PFIFO_CACHE1_PULL0, NV3_PFIFO_CACHE1_PULL0,
+        NULL, virtual_pfifo_pull_write);
+    virtual_mmio_register(dev, "PFIFO_CACHE1_GET", NV3_PFIFO_CACHE1_GET, NV3_PFIFO_CACHE1_GET,
+        NULL, virtual_pfifo_pull_write);
+
+    // Only the channels the driver can use are decoded, the rest of USER is plain memory
+    virtual_mmio_register(dev, "USER", NV3_USER_START,
+        NV3_USER_START + NV3_DMA_CHANNELS * NV3_OBJECT_SUBMIT_CHANNEL_SIZE - 1,
+        virtual_pfifo_user_read, virtual_pfifo_user_write);
+}
+
+void virtual_pfifo_reset(virtual_device_t *dev)
+{
+    uint32_t revision = (*virtual_reg(dev, NV3_PMC_BOOT) >> 4) & 0xF;
+
+    memset(&dev->pfifo, 0, sizeof(dev->pfifo));
+    dev->pfifo.cache1_size = (revision >= 2) ? NV3_PFIFO_CACHE1_SIZE_REV_C : NV3_PFIFO_CACHE1_SIZE_REV_AB;
+
+    *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMFC) = NV3_PFIFO_CONFIG_RAMFC_BASE_ADDRESS_DEFAULT;
+    *virtual_reg(dev, NV3_PFIFO_CONFIG_RAMRO) = NV3_PFIFO_CONFIG_RAMRO_BASE_ADDRESS_DEFAULT;
+}
+
+bool virtual_pfifo_get_stats(virtual_pfifo_stats_t *stats)
+{
+    virtual_device_t *dev = virtual_device_current();
+
+    if (!dev)
+        return false;
+
+    stats->pushed = dev->pfifo.pushed;
+    stats->pulled = dev->pfifo.pulled;
+    stats->runouts = dev->pfifo.runouts;
+    stats->hash_failures = dev->pfifo.hash_failures;
+    stats->cache1_size = dev->pfifo.cache1_size;
+    stats->cache1_high_water = dev->pfifo.cache1_high_water;
+    return true;
+}
@@ -0,0 +1,356 @@
+//
+// Filename: virtual_pgraph.c
+// Purpose: Virtual NV3 PGRAPH (2D/3D engine): method dispatch, surfaces, interrupts and status
+//
+// Methods arrive either from the PFIFO puller, with the class taken from the object's RAMHT context, or through the
+// class ranges in PGRAPH (NV3_PGRAPH_CLASS*_START), with the class taken from the address. Both end up in the
+// class's method handler. Methods of classes that aren't implemented are trapped as software methods. Both paths
+// only queue the method; it's executed in order on the worker thread (see virtual_pgraph_worker.c), and CPU accesses
+// to the rest of the PGRAPH registers wait for the engine to go idle first.
+//
+// NOTIFY is handled here for every implemented class: once everything before it has been drawn, a notification
+// (nv3_notification_t) is written into RAMIN at the instance in PGRAPH_NOTIFY, in 16 byte units, with its status
+// stored last. A nonzero NOTIFY parameter also raises the software notify interrupt.
+//
+// Vblank isn't ticked either. Whenever the interrupt could be observed, the number of frames since reset is worked
+// out from the device's clock, and the interrupt is raised if a new frame has started since the last check.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+typedef void (*virtual_pgraph_method_t)(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+typedef struct virtual_pgraph_class_s {
+    const char *name;
+    virtual_pgraph_method_t method;
+} virtual_pgraph_class_t;
+
+// Indexed by PGRAPH class id
+static const virtual_pgraph_class_t virtual_pgraph_classes[NV3_LAST_VALID_GRAPHICS_OBJECT_ID + 1] = {
+    [0x02] = { "PGRAPH_ROP", virtual_pgraph_class02_method },
+    [0x03] = { "PGRAPH_CHROMA", virtual_pgraph_class03_method },
+    [0x04] = { "PGRAPH_PLANE_MASK", virtual_pgraph_class04_method },
+    [0x05] = { "PGRAPH_CLIP", virtual_pgraph_class05_method },
+    [0x06] = { "PGRAPH_PATTERN", virtual_pgraph_class06_method },
+    [0x07] = { "PGRAPH_RECTANGLE", virtual_pgraph_class07_method },
+    [0x08] = { "PGRAPH_POINT", virtual_pgraph_class08_method },
+    [0x09] = { "PGRAPH_LINE", virtual_pgraph_class09_method },
+    [0x0A] = { "PGRAPH_LIN", virtual_pgraph_class0a_method },
+    [0x0C] = { "PGRAPH_GDI_TEXT", virtual_pgraph_class0c_method },
+    [0x0D] = { "PGRAPH_M2MF", virtual_pgraph_class0d_method },
+    [0x0E] = { "PGRAPH_SCALED_IMAGE", virtual_pgraph_class0e_method },
+    [0x10] = { "PGRAPH_BLIT", virtual_pgraph_class10_method },
+    [0x15] = { "PGRAPH_STRETCHED_IMAGE", virtual_pgraph_class15_method },
+    [0x17] = { "PGRAPH_D3D5_TRIANGLE", virtual_pgraph_class17_method },
+    [0x18] = { "PGRAPH_POINT_ZETA", virtual_pgraph_class18_method },
+    [0x1C] = { "PGRAPH_IMAGE_IN_MEMORY", virtual_pgraph_class1c_method },
+};
+
+static const uint32_t virtual_pgraph_bytes_per_pixel[16] = {
+    [NV3_PGRAPH_BPIXEL_FORMAT_Y8] = 1,
+    [NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5] = 2,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5] = 2,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X8R8G8B8] = 4,
+};
+
+static const nv_pixel_format_t virtual_pgraph_pixel_formats[16] = {
+    [0 ... 15] = NV_PIXEL_FORMAT_COUNT,
+    [NV3_PGRAPH_BPIXEL_FORMAT_Y8] = NV_PIXEL_FORMAT_Y8,
+    [NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5] = NV_PIXEL_FORMAT_R5G6B5,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5] = NV_PIXEL_FORMAT_X1R5G5B5,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X8R8G8B8] = NV_PIXEL_FORMAT_X8R8G8B8,
+};
+
+void virtual_pgraph_update(virtual_device_t *dev)
+{
+    uint64_t frame = (virtual_time_now(dev) - dev->vblank.base_ns) / VIRTUAL_FRAME_NS;
+
+    if (frame != dev->vblank.frame) {
+        dev->vblank.frame = frame;
+        __atomic_fetch_or(virtual_reg(dev, NV3_PGRAPH_INTR_0), 1 << NV3_PGRAPH_INTR_0_VBLANK, __ATOMIC_RELAXED);
+    }
+}
+
+//
+// Surfaces and tiling
+//
+
+// Resolve the destination buffer against VRAM. Fails if the buffer isn't set up to anything drawable.
+bool virtual_pgraph_surface(virtual_device_t *dev, virtual_surface_t *surface)
+{
+    uint32_t format = *virtual_reg(dev, NV3_PGRAPH_BPIXEL) & 0xF;
+    uint32_t bytes = virtual_pgraph_bytes_per_pixel[format];
+    uint32_t offset = *virtual_reg(dev, NV3_PGRAPH_BOFFSET(0)) & (VIRTUAL_VRAM_SIZE - 1);
+    uint32_t pitch = *virtual_reg(dev, NV3_PGRAPH_BPITCH(0)) & NV3_PGRAPH_BPITCH_MAX;
+
+    if (!bytes || pitch < bytes)
+        return false;
+
+    offset &= ~(bytes - 1);
+    surface->base = (uint8_t *)dev->vram + offset;
+    surface->pitch = pitch;
+    surface->format = format;
+    surface->bytes = bytes;
+    surface->width = pitch / bytes;
+    surface->height = (VIRTUAL_VRAM_SIZE - offset) / pitch;
+    return true;
+}
+
+// A PGRAPH buffer format (NV3_PGRAPH_BPIXEL_FORMAT_*) as a pixel conversion format, NV_PIXEL_FORMAT_COUNT if there
+// isn't one
+nv_pixel_format_t virtual_pgraph_pixel_format(uint32_t format)
+{
+    return virtual_pgraph_pixel_formats[format & 0xF];
+}
+
+// The user clip rectangle, cut down to the surface
+void virtual_pgraph_clip(virtual_device_t *dev, const virtual_surface_t *surface, virtual_rect_t *clip)
+{
+    virtual_rect_t bounds = { 0, 0, surface->width, surface->height };
+
+    clip->x0 = (int32_t)*virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_XMIN);
+    clip->x1 = (int32_t)*virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_XMAX);
+    clip->y0 = (int32_t)*virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_YMIN);
+    clip->y1 = (int32_t)*virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_YMAX);
+
+    if (!virtual_rect_intersect(clip, &bounds))
+        clip->x1 = clip->x0, clip->y1 = clip->y0;
+}
+
+typedef struct virtual_pgraph_tiles_s {
+    virtual_tile_task_t task;
+    void *arg;
+    int32_t y0;
+    int32_t y1;
+} virtual_pgraph_tiles_t;
+
+static void virtual_pgraph_tile(void *arg, uint32_t index)
+{
+    virtual_pgraph_tiles_t *tiles = arg;
+    int32_t y0 = tiles->y0 + (int32_t)index * VIRTUAL_PGRAPH_TILE_ROWS;
+    int32_t y1 = (tiles->y1 - y0 > VIRTUAL_PGRAPH_TILE_ROWS) ? y0 + VIRTUAL_PGRAPH_TILE_ROWS : tiles->y1;
+
+    tiles->task(tiles->arg, y0, y1);
+}
+
+// Run task over the rows of rect, spread over the thread pool in tiles if the draw touches enough memory
+void virtual_pgraph_run_tiles(const virtual_rect_t *rect, uint32_t bytes, virtual_tile_task_t task, void *arg)
+{
+    // Widened, so a rect spanning most of the int32 range can't overflow the sums
+    int64_t width = (int64_t)rect->x1 - rect->x0, rows = (int64_t)rect->y1 - rect->y0;
+
+    if (width <= 0 || rows <= VIRTUAL_PGRAPH_TILE_ROWS
+        || (uint64_t)width * (uint64_t)rows * bytes < VIRTUAL_PGRAPH_PARALLEL_BYTES) {
+        task(arg, rect->y0, rect->y1);
+        return;
+    }
+
+    virtual_pgraph_tiles_t tiles = { task, arg, rect->y0, rect->y1 };
+    nv_threadpool_run(virtual_pgraph_tile, &tiles,
+        (uint32_t)((rows + VIRTUAL_PGRAPH_TILE_ROWS - 1) / VIRTUAL_PGRAPH_TILE_ROWS));
+}
+
+//
+// Method dispatch
+//
+
+// Write a notification for everything executed so far
+static void virtual_pgraph_notify(virtual_device_t *dev, uint32_t data)
+{
+    uint32_t instance = (*virtual_reg(dev, NV3_PGRAPH_NOTIFY) >> NV3_PGRAPH_NOTIFY_INSTANCE) & 0xFFFF;
+    uint32_t offset = (instance << 4) & (VIRTUAL_RAMIN_SIZE - sizeof(nv3_notification_t));
+    uint32_t *notification = &dev->ramin[offset >> 2];
+    uint64_t now = virtual_ptimer_now(dev);
+
+    virtual_pgraph_d3d_flush(dev);
+    dev->pgraph.notifies++;
+
+    notification[0] = (uint32_t)now;
+    notification[1] = (uint32_t)(now >> 32);
+    notification[2] = data;                         // info32
+
+    // Status (with info16) last, so whoever polls it sees the rest
+    __atomic_store_n(&notification[3], (uint32_t)NV3_NOTIFICATION_STATUS_DONE_OK << 16, __ATOMIC_RELEASE);
+
+    if (data)
+        __atomic_fetch_or(virtual_reg(dev, NV3_PGRAPH_INTR_0), 1 << NV3_PGRAPH_INTR_0_SOFTWARE_NOTIFY,
+            __ATOMIC_RELAXED);
+}
+
+// Execute a method, on the worker thread unless methods aren't pipelined
+void virtual_pgraph_dispatch(virtual_device_t *dev, uint32_t class_id, uint32_t method, uint32_t data)
+{
+    const virtual_pgraph_class_t *class = &virtual_pgraph_classes[class_id & NV3_LAST_VALID_GRAPHICS_OBJECT_ID];
+
+    dev->pgraph.methods++;
+
+    // Queued triangles are drawn before anything another class does
+    if (dev->d3d.count && class_id != 0x17)
+        virtual_pgraph_d3d_flush(dev);
+
+    if (method == NV3_METHOD_NO_OPERATION)
+        return;
+
+    if (!class->method) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: Software method, class 0x%02X method 0x%04X = 0x%08X\n",
+            class_id, method, data);
+
+        dev->pgraph.software_methods++;
+        *virtual_reg(dev, NV3_PGRAPH_TRAPPED_ADDRESS) = (class_id << NV3_PGRAPH_CLASS_SHIFT) | method;
+        *virtual_reg(dev, NV3_PGRAPH_TRAPPED_DATA) = data;
+        __atomic_fetch_or(virtual_reg(dev, NV3_PGRAPH_INTR_1), 1 << NV3_PGRAPH_INTR_1_SOFTWARE_METHOD_PENDING,
+            __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (method == NV3_METHOD_NOTIFY) {
+        virtual_pgraph_notify(dev, data);
+        return;
+    }
+
+    class->method(dev, method, data);
+}
+
+// A method the PFIFO puller handed over for the object described by context (its RAMHT context). PFIFO numbers the
+// graphics classes from NV3_PFIFO_FIRST_VALID_GRAPHICS_OBJECT_ID, PGRAPH from 0.
+void virtual_pgraph_method(virtual_device_t *dev, uint32_t context, uint32_t method, uint32_t data)
+{
+    uint32_t class_id = (context >> NV3_RAMHT_CONTEXT_CLASS) & 0x7F;
+
+    nv_log_trace(NV_LOG_VIRTUAL, "Virtual PGRAPH: Class 0x%02X method 0x%04X = 0x%08X\n", class_id, method, data);
+
+    // Anything that isn't a graphics object goes to class 0, which traps
+    if (class_id >= NV3_PFIFO_FIRST_VALID_GRAPHICS_OBJECT_ID && class_id <= NV3_PFIFO_LAST_VALID_GRAPHICS_OBJECT_ID)
+        class_id -= NV3_PFIFO_FIRST_VALID_GRAPHICS_OBJECT_ID;
+    else
+        class_id = 0;
+
+    virtual_pgraph_submit(dev, class_id, method, data);
+}
+
+// Writes straight into a class range
+static void virtual_pgraph_class_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    virtual_pgraph_submit(dev, (addr - NV3_PGRAPH_START) >> NV3_PGRAPH_CLASS_SHIFT,
+        addr & NV3_OBJECT_SUBMIT_METHOD, value);
+}
+
+// The methods in flight read and write the PGRAPH registers, so the CPU only sees them with the engine idle
+static uint32_t virtual_pgraph_read_register(virtual_device_t *dev, uint32_t addr)
+{
+    virtual_pgraph_sync(dev);
+    return *virtual_reg(dev, addr);
+}
+
+static void virtual_pgraph_write_register(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    virtual_pgraph_sync(dev);
+    *virtual_reg(dev, addr) = value;
+}
+
+// The interrupts are raised by the worker as it executes, so these don't wait for it
+static uint32_t virtual_pgraph_read_intr(virtual_device_t *dev, uint32_t addr)
+{
+    if (!dev->pgraph_worker.running)
+        virtual_pgraph_d3d_flush(dev);
+
+    virtual_pgraph_update(dev);
+    return __atomic_load_n(virtual_reg(dev, addr), __ATOMIC_ACQUIRE);
+}
+
+static void virtual_pgraph_write_intr(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    __atomic_fetch_and(virtual_reg(dev, addr), ~value, __ATOMIC_RELAXED);
+}
+
+// Busy until everything submitted has been executed and drawn. Without the worker, queued triangles are drawn when
+// the status is read, so once it's idle the drawing can be seen.
+static uint32_t virtual_pgraph_read_status(virtual_device_t *dev, uint32_t addr)
+{
+    if (!dev->pgraph_worker.running) {
+        virtual_pgraph_d3d_flush(dev);
+        return 0;
+    }
+
+    return virtual_pgraph_worker_busy(dev) ? (1 << NV3_PGRAPH_STATUS_BUSY) : 0;
+}
+
+void virtual_pgraph_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PGRAPH", NV3_PGRAPH_START, NV3_PGRAPH_REGISTER_END, virtual_pgraph_read_register,
+        virtual_pgraph_write_register);
+    virtual_mmio_register(dev, "PGRAPH_INTR", NV3_PGRAPH_INTR_0, NV3_PGRAPH_INTR_1, virtual_pgraph_read_intr,
+        virtual_pgraph_write_intr);
+    virtual_mmio_register(dev, "PGRAPH_STATUS", NV3_PGRAPH_STATUS, NV3_PGRAPH_STATUS, virtual_pgraph_read_status,
+        virtual_write_ignore);
+
+    for (uint32_t class_id = 0; class_id <= NV3_LAST_VALID_GRAPHICS_OBJECT_ID; class_id++) {
+        uint32_t start = NV3_PGRAPH_START + (class_id << NV3_PGRAPH_CLASS_SHIFT);
+
+        if (virtual_pgraph_classes[class_id].method)
+            virtual_mmio_register(dev, virtual_pgraph_classes[class_id].name, start,
+                start + NV3_OBJECT_SUBMIT_METHOD, NULL, virtual_pgraph_class_write);
+    }
+}
+
+// The engine is idle by now, virtual_pci_reset syncs with it before dropping any memory
+void virtual_pgraph_reset(virtual_device_t *dev)
+{
+    memset(&dev->pgraph, 0, sizeof(dev->pgraph));
+
+    // No clipping until a clip rectangle is set
+    *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_XMAX) = 0x7FFF;
+    *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_YMAX) = 0x7FFF;
+
+    // Plain copies until a ROP, plane mask or chroma key is set
+    *virtual_reg(dev, NV3_PGRAPH_ROP3) = NV3_PGRAPH_ROP3_SRCCOPY;
+    *virtual_reg(dev, NV3_PGRAPH_PLANE_MASK) = 0xFFFFFFFF;
+    *virtual_reg(dev, NV3_PGRAPH_CHROMA_KEY) = 0;
+
+    // Expanded glyphs go stale with everything else, and queued triangles are dropped
+    dev->glyphs.generation++;
+    dev->d3d.count = 0;
+
+    dev->vblank.base_ns = virtual_time_now(dev);
+    dev->vblank.frame = 0;
+}
+
+// Stop the worker and free what the classes allocated for themselves
+void virtual_pgraph_cleanup(virtual_device_t *dev)
+{
+    virtual_pgraph_worker_stop(dev);
+    nv_scaler_cleanup(&dev->scaled_scaler);
+    nv_scaler_cleanup(&dev->stretch_scaler);
+    free(dev->d3d.bins);
+    free(dev->d3d.bin_starts);
+    memset(&dev->d3d, 0, sizeof(dev->d3d));
+}
+
+bool virtual_pgraph_get_stats(virtual_pgraph_stats_t *stats)
+{
+    virtual_device_t *dev = virtual_device_current();
+
+    if (!dev)
+        return false;
+
+    virtual_pgraph_sync(dev);
+    stats->methods = dev->pgraph.methods;
+    stats->software_methods = dev->pgraph.software_methods;
+    stats->pixels = dev->pgraph.pixels;
+    stats->glyphs = dev->pgraph.glyphs;
+    stats->glyph_cache_hits = dev->pgraph.glyph_cache_hits;
+    stats->triangles = dev->pgraph.triangles;
+    stats->triangle_batches = dev->pgraph.triangle_batches;
+    stats->notifies = dev->pgraph.notifies;
+    stats->queue_stalls = dev->pgraph_worker.stalls;
+    stats->pipelined = dev->pgraph_worker.running;
+    return true;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+//
+// Filename: virtual_pgraph.h
+// Purpose: Internal interface of the virtual PGRAPH rasteriser
+//
+// The classes draw into a surface: a PGRAPH buffer (BOFFSET/BPITCH/BPIXEL) resolved against VRAM and cut down so
+// that every pixel inside it lies in VRAM. Rectangles are half-open. Anything big enough is split into tiles of
+// whole rows and spread over the thread pool; tiles never share a row, so they need no synchronisation.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "core/pci/virtual.h"
+
+#define VIRTUAL_PGRAPH_TILE_ROWS        16
+#define VIRTUAL_PGRAPH_PARALLEL_BYTES   (256 * 1024)    // Draws smaller than this stay on the calling thread
+
+typedef struct virtual_surface_s {
+    uint8_t *base;
+    uint32_t pitch;                                 // Bytes per row
+    uint32_t format;                                // NV3_PGRAPH_BPIXEL_FORMAT_*
+    uint32_t bytes;                                 // Bytes per pixel
+    int32_t width;
+    int32_t height;
+} virtual_surface_t;
+
+typedef struct virtual_rect_s {
+    int32_t x0, y0;
+    int32_t x1, y1;                                 // Exclusive
+} virtual_rect_t;
+
+typedef void (*virtual_tile_task_t)(void *arg, int32_t y0, int32_t y1);
+
+// Pattern and solid source rows hold a whole number of periods of every pattern shape at every depth (64 pixels of
+// 4 bytes at most), plus a copy of their first vector at the end so a vector load can run off the end of a period
+#define VIRTUAL_PATTERN_ROW_BYTES       256
+#define VIRTUAL_PATTERN_ROW_SIZE        (VIRTUAL_PATTERN_ROW_BYTES + 16)
+#define VIRTUAL_PATTERN_MAX_ROWS        64
+
+struct virtual_draw_s;
+
+// A ROP3 kernel combines a span of pattern, source and destination bytes into the destination, then keeps the bits
+// the plane mask and chroma key protect. pattern (and src, for fills) is a repeating row read from offset phase; for
+// copies src streams along with dst and never overlaps it.
+typedef void (*virtual_rop_kernel_t)(const struct virtual_draw_s *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes);
+
+// Everything a draw needs, resolved once before any pixel is touched
+typedef struct virtual_draw_s {
+    virtual_surface_t surface;
+    virtual_rect_t clip;
+    uint32_t rop;
+    virtual_rop_kernel_t kernel;
+    bool overlap_safe;                              // The kernel copes with src overlapping dst (it's a memmove)
+    uint32_t plane_mask;                            // Replicated across 32 bits like a fill pattern
+    uint32_t chroma_key;                            // Replicated
+    uint32_t chroma_bits;                           // Replicated pixel bits compared with the key, 0 if it's off
+    uint32_t pattern_rows;                          // Distinct pattern rows (1, 8 or 64)
+    uint8_t source[VIRTUAL_PATTERN_ROW_SIZE];       // Solid source colour, for fills
+    uint8_t pattern[VIRTUAL_PATTERN_MAX_ROWS][VIRTUAL_PATTERN_ROW_SIZE];
+} virtual_draw_t;
+
+// Points and sizes in methods are packed as y in 31:16, x in 15:0
+static inline int32_t virtual_point_x(uint32_t point)
+{
+    return (int16_t)(point & 0xFFFF);
+}
+
+static inline int32_t virtual_point_y(uint32_t point)
+{
+    return (int16_t)(point >> 16);
+}
+
+static inline uint8_t *virtual_surface_pixel(const virtual_surface_t *surface, int32_t x, int32_t y)
+{
+    return surface->base + (size_t)y * surface->pitch + (size_t)x * surface->bytes;
+}
+
+static inline bool virtual_rect_intersect(virtual_rect_t *rect, const virtual_rect_t *clip)
+{
+    rect->x0 = (rect->x0 > clip->x0) ? rect->x0 : clip->x0;
+    rect->y0 = (rect->y0 > clip->y0) ? rect->y0 : clip->y0;
+    rect->x1 = (rect->x1 < clip->x1) ? rect->x1 : clip->x1;
+    rect->y1 = (rect->y1 < clip->y1) ? rect->y1 : clip->y1;
+    return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+static inline bool virtual_rect_contains(const virtual_rect_t *rect, int32_t x, int32_t y)
+{
+    return x >= rect->x0 && x < rect->x1 && y >= rect->y0 && y < rect->y1;
+}
+
+// A pixel value repeated across 32 bits, so spans can be filled a dword or a vector at a time
+static inline uint32_t virtual_pixel_replicate(uint32_t color, uint32_t bytes)
+{
+    switch (bytes) {
+        case 1:
+            return (color & 0xFF) * 0x01010101;
+        case 2:
+            return (color & 0xFFFF) * 0x00010001;
+        default:
+            return color;
+    }
+}
+
+static inline void virtual_pixel_store(uint8_t *pixel, uint32_t color, uint32_t bytes)
+{
+    memcpy(pixel, &color, bytes);                   // Little endian, the low bytes are the pixel
+}
+
+// 16 bytes as 4 32-bit, 8 16-bit or 16 8-bit lanes
+typedef uint32_t virtual_vec4_t __attribute__((vector_size(16)));
+typedef uint16_t virtual_vec8_t __attribute__((vector_size(16)));
+typedef uint8_t virtual_vec16_t __attribute__((vector_size(16)));
+
+// Fill a span of bytes with a replicated pixel value, 64 bytes per iteration in 16 byte vectors
+
+static inline void virtual_span_fill(uint8_t *dst, uint32_t bytes, uint32_t pattern)
+{
+    virtual_vec4_t vec = { pattern, pattern, pattern, pattern };
+
+    for (; bytes >= 64; bytes -= 64, dst += 64) {
+        memcpy(dst, &vec, 16);
+        memcpy(dst + 16, &vec, 16);
+        memcpy(dst + 32, &vec, 16);
+        memcpy(dst + 48, &vec, 16);
+    }
+
+    for (; bytes >= 16; bytes -= 16, dst += 16)
+        memcpy(dst, &vec, 16);
+
+    for (; bytes >= 4; bytes -= 4, dst += 4)
+        memcpy(dst, &pattern, 4);
+
+    memcpy(dst, &pattern, bytes);
+}
+
+static inline const uint8_t *virtual_draw_pattern(const virtual_draw_t *draw, int32_t y)
+{
+    return draw->pattern[y & (draw->pattern_rows - 1)];
+}
+
+static inline uint32_t virtual_draw_phase(const virtual_draw_t *draw, int32_t x)
+{
+    return (x * draw->surface.bytes) & (VIRTUAL_PATTERN_ROW_BYTES - 1);
+}
+
+// Run the draw's kernel over count pixels of row y starting at x
+static inline void virtual_draw_span(const virtual_draw_t *draw, const uint8_t *src, int32_t x, int32_t y,
+    uint32_t count)
+{
+    draw->kernel(draw, virtual_surface_pixel(&draw->surface, x, y), src, virtual_draw_pattern(draw, y),
+        virtual_draw_phase(draw, x), count * draw->surface.bytes);
+}
+
+// Surfaces and tiling (virtual_pgraph.c)
+nv_pixel_format_t virtual_pgraph_pixel_format(uint32_t format);
+bool virtual_pgraph_surface(virtual_device_t *dev, virtual_surface_t *surface);
+void virtual_pgraph_clip(virtual_device_t *dev, const virtual_surface_t *surface, virtual_rect_t *clip);
+void virtual_pgraph_run_tiles(const virtual_rect_t *rect, uint32_t bytes, virtual_tile_task_t task, void *arg);
+void virtual_pgraph_dispatch(virtual_device_t *dev, uint32_t class_id, uint32_t method, uint32_t data);
+
+// Method queue in front of the worker thread (virtual_pgraph_worker.c)
+void virtual_pgraph_submit(virtual_device_t *dev, uint32_t class_id, uint32_t method, uint32_t data);
+
+// Pixel pipeline and draw setup (virtual_pgraph_rop.c)
+bool virtual_pgraph_begin_draw(virtual_device_t *dev, virtual_draw_t *draw, bool copy, uint32_t color);
+void virtual_pgraph_class02_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class03_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class04_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class06_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+// 2D drawing classes (virtual_pgraph_2d.c)
+void virtual_pgraph_fill(virtual_device_t *dev, virtual_rect_t rect, uint32_t color);
+void virtual_pgraph_class05_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class07_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class08_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class09_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class0a_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class10_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class1c_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+// GDI text (virtual_pgraph_text.c)
+void virtual_pgraph_class0c_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+// Memory to memory format (virtual_pgraph_m2mf.c)
+void virtual_pgraph_class0d_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+// Scaled and stretched images (virtual_pgraph_scale.c)
+void virtual_pgraph_class0e_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class15_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+
+// Direct3D triangles and points with a zeta buffer (virtual_pgraph_d3d.c)
+void virtual_pgraph_d3d_flush(virtual_device_t *dev);
+void virtual_pgraph_class17_method(virtual_device_t *dev, uint32_t method, uint32_t data);
+void virtual_pgraph_class18_method(virtual_device_t *dev, uint32_t method, uint32_t data);
@@ -0,0 +1,281 @@
+//
+// Filename: virtual_pgraph_2d.c
+// Purpose: Virtual NV3 PGRAPH 2D classes: clip (0x05), rectangle (0x07), point (0x08), line (0x09), lin (0x0A),
+//          blit (0x10) and image in memory (0x1C)
+//
+// Everything is drawn through the ROP3 kernel the draw selected (virtual_pgraph_rop.c), with the class's colour as
+// the source, or the surface itself for blits. Rectangles and blits go a span at a time and are tiled over the thread
+// pool once they're big enough. Points and lines are drawn pixel by pixel, clipped per pixel, on the calling thread.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+//
+// Rectangle fills
+//
+
+typedef struct virtual_fill_s {
+    const virtual_draw_t *draw;
+    virtual_rect_t rect;
+} virtual_fill_t;
+
+static void virtual_pgraph_fill_rows(void *arg, int32_t y0, int32_t y1)
+{
+    virtual_fill_t *fill = arg;
+
+    for (int32_t y = y0; y < y1; y++)
+        virtual_draw_span(fill->draw, fill->draw->source, fill->rect.x0, y, fill->rect.x1 - fill->rect.x0);
+}
+
+void virtual_pgraph_fill(virtual_device_t *dev, virtual_rect_t rect, uint32_t color)
+{
+    virtual_draw_t draw;
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, false, color) || !virtual_rect_intersect(&rect, &draw.clip))
+        return;
+
+    virtual_fill_t fill = { &draw, rect };
+    virtual_pgraph_run_tiles(&rect, draw.surface.bytes, virtual_pgraph_fill_rows, &fill);
+    dev->pgraph.pixels += (uint64_t)(rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+}
+
+//
+// Blits
+//
+
+typedef struct virtual_blit_s {
+    const virtual_draw_t *draw;
+    virtual_rect_t dst;
+    int32_t dx;                                     // Source minus destination
+    int32_t dy;
+    bool bounce;                                    // Copy each source row aside before running the kernel
+} virtual_blit_t;
+
+static void virtual_pgraph_blit_row(virtual_blit_t *blit, int32_t y)
+{
+    const virtual_draw_t *draw = blit->draw;
+    uint32_t count = blit->dst.x1 - blit->dst.x0;
+    const uint8_t *src = virtual_surface_pixel(&draw->surface, blit->dst.x0 + blit->dx, y + blit->dy);
+    uint8_t row[NV3_PGRAPH_BPITCH_MAX + 1];
+
+    if (blit->bounce) {
+        memcpy(row, src, count * draw->surface.bytes);
+        src = row;
+    }
+
+    virtual_draw_span(draw, src, blit->dst.x0, y, count);
+}
+
+static void virtual_pgraph_blit_rows(void *arg, int32_t y0, int32_t y1)
+{
+    virtual_blit_t *blit = arg;
+
+    // Copying downwards over itself has to start at the bottom
+    if (blit->dy < 0) {
+        for (int32_t y = y1 - 1; y >= y0; y--)
+            virtual_pgraph_blit_row(blit, y);
+    } else {
+        for (int32_t y = y0; y < y1; y++)
+            virtual_pgraph_blit_row(blit, y);
+    }
+}
+
+static void virtual_pgraph_blit(virtual_device_t *dev, uint32_t point_in, uint32_t point_out, uint32_t size)
+{
+    virtual_draw_t draw;
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, true, 0))
+        return;
+
+    int32_t x = virtual_point_x(point_out), y = virtual_point_y(point_out);
+    virtual_rect_t dst = { x, y, x + (int32_t)(size & 0xFFFF), y + (int32_t)(size >> 16) };
+    virtual_blit_t blit = { &draw, dst, virtual_point_x(point_in) - x, virtual_point_y(point_in) - y, false };
+
+    // The destination is clipped, the source only has to stay on the surface
+    virtual_rect_t src_bounds = { -blit.dx, -blit.dy, draw.surface.width - blit.dx, draw.surface.height - blit.dy };
+
+    if (!virtual_rect_intersect(&blit.dst, &draw.clip) || !virtual_rect_intersect(&blit.dst, &src_bounds))
+        return;
+
+    // Only a blit along a row can overlap within a span. Kernels other than a plain memmove read and write as they go,
+    // so they get a copy of the source.
+    blit.bounce = (blit.dy == 0 && !draw.overlap_safe);
+
+    // Tiles can only run in parallel when no tile reads rows another one writes
+    int32_t src_y0 = blit.dst.y0 + blit.dy, src_y1 = blit.dst.y1 + blit.dy;
+
+    if (src_y1 <= blit.dst.y0 || src_y0 >= blit.dst.y1)
+        virtual_pgraph_run_tiles(&blit.dst, draw.surface.bytes, virtual_pgraph_blit_rows, &blit);
+    else
+        virtual_pgraph_blit_rows(&blit, blit.dst.y0, blit.dst.y1);
+
+    dev->pgraph.pixels += (uint64_t)(blit.dst.x1 - blit.dst.x0) * (blit.dst.y1 - blit.dst.y0);
+}
+
+//
+// Points and lines
+//
+
+static void virtual_pgraph_point(virtual_device_t *dev, uint32_t point, uint32_t color)
+{
+    virtual_draw_t draw;
+    int32_t x = virtual_point_x(point), y = virtual_point_y(point);
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, false, color))
+        return;
+
+    if (virtual_rect_contains(&draw.clip, x, y)) {
+        virtual_draw_span(&draw, draw.source, x, y, 1);
+        dev->pgraph.pixels++;
+    }
+}
+
+// Bresenham from start to end, both included, or both left out for a lin
+static void virtual_pgraph_line(virtual_device_t *dev, uint32_t start, uint32_t end, uint32_t color, bool lin)
+{
+    virtual_draw_t draw;
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, false, color))
+        return;
+
+    int32_t x = virtual_point_x(start), y = virtual_point_y(start);
+    int32_t x1 = virtual_point_x(end), y1 = virtual_point_y(end);
+    int32_t dx = (x1 > x) ? x1 - x : x - x1, sx = (x1 > x) ? 1 : -1;
+    int32_t dy = (y1 > y) ? y - y1 : y1 - y, sy = (y1 > y) ? 1 : -1;
+    int32_t error = dx + dy;
+    int32_t steps = ((dx > -dy) ? dx : -dy) + 1;
+
+    for (int32_t step = 0; step < steps; step++) {
+        bool endpoint = (step == 0 || step == steps - 1);
+
+        if (!(lin && endpoint) && virtual_rect_contains(&draw.clip, x, y)) {
+            virtual_draw_span(&draw, draw.source, x, y, 1);
+            dev->pgraph.pixels++;
+        }
+
+        int32_t error2 = 2 * error;
+
+        if (error2 >= dy) {
+            error += dy;
+            x += sx;
+        }
+
+        if (error2 <= dx) {
+            error += dx;
+            y += sy;
+        }
+    }
+}
+
+//
+// Methods
+//
+
+void virtual_pgraph_class05_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS05_CLIP_SET_POINT:
+            dev->pgraph.clip_point = data;
+            break;
+        case NV3_CLASS05_CLIP_SET_SIZE: {
+            int32_t x = virtual_point_x(dev->pgraph.clip_point), y = virtual_point_y(dev->pgraph.clip_point);
+
+            *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_XMIN) = x;
+            *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_XMAX) = x + (int32_t)(data & 0xFFFF);
+            *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_YMIN) = y;
+            *virtual_reg(dev, NV3_PGRAPH_ABS_UCLIP_YMAX) = y + (int32_t)(data >> 16);
+            break;
+        }
+    }
+}
+
+void virtual_pgraph_class07_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method == NV3_CLASS07_RECTANGLE_SET_COLOR) {
+        dev->pgraph.rect_color = data;
+    } else if (method >= NV3_CLASS07_RECTANGLE_START && method <= NV3_CLASS07_RECTANGLE_END) {
+        if (!(method & 4)) {
+            dev->pgraph.rect_point = data;
+        } else {
+            int32_t x = virtual_point_x(dev->pgraph.rect_point), y = virtual_point_y(dev->pgraph.rect_point);
+            virtual_rect_t rect = { x, y, x + (int32_t)(data & 0xFFFF), y + (int32_t)(data >> 16) };
+
+            virtual_pgraph_fill(dev, rect, dev->pgraph.rect_color);
+        }
+    }
+}
+
+void virtual_pgraph_class08_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method == NV3_CLASS08_POINT_SET_COLOR)
+        dev->pgraph.point_color = data;
+    else if (method >= NV3_CLASS08_POINT_START && method <= NV3_CLASS08_POINT_END)
+        virtual_pgraph_point(dev, data, dev->pgraph.point_color);
+}
+
+static void virtual_pgraph_line_method(virtual_device_t *dev, uint32_t method, uint32_t data, bool lin)
+{
+    if (method == NV3_CLASS09_LINE_SET_COLOR) {
+        dev->pgraph.line_color = data;
+    } else if (method >= NV3_CLASS09_LINE_START && method <= NV3_CLASS09_LINE_END) {
+        if (!(method & 4))
+            dev->pgraph.line_start = data;
+        else
+            virtual_pgraph_line(dev, dev->pgraph.line_start, data, dev->pgraph.line_color, lin);
+    } else if (method >= NV3_CLASS09_POLYLINE_START && method <= NV3_CLASS09_POLYLINE_END) {
+        // The first point of a polyline only sets where it starts
+        if (method == NV3_CLASS09_POLYLINE_START || !dev->pgraph.polyline_started)
+            dev->pgraph.polyline_started = true;
+        else
+            virtual_pgraph_line(dev, dev->pgraph.polyline_last, data, dev->pgraph.line_color, lin);
+
+        dev->pgraph.polyline_last = data;
+    }
+}
+
+void virtual_pgraph_class09_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    virtual_pgraph_line_method(dev, method, data, false);
+}
+
+void virtual_pgraph_class0a_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    virtual_pgraph_line_method(dev, method, data, true);
+}
+
+void virtual_pgraph_class10_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS10_BLIT_POINT_IN:
+            dev->pgraph.blit_in = data;
+            break;
+        case NV3_CLASS10_BLIT_POINT_OUT:
+            dev->pgraph.blit_out = data;
+            break;
+        case NV3_CLASS10_BLIT_SIZE:
+            virtual_pgraph_blit(dev, dev->pgraph.blit_in, dev->pgraph.blit_out, data);
+            break;
+    }
+}
+
+// Image in memory sets up the destination buffer
+void virtual_pgraph_class1c_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS1C_IMAGE_SET_FORMAT:
+            *virtual_reg(dev, NV3_PGRAPH_BPIXEL) = (*virtual_reg(dev, NV3_PGRAPH_BPIXEL) & ~0xF) | (data & 0xF);
+            break;
+        case NV3_CLASS1C_IMAGE_SET_PITCH:
+            *virtual_reg(dev, NV3_PGRAPH_BPITCH(0)) = data;
+            break;
+        case NV3_CLASS1C_IMAGE_SET_OFFSET:
+            *virtual_reg(dev, NV3_PGRAPH_BOFFSET(0)) = data;
+            break;
+    }
+}
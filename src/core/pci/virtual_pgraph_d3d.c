@@ -0,0 +1,756 @@
+//
+// Filename: virtual_pgraph_d3d.c
+// Purpose: Virtual NV3 PGRAPH Direct3D 5 triangles (class 0x17) and points (0x18) with a zeta buffer
+//
+// Triangles are set up as soon as they're submitted: the vertices are snapped to 1/16 pixel, the three edge
+// functions are built with the top-left fill rule folded into their constants, and every attribute becomes a plane
+// over the screen. They're drawn a batch at a time, when the batch fills up or before anything that could see the
+// result: a method of another class, or a read of the PGRAPH status or interrupts.
+//
+// A batch is binned into square tiles, each holding the triangles that touch it in submission order, and the tiles
+// are spread over the thread pool, neighbours together. No pixel is in two tiles, so tiles never synchronise and
+// every pixel still sees its triangles in order. Within a tile, each edge is first tested against the corners of the
+// triangle's part of the tile: a triangle entirely outside one edge is skipped, and an edge the whole part is inside
+// drops out of the per pixel test. Whatever's left is evaluated 4 pixels at a time in vectors.
+//
+// When NV3_PGRAPH_DEBUG_3_EARLY_ZABORT is set, the depth test runs before texturing and shading and pixels that fail
+// it are never shaded; otherwise, like the hardware's late test, every covered pixel is shaded and the test only
+// decides what gets written. The pixels written are the same either way.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_D3D_TILE_SHIFT      5
+#define VIRTUAL_D3D_TILE_SIZE       (1 << VIRTUAL_D3D_TILE_SHIFT)   // Pixels, square
+#define VIRTUAL_D3D_GUARD_BAND      8192.0f         // Vertices further from the origin than this aren't drawn
+#define VIRTUAL_D3D_LANES           4
+
+// Attribute planes, in virtual_d3d_triangle_t.planes
+#define VIRTUAL_D3D_Z               0
+#define VIRTUAL_D3D_R               1
+#define VIRTUAL_D3D_G               2
+#define VIRTUAL_D3D_B               3
+#define VIRTUAL_D3D_UW              4
+#define VIRTUAL_D3D_VW              5
+#define VIRTUAL_D3D_RHW             6
+
+typedef int32_t virtual_d3d_ivec_t __attribute__((vector_size(16)));
+typedef float virtual_d3d_fvec_t __attribute__((vector_size(16)));
+
+static const virtual_d3d_ivec_t virtual_d3d_lane = { 0, 1, 2, 3 };
+static const virtual_d3d_fvec_t virtual_d3d_lane_f = { 0.0f, 1.0f, 2.0f, 3.0f };
+
+// The zeta buffer, resolved like the colour buffer
+typedef struct virtual_zeta_s {
+    uint8_t *base;
+    uint32_t pitch;
+    int32_t width;
+    int32_t height;
+} virtual_zeta_t;
+
+// Everything a batch's tiles share
+typedef struct virtual_d3d_raster_s {
+    const virtual_d3d_batch_t *batch;
+    virtual_surface_t surface;
+    virtual_zeta_t zeta;
+    bool zeta_valid;
+    bool early_zabort;
+    nv_pixel_convert_t pack;                        // X8R8G8B8 to the surface's format
+    virtual_rect_t region;                          // What the tiles cover
+    uint32_t tiles_x;
+    const uint8_t *vram;
+    uint64_t pixels;                                // Written, summed over the tiles
+} virtual_d3d_raster_t;
+
+static const uint32_t virtual_d3d_texel_bytes[16] = {
+    [NV3_PGRAPH_BPIXEL_FORMAT_Y8] = 1,
+    [NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5] = 2,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5] = 2,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X8R8G8B8] = 4,
+};
+
+static inline float virtual_d3d_float(uint32_t bits)
+{
+    float value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline bool virtual_d3d_any(virtual_d3d_ivec_t mask)
+{
+    return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+static inline virtual_d3d_fvec_t virtual_d3d_splat(float value)
+{
+    return (virtual_d3d_fvec_t){ value, value, value, value };
+}
+
+// Clamp to [0, max], NaNs to 0
+static inline virtual_d3d_fvec_t virtual_d3d_clamp(virtual_d3d_fvec_t value, float max)
+{
+    virtual_d3d_fvec_t limit = virtual_d3d_splat(max);
+    virtual_d3d_ivec_t above = (value > limit);
+
+    return (virtual_d3d_fvec_t)((((virtual_d3d_ivec_t)value & (value > virtual_d3d_splat(0.0f))) & ~above)
+        | ((virtual_d3d_ivec_t)limit & above));
+}
+
+// Round to the nearest integer, halves away from zero; value has to fit
+static inline int32_t virtual_d3d_round(float value)
+{
+    return (int32_t)((value < 0.0f) ? value - 0.5f : value + 0.5f);
+}
+
+// Which of size texels (a power of two) coordinate t falls in, wrapping around
+static inline uint32_t virtual_d3d_wrap(float t, uint32_t size)
+{
+    float scaled = t * size;
+    int32_t texel;
+
+    // Written so that NaNs fail as well
+    if (!(scaled > -1e9f && scaled < 1e9f))
+        return 0;
+
+    texel = (int32_t)scaled;
+    texel -= (scaled < texel);
+    return (uint32_t)texel & (size - 1);
+}
+
+//
+// Triangle setup
+//
+
+static void virtual_d3d_plane(float plane[3], float f0, float f1, float f2, float ex1, float ey1, float ex2,
+    float ey2, float area)
+{
+    float d1 = f1 - f0, d2 = f2 - f0;
+
+    plane[0] = f0;
+    plane[1] = (d1 * ey2 - d2 * ey1) / area;
+    plane[2] = (d2 * ex1 - d1 * ex2) / area;
+}
+
+// Set up the triangle whose vertex indices are in 3:0, 7:4 and 11:8, and queue it
+static void virtual_pgraph_d3d_triangle(virtual_device_t *dev, uint32_t indices)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    virtual_d3d_batch_t *batch = &dev->d3d;
+    const uint32_t *vertex[3];
+    int32_t x[3], y[3];                             // 1/16 pixels
+
+    for (uint32_t i = 0; i < 3; i++) {
+        vertex[i] = state->d3d_vertices[(indices >> (i * 4)) & 0xF];
+
+        float sx = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_SX / 4]);
+        float sy = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_SY / 4]);
+
+        // Written so that NaNs fail as well
+        if (!(sx > -VIRTUAL_D3D_GUARD_BAND && sx < VIRTUAL_D3D_GUARD_BAND && sy > -VIRTUAL_D3D_GUARD_BAND
+            && sy < VIRTUAL_D3D_GUARD_BAND)) {
+            nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: Triangle vertex (%f, %f) is outside the guard band\n",
+                sx, sy);
+            return;
+        }
+
+        x[i] = virtual_d3d_round(sx * 16.0f);
+        y[i] = virtual_d3d_round(sy * 16.0f);
+    }
+
+    // Positive is clockwise on screen
+    int64_t area = (int64_t)(x[1] - x[0]) * (y[2] - y[0]) - (int64_t)(x[2] - x[0]) * (y[1] - y[0]);
+    uint32_t cull = (state->d3d_control >> NV3_D3D_CONTROL_CULL) & 3;
+
+    if (!area || (cull == NV3_D3D_CULL_CW && area > 0) || (cull == NV3_D3D_CULL_CCW && area < 0))
+        return;
+
+    // Everything below wants the vertices clockwise
+    if (area < 0) {
+        const uint32_t *swap_vertex = vertex[1];
+        int32_t swap_x = x[1], swap_y = y[1];
+
+        vertex[1] = vertex[2], x[1] = x[2], y[1] = y[2];
+        vertex[2] = swap_vertex, x[2] = swap_x, y[2] = swap_y;
+        area = -area;
+    }
+
+    virtual_d3d_triangle_t *tri = &batch->triangles[batch->count];
+    int32_t min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t j = (i + 1) % 3;
+        int32_t dx = x[j] - x[i], dy = y[j] - y[i];
+
+        // The edge from vertex i to j, positive on the inside. Pixels exactly on an edge are only drawn if it's a
+        // top or a left edge.
+        tri->edge_a[i] = -dy * 16;
+        tri->edge_b[i] = dx * 16;
+        tri->edge_c[i] = (int64_t)dy * x[i] - (int64_t)dx * y[i];
+
+        if (!((dy == 0 && dx > 0) || dy < 0))
+            tri->edge_c[i]--;
+
+        min_x = (x[i] < min_x) ? x[i] : min_x;
+        max_x = (x[i] > max_x) ? x[i] : max_x;
+        min_y = (y[i] < min_y) ? y[i] : min_y;
+        max_y = (y[i] > max_y) ? y[i] : max_y;
+    }
+
+    // Pixel centres are on whole coordinates
+    tri->x0 = (min_x + 15) >> 4;
+    tri->y0 = (min_y + 15) >> 4;
+    tri->x1 = (max_x >> 4) + 1;
+    tri->y1 = (max_y >> 4) + 1;
+
+    if (tri->x0 >= tri->x1 || tri->y0 >= tri->y1)
+        return;
+
+    float ex1 = (x[1] - x[0]) / 16.0f, ey1 = (y[1] - y[0]) / 16.0f;
+    float ex2 = (x[2] - x[0]) / 16.0f, ey2 = (y[2] - y[0]) / 16.0f;
+    float area_f = area / 256.0f;
+    float f[VIRTUAL_D3D_ATTRIBUTES][3];
+
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t color = vertex[i][NV3_CLASS17_D3D5_TLVERTEX_COLOR / 4];
+        float rhw = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_RHW / 4]);
+
+        f[VIRTUAL_D3D_Z][i] = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_SZ / 4]);
+        f[VIRTUAL_D3D_R][i] = (color >> 16) & 0xFF;
+        f[VIRTUAL_D3D_G][i] = (color >> 8) & 0xFF;
+        f[VIRTUAL_D3D_B][i] = color & 0xFF;
+
+        // Texture coordinates are interpolated over w and divided back per pixel, for perspective
+        f[VIRTUAL_D3D_UW][i] = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_TU / 4]) * rhw;
+        f[VIRTUAL_D3D_VW][i] = virtual_d3d_float(vertex[i][NV3_CLASS17_D3D5_TLVERTEX_TV / 4]) * rhw;
+        f[VIRTUAL_D3D_RHW][i] = rhw;
+    }
+
+    for (uint32_t i = 0; i < VIRTUAL_D3D_ATTRIBUTES; i++)
+        virtual_d3d_plane(tri->planes[i], f[i][0], f[i][1], f[i][2], ex1, ey1, ex2, ey2, area_f);
+
+    tri->origin_x = x[0] / 16.0f;
+    tri->origin_y = y[0] / 16.0f;
+    tri->control = state->d3d_control;
+    tri->texture_offset = state->d3d_texture_offset;
+    tri->texture_format = state->d3d_texture_format;
+
+    state->triangles++;
+
+    if (++batch->count == VIRTUAL_D3D_BATCH_SIZE)
+        virtual_pgraph_d3d_flush(dev);
+}
+
+//
+// Pixels
+//
+
+// The depth test, as a mask of the lanes that pass
+static inline virtual_d3d_ivec_t virtual_d3d_ztest(uint32_t func, virtual_d3d_ivec_t z, virtual_d3d_ivec_t old)
+{
+    switch (func) {
+        case NV3_D3D_ZFUNC_NEVER:
+            return (virtual_d3d_ivec_t){ 0 };
+        case NV3_D3D_ZFUNC_LESS:
+            return z < old;
+        case NV3_D3D_ZFUNC_EQUAL:
+            return z == old;
+        case NV3_D3D_ZFUNC_LESSEQUAL:
+            return z <= old;
+        case NV3_D3D_ZFUNC_GREATER:
+            return z > old;
+        case NV3_D3D_ZFUNC_NOTEQUAL:
+            return z != old;
+        case NV3_D3D_ZFUNC_GREATEREQUAL:
+            return z >= old;
+        default:
+            return (virtual_d3d_ivec_t){ -1, -1, -1, -1 };
+    }
+}
+
+// A 5 or 6 bit channel widened to 8 bits, as the pixel library does
+#define VIRTUAL_D3D_WIDEN5(c)   (((c) << 3) | ((c) >> 2))
+#define VIRTUAL_D3D_WIDEN6(c)   (((c) << 2) | ((c) >> 4))
+
+// A texel as X8R8G8B8. Textures wrap; the format has already been checked.
+static inline uint32_t virtual_d3d_texel(const uint8_t *vram, uint32_t offset, uint32_t format, float u, float v)
+{
+    uint32_t color_format = (format >> NV3_CLASS17_D3D5_TEXTURE_FORMAT_COLOR) & 0xF;
+    uint32_t width_log2 = (format >> NV3_CLASS17_D3D5_TEXTURE_FORMAT_WIDTH_LOG2) & 0xF;
+    uint32_t height_log2 = (format >> NV3_CLASS17_D3D5_TEXTURE_FORMAT_HEIGHT_LOG2) & 0xF;
+    uint32_t bytes = virtual_d3d_texel_bytes[color_format];
+    uint32_t tx = virtual_d3d_wrap(u, 1u << width_log2), ty = virtual_d3d_wrap(v, 1u << height_log2);
+    uint32_t addr = ((offset + ((ty << width_log2) + tx) * bytes) & (VIRTUAL_VRAM_SIZE - 1)) & ~(bytes - 1);
+    uint32_t c = 0;
+
+    memcpy(&c, vram + addr, bytes);
+
+    switch (color_format) {
+        case NV3_PGRAPH_BPIXEL_FORMAT_Y8:
+            return c * 0x010101;
+        case NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5:
+            return VIRTUAL_D3D_WIDEN5((c >> 11) & 0x1F) << 16 | VIRTUAL_D3D_WIDEN6((c >> 5) & 0x3F) << 8
+                | VIRTUAL_D3D_WIDEN5(c & 0x1F);
+        case NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5:
+            return VIRTUAL_D3D_WIDEN5((c >> 10) & 0x1F) << 16 | VIRTUAL_D3D_WIDEN5((c >> 5) & 0x1F) << 8
+                | VIRTUAL_D3D_WIDEN5(c & 0x1F);
+        default:
+            return c & 0xFFFFFF;
+    }
+}
+
+// Draw the part of the triangle inside rect, which is inside the region
+static void virtual_d3d_rasterize(virtual_d3d_raster_t *raster, const virtual_d3d_triangle_t *tri, virtual_rect_t rect,
+    uint64_t *pixels)
+{
+    virtual_rect_t bounds = { tri->x0, tri->y0, tri->x1, tri->y1 };
+
+    if (!virtual_rect_intersect(&rect, &bounds))
+        return;
+
+    int32_t width = rect.x1 - rect.x0, height = rect.y1 - rect.y0;
+    int32_t base[3], a[3], b[3];
+
+    // Each edge is linear, so its extremes over the rectangle are at the corners. Edges that cross the rectangle stay
+    // small enough across it to fit in 32 bits.
+    for (uint32_t i = 0; i < 3; i++) {
+        int64_t e = (int64_t)tri->edge_a[i] * rect.x0 + (int64_t)tri->edge_b[i] * rect.y0 + tri->edge_c[i];
+        int64_t ax = (int64_t)tri->edge_a[i] * (width - 1), by = (int64_t)tri->edge_b[i] * (height - 1);
+        int64_t max = e + ((ax > 0) ? ax : 0) + ((by > 0) ? by : 0);
+        int64_t min = e + ((ax < 0) ? ax : 0) + ((by < 0) ? by : 0);
+
+        if (max < 0)
+            return;
+
+        if (min >= 0) {
+            base[i] = a[i] = b[i] = 0;
+        } else {
+            base[i] = (int32_t)e;
+            a[i] = tri->edge_a[i];
+            b[i] = tri->edge_b[i];
+        }
+    }
+
+    uint32_t zfunc = (tri->control >> NV3_D3D_CONTROL_ZFUNC) & 0xF;
+    bool zwrite = (tri->control >> NV3_D3D_CONTROL_ZWRITE_ENABLE) & 1;
+    bool textured = (tri->control >> NV3_D3D_CONTROL_TEXTURE_ENABLE) & 1;
+    bool early = raster->early_zabort;
+    const virtual_surface_t *surface = &raster->surface;
+    virtual_d3d_ivec_t a0 = { a[0], a[0], a[0], a[0] }, a1 = { a[1], a[1], a[1], a[1] };
+    virtual_d3d_ivec_t a2 = { a[2], a[2], a[2], a[2] };
+    uint32_t colors[VIRTUAL_D3D_TILE_SIZE + VIRTUAL_D3D_LANES];
+    int32_t covered[VIRTUAL_D3D_TILE_SIZE + VIRTUAL_D3D_LANES];
+    uint8_t packed[VIRTUAL_D3D_TILE_SIZE * 4 + 16];
+
+    if (!zfunc || !raster->zeta_valid)
+        zfunc = 0, zwrite = false;
+
+    if (textured && !virtual_d3d_texel_bytes[(tri->texture_format >> NV3_CLASS17_D3D5_TEXTURE_FORMAT_COLOR) & 0xF])
+        textured = false;
+
+    for (int32_t y = rect.y0; y < rect.y1; y++) {
+        int32_t dy = y - rect.y0;
+        virtual_d3d_ivec_t e0 = (base[0] + b[0] * dy) + a0 * virtual_d3d_lane;
+        virtual_d3d_ivec_t e1 = (base[1] + b[1] * dy) + a1 * virtual_d3d_lane;
+        virtual_d3d_ivec_t e2 = (base[2] + b[2] * dy) + a2 * virtual_d3d_lane;
+        float px = rect.x0 - tri->origin_x, py = y - tri->origin_y;
+        uint16_t *zrow = (zfunc) ? (uint16_t *)(raster->zeta.base + (size_t)y * raster->zeta.pitch) + rect.x0 : NULL;
+        virtual_d3d_fvec_t f[VIRTUAL_D3D_ATTRIBUTES], df[VIRTUAL_D3D_ATTRIBUTES];
+        bool any = false;
+
+        for (uint32_t i = 0; i < VIRTUAL_D3D_ATTRIBUTES; i++) {
+            const float *plane = tri->planes[i];
+
+            f[i] = virtual_d3d_splat(plane[0] + plane[1] * px + plane[2] * py) + plane[1] * virtual_d3d_lane_f;
+            df[i] = virtual_d3d_splat(plane[1] * VIRTUAL_D3D_LANES);
+        }
+
+        for (int32_t x = 0; x < width; x += VIRTUAL_D3D_LANES) {
+            virtual_d3d_ivec_t mask = ((e0 | e1 | e2) >= 0) & (virtual_d3d_lane + x < width);
+            virtual_d3d_ivec_t ztest = mask;
+            virtual_d3d_ivec_t z = { 0 };
+
+            memset(&covered[x], 0, sizeof(virtual_d3d_ivec_t));
+
+            if (virtual_d3d_any(mask)) {
+                if (zfunc) {
+                    virtual_d3d_fvec_t zf = f[VIRTUAL_D3D_Z] * virtual_d3d_splat(65535.0f) + virtual_d3d_splat(0.5f);
+                    virtual_d3d_ivec_t old = { 0 };
+
+                    z = __builtin_convertvector(virtual_d3d_clamp(zf, 65535.0f), virtual_d3d_ivec_t);
+
+                    for (uint32_t lane = 0; lane < VIRTUAL_D3D_LANES; lane++)
+                        old[lane] = (mask[lane]) ? zrow[x + lane] : 0;
+
+                    ztest = mask & virtual_d3d_ztest(zfunc, z, old);
+
+                    if (early)
+                        mask = ztest;
+                }
+
+                if (virtual_d3d_any(mask)) {
+                    virtual_d3d_fvec_t r = f[VIRTUAL_D3D_R], g = f[VIRTUAL_D3D_G], bl = f[VIRTUAL_D3D_B];
+
+                    if (textured) {
+                        virtual_d3d_fvec_t w = 1.0f / f[VIRTUAL_D3D_RHW];
+                        virtual_d3d_fvec_t u = f[VIRTUAL_D3D_UW] * w, v = f[VIRTUAL_D3D_VW] * w;
+                        virtual_d3d_fvec_t tr = { 0 }, tg = { 0 }, tb = { 0 };
+
+                        for (uint32_t lane = 0; lane < VIRTUAL_D3D_LANES; lane++) {
+                            if (!mask[lane])
+                                continue;
+
+                            uint32_t texel = virtual_d3d_texel(raster->vram, tri->texture_offset,
+                                tri->texture_format, u[lane], v[lane]);
+
+                            tr[lane] = (texel >> 16) & 0xFF;
+                            tg[lane] = (texel >> 8) & 0xFF;
+                            tb[lane] = texel & 0xFF;
+                        }
+
+                        // Modulate
+                        r = r * tr * (1.0f / 255.0f);
+                        g = g * tg * (1.0f / 255.0f);
+                        bl = bl * tb * (1.0f / 255.0f);
+                    }
+
+                    virtual_d3d_fvec_t half = virtual_d3d_splat(0.5f);
+                    virtual_d3d_ivec_t color =
+                        __builtin_convertvector(virtual_d3d_clamp(r + half, 255.0f), virtual_d3d_ivec_t) << 16
+                        | __builtin_convertvector(virtual_d3d_clamp(g + half, 255.0f), virtual_d3d_ivec_t) << 8
+                        | __builtin_convertvector(virtual_d3d_clamp(bl + half, 255.0f), virtual_d3d_ivec_t);
+
+                    mask &= ztest;
+                    memcpy(&colors[x], &color, sizeof(color));
+                    memcpy(&covered[x], &mask, sizeof(mask));
+                    any |= virtual_d3d_any(mask);
+
+                    if (zwrite) {
+                        for (uint32_t lane = 0; lane < VIRTUAL_D3D_LANES; lane++) {
+                            if (mask[lane])
+                                zrow[x + lane] = (uint16_t)z[lane];
+                        }
+                    }
+                }
+            }
+
+            e0 += a0 * VIRTUAL_D3D_LANES;
+            e1 += a1 * VIRTUAL_D3D_LANES;
+            e2 += a2 * VIRTUAL_D3D_LANES;
+
+            for (uint32_t i = 0; i < VIRTUAL_D3D_ATTRIBUTES; i++)
+                f[i] += df[i];
+        }
+
+        if (!any)
+            continue;
+
+        // Pack the row into the surface format and write the runs of covered pixels
+        uint8_t *dst = virtual_surface_pixel(surface, rect.x0, y);
+
+        raster->pack(packed, colors, width);
+
+        for (int32_t x = 0; x < width;) {
+            int32_t start = x;
+
+            while (x < width && covered[x])
+                x++;
+
+            if (x > start) {
+                memcpy(dst + start * surface->bytes, packed + start * surface->bytes, (x - start) * surface->bytes);
+                *pixels += x - start;
+            }
+
+            while (x < width && !covered[x])
+                x++;
+        }
+    }
+}
+
+static void virtual_d3d_tile(void *arg, uint32_t index)
+{
+    virtual_d3d_raster_t *raster = arg;
+    const virtual_d3d_batch_t *batch = raster->batch;
+    int32_t x0 = raster->region.x0 + (int32_t)(index % raster->tiles_x) * VIRTUAL_D3D_TILE_SIZE;
+    int32_t y0 = raster->region.y0 + (int32_t)(index / raster->tiles_x) * VIRTUAL_D3D_TILE_SIZE;
+    virtual_rect_t tile = { x0, y0, x0 + VIRTUAL_D3D_TILE_SIZE, y0 + VIRTUAL_D3D_TILE_SIZE };
+    uint64_t pixels = 0;
+
+    virtual_rect_intersect(&tile, &raster->region);
+
+    for (uint32_t i = batch->bin_starts[index]; i < batch->bin_starts[index + 1]; i++)
+        virtual_d3d_rasterize(raster, &batch->triangles[batch->bins[i]], tile, &pixels);
+
+    if (pixels)
+        __atomic_fetch_add(&raster->pixels, pixels, __ATOMIC_RELAXED);
+}
+
+//
+// Batches
+//
+
+// Resolve the zeta buffer against VRAM, 16 bits per pixel
+static bool virtual_pgraph_zeta(virtual_device_t *dev, virtual_zeta_t *zeta)
+{
+    uint32_t offset = *virtual_reg(dev, NV3_PGRAPH_BOFFSET(NV3_PGRAPH_ZETA_BUFFER)) & (VIRTUAL_VRAM_SIZE - 2);
+    uint32_t pitch = *virtual_reg(dev, NV3_PGRAPH_BPITCH(NV3_PGRAPH_ZETA_BUFFER)) & NV3_PGRAPH_BPITCH_MAX & ~1;
+
+    if (!pitch)
+        return false;
+
+    zeta->base = (uint8_t *)dev->vram + offset;
+    zeta->pitch = pitch;
+    zeta->width = pitch / 2;
+    zeta->height = (VIRTUAL_VRAM_SIZE - offset) / pitch;
+    return true;
+}
+
+static bool virtual_d3d_grow(uint32_t **array, uint32_t *size, uint32_t needed)
+{
+    if (needed <= *size)
+        return true;
+
+    uint32_t *grown = realloc(*array, needed * sizeof(uint32_t));
+
+    if (!grown)
+        return false;
+
+    *array = grown;
+    *size = needed;
+    return true;
+}
+
+// Draw every queued triangle
+void virtual_pgraph_d3d_flush(virtual_device_t *dev)
+{
+    virtual_d3d_batch_t *batch = &dev->d3d;
+    virtual_d3d_raster_t raster = { batch };
+    uint32_t count = batch->count;
+
+    if (!count)
+        return;
+
+    batch->count = 0;
+
+    if (!virtual_pgraph_surface(dev, &raster.surface))
+        return;
+
+    virtual_rect_t clip;
+
+    virtual_pgraph_clip(dev, &raster.surface, &clip);
+    raster.zeta_valid = virtual_pgraph_zeta(dev, &raster.zeta);
+    raster.early_zabort = (*virtual_reg(dev, NV3_PGRAPH_DEBUG_3) >> NV3_PGRAPH_DEBUG_3_EARLY_ZABORT) & 1;
+    raster.pack = nv_pixel_get_converter(virtual_pgraph_pixel_format(raster.surface.format),
+        NV_PIXEL_FORMAT_X8R8G8B8);
+    raster.vram = (const uint8_t *)dev->vram;
+
+    // Cut every triangle down to what it can draw, and the region down to what they cover
+    virtual_rect_t zeta_bounds = { 0, 0, raster.zeta.width, raster.zeta.height };
+    bool empty = true;
+    uint64_t area = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        virtual_d3d_triangle_t *tri = &batch->triangles[i];
+        virtual_rect_t bounds = { tri->x0, tri->y0, tri->x1, tri->y1 };
+        bool visible = virtual_rect_intersect(&bounds, &clip);
+
+        if (visible && raster.zeta_valid && ((tri->control >> NV3_D3D_CONTROL_ZFUNC) & 0xF))
+            visible = virtual_rect_intersect(&bounds, &zeta_bounds);
+
+        if (!visible)
+            bounds.x1 = bounds.x0, bounds.y1 = bounds.y0;
+
+        tri->x0 = bounds.x0, tri->y0 = bounds.y0, tri->x1 = bounds.x1, tri->y1 = bounds.y1;
+
+        if (!visible)
+            continue;
+
+        if (empty) {
+            raster.region = bounds;
+            empty = false;
+        } else {
+            raster.region.x0 = (bounds.x0 < raster.region.x0) ? bounds.x0 : raster.region.x0;
+            raster.region.y0 = (bounds.y0 < raster.region.y0) ? bounds.y0 : raster.region.y0;
+            raster.region.x1 = (bounds.x1 > raster.region.x1) ? bounds.x1 : raster.region.x1;
+            raster.region.y1 = (bounds.y1 > raster.region.y1) ? bounds.y1 : raster.region.y1;
+        }
+
+        area += (uint64_t)(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0);
+    }
+
+    dev->pgraph.triangle_batches++;
+
+    if (empty)
+        return;
+
+    raster.tiles_x = (raster.region.x1 - raster.region.x0 + VIRTUAL_D3D_TILE_SIZE - 1) >> VIRTUAL_D3D_TILE_SHIFT;
+
+    uint32_t tiles_y = (raster.region.y1 - raster.region.y0 + VIRTUAL_D3D_TILE_SIZE - 1) >> VIRTUAL_D3D_TILE_SHIFT;
+    uint32_t tiles = raster.tiles_x * tiles_y;
+
+    if (!virtual_d3d_grow(&batch->bin_starts, &batch->bin_starts_size, tiles + 1)) {
+        nv_log_error(NV_LOG_VIRTUAL, "Virtual PGRAPH: Out of memory binning %u tiles\n", tiles);
+        return;
+    }
+
+    // Count each tile's triangles, then turn the counts into where each tile's group ends
+    memset(batch->bin_starts, 0, (tiles + 1) * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        const virtual_d3d_triangle_t *tri = &batch->triangles[i];
+
+        if (tri->x0 >= tri->x1)
+            continue;
+
+        uint32_t tx0 = (tri->x0 - raster.region.x0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t tx1 = (tri->x1 - 1 - raster.region.x0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t ty0 = (tri->y0 - raster.region.y0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t ty1 = (tri->y1 - 1 - raster.region.y0) >> VIRTUAL_D3D_TILE_SHIFT;
+
+        for (uint32_t ty = ty0; ty <= ty1; ty++) {
+            for (uint32_t tx = tx0; tx <= tx1; tx++)
+                batch->bin_starts[ty * raster.tiles_x + tx]++;
+        }
+    }
+
+    for (uint32_t tile = 1; tile < tiles; tile++)
+        batch->bin_starts[tile] += batch->bin_starts[tile - 1];
+
+    batch->bin_starts[tiles] = batch->bin_starts[tiles - 1];
+
+    if (!virtual_d3d_grow(&batch->bins, &batch->bins_size, batch->bin_starts[tiles])) {
+        nv_log_error(NV_LOG_VIRTUAL, "Virtual PGRAPH: Out of memory binning %u triangles\n", count);
+        return;
+    }
+
+    // Filled backwards from each group's end, which leaves the ends as starts and the groups in submission order
+    for (uint32_t i = count; i-- > 0;) {
+        const virtual_d3d_triangle_t *tri = &batch->triangles[i];
+
+        if (tri->x0 >= tri->x1)
+            continue;
+
+        uint32_t tx0 = (tri->x0 - raster.region.x0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t tx1 = (tri->x1 - 1 - raster.region.x0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t ty0 = (tri->y0 - raster.region.y0) >> VIRTUAL_D3D_TILE_SHIFT;
+        uint32_t ty1 = (tri->y1 - 1 - raster.region.y0) >> VIRTUAL_D3D_TILE_SHIFT;
+
+        for (uint32_t ty = ty0; ty <= ty1; ty++) {
+            for (uint32_t tx = tx0; tx <= tx1; tx++)
+                batch->bins[--batch->bin_starts[ty * raster.tiles_x + tx]] = i;
+        }
+    }
+
+    if (area * raster.surface.bytes < VIRTUAL_PGRAPH_PARALLEL_BYTES) {
+        for (uint32_t tile = 0; tile < tiles; tile++)
+            virtual_d3d_tile(&raster, tile);
+    } else {
+        nv_threadpool_run_local(virtual_d3d_tile, &raster, tiles);
+    }
+
+    dev->pgraph.pixels += raster.pixels;
+}
+
+//
+// Points
+//
+
+static void virtual_pgraph_point_zeta(virtual_device_t *dev, uint32_t point, uint32_t depth)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    int32_t x = virtual_point_x(point), y = virtual_point_y(point);
+    uint32_t zfunc = (state->point_zeta_control >> NV3_D3D_CONTROL_ZFUNC) & 0xF;
+    bool zwrite = (state->point_zeta_control >> NV3_D3D_CONTROL_ZWRITE_ENABLE) & 1;
+    virtual_surface_t surface;
+    virtual_zeta_t zeta;
+    virtual_rect_t clip;
+
+    if (!virtual_pgraph_surface(dev, &surface))
+        return;
+
+    virtual_pgraph_clip(dev, &surface, &clip);
+
+    if (!virtual_rect_contains(&clip, x, y))
+        return;
+
+    if (zfunc && virtual_pgraph_zeta(dev, &zeta)) {
+        virtual_rect_t zeta_bounds = { 0, 0, zeta.width, zeta.height };
+
+        if (!virtual_rect_contains(&zeta_bounds, x, y))
+            return;
+
+        uint16_t *z = (uint16_t *)(zeta.base + (size_t)y * zeta.pitch) + x;
+        virtual_d3d_ivec_t pass = virtual_d3d_ztest(zfunc, (virtual_d3d_ivec_t){ (int32_t)(depth & 0xFFFF) },
+            (virtual_d3d_ivec_t){ *z });
+
+        if (!pass[0])
+            return;
+
+        if (zwrite)
+            *z = depth & 0xFFFF;
+    }
+
+    uint8_t packed[16];
+    uint32_t color = state->point_zeta_color & 0xFFFFFF;
+
+    nv_pixel_convert(packed, virtual_pgraph_pixel_format(surface.format), &color, NV_PIXEL_FORMAT_X8R8G8B8, 1);
+    memcpy(virtual_surface_pixel(&surface, x, y), packed, surface.bytes);
+    state->pixels++;
+}
+
+//
+// Methods
+//
+
+void virtual_pgraph_class17_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS17_D3D5_TEXTURE_OFFSET:
+            dev->pgraph.d3d_texture_offset = data;
+            break;
+        case NV3_CLASS17_D3D5_TEXTURE_FORMAT:
+            dev->pgraph.d3d_texture_format = data;
+            break;
+        case NV3_CLASS17_D3D5_CONTROL:
+            dev->pgraph.d3d_control = data;
+            break;
+        default:
+            if (method >= NV3_CLASS17_D3D5_TLVERTEX_START && method <= NV3_CLASS17_D3D5_TLVERTEX_END) {
+                uint32_t offset = method - NV3_CLASS17_D3D5_TLVERTEX_START;
+
+                dev->pgraph.d3d_vertices[offset / NV3_CLASS17_D3D5_TLVERTEX_SIZE]
+                    [(offset % NV3_CLASS17_D3D5_TLVERTEX_SIZE) / 4] = data;
+            } else if (method >= NV3_CLASS17_D3D5_DRAW_START && method <= NV3_CLASS17_D3D5_DRAW_END) {
+                virtual_pgraph_d3d_triangle(dev, data);
+            }
+            break;
+    }
+}
+
+void virtual_pgraph_class18_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS18_POINT_ZETA_CONTROL:
+            dev->pgraph.point_zeta_control = data;
+            break;
+        case NV3_CLASS18_POINT_ZETA_COLOR:
+            dev->pgraph.point_zeta_color = data;
+            break;
+        default:
+            if (method >= NV3_CLASS18_POINT_ZETA_START && method <= NV3_CLASS18_POINT_ZETA_END) {
+                if (!(method & 4))
+                    dev->pgraph.point_zeta_point = data;
+                else
+                    virtual_pgraph_point_zeta(dev, dev->pgraph.point_zeta_point, data);
+            }
+            break;
+    }
+}
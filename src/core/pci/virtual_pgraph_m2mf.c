@@ -0,0 +1,133 @@
+//
+// Filename: virtual_pgraph_m2mf.c
+// Purpose: Virtual NV3 PGRAPH memory to memory format class (0x0D)
+//
+// A transfer copies line_count lines of VRAM from one place to another, converting each line from the input format
+// to the output format with the core's pixel conversion library (nvcore_pixel.c). The converter is picked once per
+// transfer, and big transfers are tiled over the thread pool like any other draw. Transfers that would run off the
+// end of VRAM, or that would convert the same line over and over because a pitch is 0, are dropped; transfers that
+// overlap themselves are undefined, as they are on the real thing.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+typedef struct virtual_m2mf_s {
+    nv_pixel_convert_t convert;
+    const uint8_t *src;
+    uint8_t *dst;
+    uint32_t src_pitch;
+    uint32_t dst_pitch;
+    uint32_t count;                                 // Pixels per line
+} virtual_m2mf_t;
+
+static void virtual_pgraph_m2mf_rows(void *arg, int32_t y0, int32_t y1)
+{
+    virtual_m2mf_t *m2mf = arg;
+
+    for (int32_t y = y0; y < y1; y++)
+        m2mf->convert(m2mf->dst + (size_t)y * m2mf->dst_pitch, m2mf->src + (size_t)y * m2mf->src_pitch, m2mf->count);
+}
+
+// Whether lines of line_bytes at offset, pitch apart, all fit in VRAM
+static bool virtual_m2mf_in_vram(uint32_t offset, uint32_t pitch, uint32_t lines, uint32_t line_bytes)
+{
+    return (uint64_t)offset + (uint64_t)pitch * (lines - 1) + line_bytes <= VIRTUAL_VRAM_SIZE;
+}
+
+static void virtual_pgraph_m2mf(virtual_device_t *dev)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    uint32_t format_in = (state->m2mf_format >> NV3_CLASS0D_M2MF_FORMAT_IN) & 0xF;
+    uint32_t format_out = (state->m2mf_format >> NV3_CLASS0D_M2MF_FORMAT_OUT) & 0xF;
+    nv_pixel_format_t src_format = NV_PIXEL_FORMAT_Y8, dst_format = NV_PIXEL_FORMAT_Y8;   // Bytes, unless set
+
+    if (format_in || format_out) {
+        src_format = virtual_pgraph_pixel_format(format_in);
+        dst_format = virtual_pgraph_pixel_format(format_out);
+    }
+
+    virtual_m2mf_t m2mf = {
+        nv_pixel_get_converter(dst_format, src_format),
+        (const uint8_t *)dev->vram + (state->m2mf_offset_in & (VIRTUAL_VRAM_SIZE - 1)),
+        (uint8_t *)dev->vram + (state->m2mf_offset_out & (VIRTUAL_VRAM_SIZE - 1)),
+        state->m2mf_pitch_in,
+        state->m2mf_pitch_out,
+        state->m2mf_line_length,
+    };
+
+    uint32_t lines = state->m2mf_line_count;
+
+    if (!m2mf.convert) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: M2MF format 0x%08X not supported\n", state->m2mf_format);
+        return;
+    }
+
+    if (!m2mf.count || !lines)
+        return;
+
+    if (lines > VIRTUAL_VRAM_SIZE || (lines > 1 && (!m2mf.src_pitch || !m2mf.dst_pitch))) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: M2MF of %u lines with pitch %u in, %u out rejected\n", lines,
+            m2mf.src_pitch, m2mf.dst_pitch);
+        return;
+    }
+
+    uint32_t src_bytes = nv_pixel_format_bytes(src_format), dst_bytes = nv_pixel_format_bytes(dst_format);
+    uint32_t src_offset = m2mf.src - (const uint8_t *)dev->vram, dst_offset = m2mf.dst - (uint8_t *)dev->vram;
+
+    if ((uint64_t)m2mf.count * (src_bytes > dst_bytes ? src_bytes : dst_bytes) > VIRTUAL_VRAM_SIZE
+        || !virtual_m2mf_in_vram(src_offset, m2mf.src_pitch, lines, m2mf.count * src_bytes)
+        || !virtual_m2mf_in_vram(dst_offset, m2mf.dst_pitch, lines, m2mf.count * dst_bytes)) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: M2MF of %u lines of %u runs off the end of VRAM\n", lines,
+            m2mf.count);
+        return;
+    }
+
+    // Lines can only be converted in parallel if no line reads what another one writes
+    uint64_t src_end = src_offset + (uint64_t)m2mf.src_pitch * (lines - 1) + m2mf.count * src_bytes;
+    uint64_t dst_end = dst_offset + (uint64_t)m2mf.dst_pitch * (lines - 1) + m2mf.count * dst_bytes;
+    virtual_rect_t rect = { 0, 0, (int32_t)m2mf.count, (int32_t)lines };
+
+    if (src_end <= dst_offset || dst_end <= src_offset)
+        virtual_pgraph_run_tiles(&rect, dst_bytes, virtual_pgraph_m2mf_rows, &m2mf);
+    else
+        virtual_pgraph_m2mf_rows(&m2mf, 0, (int32_t)lines);
+
+    state->pixels += (uint64_t)m2mf.count * lines;
+}
+
+void virtual_pgraph_class0d_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS0D_M2MF_OFFSET_IN:
+            dev->pgraph.m2mf_offset_in = data;
+            break;
+        case NV3_CLASS0D_M2MF_OFFSET_OUT:
+            dev->pgraph.m2mf_offset_out = data;
+            break;
+        case NV3_CLASS0D_M2MF_PITCH_IN:
+            dev->pgraph.m2mf_pitch_in = data;
+            break;
+        case NV3_CLASS0D_M2MF_PITCH_OUT:
+            dev->pgraph.m2mf_pitch_out = data;
+            break;
+        case NV3_CLASS0D_M2MF_LINE_LENGTH_IN:
+            dev->pgraph.m2mf_line_length = data;
+            break;
+        case NV3_CLASS0D_M2MF_LINE_COUNT:
+            dev->pgraph.m2mf_line_count = data;
+            break;
+        case NV3_CLASS0D_M2MF_FORMAT:
+            dev->pgraph.m2mf_format = data;
+            break;
+        case NV3_CLASS0D_M2MF_BUFFER_NOTIFY:
+            virtual_pgraph_m2mf(dev);
+            break;
+    }
+}
@@ -0,0 +1,372 @@
+//
+// Filename: virtual_pgraph_rop.c
+// Purpose: Virtual NV3 PGRAPH pixel pipeline: ROP3 (class 0x02), chroma key (0x03), plane mask (0x04) and pattern
+//          (0x06), and draw setup
+//
+// Every pixel a drawing class emits goes through the same stages: the ROP3 combines pattern, source and destination,
+// then the plane mask and chroma key decide which of the result's bits are written. All of it happens in one pass
+// over the span, in a kernel chosen once per draw from what's enabled.
+//
+// A ROP3 code is the truth table of a boolean function of pattern, source and destination, indexed by
+// P << 2 | S << 1 | D. Being bitwise, the function is the same at every depth: only how the pattern and source rows
+// are laid out depends on the pixel size. There is a kernel for each of the 256 codes, generated by the preprocessor
+// from the code's truth table with every bit known at compile time, so each one reduces to a handful of vector ops
+// and never loads an operand it doesn't use. Each comes in two variants: a plain one, and a masked one for when the
+// plane mask or the chroma key is active. Without either, the codes that don't depend on the destination
+// (BLACKNESS, WHITENESS, SRCCOPY, PATCOPY) and DSTCOPY go to memset/memmove/fill paths instead.
+//
+// The pattern stage is free when the ROP ignores the pattern, since its rows are never even built. A solid source
+// either matches the chroma key or it doesn't, so for fills the key is settled once per draw and only blits compare
+// it per pixel.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_ROP_ROW_MASK    (VIRTUAL_PATTERN_ROW_BYTES - 1)
+
+// Whether a ROP3 code depends on each operand: does flipping it change any entry of the truth table
+#define VIRTUAL_ROP_USES_PATTERN(rop)   ((((rop) >> 4) ^ (rop)) & 0x0F)
+#define VIRTUAL_ROP_USES_SOURCE(rop)    ((((rop) >> 2) ^ (rop)) & 0x33)
+
+// The bits of a pixel that hold colour, and so take part in the chroma key comparison
+static const uint32_t virtual_pgraph_color_bits[16] = {
+    [NV3_PGRAPH_BPIXEL_FORMAT_Y8] = 0xFF,
+    [NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5] = 0xFFFF,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X1R5G5B5] = 0x7FFF,
+    [NV3_PGRAPH_BPIXEL_FORMAT_X8R8G8B8] = 0xFFFFFF,
+};
+
+// Which bits of 16 bytes of result get written: the plane mask, less every pixel whose source matches the key.
+// chroma_bytes is the pixel size if the key is on and 0 if it's off.
+static inline virtual_vec4_t virtual_rop_write_mask(virtual_vec4_t s, virtual_vec4_t plane, virtual_vec4_t key,
+    virtual_vec4_t bits, uint32_t chroma_bytes)
+{
+    virtual_vec4_t diff = (s ^ key) & bits;
+
+    switch (chroma_bytes) {
+        case 0:
+            return plane;
+        case 1:
+            return plane & (virtual_vec4_t)((virtual_vec16_t)diff != (virtual_vec16_t){ 0 });
+        case 2:
+            return plane & (virtual_vec4_t)((virtual_vec8_t)diff != (virtual_vec8_t){ 0 });
+        default:
+            return plane & (virtual_vec4_t)(diff != (virtual_vec4_t){ 0 });
+    }
+}
+
+//
+// Kernel generation. Each level splits the truth table on one operand (Shannon expansion) and drops the operand
+// altogether when both halves match. rop is a constant in every expansion, so all the conditions fold away.
+//
+
+#define VIRTUAL_ROP_D(f, d, zero)       ((f) == 0 ? (zero) : (f) == 1 ? ~(d) : (f) == 2 ? (d) : ~(zero))
+
+#define VIRTUAL_ROP_SD(f, s, d, zero)   ((((f) >> 2) == ((f) & 3)) ? VIRTUAL_ROP_D((f) & 3, d, zero) \
+    : (((s) & VIRTUAL_ROP_D((f) >> 2, d, zero)) | (~(s) & VIRTUAL_ROP_D((f) & 3, d, zero))))
+
+#define VIRTUAL_ROP_PSD(f, p, s, d, zero)   ((((f) >> 4) == ((f) & 15)) ? VIRTUAL_ROP_SD((f) & 15, s, d, zero) \
+    : (((p) & VIRTUAL_ROP_SD((f) >> 4, s, d, zero)) | (~(p) & VIRTUAL_ROP_SD((f) & 15, s, d, zero))))
+
+// Where the source of byte i of the span is: fills repeat a row like the pattern, copies stream it
+#define VIRTUAL_ROP_FILL_AT(phase, i)   (((phase) + (i)) & VIRTUAL_ROP_ROW_MASK)
+#define VIRTUAL_ROP_COPY_AT(phase, i)   (i)
+
+#define VIRTUAL_ROP_KERNEL(name, rop, source_at)                                                                \
+    static void name(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src, const uint8_t *pattern,     \
+        uint32_t phase, uint32_t bytes)                                                                         \
+    {                                                                                                           \
+        const virtual_vec4_t zero = { 0 };                                                                      \
+        uint32_t i = 0;                                                                                         \
+                                                                                                                \
+        for (; i + 16 <= bytes; i += 16) {                                                                      \
+            virtual_vec4_t p, s, d;                                                                             \
+                                                                                                                \
+            memcpy(&p, pattern + ((phase + i) & VIRTUAL_ROP_ROW_MASK), 16);                                    \
+            memcpy(&s, src + source_at(phase, i), 16);                                                          \
+            memcpy(&d, dst + i, 16);                                                                            \
+            d = VIRTUAL_ROP_PSD(rop, p, s, d, zero);                                                            \
+            memcpy(dst + i, &d, 16);                                                                            \
+        }                                                                                                       \
+                                                                                                                \
+        for (; i < bytes; i++) {                                                                                \
+            uint32_t p = pattern[(phase + i) & VIRTUAL_ROP_ROW_MASK], s = src[source_at(phase, i)], d = dst[i]; \
+                                                                                                                \
+            dst[i] = (uint8_t)VIRTUAL_ROP_PSD(rop, p, s, d, 0u);                                                \
+        }                                                                                                       \
+    }
+
+// The masked kernels work on whole pixels, so the tail goes through the same vector code with the operands padded.
+// The draw's state is copied into locals first: stores to dst could alias it, which would force a reload of every
+// field on every step.
+#define VIRTUAL_ROP_MASKED_STEP(rop, source_at, size)                                                           \
+    {                                                                                                           \
+        virtual_vec4_t p, s = zero, d = zero, write;                                                            \
+                                                                                                                \
+        memcpy(&p, pattern + ((phase + i) & VIRTUAL_ROP_ROW_MASK), 16);                                        \
+        memcpy(&s, src + source_at(phase, i), size);                                                            \
+        memcpy(&d, dst + i, size);                                                                              \
+        write = virtual_rop_write_mask(s, plane, key, bits, chroma_bytes);                                      \
+        d = (VIRTUAL_ROP_PSD(rop, p, s, d, zero) & write) | (d & ~write);                                       \
+        memcpy(dst + i, &d, size);                                                                              \
+    }
+
+#define VIRTUAL_ROP_MASKED_KERNEL(name, rop, source_at)                                                         \
+    static void name(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src, const uint8_t *pattern,     \
+        uint32_t phase, uint32_t bytes)                                                                         \
+    {                                                                                                           \
+        const virtual_vec4_t zero = { 0 };                                                                      \
+        const virtual_vec4_t plane = zero + draw->plane_mask;                                                   \
+        const virtual_vec4_t key = zero + draw->chroma_key;                                                     \
+        const virtual_vec4_t bits = zero + draw->chroma_bits;                                                   \
+        const uint32_t chroma_bytes = draw->chroma_bits ? draw->surface.bytes : 0;                              \
+        uint32_t i = 0;                                                                                         \
+                                                                                                                \
+        for (; i + 16 <= bytes; i += 16)                                                                        \
+            VIRTUAL_ROP_MASKED_STEP(rop, source_at, 16)                                                         \
+                                                                                                                \
+        if (i < bytes)                                                                                          \
+            VIRTUAL_ROP_MASKED_STEP(rop, source_at, bytes - i)                                                  \
+    }
+
+#define VIRTUAL_ROP_KERNELS(rop)                                                                                \
+    VIRTUAL_ROP_KERNEL(virtual_rop_fill_##rop, rop, VIRTUAL_ROP_FILL_AT)                                        \
+    VIRTUAL_ROP_KERNEL(virtual_rop_copy_##rop, rop, VIRTUAL_ROP_COPY_AT)                                        \
+    VIRTUAL_ROP_MASKED_KERNEL(virtual_rop_masked_fill_##rop, rop, VIRTUAL_ROP_FILL_AT)                          \
+    VIRTUAL_ROP_MASKED_KERNEL(virtual_rop_masked_copy_##rop, rop, VIRTUAL_ROP_COPY_AT)
+
+// Expand x once per code 0x00-0xFF
+#define VIRTUAL_ROP_ROW(x, h)   x(0x##h##0) x(0x##h##1) x(0x##h##2) x(0x##h##3) x(0x##h##4) x(0x##h##5)         \
+    x(0x##h##6) x(0x##h##7) x(0x##h##8) x(0x##h##9) x(0x##h##A) x(0x##h##B) x(0x##h##C) x(0x##h##D)             \
+    x(0x##h##E) x(0x##h##F)
+
+#define VIRTUAL_ROP_ALL(x)  VIRTUAL_ROP_ROW(x, 0) VIRTUAL_ROP_ROW(x, 1) VIRTUAL_ROP_ROW(x, 2)                    \
+    VIRTUAL_ROP_ROW(x, 3) VIRTUAL_ROP_ROW(x, 4) VIRTUAL_ROP_ROW(x, 5) VIRTUAL_ROP_ROW(x, 6)                     \
+    VIRTUAL_ROP_ROW(x, 7) VIRTUAL_ROP_ROW(x, 8) VIRTUAL_ROP_ROW(x, 9) VIRTUAL_ROP_ROW(x, A)                     \
+    VIRTUAL_ROP_ROW(x, B) VIRTUAL_ROP_ROW(x, C) VIRTUAL_ROP_ROW(x, D) VIRTUAL_ROP_ROW(x, E)                     \
+    VIRTUAL_ROP_ROW(x, F)
+
+VIRTUAL_ROP_ALL(VIRTUAL_ROP_KERNELS)
+
+#define VIRTUAL_ROP_FILL_ENTRY(rop)             virtual_rop_fill_##rop,
+#define VIRTUAL_ROP_COPY_ENTRY(rop)             virtual_rop_copy_##rop,
+#define VIRTUAL_ROP_MASKED_FILL_ENTRY(rop)      virtual_rop_masked_fill_##rop,
+#define VIRTUAL_ROP_MASKED_COPY_ENTRY(rop)      virtual_rop_masked_copy_##rop,
+
+static const virtual_rop_kernel_t virtual_rop_fill_kernels[256] = { VIRTUAL_ROP_ALL(VIRTUAL_ROP_FILL_ENTRY) };
+static const virtual_rop_kernel_t virtual_rop_copy_kernels[256] = { VIRTUAL_ROP_ALL(VIRTUAL_ROP_COPY_ENTRY) };
+static const virtual_rop_kernel_t virtual_rop_masked_fill_kernels[256] = {
+    VIRTUAL_ROP_ALL(VIRTUAL_ROP_MASKED_FILL_ENTRY)
+};
+static const virtual_rop_kernel_t virtual_rop_masked_copy_kernels[256] = {
+    VIRTUAL_ROP_ALL(VIRTUAL_ROP_MASKED_COPY_ENTRY)
+};
+
+//
+// Kernels for the codes that don't need the destination
+//
+
+static void virtual_rop_blackness(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+    memset(dst, 0x00, bytes);
+}
+
+static void virtual_rop_whiteness(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+    memset(dst, 0xFF, bytes);
+}
+
+static void virtual_rop_dstcopy(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+}
+
+// A solid source repeats every 4 bytes, so the dword at phase is the span's fill pattern
+static void virtual_rop_fill_srccopy(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+    uint32_t fill;
+
+    memcpy(&fill, src + phase, 4);
+    virtual_span_fill(dst, bytes, fill);
+}
+
+static void virtual_rop_copy_srccopy(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+    memmove(dst, src, bytes);
+}
+
+// Copy the repeating pattern row out in runs up to the end of the row
+static void virtual_rop_patcopy(const virtual_draw_t *draw, uint8_t *dst, const uint8_t *src,
+    const uint8_t *pattern, uint32_t phase, uint32_t bytes)
+{
+    while (bytes) {
+        uint32_t run = VIRTUAL_PATTERN_ROW_BYTES - phase;
+
+        if (run > bytes)
+            run = bytes;
+
+        memcpy(dst, pattern + phase, run);
+        dst += run;
+        bytes -= run;
+        phase = 0;
+    }
+}
+
+static virtual_rop_kernel_t virtual_rop_select(const virtual_draw_t *draw, bool copy)
+{
+    if (!draw->plane_mask)
+        return virtual_rop_dstcopy;
+
+    if (draw->plane_mask != 0xFFFFFFFF || draw->chroma_bits)
+        return copy ? virtual_rop_masked_copy_kernels[draw->rop] : virtual_rop_masked_fill_kernels[draw->rop];
+
+    switch (draw->rop) {
+        case NV3_PGRAPH_ROP3_BLACKNESS:
+            return virtual_rop_blackness;
+        case NV3_PGRAPH_ROP3_WHITENESS:
+            return virtual_rop_whiteness;
+        case NV3_PGRAPH_ROP3_DSTCOPY:
+            return virtual_rop_dstcopy;
+        case NV3_PGRAPH_ROP3_SRCCOPY:
+            return copy ? virtual_rop_copy_srccopy : virtual_rop_fill_srccopy;
+        case NV3_PGRAPH_ROP3_PATCOPY:
+            return virtual_rop_patcopy;
+        default:
+            return copy ? virtual_rop_copy_kernels[draw->rop] : virtual_rop_fill_kernels[draw->rop];
+    }
+}
+
+//
+// Draw setup
+//
+
+// Lay out the pattern (NV3_PGRAPH_PATTERN_*) as rows of surface pixels, one per distinct row of the shape. The
+// pattern is anchored to the surface origin and 1 bits take colour 1.
+static void virtual_pgraph_build_pattern(virtual_device_t *dev, virtual_draw_t *draw)
+{
+    uint32_t shape = *virtual_reg(dev, NV3_PGRAPH_PATTERN_SHAPE) & 0x3;
+    uint64_t bitmap = *virtual_reg(dev, NV3_PGRAPH_PATTERN_BITMAP_HIGH)
+        | (uint64_t)*virtual_reg(dev, NV3_PGRAPH_PATTERN_BITMAP_LOW) << 32;
+    uint32_t colors[2] = { *virtual_reg(dev, NV3_PGRAPH_PATTERN_COLOR_0_RGB),
+        *virtual_reg(dev, NV3_PGRAPH_PATTERN_COLOR_1_RGB) };
+    uint32_t bytes = draw->surface.bytes;
+    uint32_t width = 8;                             // Pixels before a row repeats
+
+    draw->pattern_rows = 8;
+
+    if (shape == NV3_PGRAPH_PATTERN_SHAPE_64X1)
+        width = 64, draw->pattern_rows = 1;
+    else if (shape == NV3_PGRAPH_PATTERN_SHAPE_1X64)
+        width = 1, draw->pattern_rows = 64;
+
+    for (uint32_t row = 0; row < draw->pattern_rows; row++) {
+        uint8_t *out = draw->pattern[row];
+
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t bit = (shape == NV3_PGRAPH_PATTERN_SHAPE_64X1) ? x
+                : (shape == NV3_PGRAPH_PATTERN_SHAPE_1X64) ? row : row * 8 + x;
+
+            virtual_pixel_store(out + x * bytes, colors[(bitmap >> bit) & 1], bytes);
+        }
+
+        // Every period divides the row, so doubling what's there keeps it repeating
+        for (uint32_t filled = width * bytes; filled < VIRTUAL_PATTERN_ROW_SIZE; filled *= 2) {
+            uint32_t size = (filled * 2 <= VIRTUAL_PATTERN_ROW_SIZE) ? filled : VIRTUAL_PATTERN_ROW_SIZE - filled;
+
+            memcpy(out + filled, out, size);
+        }
+    }
+}
+
+// Resolve the surface, clip and pixel pipeline for a draw and lay out the operands its kernel reads. copy selects
+// the kernels that stream the source, otherwise the source is color. Fails if nothing can be drawn.
+bool virtual_pgraph_begin_draw(virtual_device_t *dev, virtual_draw_t *draw, bool copy, uint32_t color)
+{
+    if (!virtual_pgraph_surface(dev, &draw->surface))
+        return false;
+
+    uint32_t bytes = draw->surface.bytes;
+    uint32_t chroma_key = *virtual_reg(dev, NV3_PGRAPH_CHROMA_KEY);
+
+    virtual_pgraph_clip(dev, &draw->surface, &draw->clip);
+
+    draw->rop = *virtual_reg(dev, NV3_PGRAPH_ROP3) & 0xFF;
+    draw->plane_mask = virtual_pixel_replicate(*virtual_reg(dev, NV3_PGRAPH_PLANE_MASK), bytes);
+    draw->chroma_key = virtual_pixel_replicate(chroma_key, bytes);
+    draw->chroma_bits = 0;
+
+    if (chroma_key & (1u << NV3_PGRAPH_CHROMA_KEY_ENABLE)) {
+        uint32_t bits = virtual_pgraph_color_bits[draw->surface.format];
+
+        // A solid source is either keyed out entirely or not at all
+        if (copy)
+            draw->chroma_bits = virtual_pixel_replicate(bits, bytes);
+        else if (!((color ^ chroma_key) & bits))
+            return false;
+    }
+
+    draw->kernel = virtual_rop_select(draw, copy);
+    draw->overlap_safe = (draw->kernel == virtual_rop_copy_srccopy || draw->kernel == virtual_rop_dstcopy);
+    draw->pattern_rows = 1;
+
+    if (VIRTUAL_ROP_USES_PATTERN(draw->rop))
+        virtual_pgraph_build_pattern(dev, draw);
+
+    if (!copy && VIRTUAL_ROP_USES_SOURCE(draw->rop))
+        virtual_span_fill(draw->source, VIRTUAL_PATTERN_ROW_SIZE, virtual_pixel_replicate(color, bytes));
+
+    return true;
+}
+
+//
+// Methods
+//
+
+void virtual_pgraph_class02_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method == NV3_CLASS02_ROP_SET_ROP)
+        *virtual_reg(dev, NV3_PGRAPH_ROP3) = data & 0xFF;
+}
+
+void virtual_pgraph_class03_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method == NV3_CLASS03_CHROMA_SET_COLOR)
+        *virtual_reg(dev, NV3_PGRAPH_CHROMA_KEY) = data;
+}
+
+void virtual_pgraph_class04_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method == NV3_CLASS04_PLANE_MASK_SET_MASK)
+        *virtual_reg(dev, NV3_PGRAPH_PLANE_MASK) = data;
+}
+
+void virtual_pgraph_class06_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS06_PATTERN_SET_SHAPE:
+            *virtual_reg(dev, NV3_PGRAPH_PATTERN_SHAPE) = data & 0x3;
+            break;
+        case NV3_CLASS06_PATTERN_SET_COLOR0:
+            *virtual_reg(dev, NV3_PGRAPH_PATTERN_COLOR_0_RGB) = data;
+            break;
+        case NV3_CLASS06_PATTERN_SET_COLOR1:
+            *virtual_reg(dev, NV3_PGRAPH_PATTERN_COLOR_1_RGB) = data;
+            break;
+        case NV3_CLASS06_PATTERN_SET_BITMAP0:
+            *virtual_reg(dev, NV3_PGRAPH_PATTERN_BITMAP_HIGH) = data;
+            break;
+        case NV3_CLASS06_PATTERN_SET_BITMAP1:
+            *virtual_reg(dev, NV3_PGRAPH_PATTERN_BITMAP_LOW) = data;
+            break;
+    }
+}
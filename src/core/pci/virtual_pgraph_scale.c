@@ -0,0 +1,316 @@
+//
+// Filename: virtual_pgraph_scale.c
+// Purpose: Virtual NV3 PGRAPH scaled image from memory (0x0E) and stretched image from CPU (0x15) classes
+//
+// Both resample through the core's separable scaler (nvcore_scale.c) and draw the result through the draw's ROP3
+// kernel, like a blit whose source row comes out of the scaler. The scaler's tables only depend on the image sizes
+// and steps, which don't change from frame to frame for video, so each class keeps its scaler in the device and only
+// rebuilds it when the mapping changes.
+//
+// Scaled images are read from VRAM in one go and tiled over the thread pool. Stretched images arrive a dword at a
+// time, so every source row is drawn as soon as it's complete; replicating pixels means it's scaled once and then
+// drawn for every output row that samples it.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_SCALE_MAX_SIZE      0x7FFF          // Largest output, in either direction
+
+// The scaler for an image, rebuilt only if the mapping differs from the last image's. The formats and sizes have to
+// be valid already.
+static const nv_scaler_t *virtual_pgraph_scaler(nv_scaler_t *scaler, nv_scale_filter_t filter,
+    nv_pixel_format_t dst_format, uint32_t dst_width, uint32_t dst_height, nv_pixel_format_t src_format,
+    uint32_t src_width, uint32_t src_height, int32_t u0, int32_t du, int32_t v0, int32_t dv)
+{
+    if (scaler->columns && scaler->filter == filter && scaler->dst_format == dst_format
+        && scaler->dst_width == dst_width && scaler->dst_height == dst_height && scaler->src_format == src_format
+        && scaler->src_width == src_width && scaler->src_height == src_height && scaler->u0 == u0 && scaler->du == du
+        && scaler->v0 == v0 && scaler->dv == dv)
+        return scaler;
+
+    if (!nv_scaler_init_steps(scaler, filter, dst_format, dst_width, dst_height, src_format, src_width, src_height,
+        u0, du, v0, dv))
+        return NULL;
+
+    return scaler;
+}
+
+// A class's own clip rectangle. Like the hardware, nothing is drawn until it's been set.
+static virtual_rect_t virtual_scale_clip(uint32_t point, uint32_t size)
+{
+    int32_t x = virtual_point_x(point), y = virtual_point_y(point);
+    virtual_rect_t clip = { x, y, x + (int32_t)(size & 0xFFFF), y + (int32_t)(size >> 16) };
+
+    return clip;
+}
+
+//
+// Scaled image from memory
+//
+
+typedef struct virtual_scaled_s {
+    const virtual_draw_t *draw;
+    const nv_scaler_t *scaler;
+    const uint8_t *src;
+    uint32_t src_pitch;
+    virtual_rect_t rect;                            // What's drawn, on the surface
+    int32_t x;                                      // Where output pixel (0, 0) is on the surface
+    int32_t y;
+} virtual_scaled_t;
+
+static void virtual_pgraph_scaled_rows(void *arg, int32_t y0, int32_t y1)
+{
+    virtual_scaled_t *scaled = arg;
+    uint32_t count = scaled->rect.x1 - scaled->rect.x0;
+    uint8_t row[NV3_PGRAPH_BPITCH_MAX + 1];
+
+    for (int32_t y = y0; y < y1; y++) {
+        nv_scaler_row(scaled->scaler, row, scaled->src, scaled->src_pitch, y - scaled->y,
+            scaled->rect.x0 - scaled->x, scaled->rect.x1 - scaled->x);
+        virtual_draw_span(scaled->draw, row, scaled->rect.x0, y, count);
+    }
+}
+
+static void virtual_pgraph_scaled_image(virtual_device_t *dev, uint32_t point_in)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    nv_pixel_format_t src_format = virtual_pgraph_pixel_format(state->scaled_format);
+    uint32_t src_width = state->scaled_in_size & 0xFFFF, src_height = state->scaled_in_size >> 16;
+    uint32_t src_pitch = state->scaled_in_pitch & 0xFFFF;
+    uint32_t src_offset = state->scaled_in_offset & (VIRTUAL_VRAM_SIZE - 1);
+    uint32_t dst_width = state->scaled_out_size & 0xFFFF, dst_height = state->scaled_out_size >> 16;
+    virtual_draw_t draw;
+
+    if (src_format == NV_PIXEL_FORMAT_COUNT || !src_width || !src_height || !dst_width || !dst_height
+        || dst_width > VIRTUAL_SCALE_MAX_SIZE || dst_height > VIRTUAL_SCALE_MAX_SIZE)
+        return;
+
+    if ((uint64_t)src_offset + (uint64_t)src_pitch * (src_height - 1)
+        + src_width * nv_pixel_format_bytes(src_format) > VIRTUAL_VRAM_SIZE) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: Scaled image source runs off the end of VRAM\n");
+        return;
+    }
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, true, 0))
+        return;
+
+    // Steps are 12.20 and the point 12.4; the scaler wants 16.16 positions of pixel centres
+    int32_t du = (int32_t)state->scaled_du_dx >> 4, dv = (int32_t)state->scaled_dv_dy >> 4;
+    int32_t u0 = virtual_point_x(point_in) * 4096 + du / 2 - 0x8000;
+    int32_t v0 = virtual_point_y(point_in) * 4096 + dv / 2 - 0x8000;
+    nv_pixel_format_t dst_format = virtual_pgraph_pixel_format(draw.surface.format);
+    const nv_scaler_t *scaler = virtual_pgraph_scaler(&dev->scaled_scaler, NV_SCALE_BILINEAR, dst_format,
+        dst_width, dst_height, src_format, src_width, src_height, u0, du, v0, dv);
+
+    if (!scaler)
+        return;
+
+    int32_t x = virtual_point_x(state->scaled_out_point), y = virtual_point_y(state->scaled_out_point);
+    virtual_rect_t clip = virtual_scale_clip(state->scaled_clip_point, state->scaled_clip_size);
+    virtual_scaled_t scaled = {
+        &draw, scaler, (const uint8_t *)dev->vram + src_offset, src_pitch,
+        { x, y, x + (int32_t)dst_width, y + (int32_t)dst_height }, x, y,
+    };
+
+    if (!virtual_rect_intersect(&scaled.rect, &clip) || !virtual_rect_intersect(&scaled.rect, &draw.clip))
+        return;
+
+    // Rows can only be drawn in parallel if none of them writes what another one reads
+    const uint8_t *dst_start = virtual_surface_pixel(&draw.surface, scaled.rect.x0, scaled.rect.y0);
+    const uint8_t *dst_end = virtual_surface_pixel(&draw.surface, scaled.rect.x1, scaled.rect.y1 - 1);
+    const uint8_t *src_end = scaled.src + (size_t)src_pitch * (src_height - 1)
+        + src_width * nv_pixel_format_bytes(src_format);
+
+    if (src_end <= dst_start || dst_end <= scaled.src)
+        virtual_pgraph_run_tiles(&scaled.rect, draw.surface.bytes, virtual_pgraph_scaled_rows, &scaled);
+    else
+        virtual_pgraph_scaled_rows(&scaled, scaled.rect.y0, scaled.rect.y1);
+
+    state->pixels += (uint64_t)(scaled.rect.x1 - scaled.rect.x0) * (scaled.rect.y1 - scaled.rect.y0);
+}
+
+//
+// Stretched image from CPU
+//
+
+static void virtual_pgraph_stretch_begin(virtual_device_t *dev, uint32_t point)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    uint32_t src_width = state->stretch_size_in & 0xFFFF, src_height = state->stretch_size_in >> 16;
+    uint64_t dx_du = state->stretch_dx_du, dy_dv = state->stretch_dy_dv;
+    virtual_surface_t surface;
+
+    state->stretch_active = false;
+
+    if (!virtual_pgraph_surface(dev, &surface) || !src_width || !src_height || !dx_du || !dy_dv)
+        return;
+
+    if (src_width * surface.bytes > sizeof(state->stretch_row)) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: Stretched image rows of %u pixels are too long\n", src_width);
+        return;
+    }
+
+    // The output covers every pixel any part of the source lands on
+    uint64_t dst_width = (src_width * dx_du + 0xFFFFF) >> 20, dst_height = (src_height * dy_dv + 0xFFFFF) >> 20;
+
+    if (dst_width > VIRTUAL_SCALE_MAX_SIZE || dst_height > VIRTUAL_SCALE_MAX_SIZE)
+        return;
+
+    // Steps are output pixels per source pixel in 12.20; the scaler wants source pixels per output pixel in 16.16.
+    // A step so small that the inverse doesn't fit is a shrink no image is large enough for.
+    if ((1ull << 36) / dx_du > INT32_MAX || (1ull << 36) / dy_dv > INT32_MAX) {
+        nv_log_debug(NV_LOG_VIRTUAL, "Virtual PGRAPH: Stretched image steps 0x%X, 0x%X are too small\n",
+            state->stretch_dx_du, state->stretch_dy_dv);
+        return;
+    }
+
+    int32_t du = (int32_t)((1ull << 36) / dx_du), dv = (int32_t)((1ull << 36) / dy_dv);
+    nv_pixel_format_t format = virtual_pgraph_pixel_format(surface.format);
+
+    if (!virtual_pgraph_scaler(&dev->stretch_scaler, NV_SCALE_NEAREST, format, dst_width, dst_height, format,
+        src_width, src_height, du / 2 - 0x8000, du, dv / 2 - 0x8000, dv))
+        return;
+
+    // Back to whole pixels, repacked as unsigned so a negative y doesn't get shifted
+    state->stretch_point = ((uint32_t)(virtual_point_y(point) >> 4) << 16)
+        | ((uint32_t)(virtual_point_x(point) >> 4) & 0xFFFF);
+    state->stretch_row_dwords = (src_width * surface.bytes + 3) / 4;
+    state->stretch_fill = 0;
+    state->stretch_line = 0;
+    state->stretch_next_y = 0;
+    state->stretch_active = true;
+}
+
+// Draw every output row that samples the source row just received
+static void virtual_pgraph_stretch_row(virtual_device_t *dev)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+    const nv_scaler_t *scaler = &dev->stretch_scaler;
+    uint32_t first = state->stretch_next_y;
+    virtual_draw_t draw;
+
+    while (state->stretch_next_y < scaler->dst_height
+        && scaler->rows[state->stretch_next_y].index0 == state->stretch_line)
+        state->stretch_next_y++;
+
+    if (first == state->stretch_next_y || !virtual_pgraph_begin_draw(dev, &draw, true, 0))
+        return;
+
+    // The surface has to stay in the format the image was set up for
+    if (virtual_pgraph_pixel_format(draw.surface.format) != scaler->dst_format)
+        return;
+
+    int32_t x = virtual_point_x(state->stretch_point), y = virtual_point_y(state->stretch_point);
+    virtual_rect_t clip = virtual_scale_clip(state->stretch_clip_point, state->stretch_clip_size);
+    virtual_rect_t rect = { x, y + (int32_t)first, x + (int32_t)scaler->dst_width, y + (int32_t)state->stretch_next_y };
+
+    if (!virtual_rect_intersect(&rect, &clip) || !virtual_rect_intersect(&rect, &draw.clip))
+        return;
+
+    uint32_t count = rect.x1 - rect.x0;
+    uint8_t span[NV3_PGRAPH_BPITCH_MAX + 1];
+
+    nv_scaler_span(scaler, span, state->stretch_row, state->stretch_row, 0, rect.x0 - x, rect.x1 - x);
+
+    for (int32_t row = rect.y0; row < rect.y1; row++)
+        virtual_draw_span(&draw, span, rect.x0, row, count);
+
+    state->pixels += (uint64_t)count * (rect.y1 - rect.y0);
+}
+
+static void virtual_pgraph_stretch_data(virtual_device_t *dev, uint32_t data)
+{
+    virtual_pgraph_state_t *state = &dev->pgraph;
+
+    if (!state->stretch_active)
+        return;
+
+    state->stretch_row[state->stretch_fill++] = data;
+
+    if (state->stretch_fill < state->stretch_row_dwords)
+        return;
+
+    virtual_pgraph_stretch_row(dev);
+    state->stretch_fill = 0;
+
+    if (++state->stretch_line == dev->stretch_scaler.src_height)
+        state->stretch_active = false;
+}
+
+//
+// Methods
+//
+
+void virtual_pgraph_class0e_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS0E_SCALED_COLOR_FORMAT:
+            dev->pgraph.scaled_format = data;
+            break;
+        case NV3_CLASS0E_SCALED_CLIP_POINT:
+            dev->pgraph.scaled_clip_point = data;
+            break;
+        case NV3_CLASS0E_SCALED_CLIP_SIZE:
+            dev->pgraph.scaled_clip_size = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_OUT_POINT:
+            dev->pgraph.scaled_out_point = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_OUT_SIZE:
+            dev->pgraph.scaled_out_size = data;
+            break;
+        case NV3_CLASS0E_SCALED_DELTA_DU_DX:
+            dev->pgraph.scaled_du_dx = data;
+            break;
+        case NV3_CLASS0E_SCALED_DELTA_DV_DY:
+            dev->pgraph.scaled_dv_dy = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_IN_SIZE:
+            dev->pgraph.scaled_in_size = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_IN_PITCH:
+            dev->pgraph.scaled_in_pitch = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_IN_OFFSET:
+            dev->pgraph.scaled_in_offset = data;
+            break;
+        case NV3_CLASS0E_SCALED_IMAGE_IN_POINT:
+            virtual_pgraph_scaled_image(dev, data);
+            break;
+    }
+}
+
+void virtual_pgraph_class15_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    switch (method) {
+        case NV3_CLASS15_STRETCHED_SIZE_IN:
+            dev->pgraph.stretch_size_in = data;
+            break;
+        case NV3_CLASS15_STRETCHED_DELTA_DX_DU:
+            dev->pgraph.stretch_dx_du = data;
+            break;
+        case NV3_CLASS15_STRETCHED_DELTA_DY_DV:
+            dev->pgraph.stretch_dy_dv = data;
+            break;
+        case NV3_CLASS15_STRETCHED_CLIP_POINT:
+            dev->pgraph.stretch_clip_point = data;
+            break;
+        case NV3_CLASS15_STRETCHED_CLIP_SIZE:
+            dev->pgraph.stretch_clip_size = data;
+            break;
+        case NV3_CLASS15_STRETCHED_POINT_12D4:
+            virtual_pgraph_stretch_begin(dev, data);
+            break;
+        default:
+            if (method >= NV3_CLASS15_STRETCHED_COLOR_START && method <= NV3_CLASS15_STRETCHED_COLOR_END)
+                virtual_pgraph_stretch_data(dev, data);
+            break;
+    }
+}
@@ -0,0 +1,315 @@
+//
+// Filename: virtual_pgraph_text.c
+// Purpose: Virtual NV3 PGRAPH GDI text (class 0x0C)
+//
+// Type A rectangles are plain fills. Type C glyphs are 1bpp bitmaps drawn in colour 1 with a transparent background:
+// the glyph is expanded into a mask of 0x00/0xFF bytes at the surface depth, and each visible row runs the draw's
+// kernel over a copy of the destination, which the mask then merges back. The expansion works on vectors, a byte of
+// glyph bits at a time (16 pixels at 8bpp), by broadcasting the bits across the lanes and testing one per lane.
+//
+// Text redraws the same few glyphs over and over, so expanded glyphs are cached by their bitmap, size and depth, in a
+// small set-associative cache that replaces the least recently drawn glyph of a set. Glyphs too big for the cache
+// are expanded on the stack every time.
+//
+#include <stdio.h>
+#include <string.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_GLYPH_MAX_PIXELS        (VIRTUAL_GLYPH_MAX_DWORDS * 32)
+
+// Scratch space for a glyph that doesn't fit the cache
+typedef struct virtual_glyph_scratch_s {
+    virtual_glyph_t glyph;
+    uint8_t bits[VIRTUAL_GLYPH_MAX_PIXELS + 16];
+    uint8_t mask[VIRTUAL_GLYPH_MAX_PIXELS * 4 + 16];
+} virtual_glyph_scratch_t;
+
+//
+// Expansion
+//
+
+// 8 bits of the glyph's bit stream from bit offset, first pixel in bit 7
+static inline uint8_t virtual_glyph_stream_byte(const uint32_t *dwords, uint32_t offset)
+{
+    uint64_t pair = (uint64_t)dwords[offset >> 5] << 32 | dwords[(offset >> 5) + 1];
+
+    return (uint8_t)(pair >> (56 - (offset & 31)));
+}
+
+// Set bits in [x0, x1) of a row of glyph bits, a byte at a time
+static uint32_t virtual_glyph_count(const uint8_t *bits, uint32_t x0, uint32_t x1)
+{
+    uint32_t count = 0;
+
+    while (x0 < x1) {
+        uint32_t byte = bits[x0 / 8] & (0xFF >> (x0 & 7));
+        uint32_t end = (x0 | 7) + 1;
+
+        if (end > x1) {
+            byte &= 0xFF << (end - x1);
+            end = x1;
+        }
+
+        count += __builtin_popcount(byte);
+        x0 = end;
+    }
+
+    return count;
+}
+
+// Expand a row of glyph bits into a byte mask. Writes up to 15 bytes past the end of the row.
+static void virtual_glyph_expand_row(const uint8_t *bits, uint8_t *mask, uint32_t width, uint32_t bytes)
+{
+    static const virtual_vec16_t select8 = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+    static const virtual_vec8_t select16 = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+    static const virtual_vec4_t select32_high = { 0x80, 0x40, 0x20, 0x10 };
+    static const virtual_vec4_t select32_low = { 0x08, 0x04, 0x02, 0x01 };
+
+    switch (bytes) {
+        case 1:
+            for (uint32_t x = 0; x < width; x += 16, bits += 2, mask += 16) {
+                uint8_t b0 = bits[0], b1 = bits[1];
+                virtual_vec16_t lanes = { b0, b0, b0, b0, b0, b0, b0, b0, b1, b1, b1, b1, b1, b1, b1, b1 };
+                virtual_vec16_t out = (virtual_vec16_t)((lanes & select8) != (virtual_vec16_t){ 0 });
+
+                memcpy(mask, &out, 16);
+            }
+            break;
+        case 2:
+            for (uint32_t x = 0; x < width; x += 8, bits++, mask += 16) {
+                virtual_vec8_t out = (virtual_vec8_t)((((virtual_vec8_t){ 0 } + bits[0]) & select16)
+                    != (virtual_vec8_t){ 0 });
+
+                memcpy(mask, &out, 16);
+            }
+            break;
+        default:
+            for (uint32_t x = 0; x < width; x += 8, bits++, mask += 32) {
+                virtual_vec4_t lanes = (virtual_vec4_t){ 0 } + bits[0];
+                virtual_vec4_t high = (virtual_vec4_t)((lanes & select32_high) != (virtual_vec4_t){ 0 });
+                virtual_vec4_t low = (virtual_vec4_t)((lanes & select32_low) != (virtual_vec4_t){ 0 });
+
+                memcpy(mask, &high, 16);
+
+                if (x + 4 < width)
+                    memcpy(mask + 16, &low, 16);
+            }
+            break;
+    }
+}
+
+// Unpack the bit stream into whole-byte rows and expand each row. glyph->bits and glyph->mask point at storage big
+// enough for the glyph, plus 16 bytes.
+static void virtual_glyph_expand(virtual_glyph_t *glyph, const uint32_t *dwords)
+{
+    glyph->bits_pitch = (glyph->width + 7) / 8;
+
+    for (uint32_t y = 0; y < glyph->height; y++) {
+        uint8_t *row = glyph->bits + y * glyph->bits_pitch;
+
+        for (uint32_t x = 0; x < glyph->width; x += 8)
+            row[x / 8] = virtual_glyph_stream_byte(dwords, y * glyph->width + x);
+    }
+
+    // The 8bpp expansion reads bits in pairs
+    glyph->bits[glyph->height * glyph->bits_pitch] = 0;
+
+    // Rows are expanded in order, so each one's overrun is overwritten by the next
+    glyph->set_bits = 0;
+
+    for (uint32_t y = 0; y < glyph->height; y++) {
+        virtual_glyph_expand_row(glyph->bits + y * glyph->bits_pitch,
+            glyph->mask + y * glyph->width * glyph->bytes, glyph->width, glyph->bytes);
+        glyph->set_bits += virtual_glyph_count(glyph->bits + y * glyph->bits_pitch, 0, glyph->width);
+    }
+}
+
+static uint32_t virtual_glyph_hash(const uint32_t *dwords, uint32_t count, uint32_t size, uint32_t bytes)
+{
+    uint32_t hash = 2166136261u ^ size ^ (bytes << 29);
+
+    for (uint32_t i = 0; i < count; i++)
+        hash = (hash ^ dwords[i]) * 16777619u;
+
+    return hash ^ (hash >> 16);
+}
+
+// The expanded form of the glyph the methods just finished, from the cache if it's been seen at this depth before
+static const virtual_glyph_t *virtual_glyph_lookup(virtual_device_t *dev, uint32_t width, uint32_t height,
+    uint32_t bytes, virtual_glyph_scratch_t *scratch)
+{
+    const uint32_t *dwords = dev->pgraph.text_mono_c;
+    uint32_t count = (width * height + 31) / 32;
+    virtual_glyph_t *glyph = &scratch->glyph;
+
+    if (width * height <= VIRTUAL_GLYPH_CACHE_PIXELS) {
+        virtual_glyph_cache_t *cache = &dev->glyphs;
+        uint32_t size = height << 16 | width;
+        uint32_t set = virtual_glyph_hash(dwords, count, size, bytes)
+            & (VIRTUAL_GLYPH_CACHE_SIZE / VIRTUAL_GLYPH_CACHE_WAYS - 1);
+        virtual_glyph_entry_t *entry = &cache->entries[set * VIRTUAL_GLYPH_CACHE_WAYS];
+        virtual_glyph_entry_t *victim = entry;
+
+        for (uint32_t way = 0; way < VIRTUAL_GLYPH_CACHE_WAYS; way++, entry++) {
+            if (entry->generation != cache->generation) {
+                victim = entry;
+                continue;
+            }
+
+            if (entry->glyph.width == width && entry->glyph.height == height && entry->glyph.bytes == bytes
+                && !memcmp(entry->key, dwords, count * 4)) {
+                entry->last_used = dev->pgraph.glyphs;
+                dev->pgraph.glyph_cache_hits++;
+                return &entry->glyph;
+            }
+
+            if (victim->generation == cache->generation && entry->last_used < victim->last_used)
+                victim = entry;
+        }
+
+        victim->generation = cache->generation;
+        victim->last_used = dev->pgraph.glyphs;
+        memcpy(victim->key, dwords, count * 4);
+        glyph = &victim->glyph;
+        glyph->bits = victim->bits;
+        glyph->mask = victim->mask;
+    } else {
+        glyph->bits = scratch->bits;
+        glyph->mask = scratch->mask;
+    }
+
+    glyph->width = width;
+    glyph->height = height;
+    glyph->bytes = bytes;
+    virtual_glyph_expand(glyph, dwords);
+    return glyph;
+}
+
+//
+// Drawing
+//
+
+// dst = mask ? src : dst, a vector at a time
+static void virtual_span_select(uint8_t *dst, const uint8_t *src, const uint8_t *mask, uint32_t bytes)
+{
+    uint32_t i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        virtual_vec4_t d, s, m;
+
+        memcpy(&d, dst + i, 16);
+        memcpy(&s, src + i, 16);
+        memcpy(&m, mask + i, 16);
+        d = (s & m) | (d & ~m);
+        memcpy(dst + i, &d, 16);
+    }
+
+    for (; i < bytes; i++)
+        dst[i] = (src[i] & mask[i]) | (dst[i] & ~mask[i]);
+}
+
+static void virtual_pgraph_glyph(virtual_device_t *dev)
+{
+    virtual_draw_t draw;
+    uint32_t width = dev->pgraph.text_size_c & 0xFFFF, height = dev->pgraph.text_size_c >> 16;
+    int32_t gx = virtual_point_x(dev->pgraph.text_point_c), gy = virtual_point_y(dev->pgraph.text_point_c);
+
+    if (!virtual_pgraph_begin_draw(dev, &draw, false, dev->pgraph.text_color_c))
+        return;
+
+    virtual_rect_t rect = { gx, gy, gx + (int32_t)width, gy + (int32_t)height };
+    virtual_rect_t clip = { virtual_point_x(dev->pgraph.text_clip_c[0]), virtual_point_y(dev->pgraph.text_clip_c[0]),
+        virtual_point_x(dev->pgraph.text_clip_c[1]), virtual_point_y(dev->pgraph.text_clip_c[1]) };
+
+    if (!virtual_rect_intersect(&rect, &clip) || !virtual_rect_intersect(&rect, &draw.clip))
+        return;
+
+    virtual_glyph_scratch_t scratch;
+    const virtual_glyph_t *glyph = virtual_glyph_lookup(dev, width, height, draw.surface.bytes, &scratch);
+    uint32_t bytes = draw.surface.bytes;
+    uint32_t count = rect.x1 - rect.x0;
+    uint8_t row[VIRTUAL_GLYPH_MAX_PIXELS * 4];
+
+    bool whole = (count == width && rect.y1 - rect.y0 == (int32_t)height);
+
+    dev->pgraph.glyphs++;
+
+    if (whole)
+        dev->pgraph.pixels += glyph->set_bits;
+
+    for (int32_t y = rect.y0; y < rect.y1; y++) {
+        uint8_t *dst = virtual_surface_pixel(&draw.surface, rect.x0, y);
+        const uint8_t *mask = glyph->mask + ((y - gy) * width + (rect.x0 - gx)) * bytes;
+
+        memcpy(row, dst, count * bytes);
+        draw.kernel(&draw, row, draw.source, virtual_draw_pattern(&draw, y), virtual_draw_phase(&draw, rect.x0),
+            count * bytes);
+        virtual_span_select(dst, row, mask, count * bytes);
+
+        if (!whole)
+            dev->pgraph.pixels += virtual_glyph_count(glyph->bits + (y - gy) * glyph->bits_pitch, rect.x0 - gx,
+                rect.x1 - gx);
+    }
+}
+
+//
+// Methods
+//
+
+void virtual_pgraph_class0c_method(virtual_device_t *dev, uint32_t method, uint32_t data)
+{
+    if (method >= NV3_CLASS0C_TEXT_RECT_A_START && method <= NV3_CLASS0C_TEXT_RECT_A_END) {
+        if (!(method & 4)) {
+            dev->pgraph.text_point_a = data;
+        } else {
+            int32_t x = virtual_point_x(dev->pgraph.text_point_a), y = virtual_point_y(dev->pgraph.text_point_a);
+            virtual_rect_t rect = { x, y, x + (int32_t)(data & 0xFFFF), y + (int32_t)(data >> 16) };
+
+            virtual_pgraph_fill(dev, rect, dev->pgraph.text_color_a);
+        }
+
+        return;
+    }
+
+    if (method >= NV3_CLASS0C_TEXT_MONO_C_START && method <= NV3_CLASS0C_TEXT_MONO_C_END) {
+        uint32_t index = (method - NV3_CLASS0C_TEXT_MONO_C_START) / 4;
+        uint32_t pixels = (dev->pgraph.text_size_c & 0xFFFF) * (dev->pgraph.text_size_c >> 16);
+
+        dev->pgraph.text_mono_c[index] = data;
+
+        // The glyph is drawn when its last dword arrives
+        if (pixels && pixels <= VIRTUAL_GLYPH_MAX_PIXELS && index == (pixels + 31) / 32 - 1) {
+            dev->pgraph.text_mono_c[index + 1] = 0;
+            virtual_pgraph_glyph(dev);
+        }
+
+        return;
+    }
+
+    switch (method) {
+        case NV3_CLASS0C_TEXT_COLOR_A:
+            dev->pgraph.text_color_a = data;
+            break;
+        case NV3_CLASS0C_TEXT_CLIP_C_POINT0:
+            dev->pgraph.text_clip_c[0] = data;
+            break;
+        case NV3_CLASS0C_TEXT_CLIP_C_POINT1:
+            dev->pgraph.text_clip_c[1] = data;
+            break;
+        case NV3_CLASS0C_TEXT_COLOR1_C:
+            dev->pgraph.text_color_c = data;
+            break;
+        case NV3_CLASS0C_TEXT_SIZE_C:
+            dev->pgraph.text_size_c = data;
+            break;
+        case NV3_CLASS0C_TEXT_POINT_C:
+            dev->pgraph.text_point_c = data;
+            break;
+    }
+}
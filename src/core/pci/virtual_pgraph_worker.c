@@ -0,0 +1,243 @@
+//
+// Filename: virtual_pgraph_worker.c
+// Purpose: Virtual PGRAPH worker thread and the method queue that feeds it
+//
+// Methods (from the PFIFO puller or the class ranges) are put on a single producer, single consumer ring and the
+// submitting thread goes straight back to pushing, while a worker thread executes them in order. Submission is a
+// store and a release of the head counter; the worker publishes how far it has got the same way. Neither side
+// takes a lock unless the other one is asleep: the worker sleeps when the ring stays empty, a submitter only
+// blocks when the ring is full or when it has to see the engine idle.
+//
+// The worker only counts work as retired once the ring is empty and anything it deferred (queued triangles) has
+// been drawn, so retired == head is exactly "PGRAPH is idle and everything it did can be seen". STATUS reports
+// busy until then, and any other access to the PGRAPH registers waits for it, since the methods in flight read and
+// write them too.
+//
+// The worker is opt in per device (virtual_device_set_pipelined): a process can hold hundreds of devices, and a
+// thread for each of them would cost far more than it gains. Without it, methods are executed on the submitting
+// thread.
+//
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_PGRAPH_SPIN             4096        // Polls before going to sleep
+#define VIRTUAL_PGRAPH_NOTIFY_INTERVAL  64          // Commands between progress updates for a blocked submitter
+
+// Wake anyone waiting on the worker's counters. The fence orders the counter store before the check of waiters;
+// a waiter does the opposite (waiters, then the counter), so one of the two always sees the other.
+static void virtual_pgraph_progress(virtual_pgraph_worker_t *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&worker->waiters, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_broadcast(&worker->progress);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// Wait until one of the worker's counters reaches target, spinning for a while first
+static void virtual_pgraph_wait(virtual_pgraph_worker_t *worker, const uint64_t *counter, uint64_t target)
+{
+    for (uint32_t spin = 0; spin < VIRTUAL_PGRAPH_SPIN; spin++) {
+        if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) >= target)
+            return;
+
+        nv_cpu_relax();
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    __atomic_add_fetch(&worker->waiters, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < target)
+        pthread_cond_wait(&worker->progress, &worker->lock);
+
+    __atomic_sub_fetch(&worker->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void *virtual_pgraph_worker_thread(void *arg)
+{
+    virtual_device_t *dev = arg;
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+    uint64_t tail = worker->tail;
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE);
+
+        if (tail != head) {
+            do {
+                const virtual_pgraph_command_t *command = &worker->queue[tail % VIRTUAL_PGRAPH_QUEUE_SIZE];
+
+                virtual_pgraph_dispatch(dev, command->class_id, command->method, command->data);
+                __atomic_store_n(&worker->tail, ++tail, __ATOMIC_RELEASE);
+
+                if (!(tail % VIRTUAL_PGRAPH_NOTIFY_INTERVAL))
+                    virtual_pgraph_progress(worker);
+            } while (tail != head);
+
+            continue;
+        }
+
+        // Drained: draw whatever was held back, then everything submitted so far can be seen. Device state is
+        // left alone otherwise, once retired the CPU may reset it.
+        if (worker->retired != tail) {
+            virtual_pgraph_d3d_flush(dev);
+            __atomic_store_n(&worker->retired, tail, __ATOMIC_RELEASE);
+            virtual_pgraph_progress(worker);
+        }
+
+        uint32_t spin = 0;
+
+        while (spin < VIRTUAL_PGRAPH_SPIN && __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == tail) {
+            nv_cpu_relax();
+            spin++;
+        }
+
+        if (spin < VIRTUAL_PGRAPH_SPIN)
+            continue;
+
+        // Announce the sleep before the last look at head; a submitter stores head before looking at sleeping
+        __atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&worker->lock);
+
+        while (!worker->stop && __atomic_load_n(&worker->head, __ATOMIC_SEQ_CST) == tail)
+            pthread_cond_wait(&worker->wake, &worker->lock);
+
+        bool stop = worker->stop && __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == tail;
+
+        pthread_mutex_unlock(&worker->lock);
+        __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+
+        if (stop)
+            return NULL;
+    }
+}
+
+// Hand a method (class in PGRAPH numbering) to the engine
+void virtual_pgraph_submit(virtual_device_t *dev, uint32_t class_id, uint32_t method, uint32_t data)
+{
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+
+    if (!worker->running) {
+        virtual_pgraph_dispatch(dev, class_id, method, data);
+        return;
+    }
+
+    uint64_t head = worker->head;
+
+    if (head - __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE) >= VIRTUAL_PGRAPH_QUEUE_SIZE) {
+        worker->stalls++;
+        virtual_pgraph_wait(worker, &worker->tail, head + 1 - VIRTUAL_PGRAPH_QUEUE_SIZE);
+    }
+
+    worker->queue[head % VIRTUAL_PGRAPH_QUEUE_SIZE] = (virtual_pgraph_command_t){ class_id, method, data };
+    __atomic_store_n(&worker->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_signal(&worker->wake);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// Wait for the engine to go idle, with everything submitted so far executed and its drawing in memory
+void virtual_pgraph_sync(virtual_device_t *dev)
+{
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+
+    if (!worker->running) {
+        virtual_pgraph_d3d_flush(dev);
+        return;
+    }
+
+    virtual_pgraph_wait(worker, &worker->retired, worker->head);
+}
+
+// Whether anything submitted hasn't been retired yet, without waiting
+bool virtual_pgraph_worker_busy(virtual_device_t *dev)
+{
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+
+    return worker->running && __atomic_load_n(&worker->retired, __ATOMIC_ACQUIRE) != worker->head;
+}
+
+bool virtual_pgraph_worker_start(virtual_device_t *dev)
+{
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+
+    if (worker->running)
+        return true;
+
+    // Whatever was held back on this thread is drawn first, the worker starts from an empty ring
+    virtual_pgraph_d3d_flush(dev);
+    worker->head = worker->tail = worker->retired = 0;
+    worker->sleeping = 0;
+    worker->waiters = 0;
+    worker->stop = false;
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+    pthread_cond_init(&worker->progress, NULL);
+
+    if (pthread_create(&worker->thread, NULL, virtual_pgraph_worker_thread, dev) != 0) {
+        nv_log_warning(NV_LOG_VIRTUAL, "Virtual PGRAPH: Failed to start the worker thread, executing methods inline\n");
+        pthread_cond_destroy(&worker->progress);
+        pthread_cond_destroy(&worker->wake);
+        pthread_mutex_destroy(&worker->lock);
+        return false;
+    }
+
+    worker->running = true;
+    return true;
+}
+
+// Let the worker drain the ring and exit. Methods submitted afterwards run on the submitting thread.
+void virtual_pgraph_worker_stop(virtual_device_t *dev)
+{
+    virtual_pgraph_worker_t *worker = &dev->pgraph_worker;
+
+    if (!worker->running)
+        return;
+
+    virtual_pgraph_sync(dev);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+
+    pthread_cond_destroy(&worker->progress);
+    pthread_cond_destroy(&worker->wake);
+    pthread_mutex_destroy(&worker->lock);
+    worker->running = false;
+}
+
+// Switch a device between executing methods on its worker thread and on the thread that submits them. Returns
+// whether methods are now pipelined.
+bool virtual_device_set_pipelined(virtual_device_t *dev, bool pipelined)
+{
+    if (!pipelined) {
+        virtual_pgraph_worker_stop(dev);
+        return false;
+    }
+
+    return virtual_pgraph_worker_start(dev);
+}
+
+// The same, for the calling thread's current device
+bool virtual_pgraph_set_pipelined(bool pipelined)
+{
+    virtual_device_t *dev = virtual_device_current();
+
+    return (dev) ? virtual_device_set_pipelined(dev, pipelined) : false;
+}
@@ -0,0 +1,76 @@
+//
+// Filename: virtual_pmc.c
+// Purpose: Virtual NV3 PMC (chip master control): boot ID, subsystem enables and interrupt aggregation
+//
+#include <stdio.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "architecture/nv3/nv3_ref.h"
+
+// Each subsystem interrupt line is pending when any enabled interrupt in that subsystem is pending
+static inline uint32_t virtual_pmc_pending(virtual_device_t *dev, uint32_t intr, uint32_t intr_en)
+{
+    return (*virtual_reg(dev, intr) & *virtual_reg(dev, intr_en)) != 0;
+}
+
+// NV_PMC_INTR_0 isn't stored anywhere, it's worked out from the subsystems every time it's read
+static uint32_t virtual_pmc_interrupt_status_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t status = *virtual_reg(dev, NV3_PMC_INTERRUPT_STATUS) & (1u << NV3_PMC_INTERRUPT_SOFTWARE);
+
+    // The timer alarm and vblank are only checked when someone could see them
+    virtual_ptimer_update(dev);
+    virtual_pgraph_update(dev);
+
+    status |= virtual_pmc_pending(dev, NV3_PFIFO_INTR, NV3_PFIFO_INTR_EN) << NV3_PMC_INTERRUPT_PFIFO;
+    status |= (virtual_pmc_pending(dev, NV3_PGRAPH_INTR_0, NV3_PGRAPH_INTR_EN_0)
+        | virtual_pmc_pending(dev, NV3_PGRAPH_INTR_1, NV3_PGRAPH_INTR_EN_1)) << NV3_PMC_INTERRUPT_PGRAPH0;
+    status |= virtual_pmc_pending(dev, NV3_PTIMER_INTR, NV3_PTIMER_INTR_EN) << NV3_PMC_INTERRUPT_PTIMER;
+    status |= virtual_pmc_pending(dev, NV3_PBUS_INTR, NV3_PBUS_INTR_EN) << NV3_PMC_INTERRUPT_PBUS;
+
+    return status;
+}
+
+// Only the software interrupt can be raised or cleared from here, the others are acknowledged in their subsystem
+static void virtual_pmc_interrupt_status_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    *virtual_reg(dev, NV3_PMC_INTERRUPT_STATUS) = value & (1u << NV3_PMC_INTERRUPT_SOFTWARE);
+}
+
+static uint32_t virtual_pmc_boot_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint32_t value = *virtual_reg(dev, addr);
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Read PMC_BOOT = 0x%08X\n", value);
+    return value;
+}
+
+static void virtual_pmc_interrupt_enable_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Write PMC_INTR_EN = 0x%08X (interrupts %s)\n",
+        value, (value & 0x3) ? "enabled" : "disabled");
+    *virtual_reg(dev, addr) = value;
+}
+
+static void virtual_pmc_enable_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Write PMC_ENABLE = 0x%08X (%s)\n", value,
+        (value == 0x11111111) ? "all subsystems enabled" : "partial subsystem enable");
+    *virtual_reg(dev, addr) = value;
+}
+
+void virtual_pmc_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PMC_BOOT", NV3_PMC_BOOT, NV3_PMC_BOOT, virtual_pmc_boot_read, virtual_write_ignore);
+    virtual_mmio_register(dev, "PMC_INTR", NV3_PMC_INTERRUPT_STATUS, NV3_PMC_INTERRUPT_STATUS,
+        virtual_pmc_interrupt_status_read, virtual_pmc_interrupt_status_write);
+    virtual_mmio_register(dev, "PMC_INTR_EN", NV3_PMC_INTERRUPT_ENABLE, NV3_PMC_INTERRUPT_ENABLE,
+        NULL, virtual_pmc_interrupt_enable_write);
+    virtual_mmio_register(dev, "PMC_ENABLE", NV3_PMC_ENABLE, NV3_PMC_ENABLE, NULL, virtual_pmc_enable_write);
+}
+
+void virtual_pmc_reset(virtual_device_t *dev)
+{
+    *virtual_reg(dev, NV3_PMC_BOOT) = 0x00030110;   // NV3_BOOT_REG_REV_B00
+}
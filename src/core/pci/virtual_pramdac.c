@@ -0,0 +1,40 @@
+//
+// Filename: virtual_pramdac.c
+// Purpose: Virtual NV3 PRAMDAC (RAMDAC and clock generators)
+//
+#include <stdio.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/virtual.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_PRAMDAC_CRYSTAL_MHZ     14.31818f
+
+static void virtual_pramdac_clock_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    uint32_t vdiv = value & 0xFF;
+    uint32_t ndiv = (value >> 8) & 0xFF;
+    uint32_t pdiv = (value >> 16) & 0x7;
+    const char *name = (addr == NV3_PRAMDAC_CLOCK_MEMORY) ? "MCLK" : "VCLK";
+
+    nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: Write PRAMDAC_CLOCK_%s = 0x%08X\n",
+        (addr == NV3_PRAMDAC_CLOCK_MEMORY) ? "MEMORY" : "PIXEL", value);
+
+    if (vdiv)
+        nv_log_info(NV_LOG_VIRTUAL, "Virtual MMIO: %s set to approximately %.2f MHz\n", name,
+            (VIRTUAL_PRAMDAC_CRYSTAL_MHZ * ndiv) / (vdiv * (1 << pdiv)));
+
+    *virtual_reg(dev, addr) = value;
+}
+
+void virtual_pramdac_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PRAMDAC_CLOCK", NV3_PRAMDAC_CLOCK_MEMORY, NV3_PRAMDAC_CLOCK_PIXEL, NULL,
+        virtual_pramdac_clock_write);
+}
+
+void virtual_pramdac_reset(virtual_device_t *dev)
+{
+    *virtual_reg(dev, NV3_PRAMDAC_CLOCK_MEMORY) = 0x0EC40E;     // 100 MHz
+}
@@ -0,0 +1,128 @@
+//
+// Filename: virtual_ptimer.c
+// Purpose: Virtual NV3 PTIMER (programmable interval timer)
+//
+// The timer is never ticked. Its value is worked out from the device's clock whenever it's read, scaled by
+// NUMERATOR/DENOMINATOR, and the alarm is checked lazily whenever something could observe the interrupt. Because it
+// follows the core time source, a skipped sleep on this device moves the timer forward just as a real one would.
+//
+#include <stdio.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "core/pci/virtual.h"
+#include "architecture/nv3/nv3_ref.h"
+
+#define VIRTUAL_PTIMER_TIME_0_MASK      0xFFFFFFE0  // Only [31:5] of the low word are implemented
+#define VIRTUAL_PTIMER_TIME_1_MASK      0x1FFFFFFF  // [28:0] of the high word
+
+uint64_t virtual_ptimer_now(virtual_device_t *dev)
+{
+    virtual_ptimer_state_t *timer = &dev->ptimer;
+    uint32_t numerator = *virtual_reg(dev, NV3_PTIMER_NUMERATOR);
+    uint32_t denominator = *virtual_reg(dev, NV3_PTIMER_DENOMINATOR);
+
+    if (!denominator)
+        denominator = 1;
+
+    // 128-bit product, an hour of host time times a 32-bit numerator doesn't fit in 64 bits
+    unsigned __int128 elapsed = (unsigned __int128)(virtual_time_now(dev) - timer->host_base_ns) * numerator;
+    return timer->gpu_base_ns + (uint64_t)(elapsed / denominator);
+}
+
+// Restart the timer from its current value, before anything that changes how it counts
+static void virtual_ptimer_rebase(virtual_device_t *dev, uint64_t gpu_ns)
+{
+    dev->ptimer.gpu_base_ns = gpu_ns;
+    dev->ptimer.host_base_ns = virtual_time_now(dev);
+}
+
+// Raise the alarm interrupt if the low word of the timer has passed ALARM since the last check
+void virtual_ptimer_update(virtual_device_t *dev)
+{
+    virtual_ptimer_state_t *timer = &dev->ptimer;
+    uint64_t now = virtual_ptimer_now(dev);
+    uint32_t alarm = *virtual_reg(dev, NV3_PTIMER_ALARM_NSEC) & VIRTUAL_PTIMER_TIME_0_MASK;
+
+    if (now <= timer->alarm_checked_ns)
+        return;
+
+    // First time after the last check that the low word equals the alarm
+    uint64_t next = (timer->alarm_checked_ns & ~0xFFFFFFFFull) | alarm;
+
+    if (next <= timer->alarm_checked_ns)
+        next += 0x100000000ull;
+
+    if (now >= next)
+        *virtual_reg(dev, NV3_PTIMER_INTR) |= (1 << NV3_PTIMER_INTR_ALARM);
+
+    timer->alarm_checked_ns = now;
+}
+
+static uint32_t virtual_ptimer_time_read(virtual_device_t *dev, uint32_t addr)
+{
+    uint64_t now = virtual_ptimer_now(dev);
+
+    if (addr == NV3_PTIMER_TIME_0_NSEC)
+        return (uint32_t)now & VIRTUAL_PTIMER_TIME_0_MASK;
+
+    return (uint32_t)(now >> 32) & VIRTUAL_PTIMER_TIME_1_MASK;
+}
+
+static void virtual_ptimer_time_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    uint64_t now = virtual_ptimer_now(dev);
+
+    if (addr == NV3_PTIMER_TIME_0_NSEC)
+        now = (now & ~0xFFFFFFFFull) | (value & VIRTUAL_PTIMER_TIME_0_MASK);
+    else
+        now = (now & 0xFFFFFFFFull) | ((uint64_t)(value & VIRTUAL_PTIMER_TIME_1_MASK) << 32);
+
+    // Setting the time isn't the time passing, so it mustn't fire the alarm
+    virtual_ptimer_rebase(dev, now);
+    dev->ptimer.alarm_checked_ns = now;
+}
+
+static void virtual_ptimer_ratio_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    // Time up to now counts at the old rate
+    virtual_ptimer_update(dev);
+    virtual_ptimer_rebase(dev, virtual_ptimer_now(dev));
+    *virtual_reg(dev, addr) = value;
+}
+
+static void virtual_ptimer_alarm_write(virtual_device_t *dev, uint32_t addr, uint32_t value)
+{
+    // Anything that passed under the old alarm value has already been accounted for
+    virtual_ptimer_update(dev);
+    *virtual_reg(dev, addr) = value;
+}
+
+static uint32_t virtual_ptimer_intr_read(virtual_device_t *dev, uint32_t addr)
+{
+    virtual_ptimer_update(dev);
+    return *virtual_reg(dev, addr);
+}
+
+void virtual_ptimer_attach(virtual_device_t *dev)
+{
+    virtual_mmio_register(dev, "PTIMER_INTR", NV3_PTIMER_INTR, NV3_PTIMER_INTR, virtual_ptimer_intr_read,
+        virtual_write_1_to_clear);
+    virtual_mmio_register(dev, "PTIMER_NUMERATOR", NV3_PTIMER_NUMERATOR, NV3_PTIMER_NUMERATOR, NULL,
+        virtual_ptimer_ratio_write);
+    virtual_mmio_register(dev, "PTIMER_DENOMINATOR", NV3_PTIMER_DENOMINATOR, NV3_PTIMER_DENOMINATOR, NULL,
+        virtual_ptimer_ratio_write);
+    virtual_mmio_register(dev, "PTIMER_TIME_0", NV3_PTIMER_TIME_0_NSEC, NV3_PTIMER_TIME_0_NSEC,
+        virtual_ptimer_time_read, virtual_ptimer_time_write);
+    virtual_mmio_register(dev, "PTIMER_TIME_1", NV3_PTIMER_TIME_1_NSEC, NV3_PTIMER_TIME_1_NSEC,
+        virtual_ptimer_time_read, virtual_ptimer_time_write);
+    virtual_mmio_register(dev, "PTIMER_ALARM", NV3_PTIMER_ALARM_NSEC, NV3_PTIMER_ALARM_NSEC, NULL,
+        virtual_ptimer_alarm_write);
+}
+
+void virtual_ptimer_reset(virtual_device_t *dev)
+{
+    *virtual_reg(dev, NV3_PTIMER_NUMERATOR) = 1;
+    *virtual_reg(dev, NV3_PTIMER_DENOMINATOR) = 1;
+    virtual_ptimer_rebase(dev, 0);
+    dev->ptimer.alarm_checked_ns = 0;
+}
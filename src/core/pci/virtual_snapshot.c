@@ -0,0 +1,275 @@
+//
+// Filename: virtual_snapshot.c
+// Purpose: Copy-on-write snapshots of a virtual device, and restoring them
+//
+// A snapshot keeps each backing store (MMIO, VRAM, RAMIN) as a memfd holding its contents, only the pages that
+// weren't zero are written, and the device's subsystem state and config space as a plain copy. Taking a snapshot
+// maps the device's backing stores privately over those files, in place, so every pointer into them stays valid.
+// From then on a write copies the page it lands in, and restoring is dropping the copies (MADV_DONTNEED): the next
+// touch reads the snapshot's page back from the page cache. The cost of a restore is the pages used since, not the
+// size of the device.
+//
+// Any number of devices can be restored from the same snapshot. A device that was last restored from (or mapped
+// over) a different snapshot is remapped first, which costs a few mmap calls.
+//
+// The PGRAPH scalers hold heap tables, so a snapshot keeps only their mappings and a restore rebuilds the tables
+// if the device's scalers have moved on to a different mapping since. A stretched image in flight when the
+// snapshot was taken carries on with the scaler it was set up with.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "util/util.h"
+#include "core/pci/pci.h"
+#include "core/pci/virtual.h"
+#include "core/pci/virtual_pgraph.h"
+
+#define VIRTUAL_SNAPSHOT_STORES     3               // MMIO, VRAM, RAMIN
+
+typedef struct virtual_snapshot_store_s {
+    int fd;
+    uint32_t size;
+    uint32_t pages;                                 // Pages written, the rest read back as zero
+} virtual_snapshot_store_t;
+
+// A scaler's mapping, without its tables
+typedef struct virtual_snapshot_scaler_s {
+    bool built;                                     // The scaler had tables; otherwise nothing to restore
+    nv_scaler_t mapping;                            // columns and rows are always NULL
+} virtual_snapshot_scaler_t;
+
+struct virtual_snapshot_s {
+    uint64_t id;                                    // Never reused, so a device can tell which one it's mapped over
+    uint64_t captured_ns;                           // Host time it was taken, to carry the clocks across
+    virtual_snapshot_store_t stores[VIRTUAL_SNAPSHOT_STORES];
+    uint32_t device_id;
+    uint32_t vendor_id;
+    uint8_t pci_config[256];
+    virtual_pfifo_state_t pfifo;
+    virtual_pgraph_state_t pgraph;
+    virtual_ptimer_state_t ptimer;
+    virtual_vblank_state_t vblank;
+    virtual_snapshot_scaler_t scaled_scaler;
+    virtual_snapshot_scaler_t stretch_scaler;
+};
+
+static uint64_t virtual_snapshot_next_id = 1;
+
+static uint32_t **virtual_snapshot_store(virtual_device_t *dev, uint32_t index)
+{
+    uint32_t **stores[VIRTUAL_SNAPSHOT_STORES] = { &dev->mmio, &dev->vram, &dev->ramin };
+    return stores[index];
+}
+
+static const uint32_t virtual_snapshot_sizes[VIRTUAL_SNAPSHOT_STORES] = {
+    VIRTUAL_MMIO_SIZE, VIRTUAL_VRAM_SIZE, VIRTUAL_RAMIN_SIZE,
+};
+
+static const char *const virtual_snapshot_names[VIRTUAL_SNAPSHOT_STORES] = {
+    "nv-virtual-mmio", "nv-virtual-vram", "nv-virtual-ramin",
+};
+
+static bool virtual_snapshot_page_is_zero(const uint64_t *page)
+{
+    uint64_t bits = 0;
+
+    for (uint32_t i = 0; i < VIRTUAL_PAGE_SIZE / 8; i++)
+        bits |= page[i];
+
+    return !bits;
+}
+
+static void virtual_snapshot_save_scaler(virtual_snapshot_scaler_t *saved, const nv_scaler_t *scaler)
+{
+    saved->built = (scaler->columns != NULL);
+    saved->mapping = *scaler;
+    saved->mapping.columns = NULL;
+    saved->mapping.rows = NULL;
+}
+
+// Put a scaler back on the mapping it had, rebuilding its tables only if the mapping has changed since
+static bool virtual_snapshot_restore_scaler(nv_scaler_t *scaler, const virtual_snapshot_scaler_t *saved)
+{
+    const nv_scaler_t *mapping = &saved->mapping;
+
+    if (!saved->built)
+        return true;
+
+    if (scaler->columns && scaler->filter == mapping->filter && scaler->dst_format == mapping->dst_format
+        && scaler->dst_width == mapping->dst_width && scaler->dst_height == mapping->dst_height
+        && scaler->src_format == mapping->src_format && scaler->src_width == mapping->src_width
+        && scaler->src_height == mapping->src_height && scaler->u0 == mapping->u0 && scaler->du == mapping->du
+        && scaler->v0 == mapping->v0 && scaler->dv == mapping->dv)
+        return true;
+
+    return nv_scaler_init_steps(scaler, mapping->filter, mapping->dst_format, mapping->dst_width,
+        mapping->dst_height, mapping->src_format, mapping->src_width, mapping->src_height, mapping->u0, mapping->du,
+        mapping->v0, mapping->dv);
+}
+
+// Write a backing store into a new file, skipping pages of zeroes
+static bool virtual_snapshot_save(virtual_snapshot_store_t *store, const char *name, const uint8_t *memory,
+    uint32_t size)
+{
+    store->size = size;
+    store->pages = 0;
+    store->fd = memfd_create(name, MFD_CLOEXEC);
+
+    if (store->fd < 0 || ftruncate(store->fd, size) < 0)
+        return false;
+
+    for (uint32_t offset = 0; offset < size; offset += VIRTUAL_PAGE_SIZE) {
+        if (virtual_snapshot_page_is_zero((const uint64_t *)(memory + offset)))
+            continue;
+
+        if (pwrite(store->fd, memory + offset, VIRTUAL_PAGE_SIZE, offset) != VIRTUAL_PAGE_SIZE)
+            return false;
+
+        store->pages++;
+    }
+
+    return true;
+}
+
+// Map a device's backing stores over a snapshot's files, where they already are
+static bool virtual_snapshot_map(virtual_device_t *dev, const virtual_snapshot_t *snapshot)
+{
+    for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++) {
+        void *memory = mmap(*virtual_snapshot_store(dev, i), snapshot->stores[i].size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, snapshot->stores[i].fd, 0);
+
+        if (memory == MAP_FAILED) {
+            nv_log_error(NV_LOG_VIRTUAL, "Virtual snapshot: Failed to map %s\n", virtual_snapshot_names[i]);
+            virtual_snapshot_detach(dev);
+            return false;
+        }
+    }
+
+    dev->snapshot_id = snapshot->id;
+    return true;
+}
+
+// Put a device's backing stores back onto anonymous memory (all zeroes), if they're mapped over a snapshot
+void virtual_snapshot_detach(virtual_device_t *dev)
+{
+    if (!dev->snapshot_id)
+        return;
+
+    for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++)
+        mmap(*virtual_snapshot_store(dev, i), virtual_snapshot_sizes[i], PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+
+    dev->snapshot_id = 0;
+}
+
+// Capture the device as it is now. The device carries on from the snapshot, so restoring it later only has to undo
+// what happened since.
+virtual_snapshot_t *virtual_snapshot_create(virtual_device_t *dev)
+{
+    virtual_snapshot_t *snapshot = calloc(1, sizeof(virtual_snapshot_t));
+
+    if (!snapshot) {
+        nv_log_error(NV_LOG_VIRTUAL, "Virtual snapshot: Out of memory\n");
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++)
+        snapshot->stores[i].fd = -1;
+
+    // Everything PGRAPH was given has to be in memory, and nothing can be half drawn
+    virtual_pgraph_sync(dev);
+
+    for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++) {
+        if (!virtual_snapshot_save(&snapshot->stores[i], virtual_snapshot_names[i],
+            (const uint8_t *)*virtual_snapshot_store(dev, i), virtual_snapshot_sizes[i])) {
+            nv_log_error(NV_LOG_VIRTUAL, "Virtual snapshot: Failed to save %s\n", virtual_snapshot_names[i]);
+            virtual_snapshot_destroy(snapshot);
+            return NULL;
+        }
+    }
+
+    snapshot->id = __atomic_fetch_add(&virtual_snapshot_next_id, 1, __ATOMIC_RELAXED);
+    snapshot->captured_ns = virtual_time_now(dev);
+    snapshot->device_id = dev->device_id;
+    snapshot->vendor_id = dev->vendor_id;
+    memcpy(snapshot->pci_config, dev->pci_config, sizeof(snapshot->pci_config));
+    snapshot->pfifo = dev->pfifo;
+    snapshot->pgraph = dev->pgraph;
+    snapshot->ptimer = dev->ptimer;
+    snapshot->vblank = dev->vblank;
+    virtual_snapshot_save_scaler(&snapshot->scaled_scaler, &dev->scaled_scaler);
+    virtual_snapshot_save_scaler(&snapshot->stretch_scaler, &dev->stretch_scaler);
+
+    // The contents are the same, only now they're copy on write
+    if (!virtual_snapshot_map(dev, snapshot)) {
+        virtual_snapshot_destroy(snapshot);
+        return NULL;
+    }
+
+    nv_log_debug(NV_LOG_VIRTUAL, "Virtual snapshot: Took snapshot %llu (%u + %u + %u pages)\n",
+        (unsigned long long)snapshot->id, snapshot->stores[0].pages, snapshot->stores[1].pages,
+        snapshot->stores[2].pages);
+    return snapshot;
+}
+
+// Put the device back the way it was when the snapshot was taken. The clocks carry on from where they were then,
+// as if no time had passed in between. Devices keep their own clocks, so the rebase is against the restored device's
+// clock; the arithmetic wraps, so it works even if that clock is behind the one the snapshot was taken on.
+bool virtual_snapshot_restore(virtual_device_t *dev, const virtual_snapshot_t *snapshot)
+{
+    virtual_pgraph_sync(dev);
+
+    if (dev->snapshot_id == snapshot->id) {
+        for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++)
+            madvise(*virtual_snapshot_store(dev, i), snapshot->stores[i].size, MADV_DONTNEED);
+    } else if (!virtual_snapshot_map(dev, snapshot)) {
+        return false;
+    }
+
+    uint64_t elapsed = virtual_time_now(dev) - snapshot->captured_ns;
+
+    dev->device_id = snapshot->device_id;
+    dev->vendor_id = snapshot->vendor_id;
+    memcpy(dev->pci_config, snapshot->pci_config, sizeof(dev->pci_config));
+    dev->pfifo = snapshot->pfifo;
+    dev->pgraph = snapshot->pgraph;
+    dev->ptimer = snapshot->ptimer;
+    dev->ptimer.host_base_ns += elapsed;
+    dev->vblank = snapshot->vblank;
+    dev->vblank.base_ns += elapsed;
+
+    // The scaled image scaler is only a cache, checked against the mapping before every image; the stretched image
+    // one is what an image in flight is drawn with, so without it the image has to be abandoned
+    if (!virtual_snapshot_restore_scaler(&dev->scaled_scaler, &snapshot->scaled_scaler))
+        nv_scaler_cleanup(&dev->scaled_scaler);
+
+    if (!virtual_snapshot_restore_scaler(&dev->stretch_scaler, &snapshot->stretch_scaler)) {
+        nv_log_warning(NV_LOG_VIRTUAL, "Virtual snapshot: Couldn't rebuild the stretched image scaler\n");
+        nv_scaler_cleanup(&dev->stretch_scaler);
+        dev->pgraph.stretch_active = false;
+    }
+
+    // Nothing was queued when the snapshot was taken; cached glyphs go stale like on reset
+    dev->d3d.count = 0;
+    dev->glyphs.generation++;
+    return true;
+}
+
+// Devices mapped over the snapshot keep working, the mappings hold on to the files
+void virtual_snapshot_destroy(virtual_snapshot_t *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    for (uint32_t i = 0; i < VIRTUAL_SNAPSHOT_STORES; i++) {
+        if (snapshot->stores[i].fd >= 0)
+            close(snapshot->stores[i].fd);
+    }
+
+    free(snapshot);
+}
@@ -6,6 +6,7 @@
 #include "nvplayground.h"
 #include "core/nvcore.h"
 #include "core/pci/pci.h"
+#include "util/util.h"
 
 // Signal handling
 static void cleanup(void);
@@ -19,13 +20,37 @@ static void signal_handler(int sig)
 // Main application cleanup
 static void cleanup(void)
 {
+    nv_log_flush();
+    nv_trace_stop();
+    nv_stats_print();
+
     // Clean up hardware resources
     cleanup_mmio_mappings();
     pci_cleanup();
 }
 
+static void usage(const char *name)
+{
+    printf("Usage: %s [-t|--trace <file>] [-r|--real-time]\n", name);
+    printf("    -t, --trace <file>  Record every MMIO access to a binary trace file\n");
+    printf("    -r, --real-time     Really sleep instead of skipping ahead (the default against the virtual device)\n");
+}
+
 int main(int argc, char *argv[])
 {
+    const char *trace_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--real-time")) {
+            nv_time_set_source(&nv_time_host);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
     // Register signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
@@ -48,9 +73,16 @@ int main(int argc, char *argv[])
         return 1;
     }
     
+    // Start tracing before anything touches the GPU
+    if (trace_path && !nv_trace_start(trace_path)) {
+        pci_cleanup();
+        return 1;
+    }
+
     // Detect supported NVIDIA GPU
     if (!nv_detect()) {
         fprintf(stderr, "No supported NVIDIA GPU found\n");
+        nv_trace_stop();
         pci_cleanup();
         return 2;
     }
@@ -70,6 +102,7 @@ int main(int argc, char *argv[])
         return 4;
     }
     
+    nv_log_flush();
     printf("\nGPU initialized successfully!\n");
     printf("Press Ctrl+C to exit...\n");
     
@@ -0,0 +1,680 @@
+//
+// Filename: nvfuzz.c
+// Purpose: In-process fuzzer for the virtual device
+//
+// Every thread drives a virtual device of its own. The device is brought up once into a state where methods get
+// somewhere (PFIFO pushing and pulling, RAMHT holding an object of every class, subchannels bound, a surface to
+// draw on) and snapshotted; each input starts from a restore of that snapshot, so nothing carries over between
+// inputs and there's no process or device to restart.
+//
+// An input is a 64-bit seed, expanded into a short sequence of operations: USER submissions (mostly to the bound
+// subchannels, some SET_OBJECTs with real and made up handles, some to other channels), writes and reads of the
+// registers that have handlers, writes anywhere in the PFIFO and PGRAPH blocks, writes into RAMHT, RAMFC and RAMRO,
+// class range writes and config space reads. Any input can be run again on its own with --replay, which prints the
+// operations as it goes.
+//
+// A crash prints the inputs every thread was running, an input that takes longer than --timeout is reported as a
+// hang. The coverage reported is of register handlers: which have been read and written by any input so far.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "core/pci/pci.h"
+#include "architecture/nv3/nv3_ref.h"
+#include "util/util.h"
+
+#define NVFUZZ_MAX_THREADS          256
+#define NVFUZZ_MAX_HANDLERS         64              // Coverage is kept as a bit per handler
+#define NVFUZZ_SURFACE_PITCH        (640 * 2)
+#define NVFUZZ_HANDLE_BASE          0x10000         // Object handles are this plus the PGRAPH class id
+#define NVFUZZ_RAMIN_FUZZ_SIZE      0x10000         // RAMIN writes land in the first 64KB: RAMHT, RAMFC, RAMRO
+
+typedef struct nvfuzz_options_s {
+    uint32_t threads;
+    uint32_t seconds;                               // 0: until stopped
+    uint64_t runs;                                  // 0: no limit
+    uint64_t seed;
+    uint32_t max_ops;                               // Operations per input
+    uint32_t timeout_ms;
+    bool pipelined;
+    bool replay;
+    uint64_t replay_seed;
+} nvfuzz_options_t;
+
+// What a thread is up to, read by the monitor. Each one on its own cache line.
+typedef struct nvfuzz_thread_s {
+    pthread_t thread;
+    uint32_t index;
+    uint64_t seed;                                  // Input being run
+    uint64_t started_ns;                            // When it started, 0 between inputs
+    uint64_t execs;
+    uint64_t read_coverage;                         // Handlers read / written, a bit per handler
+    uint64_t write_coverage;
+    uint64_t pushed;                                // PFIFO totals over every input
+    uint64_t pulled;
+    uint64_t runouts;
+    uint64_t hash_failures;
+} __attribute__((aligned(64))) nvfuzz_thread_t;
+
+static nvfuzz_options_t nvfuzz_options;
+static nvfuzz_thread_t nvfuzz_threads[NVFUZZ_MAX_THREADS];
+static uint64_t nvfuzz_next_input = 0;
+static bool nvfuzz_stop = false;
+static uint32_t nvfuzz_finished = 0;                 // Threads that have run out of inputs or been stopped
+
+// Handlers as registered, the same on every device
+static virtual_handler_stats_t nvfuzz_handlers[NVFUZZ_MAX_HANDLERS];
+static uint32_t nvfuzz_handler_count = 0;
+
+// The classes bound to subchannels 0-7 in the starting state
+static const uint32_t nvfuzz_subchannel_classes[NV3_DMA_SUBCHANNELS_PER_CHANNEL] = {
+    0x07, 0x08, 0x09, 0x0C, 0x0D, 0x10, 0x17, 0x1C,
+};
+
+// Values that tend to find edges
+static const uint32_t nvfuzz_interesting[] = {
+    0x00000000, 0x00000001, 0x00000002, 0x00000004, 0x0000000F, 0x00000010, 0x0000007F, 0x00000080,
+    0x000000FF, 0x00000100, 0x00000FFF, 0x00001000, 0x00007FFF, 0x00008000, 0x0000FFFF, 0x00010000,
+    0x00010001, 0x7FFF7FFF, 0x7FFFFFFF, 0x80000000, 0x80008000, 0xFFFF0000, 0xFFFFFFFE, 0xFFFFFFFF,
+    0x00200020, 0x01E00280, 0x3F800000, 0x44200000, 0xC4200000, 0x7F800000, 0x7FC00000, 0xFF800000,
+};
+
+static inline uint64_t nvfuzz_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+//
+// Inputs
+//
+
+// splitmix64, both to turn an input index into a seed and as the generator an input is expanded with
+static inline uint64_t nvfuzz_mix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t nvfuzz_below(uint64_t *state, uint32_t bound)
+{
+    return (uint32_t)(((nvfuzz_mix(state) & 0xFFFFFFFF) * bound) >> 32);
+}
+
+static uint32_t nvfuzz_value(uint64_t *state)
+{
+    uint32_t pick = nvfuzz_below(state, 4);
+
+    if (pick == 0)
+        return nvfuzz_interesting[nvfuzz_below(state, sizeof(nvfuzz_interesting) / sizeof(nvfuzz_interesting[0]))];
+
+    // Small points and sizes, y in 31:16 and x in 15:0
+    if (pick == 1)
+        return (nvfuzz_below(state, 600) << 16) | nvfuzz_below(state, 800);
+
+    return (uint32_t)nvfuzz_mix(state);
+}
+
+// Any dword a handler decodes
+static uint32_t nvfuzz_handled_register(uint64_t *state)
+{
+    const virtual_handler_stats_t *handler = &nvfuzz_handlers[nvfuzz_below(state, nvfuzz_handler_count)];
+    uint32_t dwords = (handler->end - handler->start) / 4 + 1;
+
+    return handler->start + nvfuzz_below(state, dwords) * 4;
+}
+
+typedef enum nvfuzz_op_e {
+    NVFUZZ_OP_SUBMIT,
+    NVFUZZ_OP_SET_OBJECT,
+    NVFUZZ_OP_WRITE_HANDLED,
+    NVFUZZ_OP_READ_HANDLED,
+    NVFUZZ_OP_WRITE_BLOCK,
+    NVFUZZ_OP_WRITE_RAMIN,
+    NVFUZZ_OP_WRITE_CLASS,
+    NVFUZZ_OP_READ_CONFIG,
+    NVFUZZ_OP_COUNT,
+} nvfuzz_op_t;
+
+// Out of 100
+static const uint32_t nvfuzz_op_weights[NVFUZZ_OP_COUNT] = { 34, 8, 18, 10, 8, 9, 8, 5 };
+
+static const char *const nvfuzz_op_names[NVFUZZ_OP_COUNT] = {
+    "submit", "set object", "write", "read", "write", "write RAMIN", "class write", "config read",
+};
+
+static nvfuzz_op_t nvfuzz_pick_op(uint64_t *state)
+{
+    uint32_t pick = nvfuzz_below(state, 100);
+    uint32_t op = 0;
+
+    while (pick >= nvfuzz_op_weights[op]) {
+        pick -= nvfuzz_op_weights[op];
+        op++;
+    }
+
+    return (nvfuzz_op_t)op;
+}
+
+// Expand a seed into operations and run them on the thread's device
+static void nvfuzz_run_input(virtual_device_t *dev, uint64_t seed, bool verbose)
+{
+    uint64_t state = seed;
+    uint32_t ops = 1 + nvfuzz_below(&state, nvfuzz_options.max_ops);
+
+    for (uint32_t i = 0; i < ops; i++) {
+        nvfuzz_op_t op = nvfuzz_pick_op(&state);
+        uint32_t addr = 0, value = 0, size = 0;
+
+        switch (op) {
+            case NVFUZZ_OP_SUBMIT: {
+                // Mostly the channel everything is bound on, now and then another one to force a switch
+                uint32_t channel = (nvfuzz_below(&state, 16)) ? 0 : nvfuzz_below(&state, NV3_DMA_CHANNELS);
+                uint32_t method = (nvfuzz_below(&state, 4)) ? 0x100 + nvfuzz_below(&state, 0x1F00 / 4) * 4
+                    : nvfuzz_below(&state, (NV3_OBJECT_SUBMIT_METHOD + 4) / 4) * 4;
+
+                addr = NV3_USER_START + (channel << NV3_OBJECT_SUBMIT_CHANNEL)
+                    + (nvfuzz_below(&state, NV3_DMA_SUBCHANNELS_PER_CHANNEL) << NV3_OBJECT_SUBMIT_SUBCHANNEL) + method;
+                value = nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            }
+            case NVFUZZ_OP_SET_OBJECT:
+                // A real handle most of the time, so the subchannel ends up with a different class bound
+                addr = NV3_USER_START + (nvfuzz_below(&state, NV3_DMA_SUBCHANNELS_PER_CHANNEL)
+                    << NV3_OBJECT_SUBMIT_SUBCHANNEL) + NV3_OBJECT_METHOD_SET_OBJECT;
+                value = (nvfuzz_below(&state, 4)) ? NVFUZZ_HANDLE_BASE + nvfuzz_below(&state, 0x20)
+                    : nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            case NVFUZZ_OP_WRITE_HANDLED:
+                addr = nvfuzz_handled_register(&state);
+                value = nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            case NVFUZZ_OP_READ_HANDLED:
+                addr = nvfuzz_handled_register(&state);
+                value = virtual_device_read32(dev, addr);
+                break;
+            case NVFUZZ_OP_WRITE_BLOCK:
+                // Anywhere in PFIFO or PGRAPH, handled or not
+                addr = (nvfuzz_below(&state, 2)) ? NV3_PFIFO_START + nvfuzz_below(&state, 0x2000 / 4) * 4
+                    : NV3_PGRAPH_START + nvfuzz_below(&state, (NV3_PGRAPH_REGISTER_END + 1 - NV3_PGRAPH_START) / 4) * 4;
+                value = nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            case NVFUZZ_OP_WRITE_RAMIN:
+                addr = NV_MMIO_RAMIN_START + nvfuzz_below(&state, NVFUZZ_RAMIN_FUZZ_SIZE / 4) * 4;
+                value = nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            case NVFUZZ_OP_WRITE_CLASS:
+                addr = NV3_PGRAPH_START + (nvfuzz_below(&state, NV3_LAST_VALID_GRAPHICS_OBJECT_ID + 1)
+                    << NV3_PGRAPH_CLASS_SHIFT) + nvfuzz_below(&state, (NV3_OBJECT_SUBMIT_METHOD + 4) / 4) * 4;
+                value = nvfuzz_value(&state);
+                virtual_device_write32(dev, addr, value);
+                break;
+            case NVFUZZ_OP_READ_CONFIG:
+                size = 1 << nvfuzz_below(&state, 3);
+                addr = nvfuzz_below(&state, 260);
+                value = virtual_device_read_config(dev, addr, size);
+                break;
+            default:
+                break;
+        }
+
+        if (verbose) {
+            if (op == NVFUZZ_OP_READ_CONFIG)
+                printf("    %3u: %-12s 0x%03X (%u bytes) = 0x%08X\n", i, nvfuzz_op_names[op], addr, size, value);
+            else
+                printf("    %3u: %-12s 0x%07X %s 0x%08X\n", i, nvfuzz_op_names[op], addr,
+                    (op == NVFUZZ_OP_READ_HANDLED) ? "=" : "<-", value);
+        }
+    }
+
+    // Wait for PGRAPH to finish, a hang in there shows up here
+    while (virtual_device_read32(dev, NV3_PGRAPH_STATUS))
+        ;
+}
+
+//
+// Devices
+//
+
+static void nvfuzz_ramht_insert(virtual_device_t *dev, uint32_t handle, uint32_t channel, uint32_t context)
+{
+    // The same hash PFIFO uses for a 4KB table: the handle folded into 9 bits, the channel mixed in at the top
+    uint32_t hash = 0;
+
+    for (uint32_t folded = handle; folded; folded >>= 9)
+        hash ^= folded & 0x1FF;
+
+    hash = (hash ^ (channel << 5)) & 0x1FF;
+
+    for (uint32_t probe = 0; probe < 0x200; probe++, hash = (hash + 1) & 0x1FF) {
+        uint32_t addr = NV3_RAMIN_RAMHT_START + hash * NV3_RAMHT_ENTRY_SIZE;
+
+        if (!virtual_device_read32(dev, addr) && !virtual_device_read32(dev, addr + 4)) {
+            virtual_device_write32(dev, addr, handle);
+            virtual_device_write32(dev, addr + 4, context);
+            return;
+        }
+    }
+}
+
+// Bring a device up into the state every input starts from
+static void nvfuzz_prepare(virtual_device_t *dev)
+{
+    // An object of every graphics class on channel 0
+    for (uint32_t class_id = 0; class_id <= NV3_LAST_VALID_GRAPHICS_OBJECT_ID; class_id++) {
+        uint32_t context = (1u << NV3_RAMHT_CONTEXT_VALID) | (0 << NV3_RAMHT_CONTEXT_CHANNEL)
+            | ((class_id + NV3_PFIFO_FIRST_VALID_GRAPHICS_OBJECT_ID) << NV3_RAMHT_CONTEXT_CLASS) | (0x100 + class_id);
+
+        nvfuzz_ramht_insert(dev, NVFUZZ_HANDLE_BASE + class_id, 0, context);
+    }
+
+    virtual_device_write32(dev, NV3_PFIFO_CONFIG_RAMHT, NV3_PFIFO_CONFIG_RAMHT_SIZE_4K << NV3_PFIFO_CONFIG_RAMHT_SIZE);
+    virtual_device_write32(dev, NV3_PFIFO_CACHE1_PUSH_CHANNEL_ID, 0);
+    virtual_device_write32(dev, NV3_PFIFO_CACHE1_PUSH0, 1);
+    virtual_device_write32(dev, NV3_PFIFO_CACHE1_PULL0, 1 << NV3_PFIFO_CACHE1_PULL0_ENABLED);
+
+    // A 640x480 16bpp surface with a depth buffer behind it
+    virtual_device_write32(dev, NV3_PGRAPH_BPIXEL, NV3_PGRAPH_BPIXEL_FORMAT_R5G6B5);
+    virtual_device_write32(dev, NV3_PGRAPH_BOFFSET(0), 0);
+    virtual_device_write32(dev, NV3_PGRAPH_BPITCH(0), NVFUZZ_SURFACE_PITCH);
+    virtual_device_write32(dev, NV3_PGRAPH_BOFFSET(1), NVFUZZ_SURFACE_PITCH * 480);
+    virtual_device_write32(dev, NV3_PGRAPH_BPITCH(1), NVFUZZ_SURFACE_PITCH);
+    virtual_device_write32(dev, NV3_PGRAPH_ABS_UCLIP_XMAX, 640);
+    virtual_device_write32(dev, NV3_PGRAPH_ABS_UCLIP_YMAX, 480);
+    virtual_device_write32(dev, NV3_PGRAPH_NOTIFY, 0x1000);
+
+    for (uint32_t subchannel = 0; subchannel < NV3_DMA_SUBCHANNELS_PER_CHANNEL; subchannel++)
+        virtual_device_write32(dev, NV3_USER_START + (subchannel << NV3_OBJECT_SUBMIT_SUBCHANNEL)
+            + NV3_OBJECT_METHOD_SET_OBJECT, NVFUZZ_HANDLE_BASE + nvfuzz_subchannel_classes[subchannel]);
+
+    while (virtual_device_read32(dev, NV3_PGRAPH_STATUS))
+        ;
+}
+
+// A device of the calling thread's own, prepared and snapshotted
+static virtual_device_t *nvfuzz_create_device(virtual_snapshot_t **snapshot)
+{
+    virtual_device_t *dev = virtual_device_create(PCI_DEVICE_NV3, PCI_VENDOR_SGS_NV);
+
+    if (!dev)
+        return NULL;
+
+    virtual_device_select(dev);
+    virtual_pgraph_set_pipelined(nvfuzz_options.pipelined);
+    nvfuzz_prepare(dev);
+
+    if (!(*snapshot = virtual_snapshot_create(dev))) {
+        virtual_device_destroy(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+// Fold the handlers the device has seen into the thread's coverage. The counts aren't part of the device state, so
+// they keep adding up across restores.
+static void nvfuzz_collect_coverage(nvfuzz_thread_t *thread)
+{
+    virtual_handler_stats_t stats[NVFUZZ_MAX_HANDLERS];
+    uint32_t count = virtual_mmio_get_handler_stats(stats, NVFUZZ_MAX_HANDLERS);
+    uint64_t reads = 0, writes = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        reads |= (uint64_t)(stats[i].reads != 0) << i;
+        writes |= (uint64_t)(stats[i].writes != 0) << i;
+    }
+
+    __atomic_store_n(&thread->read_coverage, reads, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->write_coverage, writes, __ATOMIC_RELAXED);
+}
+
+// Add what PFIFO did during an input to the totals. The counters are part of the device state, each restore puts
+// them back to the snapshot's (the baseline).
+static void nvfuzz_collect_pfifo(nvfuzz_thread_t *thread, const virtual_pfifo_stats_t *baseline)
+{
+    virtual_pfifo_stats_t pfifo;
+
+    if (!virtual_pfifo_get_stats(&pfifo))
+        return;
+
+    __atomic_store_n(&thread->pushed, thread->pushed + pfifo.pushed - baseline->pushed, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->pulled, thread->pulled + pfifo.pulled - baseline->pulled, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->runouts, thread->runouts + pfifo.runouts - baseline->runouts, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->hash_failures, thread->hash_failures + pfifo.hash_failures - baseline->hash_failures,
+        __ATOMIC_RELAXED);
+}
+
+static void *nvfuzz_thread(void *arg)
+{
+    nvfuzz_thread_t *thread = arg;
+    virtual_snapshot_t *snapshot;
+    virtual_device_t *dev = nvfuzz_create_device(&snapshot);
+    virtual_pfifo_stats_t baseline = {0};
+
+    if (!dev) {
+        printf("Thread %u: Failed to set up a virtual device\n", thread->index);
+        __atomic_add_fetch(&nvfuzz_finished, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    virtual_pfifo_get_stats(&baseline);
+
+    while (!__atomic_load_n(&nvfuzz_stop, __ATOMIC_RELAXED)) {
+        uint64_t input = __atomic_fetch_add(&nvfuzz_next_input, 1, __ATOMIC_RELAXED);
+        uint64_t seed = nvfuzz_options.seed ^ input;
+
+        if (nvfuzz_options.runs && input >= nvfuzz_options.runs)
+            break;
+
+        seed = nvfuzz_mix(&seed);
+        __atomic_store_n(&thread->seed, seed, __ATOMIC_RELAXED);
+        __atomic_store_n(&thread->started_ns, nvfuzz_now_ns(), __ATOMIC_RELEASE);
+
+        virtual_snapshot_restore(dev, snapshot);
+        nvfuzz_run_input(dev, seed, false);
+
+        __atomic_store_n(&thread->started_ns, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&thread->execs, thread->execs + 1, __ATOMIC_RELAXED);
+        nvfuzz_collect_pfifo(thread, &baseline);
+
+        // Coverage only changes slowly, so it's not worth collecting after every input
+        if (!(thread->execs & 63))
+            nvfuzz_collect_coverage(thread);
+    }
+
+    nvfuzz_collect_coverage(thread);
+    virtual_device_destroy(dev);
+    virtual_snapshot_destroy(snapshot);
+    __atomic_add_fetch(&nvfuzz_finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//
+// Reporting
+//
+
+static void nvfuzz_print_inputs(void)
+{
+    char line[128];
+
+    for (uint32_t i = 0; i < nvfuzz_options.threads; i++) {
+        int length = snprintf(line, sizeof(line), "    Thread %u: input 0x%016llX%s\n", i,
+            (unsigned long long)__atomic_load_n(&nvfuzz_threads[i].seed, __ATOMIC_RELAXED),
+            __atomic_load_n(&nvfuzz_threads[i].started_ns, __ATOMIC_RELAXED) ? "" : " (finished)");
+
+        if (length > 0 && write(STDOUT_FILENO, line, length) < 0)
+            return;
+    }
+
+    static const char hint[] = "Run one again with --replay <input>\n";
+    ssize_t written = write(STDOUT_FILENO, hint, sizeof(hint) - 1);
+
+    (void)written;
+}
+
+static void nvfuzz_crash(int sig)
+{
+    char line[64];
+    int length = snprintf(line, sizeof(line), "\n=== Crash (signal %d) ===\n", sig);
+
+    if (length > 0 && write(STDOUT_FILENO, line, length) >= 0)
+        nvfuzz_print_inputs();
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void nvfuzz_interrupt(int sig)
+{
+    __atomic_store_n(&nvfuzz_stop, true, __ATOMIC_RELAXED);
+}
+
+typedef struct nvfuzz_totals_s {
+    uint64_t execs;
+    uint64_t read_coverage;
+    uint64_t write_coverage;
+    uint64_t pushed;
+    uint64_t pulled;
+    uint64_t runouts;
+    uint64_t hash_failures;
+} nvfuzz_totals_t;
+
+static void nvfuzz_sum(nvfuzz_totals_t *totals)
+{
+    memset(totals, 0, sizeof(*totals));
+
+    for (uint32_t i = 0; i < nvfuzz_options.threads; i++) {
+        nvfuzz_thread_t *thread = &nvfuzz_threads[i];
+
+        totals->execs += __atomic_load_n(&thread->execs, __ATOMIC_RELAXED);
+        totals->read_coverage |= __atomic_load_n(&thread->read_coverage, __ATOMIC_RELAXED);
+        totals->write_coverage |= __atomic_load_n(&thread->write_coverage, __ATOMIC_RELAXED);
+        totals->pushed += __atomic_load_n(&thread->pushed, __ATOMIC_RELAXED);
+        totals->pulled += __atomic_load_n(&thread->pulled, __ATOMIC_RELAXED);
+        totals->runouts += __atomic_load_n(&thread->runouts, __ATOMIC_RELAXED);
+        totals->hash_failures += __atomic_load_n(&thread->hash_failures, __ATOMIC_RELAXED);
+    }
+}
+
+// Watch the threads until they're all done, reporting once a second. Returns false on a hang.
+static bool nvfuzz_monitor(uint64_t start)
+{
+    uint64_t last_report = start, last_execs = 0;
+    uint64_t timeout_ns = (uint64_t)nvfuzz_options.timeout_ms * 1000000ull;
+    nvfuzz_totals_t totals;
+
+    for (;;) {
+        struct timespec tick = { 0, 50000000 };
+        uint64_t now;
+
+        nanosleep(&tick, NULL);
+        now = nvfuzz_now_ns();
+
+        for (uint32_t i = 0; i < nvfuzz_options.threads; i++) {
+            uint64_t started = __atomic_load_n(&nvfuzz_threads[i].started_ns, __ATOMIC_ACQUIRE);
+
+            if (started && now > started && now - started > timeout_ns) {
+                printf("\n=== Hang: an input has run for more than %u ms ===\n", nvfuzz_options.timeout_ms);
+                fflush(stdout);
+                nvfuzz_print_inputs();
+                return false;
+            }
+        }
+
+        if (nvfuzz_options.seconds && now - start >= nvfuzz_options.seconds * NV_TIME_NS_PER_SECOND)
+            __atomic_store_n(&nvfuzz_stop, true, __ATOMIC_RELAXED);
+
+        if (now - last_report >= NV_TIME_NS_PER_SECOND) {
+            nvfuzz_sum(&totals);
+            printf("[%5.0f s] %llu inputs, %.0f/s, handlers read %u/%u, written %u/%u\n", (now - start) / 1e9,
+                (unsigned long long)totals.execs, (totals.execs - last_execs) * 1e9 / (now - last_report),
+                __builtin_popcountll(totals.read_coverage), nvfuzz_handler_count,
+                __builtin_popcountll(totals.write_coverage), nvfuzz_handler_count);
+            fflush(stdout);
+            last_report = now;
+            last_execs = totals.execs;
+        }
+
+        // Stopped threads finish the input they're on, which can still hang
+        if (__atomic_load_n(&nvfuzz_finished, __ATOMIC_ACQUIRE) == nvfuzz_options.threads)
+            return true;
+    }
+}
+
+static void nvfuzz_usage(const char *name)
+{
+    printf("Usage: %s [options]\n", name);
+    printf("    -j, --jobs <n>          Threads, each with its own device (default: one per core)\n");
+    printf("    -t, --time <s>          Stop after this many seconds (default 10, 0 runs until interrupted)\n");
+    printf("    -n, --runs <n>          Stop after this many inputs\n");
+    printf("    -s, --seed <n>          Seed the inputs are derived from (default: from the clock)\n");
+    printf("    -o, --ops <n>           Most operations in an input (default 64)\n");
+    printf("    -T, --timeout <ms>      Report an input running longer than this as a hang (default 2000)\n");
+    printf("    -p, --pipelined         Execute PGRAPH methods on worker threads\n");
+    printf("    -r, --replay <input>    Run one input, printing its operations\n");
+}
+
+static bool nvfuzz_parse_args(int argc, char *argv[], nvfuzz_options_t *options)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    options->threads = (cores > 0) ? (uint32_t)cores : 1;
+    options->seconds = 10;
+    options->seed = nvfuzz_now_ns();
+    options->max_ops = 64;
+    options->timeout_ms = 2000;
+
+    for (int i = 1; i < argc; i++) {
+        bool value = (i + 1 < argc);
+
+        if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) && value)
+            options->threads = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--time")) && value)
+            options->seconds = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--runs")) && value)
+            options->runs = strtoull(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--seed")) && value)
+            options->seed = strtoull(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--ops")) && value)
+            options->max_ops = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-T") || !strcmp(argv[i], "--timeout")) && value)
+            options->timeout_ms = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pipelined"))
+            options->pipelined = true;
+        else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--replay")) && value) {
+            options->replay = true;
+            options->replay_seed = strtoull(argv[++i], NULL, 0);
+        } else
+            return false;
+    }
+
+    if (options->threads > NVFUZZ_MAX_THREADS)
+        options->threads = NVFUZZ_MAX_THREADS;
+
+    return (options->threads && options->max_ops && options->timeout_ms);
+}
+
+// Learn the handler layout from a throwaway device, it's the same on all of them
+static bool nvfuzz_load_handlers(void)
+{
+    virtual_device_t *dev = virtual_device_create(PCI_DEVICE_NV3, PCI_VENDOR_SGS_NV);
+
+    if (!dev)
+        return false;
+
+    virtual_device_select(dev);
+    nvfuzz_handler_count = virtual_mmio_get_handler_stats(nvfuzz_handlers, NVFUZZ_MAX_HANDLERS);
+    virtual_device_select(NULL);
+    virtual_device_destroy(dev);
+    return (nvfuzz_handler_count != 0);
+}
+
+static int nvfuzz_replay(void)
+{
+    virtual_snapshot_t *snapshot;
+    virtual_device_t *dev = nvfuzz_create_device(&snapshot);
+
+    if (!dev)
+        return 2;
+
+    printf("Replaying input 0x%016llX\n", (unsigned long long)nvfuzz_options.replay_seed);
+    nvfuzz_run_input(dev, nvfuzz_options.replay_seed, true);
+    printf("Input completed\n");
+
+    virtual_device_destroy(dev);
+    virtual_snapshot_destroy(snapshot);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!nvfuzz_parse_args(argc, argv, &nvfuzz_options)) {
+        nvfuzz_usage(argv[0]);
+        return 2;
+    }
+
+    // The inputs are meant to be wrong, don't drown in the device complaining about them
+    nv_log_set_level(NV_LOG_VIRTUAL, NV_LOG_LEVEL_ERROR);
+    nv_log_set_level(NV_LOG_PCI, NV_LOG_LEVEL_ERROR);
+
+    if (!nvfuzz_load_handlers()) {
+        printf("Error: Failed to create a virtual device\n");
+        return 2;
+    }
+
+    signal(SIGSEGV, nvfuzz_crash);
+    signal(SIGBUS, nvfuzz_crash);
+    signal(SIGFPE, nvfuzz_crash);
+    signal(SIGILL, nvfuzz_crash);
+    signal(SIGABRT, nvfuzz_crash);
+
+    if (nvfuzz_options.replay)
+        return nvfuzz_replay();
+
+    signal(SIGINT, nvfuzz_interrupt);
+    printf("Fuzzing %u handlers with %u thread%s, seed 0x%016llX, up to %u operations per input\n",
+        nvfuzz_handler_count, nvfuzz_options.threads, (nvfuzz_options.threads == 1) ? "" : "s",
+        (unsigned long long)nvfuzz_options.seed, nvfuzz_options.max_ops);
+    fflush(stdout);
+
+    uint64_t start = nvfuzz_now_ns();
+
+    for (uint32_t i = 0; i < nvfuzz_options.threads; i++) {
+        nvfuzz_threads[i].index = i;
+
+        if (pthread_create(&nvfuzz_threads[i].thread, NULL, nvfuzz_thread, &nvfuzz_threads[i]) != 0) {
+            printf("Error: Failed to start thread %u\n", i);
+            nvfuzz_options.threads = i;
+            break;
+        }
+    }
+
+    if (!nvfuzz_monitor(start)) {
+        nv_log_flush();
+        _exit(3);
+    }
+
+    for (uint32_t i = 0; i < nvfuzz_options.threads; i++)
+        pthread_join(nvfuzz_threads[i].thread, NULL);
+
+    uint64_t elapsed = nvfuzz_now_ns() - start;
+    double seconds = elapsed / 1e9;
+    nvfuzz_totals_t totals;
+
+    nv_log_flush();
+    nvfuzz_sum(&totals);
+
+    printf("\n=== Fuzzing ===\n");
+    printf("    Inputs              = %llu\n", (unsigned long long)totals.execs);
+    printf("    Elapsed             = %.3f s\n", seconds);
+    printf("    Rate                = %.0f inputs/s (%.2fM/min)\n", (seconds > 0) ? totals.execs / seconds : 0.0,
+        (seconds > 0) ? totals.execs / seconds * 60 / 1e6 : 0.0);
+    printf("    PFIFO pushed        = %llu\n", (unsigned long long)totals.pushed);
+    printf("    PFIFO pulled        = %llu\n", (unsigned long long)totals.pulled);
+    printf("    PFIFO runouts       = %llu\n", (unsigned long long)totals.runouts);
+    printf("    RAMHT misses        = %llu\n", (unsigned long long)totals.hash_failures);
+    printf("    Handlers read       = %u/%u\n", __builtin_popcountll(totals.read_coverage), nvfuzz_handler_count);
+    printf("    Handlers written    = %u/%u\n", __builtin_popcountll(totals.write_coverage), nvfuzz_handler_count);
+
+    for (uint32_t i = 0; i < nvfuzz_handler_count; i++) {
+        if (!((totals.read_coverage | totals.write_coverage) >> i & 1))
+            printf("    Never reached       : %s\n", nvfuzz_handlers[i].name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+//
+// Filename: nvreplay.c
+// Purpose: Replays a recorded MMIO trace (see nvcore_trace.h) against the virtual device
+//
+// Every record is issued through the virtual_mmio_* backend, which decodes registers, VRAM and RAMIN, and every
+// recorded read is repeated and checked against the value the original session saw. By default the trace runs as fast as
+// possible; --realtime honours the recorded timestamps instead.
+//
+// PGRAPH executes methods synchronously unless --pipelined is given: with its worker thread running, how many STATUS
+// polls the engine stays busy for depends on timing, so those reads can't be expected to match the trace.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nvplayground.h"
+#include "core/nvcore.h"
+#include "core/pci/pci.h"
+#include "architecture/nv3/nv3_ref.h"
+#include "util/util.h"
+
+// In realtime mode, gaps shorter than this are spun out instead of slept, since the scheduler can't hit them
+#define NVREPLAY_SPIN_THRESHOLD_NS      200000
+
+typedef struct nvreplay_options_s {
+    const char *path;
+    bool realtime;                                  // Honour the recorded timestamps
+    bool keep_going;                                // Don't stop at the first divergence
+    bool pipelined;                                 // Run PGRAPH methods on its worker thread
+    uint32_t loops;                                 // Times to run through the trace, resetting the device in between
+} nvreplay_options_t;
+
+typedef struct nvreplay_stats_s {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t skipped;                               // Records outside of every region
+    uint64_t unverified;                            // Reads of free-running counters, replayed but not compared
+    uint64_t divergences;
+} nvreplay_stats_t;
+
+static inline uint64_t nvreplay_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void nvreplay_wait_until(uint64_t target_ns)
+{
+    uint64_t now = nvreplay_now_ns();
+
+    if (target_ns <= now)
+        return;
+
+    if (target_ns - now > NVREPLAY_SPIN_THRESHOLD_NS) {
+        uint64_t wake = target_ns - NVREPLAY_SPIN_THRESHOLD_NS / 2;
+        struct timespec until = { wake / 1000000000ull, wake % 1000000000ull };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+
+    while (nvreplay_now_ns() < target_ns)
+        nv_cpu_relax();
+}
+
+static const char *nvreplay_region_name(uint8_t region)
+{
+    switch (region) {
+        case NV_TRACE_REGION_REGS:  return "REGS";
+        case NV_TRACE_REGION_VRAM:  return "VRAM";
+        case NV_TRACE_REGION_RAMIN: return "RAMIN";
+        default:                    return "INVALID";
+    }
+}
+
+// Replays one record, returns false if it was a read that didn't match the trace
+static inline bool nvreplay_step(const nv_trace_record_t *record, nvreplay_stats_t *stats, uint32_t *actual)
+{
+    if (record->region > NV_TRACE_REGION_RAMIN) {
+        stats->skipped++;
+        return true;
+    }
+
+    if (record->direction == NV_TRACE_WRITE) {
+        stats->writes++;
+        virtual_mmio_write32(record->addr, record->value);
+        return true;
+    }
+
+    stats->reads++;
+    *actual = virtual_mmio_read32(record->addr);
+
+    // The timer keeps counting, so it can never read back what it did in the original session
+    if (record->addr == NV3_PTIMER_TIME_0_NSEC || record->addr == NV3_PTIMER_TIME_1_NSEC) {
+        stats->unverified++;
+        return true;
+    }
+
+    return (*actual == record->value);
+}
+
+static bool nvreplay_run(const nv_trace_record_t *records, uint64_t count, const nvreplay_options_t *options,
+    nvreplay_stats_t *stats)
+{
+    for (uint32_t loop = 0; loop < options->loops; loop++) {
+        // Every pass has to start from the same power-on state the first one did
+        if (loop)
+            virtual_pci_reset();
+
+        uint64_t host_start = nvreplay_now_ns();
+
+        for (uint64_t i = 0; i < count; i++) {
+            const nv_trace_record_t *record = &records[i];
+            uint32_t actual = 0;
+
+            if (options->realtime)
+                nvreplay_wait_until(host_start + (record->timestamp - records[0].timestamp));
+
+            if (__builtin_expect(nvreplay_step(record, stats, &actual), 1))
+                continue;
+
+            if (!stats->divergences) {
+                printf("First divergence at record %llu (loop %u, +%.6f s):\n", (unsigned long long)i, loop,
+                    (record->timestamp - records[0].timestamp) / 1e9);
+                printf("    Read %s 0x%08X: expected 0x%08X, got 0x%08X (thread %u)\n",
+                    nvreplay_region_name(record->region), record->addr, record->value, actual, record->thread);
+            }
+
+            stats->divergences++;
+
+            if (!options->keep_going)
+                return false;
+        }
+    }
+
+    return (stats->divergences == 0);
+}
+
+static void nvreplay_usage(const char *name)
+{
+    printf("Usage: %s [options] <trace file>\n", name);
+    printf("    -r, --realtime      Honour the recorded timestamps instead of replaying as fast as possible\n");
+    printf("    -k, --keep-going    Count every divergence instead of stopping at the first one\n");
+    printf("    -n, --loops <n>     Replay the trace n times (default 1)\n");
+    printf("    -p, --pipelined     Execute PGRAPH methods on a worker thread instead of inline\n");
+}
+
+static bool nvreplay_parse_args(int argc, char *argv[], nvreplay_options_t *options)
+{
+    options->loops = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--realtime"))
+            options->realtime = true;
+        else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep-going"))
+            options->keep_going = true;
+        else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pipelined"))
+            options->pipelined = true;
+        else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--loops")) && i + 1 < argc)
+            options->loops = strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && !options->path)
+            options->path = argv[i];
+        else
+            return false;
+    }
+
+    return (options->path && options->loops);
+}
+
+int main(int argc, char *argv[])
+{
+    nvreplay_options_t options = {0};
+    nvreplay_stats_t stats = {0};
+
+    if (!nvreplay_parse_args(argc, argv, &options)) {
+        nvreplay_usage(argv[0]);
+        return 2;
+    }
+
+    int fd = open(options.path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("Failed to open trace file");
+        return 2;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(nv_trace_header_t)) {
+        printf("Error: %s is not an MMIO trace\n", options.path);
+        close(fd);
+        return 2;
+    }
+
+    const uint8_t *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (file == MAP_FAILED) {
+        perror("Failed to map trace file");
+        return 2;
+    }
+
+    madvise((void *)file, st.st_size, MADV_SEQUENTIAL);
+
+    const nv_trace_header_t *header = (const nv_trace_header_t *)file;
+
+    if (header->magic != NV_TRACE_MAGIC || header->version != NV_TRACE_VERSION
+        || header->record_size != sizeof(nv_trace_record_t)) {
+        printf("Error: %s is not a version %u MMIO trace\n", options.path, NV_TRACE_VERSION);
+        munmap((void *)file, st.st_size);
+        return 2;
+    }
+
+    uint64_t payload = st.st_size - sizeof(nv_trace_header_t);
+    uint64_t count = payload / sizeof(nv_trace_record_t);
+    const nv_trace_record_t *records = (const nv_trace_record_t *)(file + sizeof(nv_trace_header_t));
+
+    if (payload % sizeof(nv_trace_record_t))
+        printf("Warning: Trace is truncated, ignoring the partial record at the end\n");
+
+    if (!virtual_pci_init()) {
+        munmap((void *)file, st.st_size);
+        return 2;
+    }
+
+    virtual_pci_register_device(PCI_DEVICE_NV3, PCI_VENDOR_SGS_NV);
+    virtual_pgraph_set_pipelined(options.pipelined);
+
+    printf("Replaying %llu records from %s (%s, %u loop%s)\n", (unsigned long long)count, options.path,
+        (options.realtime) ? "realtime" : "as fast as possible", options.loops, (options.loops == 1) ? "" : "s");
+
+    uint64_t start = nvreplay_now_ns();
+    bool matched = nvreplay_run(records, count, &options, &stats);
+    uint64_t elapsed = nvreplay_now_ns() - start;
+
+    // Let the device's log output land before the summary
+    nv_log_flush();
+
+    uint64_t replayed = stats.reads + stats.writes + stats.skipped;
+    double seconds = elapsed / 1e9;
+
+    printf("\n=== Replay ===\n");
+    printf("    Records replayed    = %llu\n", (unsigned long long)replayed);
+    printf("    Reads verified      = %llu\n", (unsigned long long)(stats.reads - stats.unverified));
+    printf("    Reads not compared  = %llu\n", (unsigned long long)stats.unverified);
+    printf("    Writes              = %llu\n", (unsigned long long)stats.writes);
+    printf("    Skipped             = %llu\n", (unsigned long long)stats.skipped);
+    printf("    Divergences         = %llu\n", (unsigned long long)stats.divergences);
+    printf("    Elapsed             = %.6f s\n", seconds);
+    printf("    Rate                = %.0f records/s\n", (seconds > 0) ? replayed / seconds : 0.0);
+
+    virtual_pci_cleanup();
+    munmap((void *)file, st.st_size);
+    return (matched) ? 0 : 1;
+}
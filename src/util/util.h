@@ -0,0 +1,99 @@
+#pragma once
+
+//
+// Filename: util.h
+// Purpose: Utility functions shared by every part of NVPlayground
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Logging (util_logging.c)
+//
+// Log calls format into a lock-free ring and return; a background thread writes the ring out to stdout. Calls
+// below NV_LOG_MIN_LEVEL compile away completely, and each call site is rate limited so a message on a hot path
+// can't flood the output. Messages are written as given, with no prefix, so they read the same as printf did.
+//
+// Output from nv_log_* can overtake plain printf output that was issued later; call nv_log_flush first where the
+// order matters.
+//
+
+#define NV_LOG_LEVEL_TRACE          0
+#define NV_LOG_LEVEL_DEBUG          1
+#define NV_LOG_LEVEL_INFO           2
+#define NV_LOG_LEVEL_WARNING        3
+#define NV_LOG_LEVEL_ERROR          4
+#define NV_LOG_LEVEL_NONE           5
+
+// Set by the build (see NV_LOG_LEVEL in CMakeLists.txt)
+#ifndef NV_LOG_MIN_LEVEL
+#define NV_LOG_MIN_LEVEL            NV_LOG_LEVEL_INFO
+#endif
+
+typedef enum nv_log_category_e {
+    NV_LOG_CORE = 0,                                // Core MMIO/VRAM access
+    NV_LOG_PCI = 1,                                 // PCI config space
+    NV_LOG_VIRTUAL = 2,                             // Virtual device model
+    NV_LOG_NV3 = 3,                                 // NV3 architecture code
+    NV_LOG_CATEGORY_COUNT,
+} nv_log_category_t;
+
+// Per call site rate limit: a burst of this many messages, refilled at this many per second
+#define NV_LOG_RATE_BURST           100
+#define NV_LOG_RATE_PER_SECOND      100
+
+typedef struct nv_log_site_s {
+    uint64_t last_refill_ns;
+    uint32_t tokens;
+    uint32_t suppressed;                            // Messages dropped since the last one that got through
+} nv_log_site_t;
+
+typedef struct nv_log_stats_s {
+    uint64_t written;                               // Messages written out
+    uint64_t dropped;                               // Messages lost because the ring was full
+    uint64_t suppressed;                            // Messages dropped by the rate limit
+} nv_log_stats_t;
+
+// Minimum runtime level of each category; anything below it is dropped before it's formatted
+extern uint8_t nv_log_levels[NV_LOG_CATEGORY_COUNT];
+
+#define nv_log(level, category, ...)                                                    \
+    do {                                                                                \
+        if ((level) >= NV_LOG_MIN_LEVEL && (level) >= nv_log_levels[category]) {        \
+            static nv_log_site_t nv_log_site;                                           \
+            nv_log_write(&nv_log_site, level, category, __VA_ARGS__);                   \
+        }                                                                               \
+    } while (0)
+
+#define nv_log_trace(category, ...)     nv_log(NV_LOG_LEVEL_TRACE, category, __VA_ARGS__)
+#define nv_log_debug(category, ...)     nv_log(NV_LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+#define nv_log_info(category, ...)      nv_log(NV_LOG_LEVEL_INFO, category, __VA_ARGS__)
+#define nv_log_warning(category, ...)   nv_log(NV_LOG_LEVEL_WARNING, category, __VA_ARGS__)
+#define nv_log_error(category, ...)     nv_log(NV_LOG_LEVEL_ERROR, category, __VA_ARGS__)
+
+void nv_log_write(nv_log_site_t *site, uint32_t level, nv_log_category_t category, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void nv_log_set_level(nv_log_category_t category, uint32_t level);
+void nv_log_flush(void);
+void nv_log_shutdown(void);
+void nv_log_get_stats(nv_log_stats_t *stats);
+
+//
+// Thread pool (util_threadpool.c)
+//
+// One pool shared by the whole process, started on first use with a worker per core. Jobs are fork-join: the
+// caller takes part and nv_threadpool_run returns once every index is done. Only one job runs on the pool at a time;
+// a job submitted while the pool is busy runs on the calling thread instead.
+//
+// nv_threadpool_run_local deals the indices out in contiguous shares instead, one per thread, and a thread that runs
+// out steals half of what another has left. Neighbouring indices tend to stay on one thread, which suits work whose
+// indices share data (screen tiles, rows of an image), and uneven indices still balance out.
+//
+
+typedef void (*nv_threadpool_task_t)(void *arg, uint32_t index);
+
+void nv_threadpool_run(nv_threadpool_task_t task, void *arg, uint32_t count);
+void nv_threadpool_run_local(nv_threadpool_task_t task, void *arg, uint32_t count);
+uint32_t nv_threadpool_size(void);
+void nv_threadpool_shutdown(void);
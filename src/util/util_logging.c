@@ -0,0 +1,205 @@
+//
+// Filename: util_logging.c
+// Purpose: Asynchronous leveled logging
+//
+// Producers claim a slot in a bounded multi-producer ring with a single CAS, format straight into it and publish it
+// by bumping the slot's sequence number. The writer thread is the only consumer. It copies published messages into
+// a local buffer and writes them out with a single fwrite, so a log call never blocks on stdio.
+//
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "nvplayground.h"
+#include "util/util.h"
+
+#define NV_LOG_RING_SIZE            1024            // Must be a power of two
+#define NV_LOG_MESSAGE_SIZE         240
+#define NV_LOG_WRITER_INTERVAL_NS   1000000         // How often the writer looks for new messages
+
+typedef struct nv_log_slot_s {
+    uint64_t sequence;                              // == position + 1 once the message at position is published
+    uint16_t length;
+    char text[NV_LOG_MESSAGE_SIZE];
+} nv_log_slot_t;
+
+uint8_t nv_log_levels[NV_LOG_CATEGORY_COUNT] = {0};
+
+static nv_log_slot_t nv_log_ring[NV_LOG_RING_SIZE];
+static uint64_t nv_log_head = 0;                    // Next position producers claim
+static uint64_t nv_log_tail = 0;                    // Next position the consumer reads
+
+static nv_log_stats_t nv_log_stats = {0};
+
+// Only one consumer may run at a time, either the writer thread or nv_log_flush
+static pthread_mutex_t nv_log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t nv_log_once = PTHREAD_ONCE_INIT;
+static pthread_t nv_log_writer;
+static bool nv_log_writer_running = false;
+static bool nv_log_writer_stop = false;
+
+static inline uint64_t nv_log_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Write out everything published so far. Caller holds nv_log_drain_lock.
+static void nv_log_drain_locked(void)
+{
+    char buffer[16384];
+    size_t used = 0;
+
+    while (true) {
+        nv_log_slot_t *slot = &nv_log_ring[nv_log_tail & (NV_LOG_RING_SIZE - 1)];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != nv_log_tail + 1)
+            break;
+
+        if (used + slot->length > sizeof(buffer)) {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+
+        memcpy(buffer + used, slot->text, slot->length);
+        used += slot->length;
+
+        // Hand the slot back to the producers for the next lap around the ring
+        __atomic_store_n(&slot->sequence, nv_log_tail + NV_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        nv_log_tail++;
+        __atomic_fetch_add(&nv_log_stats.written, 1, __ATOMIC_RELAXED);
+    }
+
+    if (used) {
+        fwrite(buffer, 1, used, stdout);
+        fflush(stdout);
+    }
+}
+
+static void *nv_log_writer_thread(void *arg)
+{
+    struct timespec interval = { 0, NV_LOG_WRITER_INTERVAL_NS };
+
+    while (!__atomic_load_n(&nv_log_writer_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&nv_log_drain_lock);
+        nv_log_drain_locked();
+        pthread_mutex_unlock(&nv_log_drain_lock);
+    }
+
+    return NULL;
+}
+
+static void nv_log_start(void)
+{
+    for (uint32_t i = 0; i < NV_LOG_RING_SIZE; i++)
+        nv_log_ring[i].sequence = i;
+
+    nv_log_writer_running = (pthread_create(&nv_log_writer, NULL, nv_log_writer_thread, NULL) == 0);
+    atexit(nv_log_shutdown);
+}
+
+// Token bucket per call site. The site isn't locked, so threads racing on the same site can make the count a little
+// off, which doesn't matter for a rate limit.
+static bool nv_log_ratelimit(nv_log_site_t *site)
+{
+    uint64_t now = nv_log_now_ns();
+
+    if (!site->last_refill_ns) {
+        site->last_refill_ns = now;
+        site->tokens = NV_LOG_RATE_BURST;
+    } else if (now - site->last_refill_ns >= 1000000000ull / NV_LOG_RATE_PER_SECOND) {
+        uint64_t refill = (now - site->last_refill_ns) * NV_LOG_RATE_PER_SECOND / 1000000000ull;
+        site->tokens = (site->tokens + refill < NV_LOG_RATE_BURST) ? site->tokens + refill : NV_LOG_RATE_BURST;
+        site->last_refill_ns = now;
+    }
+
+    if (!site->tokens) {
+        site->suppressed++;
+        __atomic_fetch_add(&nv_log_stats.suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    site->tokens--;
+    return true;
+}
+
+void nv_log_write(nv_log_site_t *site, uint32_t level, nv_log_category_t category, const char *fmt, ...)
+{
+    pthread_once(&nv_log_once, nv_log_start);
+
+    if (!nv_log_ratelimit(site))
+        return;
+
+    // Claim a slot
+    uint64_t position = __atomic_load_n(&nv_log_head, __ATOMIC_RELAXED);
+    nv_log_slot_t *slot;
+
+    while (true) {
+        slot = &nv_log_ring[position & (NV_LOG_RING_SIZE - 1)];
+        int64_t lag = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&nv_log_head, &position, position + 1, true, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED))
+                break;
+        } else if (lag < 0) {
+            // The writer hasn't caught up a full ring behind
+            __atomic_fetch_add(&nv_log_stats.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&nv_log_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    int length = 0;
+
+    if (site->suppressed) {
+        length = snprintf(slot->text, sizeof(slot->text), "(%u similar messages suppressed) ", site->suppressed);
+        site->suppressed = 0;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    length += vsnprintf(slot->text + length, sizeof(slot->text) - length, fmt, args);
+    va_end(args);
+
+    slot->length = (length < (int)sizeof(slot->text)) ? length : sizeof(slot->text) - 1;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+void nv_log_set_level(nv_log_category_t category, uint32_t level)
+{
+    if (category < NV_LOG_CATEGORY_COUNT)
+        nv_log_levels[category] = level;
+}
+
+// Write out everything logged so far from the calling thread
+void nv_log_flush(void)
+{
+    pthread_mutex_lock(&nv_log_drain_lock);
+    nv_log_drain_locked();
+    pthread_mutex_unlock(&nv_log_drain_lock);
+}
+
+void nv_log_shutdown(void)
+{
+    if (nv_log_writer_running) {
+        __atomic_store_n(&nv_log_writer_stop, true, __ATOMIC_RELEASE);
+        pthread_join(nv_log_writer, NULL);
+        nv_log_writer_running = false;
+    }
+
+    nv_log_flush();
+}
+
+void nv_log_get_stats(nv_log_stats_t *stats)
+{
+    stats->written = __atomic_load_n(&nv_log_stats.written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&nv_log_stats.dropped, __ATOMIC_RELAXED);
+    stats->suppressed = __atomic_load_n(&nv_log_stats.suppressed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,252 @@
+//
+// Filename: util_threadpool.c
+// Purpose: Fork-join thread pool for splitting work across cores
+//
+// nv_threadpool_run hands out the indices of a job to the workers and the calling thread alike, each claiming the
+// next index with a single atomic add, and returns once every index has run. There is one job in flight at a time:
+// a caller that finds the pool busy (another thread's job, or a task that itself calls nv_threadpool_run) runs its
+// job inline instead of waiting, so the pool can never deadlock on itself.
+//
+// A local job gives every thread (the caller is slot 0, worker n is slot n + 1) its own share of the indices as a
+// [begin, end) range packed into one 64-bit word. The owner takes indices from the front of its range, a thief takes
+// the back half of a victim's range, both with a compare and swap, so neither ever blocks the other. A thread whose
+// range is empty is the only one that writes it, which is how a thief can hand itself what it stole.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "nvplayground.h"
+#include "util/util.h"
+
+#define NV_THREADPOOL_MAX_THREADS   64
+
+// A thread's share of a local job, on its own cache line
+typedef struct nv_threadpool_range_s {
+    uint64_t range;                                 // begin in 63:32, end in 31:0
+} __attribute__((aligned(64))) nv_threadpool_range_t;
+
+typedef struct nv_threadpool_job_s {
+    nv_threadpool_task_t task;
+    void *arg;
+    uint32_t count;
+    uint32_t next;                                  // Next index to claim
+    uint32_t done;                                  // Indices finished
+    uint32_t active;                                // Workers still holding a pointer to the job
+    nv_threadpool_range_t *ranges;                  // Per slot, for local jobs; NULL for shared ones
+    uint32_t slots;
+} nv_threadpool_job_t;
+
+static pthread_t nv_threadpool_threads[NV_THREADPOOL_MAX_THREADS];
+static uint32_t nv_threadpool_thread_count = 0;
+static pthread_once_t nv_threadpool_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t nv_threadpool_submit_lock = PTHREAD_MUTEX_INITIALIZER;    // Held by the job's owner
+static pthread_mutex_t nv_threadpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nv_threadpool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t nv_threadpool_finished = PTHREAD_COND_INITIALIZER;
+static nv_threadpool_job_t *nv_threadpool_job = NULL;
+static uint64_t nv_threadpool_generation = 0;
+static bool nv_threadpool_stop = false;
+
+// Take the next index from the front of a range
+static bool nv_threadpool_take(uint64_t *range, uint32_t *index)
+{
+    uint64_t old = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    uint32_t begin;
+
+    do {
+        begin = (uint32_t)(old >> 32);
+
+        if (begin >= (uint32_t)old)
+            return false;
+    } while (!__atomic_compare_exchange_n(range, &old, old + (1ull << 32), true, __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE));
+
+    *index = begin;
+    return true;
+}
+
+// Move the back half of another slot's range into this one's, which is empty
+static bool nv_threadpool_steal(nv_threadpool_job_t *job, uint32_t slot)
+{
+    for (uint32_t i = 1; i < job->slots; i++) {
+        uint64_t *victim = &job->ranges[(slot + i) % job->slots].range;
+        uint64_t old = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+        uint32_t begin = (uint32_t)(old >> 32), end = (uint32_t)old;
+
+        while (begin < end) {
+            uint32_t middle = begin + (end - begin) / 2;
+
+            if (__atomic_compare_exchange_n(victim, &old, ((uint64_t)begin << 32) | middle, true, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&job->ranges[slot].range, ((uint64_t)middle << 32) | end, __ATOMIC_RELEASE);
+                return true;
+            }
+
+            begin = (uint32_t)(old >> 32), end = (uint32_t)old;
+        }
+    }
+
+    return false;
+}
+
+// Run indices of the job until there are none left to claim. Returns how many this thread ran.
+static uint32_t nv_threadpool_work(nv_threadpool_job_t *job, uint32_t slot)
+{
+    uint32_t ran = 0;
+    uint32_t index;
+
+    if (job->ranges) {
+        do {
+            while (nv_threadpool_take(&job->ranges[slot].range, &index)) {
+                job->task(job->arg, index);
+                ran++;
+            }
+        } while (nv_threadpool_steal(job, slot));
+
+        return ran;
+    }
+
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        job->task(job->arg, index);
+        ran++;
+    }
+
+    return ran;
+}
+
+static void *nv_threadpool_worker(void *arg)
+{
+    uint32_t slot = (uint32_t)(uintptr_t)arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&nv_threadpool_lock);
+
+    while (true) {
+        while (!nv_threadpool_stop && (nv_threadpool_generation == seen || !nv_threadpool_job))
+            pthread_cond_wait(&nv_threadpool_wake, &nv_threadpool_lock);
+
+        if (nv_threadpool_stop)
+            break;
+
+        nv_threadpool_job_t *job = nv_threadpool_job;
+        seen = nv_threadpool_generation;
+        job->active++;
+        pthread_mutex_unlock(&nv_threadpool_lock);
+
+        uint32_t ran = nv_threadpool_work(job, slot);
+
+        pthread_mutex_lock(&nv_threadpool_lock);
+
+        job->done += ran;
+
+        // The job lives on its owner's stack, so the owner mustn't return while anyone can still touch it
+        if (!--job->active && job->done == job->count)
+            pthread_cond_signal(&nv_threadpool_finished);
+    }
+
+    pthread_mutex_unlock(&nv_threadpool_lock);
+    return NULL;
+}
+
+static void nv_threadpool_start(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = (cores > 1) ? (uint32_t)cores - 1 : 0;   // The caller is a worker too
+
+    if (threads > NV_THREADPOOL_MAX_THREADS)
+        threads = NV_THREADPOOL_MAX_THREADS;
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if (pthread_create(&nv_threadpool_threads[i], NULL, nv_threadpool_worker, (void *)(uintptr_t)(i + 1)))
+            break;
+
+        nv_threadpool_thread_count++;
+    }
+
+    atexit(nv_threadpool_shutdown);
+}
+
+static void nv_threadpool_submit(nv_threadpool_job_t *job)
+{
+    pthread_mutex_lock(&nv_threadpool_lock);
+    nv_threadpool_job = job;
+    nv_threadpool_generation++;
+    pthread_cond_broadcast(&nv_threadpool_wake);
+    pthread_mutex_unlock(&nv_threadpool_lock);
+
+    uint32_t ran = nv_threadpool_work(job, 0);
+
+    pthread_mutex_lock(&nv_threadpool_lock);
+    job->done += ran;
+
+    while (job->done < job->count || job->active)
+        pthread_cond_wait(&nv_threadpool_finished, &nv_threadpool_lock);
+
+    nv_threadpool_job = NULL;
+    pthread_mutex_unlock(&nv_threadpool_lock);
+    pthread_mutex_unlock(&nv_threadpool_submit_lock);
+}
+
+// Whether a job has to run inline. If not, the caller now owns the pool.
+static bool nv_threadpool_inline(nv_threadpool_task_t task, void *arg, uint32_t count)
+{
+    pthread_once(&nv_threadpool_once, nv_threadpool_start);
+
+    if (count > 1 && nv_threadpool_thread_count && !pthread_mutex_trylock(&nv_threadpool_submit_lock))
+        return false;
+
+    for (uint32_t index = 0; index < count; index++)
+        task(arg, index);
+
+    return true;
+}
+
+// Run task(arg, index) for every index in [0, count), spread over the pool, and wait for all of them
+void nv_threadpool_run(nv_threadpool_task_t task, void *arg, uint32_t count)
+{
+    nv_threadpool_job_t job = { task, arg, count, 0, 0, 0, NULL, 0 };
+
+    if (!nv_threadpool_inline(task, arg, count))
+        nv_threadpool_submit(&job);
+}
+
+// The same, but each thread starts on its own contiguous share of the indices and steals once that runs out
+void nv_threadpool_run_local(nv_threadpool_task_t task, void *arg, uint32_t count)
+{
+    nv_threadpool_range_t ranges[NV_THREADPOOL_MAX_THREADS + 1];
+    nv_threadpool_job_t job = { task, arg, count, 0, 0, 0, ranges, 0 };
+
+    if (nv_threadpool_inline(task, arg, count))
+        return;
+
+    job.slots = nv_threadpool_thread_count + 1;
+
+    for (uint32_t slot = 0; slot < job.slots; slot++) {
+        uint64_t begin = (uint64_t)count * slot / job.slots, end = (uint64_t)count * (slot + 1) / job.slots;
+        ranges[slot].range = (begin << 32) | end;
+    }
+
+    nv_threadpool_submit(&job);
+}
+
+// Threads that take part in a job, including the caller
+uint32_t nv_threadpool_size(void)
+{
+    pthread_once(&nv_threadpool_once, nv_threadpool_start);
+    return nv_threadpool_thread_count + 1;
+}
+
+void nv_threadpool_shutdown(void)
+{
+    pthread_mutex_lock(&nv_threadpool_lock);
+    nv_threadpool_stop = true;
+    pthread_cond_broadcast(&nv_threadpool_wake);
+    pthread_mutex_unlock(&nv_threadpool_lock);
+
+    for (uint32_t i = 0; i < nv_threadpool_thread_count; i++)
+        pthread_join(nv_threadpool_threads[i], NULL);
+
+    nv_threadpool_thread_count = 0;
+}